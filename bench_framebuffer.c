@@ -0,0 +1,451 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "shareit.h"
+#include "framebuffer.h"
+#include "packet.h"
+#include "jpeg.h"
+#include "convert.h"
+#include "grab.h"
+
+// Size of the tiles used when benchmarking the per-tile functions,
+// should match the block size used by compare_screens()
+#define TILE_SIZE 64
+
+// Allocation counters, updated by the malloc wrappers below.
+// The bench target is linked with -Wl,--wrap=malloc etc., so every allocation
+// made by the code under test ends up here.
+static unsigned long n_allocs;
+
+void *__real_malloc(size_t sz);
+void *__real_calloc(size_t n, size_t sz);
+void *__real_realloc(void *ptr, size_t sz);
+
+void *__wrap_malloc(size_t sz) {
+    n_allocs ++;
+    return __real_malloc(sz);
+}
+
+void *__wrap_calloc(size_t n, size_t sz) {
+    n_allocs ++;
+    return __real_calloc(n, sz);
+}
+
+void *__wrap_realloc(void *ptr, size_t sz) {
+    n_allocs ++;
+    return __real_realloc(ptr, sz);
+}
+
+typedef struct {
+    const char *name;
+    int width;
+    int height;
+} resolution_t;
+
+static const resolution_t resolutions[] = {
+    { "1080p", 1920, 1080 },
+    { "1440p", 2560, 1440 },
+    { "4k", 3840, 2160 },
+};
+
+typedef void (*corpus_fn)(uint32_t *screen, int width, int height, int frame);
+
+typedef struct {
+    const char *name;
+    corpus_fn generate;
+} corpus_t;
+
+typedef struct {
+    int csv;
+    int iterations;
+    int tiled;  // store the screens one tile at a time, like share-it -T
+} bench_options_t;
+
+static uint32_t rand_state;
+
+static uint32_t bench_rand() {
+    // xorshift32, deterministic so that all runs measure the same content
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static void fill_rect(uint32_t *screen, int width, int height, int x, int y, int w, int h, uint32_t colour) {
+    for (int sy = y; sy < y + h && sy < height; sy ++) {
+        for (int sx = x; sx < x + w && sx < width; sx ++) {
+            screen[sx + sy * width] = colour;
+        }
+    }
+}
+
+/**
+ * desktop with a flat background and a couple of flat coloured windows
+ */
+static void corpus_desktop(uint32_t *screen, int width, int height, int frame) {
+    rand_state = 0x1234 + frame;
+    fill_rect(screen, width, height, 0, 0, width, height, 0xff3a6ea5);
+    for (int i = 0; i < 8; i ++) {
+        int w = width / 6 + bench_rand() % (width / 4);
+        int h = height / 6 + bench_rand() % (height / 4);
+        int x = bench_rand() % (width - w);
+        int y = bench_rand() % (height - h);
+        fill_rect(screen, width, height, x, y, w, h, 0xffd4d0c8);
+        fill_rect(screen, width, height, x, y, w, 24, 0xff0a246a);
+    }
+}
+
+/**
+ * terminal / editor, black text on white background
+ */
+static void corpus_text(uint32_t *screen, int width, int height, int frame) {
+    rand_state = 0x5678 + frame;
+    fill_rect(screen, width, height, 0, 0, width, height, 0xffffffff);
+    for (int y = 4; y + 12 < height; y += 16) {
+        int line_len = bench_rand() % (width / 8);
+        for (int x = 4; x < line_len * 8; x += 8) {
+            if (bench_rand() % 6 == 0) {
+                // space
+                continue;
+            }
+            uint32_t glyph = bench_rand();
+            for (int gy = 0; gy < 12; gy ++) {
+                for (int gx = 0; gx < 6; gx ++) {
+                    if (glyph & (1 << ((gx + gy * 6) % 32))) {
+                        screen[(x + gx) + (y + gy) * width] = 0xff000000;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * application UI with a few flat colours, borders and gradients-free widgets
+ */
+static void corpus_ui(uint32_t *screen, int width, int height, int frame) {
+    static const uint32_t colours[] = {
+        0xfff6f5f4, 0xffdeddda, 0xff3584e4, 0xff241f31, 0xffc0bfbc, 0xff77767b,
+    };
+    rand_state = 0x9abc + frame;
+    fill_rect(screen, width, height, 0, 0, width, height, colours[0]);
+    for (int i = 0; i < 400; i ++) {
+        int w = 16 + bench_rand() % 200;
+        int h = 8 + bench_rand() % 40;
+        int x = bench_rand() % width;
+        int y = bench_rand() % height;
+        fill_rect(screen, width, height, x, y, w, h, colours[bench_rand() % 6]);
+    }
+}
+
+/**
+ * photographic content / video, every pixel is different
+ */
+static void corpus_photo(uint32_t *screen, int width, int height, int frame) {
+    rand_state = 0xdef0 + frame;
+    for (int y = 0; y < height; y ++) {
+        for (int x = 0; x < width; x ++) {
+            uint32_t noise = bench_rand() & 0x0f0f0f;
+            uint32_t r = (x * 255 / width) & 0xff;
+            uint32_t g = (y * 255 / height) & 0xff;
+            uint32_t b = ((x + y + frame * 8) & 0xff);
+            screen[x + y * width] = 0xff000000 | ((r | (g << 8) | (b << 16)) ^ noise);
+        }
+    }
+}
+
+static const corpus_t corpora[] = {
+    { "desktop", corpus_desktop },
+    { "text", corpus_text },
+    { "ui", corpus_ui },
+    { "photo", corpus_photo },
+    { "synthetic", grab_synthetic_render },
+};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * print the result of a benchmark
+ *
+ * @param opts       benchmark options
+ * @param name       name of function benchmarked
+ * @param res        resolution used
+ * @param corpus     corpus used
+ * @param elapsed    total number of nanoseconds spent
+ * @param n_tiles    total number of tiles processed
+ * @param n_bytes    total number of bytes processed
+ * @param n_frames   number of frames processed
+ * @param allocs     number of allocations made
+ */
+static void report(bench_options_t *opts, const char *name, const resolution_t *res, const corpus_t *corpus,
+                   uint64_t elapsed, uint64_t n_tiles, uint64_t n_bytes, int n_frames, unsigned long allocs) {
+    double ns_per_tile = n_tiles > 0 ? (double)elapsed / n_tiles : 0;
+    double mb_per_s = elapsed > 0 ? ((double)n_bytes / (1024 * 1024)) / ((double)elapsed / 1e9) : 0;
+    double allocs_per_frame = (double)allocs / n_frames;
+
+    if (opts->csv) {
+        printf("%s,%s,%dx%d,%s,%.1f,%.1f,%.1f\n", name, res->name, res->width, res->height, corpus->name,
+               ns_per_tile, mb_per_s, allocs_per_frame);
+    } else {
+        printf("%-28s %-6s %-8s %12.1f ns/tile %10.1f MB/s %10.1f allocs/frame\n", name, res->name, corpus->name,
+               ns_per_tile, mb_per_s, allocs_per_frame);
+    }
+}
+
+static void *drain_socket(void *arg) {
+    int s = *(int *)arg;
+    uint8_t buf[65536];
+
+    while (recv(s, buf, sizeof(buf), 0) > 0) {
+        /* discard */
+    }
+    return NULL;
+}
+
+/**
+ * generate a frame of a corpus into one of the screen buffers, in the layout used by the app
+ *
+ * @param app      the app the screen belongs to
+ * @param screen   current_screen or prev_screen
+ * @param corpus   corpus to generate
+ * @param frame    frame number
+ * @param scratch  row by row buffer used with the tiled layout
+ */
+static void generate(shareit_app_t *app, uint32_t *screen, const corpus_t *corpus, int frame, uint32_t *scratch) {
+    if (!app->tiled_screen) {
+        corpus->generate(screen, app->width, app->height, frame);
+        return;
+    }
+    corpus->generate(scratch, app->width, app->height, frame);
+    screen_to_tiles(scratch, app->width, app->height, screen, screen_tile_size(app));
+}
+
+static void bench_run(bench_options_t *opts, const resolution_t *res, const corpus_t *corpus) {
+    shareit_app_t app;
+    viewinfo_t view = { 0 };
+    framebuffer_update_t *update;
+    uint64_t start, elapsed;
+    unsigned long allocs;
+    int tiles_x = (res->width + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (res->height + TILE_SIZE - 1) / TILE_SIZE;
+    uint64_t n_tiles = (uint64_t)tiles_x * tiles_y * opts->iterations;
+    uint64_t screen_bytes = (uint64_t)res->width * res->height * sizeof(uint32_t) * opts->iterations;
+    uint8_t raw[TILE_SIZE * TILE_SIZE * 3];
+    int x, y, i;
+
+    memset(&app, 0, sizeof(app));
+    app.width = res->width;
+    app.height = res->height;
+    app.block_size = TILE_SIZE;
+    app.tiled_screen = opts->tiled;
+    app.current_screen = malloc(sizeof(uint32_t) * screen_size(&app));
+    app.prev_screen = malloc(sizeof(uint32_t) * screen_size(&app));
+    uint32_t *scratch = malloc(sizeof(uint32_t) * res->width * res->height);
+
+    view.width = res->width;
+    view.height = res->height;
+    view.row_stride = res->width * sizeof(uint32_t);
+    view.pixels = calloc(res->width * res->height, sizeof(uint32_t));
+
+    generate(&app, app.current_screen, corpus, 0, scratch);
+    memcpy(app.prev_screen, app.current_screen, sizeof(uint32_t) * screen_size(&app));
+
+    // compare_parts(), equal buffers means that every row has to be compared
+    allocs = n_allocs;
+    start = now_ns();
+    for (i = 0; i < opts->iterations; i ++) {
+        for (y = 0; y < res->height; y += TILE_SIZE) {
+            for (x = 0; x < res->width; x += TILE_SIZE) {
+                compare_parts(&app, x, y, TILE_SIZE, TILE_SIZE);
+            }
+        }
+    }
+    elapsed = now_ns() - start;
+    report(opts, "compare_parts", res, corpus, elapsed, n_tiles, screen_bytes * 2, opts->iterations, n_allocs - allocs);
+
+    // rect_palette()
+    allocs = n_allocs;
+    start = now_ns();
+    for (i = 0; i < opts->iterations; i ++) {
+        for (y = 0; y < res->height; y += TILE_SIZE) {
+            for (x = 0; x < res->width; x += TILE_SIZE) {
+                rect_palette(&app, x, y, TILE_SIZE, TILE_SIZE, NULL, NULL);
+            }
+        }
+    }
+    elapsed = now_ns() - start;
+    report(opts, "rect_palette", res, corpus, elapsed, n_tiles, screen_bytes, opts->iterations, n_allocs - allocs);
+
+    // copy_screen_to_raw()
+    allocs = n_allocs;
+    start = now_ns();
+    for (i = 0; i < opts->iterations; i ++) {
+        for (y = 0; y < res->height; y += TILE_SIZE) {
+            for (x = 0; x < res->width; x += TILE_SIZE) {
+                copy_screen_to_raw(&app, raw, x, y, TILE_SIZE, TILE_SIZE);
+            }
+        }
+    }
+    elapsed = now_ns() - start;
+    report(opts, "copy_screen_to_raw", res, corpus, elapsed, n_tiles, screen_bytes, opts->iterations, n_allocs - allocs);
+
+    // create_rect()
+    allocs = 0;
+    elapsed = 0;
+    for (i = 0; i < opts->iterations; i ++) {
+        for (y = 0; y < res->height; y += TILE_SIZE) {
+            for (x = 0; x < res->width; x += TILE_SIZE) {
+                unsigned long before = n_allocs;
+                start = now_ns();
+                framebuffer_rect_t *rect = create_rect(&app, x, y, TILE_SIZE, TILE_SIZE);
+                elapsed += now_ns() - start;
+                allocs += n_allocs - before;
+                free_framebuffer_rect(rect);
+            }
+        }
+    }
+    report(opts, "create_rect", res, corpus, elapsed, n_tiles, screen_bytes, opts->iterations, allocs);
+
+    // create_jpeg_rect()
+    allocs = 0;
+    elapsed = 0;
+    for (i = 0; i < opts->iterations; i ++) {
+        for (y = 0; y < res->height; y += TILE_SIZE) {
+            for (x = 0; x < res->width; x += TILE_SIZE) {
+                unsigned long before = n_allocs;
+                start = now_ns();
+                framebuffer_rect_t *rect = create_jpeg_rect(&app, x, y, TILE_SIZE, TILE_SIZE, JPEG_DEFAULT_QUALITY);
+                elapsed += now_ns() - start;
+                allocs += n_allocs - before;
+                free_framebuffer_rect(rect);
+            }
+        }
+    }
+    report(opts, "create_jpeg_rect", res, corpus, elapsed, n_tiles, screen_bytes, opts->iterations, allocs);
+
+    // compare_screens(), with every frame differing from the previous one
+    allocs = 0;
+    elapsed = 0;
+    for (i = 0; i < opts->iterations; i ++) {
+        generate(&app, app.prev_screen, corpus, i * 2 + 1, scratch);
+        generate(&app, app.current_screen, corpus, i * 2 + 2, scratch);
+
+        unsigned long before = n_allocs;
+        start = now_ns();
+        int changed = compare_screens(&app, &update);
+        elapsed += now_ns() - start;
+        allocs += n_allocs - before;
+        if (changed) {
+            free_framebuffer_update(update);
+        }
+    }
+    report(opts, "compare_screens", res, corpus, elapsed, n_tiles, screen_bytes * 2, opts->iterations, allocs);
+
+    // pkt_send_framebuffer_update() and draw_update(), using the update for the last frame
+    app.prev_screen[0] = ~app.current_screen[0];
+    compare_screens(&app, &update);
+
+    int sv[2];
+    pthread_t drain;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    pthread_create(&drain, NULL, drain_socket, &sv[1]);
+
+    uint64_t wire_bytes = framebuffer_update_wire_size(update);
+
+    allocs = n_allocs;
+    start = now_ns();
+    for (i = 0; i < opts->iterations; i ++) {
+        pkt_send_framebuffer_update(sv[0], update);
+    }
+    elapsed = now_ns() - start;
+    report(opts, "pkt_send_framebuffer_update", res, corpus, elapsed, n_tiles, wire_bytes * opts->iterations,
+           opts->iterations, n_allocs - allocs);
+    shutdown(sv[0], SHUT_WR);
+    pthread_join(drain, NULL);
+    close(sv[0]);
+    close(sv[1]);
+
+    allocs = n_allocs;
+    start = now_ns();
+    for (i = 0; i < opts->iterations; i ++) {
+        draw_update(&view, update);
+    }
+    elapsed = now_ns() - start;
+    report(opts, "draw_update", res, corpus, elapsed, n_tiles, screen_bytes, opts->iterations, n_allocs - allocs);
+
+    free_framebuffer_update(update);
+    free(view.pixels);
+    free(app.current_screen);
+    free(app.prev_screen);
+    free(scratch);
+    free_tile_state(&app);
+}
+
+int main(int argc, char *argv[]) {
+    bench_options_t opts;
+    int opt;
+    int convert_level = convert_level_avx2;
+
+    opts.csv = 0;
+    opts.iterations = 5;
+    opts.tiled = 0;
+
+    while ((opt = getopt(argc, argv, "cn:st")) != -1) {
+        switch (opt) {
+        case 'c':
+            opts.csv = 1;
+            break;
+        case 'n':
+            opts.iterations = atoi(optarg);
+            break;
+        case 's':
+            convert_level = convert_level_scalar;
+            break;
+        case 't':
+            opts.tiled = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c] [-n iterations] [-s] [-t]\n", argv[0]);
+            fprintf(stderr, "  -c  output results as CSV\n");
+            fprintf(stderr, "  -s  use the scalar pixel conversion instead of SSSE3/AVX2\n");
+            fprintf(stderr, "  -t  store the screens one tile at a time, instead of row by row\n");
+            return 1;
+        }
+    }
+
+    if (opts.iterations < 1) {
+        opts.iterations = 1;
+    }
+    convert_init(convert_level);
+
+    if (opts.csv) {
+        printf("function,resolution,size,corpus,ns_per_tile,mb_per_s,allocs_per_frame\n");
+    }
+
+    for (size_t r = 0; r < sizeof(resolutions) / sizeof(resolutions[0]); r ++) {
+        for (size_t c = 0; c < sizeof(corpora) / sizeof(corpora[0]); c ++) {
+            bench_run(&opts, &resolutions[r], &corpora[c]);
+        }
+    }
+    return 0;
+}
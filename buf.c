@@ -8,6 +8,7 @@
 // Licensed under the GPLv3 or later.
 // See COPYING at the root of the repository for details.
 #include <arpa/inet.h>
+#include <endian.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -63,12 +64,14 @@ static void buf_check_realloc(buf_t *b, int sz) {
     int new_sz;
     int required_sz;
 
+    // Grow geometrically, large updates are built a few bytes at a time
     required_sz = b->len + sz;
-    for (new_sz = b->allocated + BUF_INITIAL_SIZE; new_sz < required_sz;) {
-        new_sz += BUF_INITIAL_SIZE;
+    for (new_sz = b->allocated * 2; new_sz < required_sz;) {
+        new_sz *= 2;
     }
 
     b->buf = realloc(b->buf, new_sz);
+    b->allocated = new_sz;
 }
 
 void buf_add_uint8(buf_t *b, uint8_t v) {
@@ -80,19 +83,29 @@ void buf_add_uint8(buf_t *b, uint8_t v) {
 void buf_add_uint16(buf_t *b, uint16_t v) {
     buf_check_realloc(b, 2);
 
-    *((uint16_t *)&(b->buf[b->len])) = htons(v);
+    v = htons(v);
+    memcpy(&b->buf[b->len], &v, sizeof(v));
     b->len += 2;
 }
 
 void buf_add_uint32(buf_t *b, uint32_t v) {
     buf_check_realloc(b, 4);
-    *((uint32_t *)&(b->buf[b->len])) = htonl(v);
+    v = htonl(v);
+    memcpy(&b->buf[b->len], &v, sizeof(v));
     b->len += 4;
 }
 
+void buf_add_uint64(buf_t *b, uint64_t v) {
+    buf_check_realloc(b, 8);
+    v = htobe64(v);
+    memcpy(&b->buf[b->len], &v, sizeof(v));
+    b->len += 8;
+}
+
 void buf_add_int32(buf_t *b, int32_t v) {
     buf_check_realloc(b, 4);
-    *((int32_t *)&(b->buf[b->len])) = htonl(v);
+    v = htonl(v);
+    memcpy(&b->buf[b->len], &v, sizeof(v));
     b->len += 4;
 }
 
@@ -25,6 +25,7 @@ void buf_dump(buf_t *);
 void buf_add_uint8(buf_t *, uint8_t);
 void buf_add_uint16(buf_t *, uint16_t);
 void buf_add_uint32(buf_t *, uint32_t);
+void buf_add_uint64(buf_t *, uint64_t);
 void buf_add_int32(buf_t *, int32_t);
 void buf_add_bytes(buf_t *, int len, const uint8_t *bytes);
 void buf_add_string(buf_t *, const char *str);
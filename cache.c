@@ -0,0 +1,218 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+
+/**
+ * create a new, empty tile cache
+ *
+ * @param index_hashes  TRUE if tiles will be looked up by hash
+ * @return newly allocated tile cache, or NULL on error
+ */
+tile_cache_t *tile_cache_new(int index_hashes) {
+    tile_cache_t *cache;
+
+    cache = calloc(1, sizeof(tile_cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->index_hashes = index_hashes;
+    tile_cache_clear(cache);
+    return cache;
+}
+
+void tile_cache_free(tile_cache_t *cache) {
+    if (cache == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < TILE_CACHE_SLOTS; i ++) {
+        free(cache->entries[i].pixels);
+    }
+    free(cache);
+}
+
+/**
+ * forget all tiles in the cache
+ * Pixel buffers are kept, so that they can be reused.
+ *
+ * @param cache  cache to clear
+ */
+void tile_cache_clear(tile_cache_t *cache) {
+    for (int i = 0; i < TILE_CACHE_SLOTS; i ++) {
+        cache->entries[i].used = 0;
+    }
+    for (int i = 0; i < TILE_CACHE_BUCKETS; i ++) {
+        cache->buckets[i] = -1;
+    }
+    cache->head = -1;
+    cache->tail = -1;
+    cache->n_used = 0;
+}
+
+static void lru_unlink(tile_cache_t *cache, int slot) {
+    tile_cache_entry_t *entry = &cache->entries[slot];
+
+    if (entry->prev != -1) {
+        cache->entries[entry->prev].next = entry->next;
+    } else {
+        cache->head = entry->next;
+    }
+    if (entry->next != -1) {
+        cache->entries[entry->next].prev = entry->prev;
+    } else {
+        cache->tail = entry->prev;
+    }
+}
+
+static void lru_push_front(tile_cache_t *cache, int slot) {
+    tile_cache_entry_t *entry = &cache->entries[slot];
+
+    entry->prev = -1;
+    entry->next = cache->head;
+    if (cache->head != -1) {
+        cache->entries[cache->head].prev = slot;
+    }
+    cache->head = slot;
+    if (cache->tail == -1) {
+        cache->tail = slot;
+    }
+}
+
+static void bucket_remove(tile_cache_t *cache, int slot) {
+    int *p = &cache->buckets[cache->entries[slot].hash % TILE_CACHE_BUCKETS];
+
+    while (*p != -1) {
+        if (*p == slot) {
+            *p = cache->entries[slot].bucket_next;
+            return;
+        }
+        p = &cache->entries[*p].bucket_next;
+    }
+}
+
+/**
+ * find a tile in the cache, without marking it as used
+ *
+ * @param cache  cache to search
+ * @param hash   hash of tile
+ * @param w      width of tile
+ * @param h      height of tile
+ * @return slot of tile, or -1 if it's not in the cache
+ */
+int tile_cache_find(tile_cache_t *cache, uint64_t hash, int w, int h) {
+    int slot;
+
+    for (slot = cache->buckets[hash % TILE_CACHE_BUCKETS]; slot != -1; slot = cache->entries[slot].bucket_next) {
+        tile_cache_entry_t *entry = &cache->entries[slot];
+        if (entry->hash == hash && entry->width == w && entry->height == h) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/**
+ * find a tile in the cache, and mark it as recently used
+ *
+ * @param cache  cache to search
+ * @param hash   hash of tile
+ * @param w      width of tile
+ * @param h      height of tile
+ * @return slot of tile, or -1 if it's not in the cache
+ */
+int tile_cache_lookup(tile_cache_t *cache, uint64_t hash, int w, int h) {
+    int slot = tile_cache_find(cache, hash, w, h);
+
+    if (slot == -1) {
+        cache->misses ++;
+        return -1;
+    }
+    tile_cache_touch(cache, slot);
+    cache->hits ++;
+    return slot;
+}
+
+/**
+ * add a tile to the cache, replacing the least recently used one if the cache is full
+ *
+ * @param cache  cache to add tile to
+ * @param hash   hash of tile (ignored unless the cache indexes hashes)
+ * @param w      width of tile
+ * @param h      height of tile
+ * @return slot that the tile was put in
+ */
+int tile_cache_insert(tile_cache_t *cache, uint64_t hash, int w, int h) {
+    tile_cache_entry_t *entry;
+    int slot;
+
+    if (cache->n_used < TILE_CACHE_SLOTS) {
+        slot = cache->n_used++;
+    } else {
+        slot = cache->tail;
+        lru_unlink(cache, slot);
+        if (cache->index_hashes) {
+            bucket_remove(cache, slot);
+        }
+    }
+
+    entry = &cache->entries[slot];
+    if (entry->pixels != NULL && (entry->width != w || entry->height != h)) {
+        free(entry->pixels);
+        entry->pixels = NULL;
+    }
+    entry->hash = hash;
+    entry->width = w;
+    entry->height = h;
+    entry->used = 1;
+    lru_push_front(cache, slot);
+
+    if (cache->index_hashes) {
+        entry->bucket_next = cache->buckets[hash % TILE_CACHE_BUCKETS];
+        cache->buckets[hash % TILE_CACHE_BUCKETS] = slot;
+    }
+    return slot;
+}
+
+/**
+ * mark a tile as recently used
+ *
+ * @param cache  cache containing tile
+ * @param slot   slot of tile
+ * @return 0 on success, -1 if there's no tile in the slot
+ */
+int tile_cache_touch(tile_cache_t *cache, int slot) {
+    if (slot < 0 || slot >= TILE_CACHE_SLOTS || !cache->entries[slot].used) {
+        return -1;
+    }
+
+    if (cache->head != slot) {
+        lru_unlink(cache, slot);
+        lru_push_front(cache, slot);
+    }
+    return 0;
+}
+
+/**
+ * get the pixel buffer of a tile, allocating it if needed
+ *
+ * @param cache  cache containing tile
+ * @param slot   slot of tile
+ * @return buffer of width*height*4 bytes, or NULL on error
+ */
+uint8_t *tile_cache_pixels(tile_cache_t *cache, int slot) {
+    tile_cache_entry_t *entry = &cache->entries[slot];
+
+    if (entry->pixels == NULL) {
+        entry->pixels = malloc(entry->width * entry->height * 4);
+    }
+    return entry->pixels;
+}
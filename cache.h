@@ -0,0 +1,60 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#ifndef SHAREIT_CACHE_H
+#define SHAREIT_CACHE_H
+#include <stdint.h>
+
+// Number of tiles remembered by each end, must fit in the uint16 slot number
+#define TILE_CACHE_SLOTS 1024
+
+// Larger rects are not cached, this bounds the memory used by the viewer cache
+#define TILE_CACHE_MAX_PIXELS (128 * 128)
+
+// Number of hash buckets used to look up tiles on the sharer side
+#define TILE_CACHE_BUCKETS 2048
+
+typedef struct {
+    uint64_t hash;
+    uint16_t width;
+    uint16_t height;
+    int used;
+    int prev;         // more recently used slot, or -1
+    int next;         // less recently used slot, or -1
+    int bucket_next;  // next slot in the same hash bucket, or -1
+    uint8_t *pixels;  // decoded tile, 4 bytes per pixel (viewer only)
+} tile_cache_entry_t;
+
+/*
+ * The viewer keeps a copy of every tile the sharer puts in its cache. Both ends
+ * insert the same tiles in the same order and use the same replacement policy,
+ * so a slot number means the same tile on both ends without any extra messages.
+ */
+typedef struct {
+    int index_hashes;  // TRUE if tiles can be looked up by hash (sharer)
+    tile_cache_entry_t entries[TILE_CACHE_SLOTS];
+    int head;          // most recently used slot, or -1
+    int tail;          // least recently used slot, or -1
+    int n_used;
+    int buckets[TILE_CACHE_BUCKETS];
+
+    // Counters, for statistics
+    uint32_t hits;
+    uint32_t misses;
+} tile_cache_t;
+
+tile_cache_t *tile_cache_new(int index_hashes);
+void tile_cache_free(tile_cache_t *cache);
+void tile_cache_clear(tile_cache_t *cache);
+int tile_cache_find(tile_cache_t *cache, uint64_t hash, int w, int h);
+int tile_cache_lookup(tile_cache_t *cache, uint64_t hash, int w, int h);
+int tile_cache_insert(tile_cache_t *cache, uint64_t hash, int w, int h);
+int tile_cache_touch(tile_cache_t *cache, int slot);
+uint8_t *tile_cache_pixels(tile_cache_t *cache, int slot);
+#endif
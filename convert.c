@@ -0,0 +1,211 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVERT_X86
+#endif
+
+typedef void (*convert_to_screen_func)(const uint8_t *src, uint32_t *dst, int n);
+typedef void (*convert_from_screen_func)(const uint32_t *src, uint8_t *dst, int n);
+
+/*
+ * Scalar versions, used as fallback and for the pixels at the end of
+ * the rows that don't fill a whole vector
+ */
+static void rgb_to_screen_scalar(const uint8_t *src, uint32_t *dst, int n) {
+    for (int i = 0; i < n; i++, src += 3) {
+        dst[i] = (src[0] << 16) | (src[1] << 8) | src[2];
+    }
+}
+
+static void rgba_to_screen_scalar(const uint8_t *src, uint32_t *dst, int n) {
+    for (int i = 0; i < n; i++, src += 4) {
+        dst[i] = ((uint32_t)src[3] << 24) | (src[0] << 16) | (src[1] << 8) | src[2];
+    }
+}
+
+static void screen_to_rgb888_scalar(const uint32_t *src, uint8_t *dst, int n) {
+    for (int i = 0; i < n; i++, dst += 3) {
+        dst[0] = src[i] & 0xff;
+        dst[1] = (src[i] >> 8) & 0xff;
+        dst[2] = (src[i] >> 16) & 0xff;
+    }
+}
+
+#ifdef CONVERT_X86
+/*
+ * The vector loops read and write whole vectors, so they stop while there's
+ * still enough room left in the rows, and leave the rest to the scalar versions.
+ */
+__attribute__((target("ssse3")))
+static void rgb_to_screen_ssse3(const uint8_t *src, uint32_t *dst, int n) {
+    // 4 pixels from the first 12 bytes, with a zero top byte
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    int i;
+
+    for (i = 0; i + 6 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 3));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v, shuffle));
+    }
+    rgb_to_screen_scalar(src + i * 3, dst + i, n - i);
+}
+
+__attribute__((target("ssse3")))
+static void rgba_to_screen_ssse3(const uint8_t *src, uint32_t *dst, int n) {
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v, shuffle));
+    }
+    rgba_to_screen_scalar(src + i * 4, dst + i, n - i);
+}
+
+__attribute__((target("ssse3")))
+static void screen_to_rgb888_ssse3(const uint32_t *src, uint8_t *dst, int n) {
+    // Packs 4 pixels into the first 12 bytes, the last 4 are overwritten by the next store
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    int i;
+
+    for (i = 0; i + 6 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i * 3), _mm_shuffle_epi8(v, shuffle));
+    }
+    screen_to_rgb888_scalar(src + i, dst + i * 3, n - i);
+}
+
+/*
+ * AVX2 shuffles only move bytes within each 128 bit lane, so
+ * each lane is loaded and stored by itself
+ */
+__attribute__((target("avx2")))
+static void rgb_to_screen_avx2(const uint8_t *src, uint32_t *dst, int n) {
+    const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+                                             2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    int i;
+
+    for (i = 0; i + 10 <= n; i += 8) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(src + i * 3));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(src + i * 3 + 12));
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(v, shuffle));
+    }
+    rgb_to_screen_scalar(src + i * 3, dst + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void rgba_to_screen_avx2(const uint8_t *src, uint32_t *dst, int n) {
+    const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                             2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(v, shuffle));
+    }
+    rgba_to_screen_scalar(src + i * 4, dst + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void screen_to_rgb888_avx2(const uint32_t *src, uint8_t *dst, int n) {
+    const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                             0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    int i;
+
+    for (i = 0; i + 10 <= n; i += 8) {
+        __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(src + i)), shuffle);
+        _mm_storeu_si128((__m128i *)(dst + i * 3), _mm256_castsi256_si128(v));
+        _mm_storeu_si128((__m128i *)(dst + i * 3 + 12), _mm256_extracti128_si256(v, 1));
+    }
+    screen_to_rgb888_scalar(src + i, dst + i * 3, n - i);
+}
+#endif
+
+static convert_to_screen_func rgb_to_screen = rgb_to_screen_scalar;
+static convert_to_screen_func rgba_to_screen = rgba_to_screen_scalar;
+static convert_from_screen_func screen_to_rgb888 = screen_to_rgb888_scalar;
+
+/**
+ * pick the conversion kernels to use
+ *
+ * Until this is called, the scalar versions are used.
+ *
+ * @param max_level  highest convert_level to use, even if the CPU supports more
+ * @return the convert_level that is used
+ */
+int convert_init(int max_level) {
+    int level = convert_level_scalar;
+
+#ifdef CONVERT_X86
+    __builtin_cpu_init();
+    if (max_level >= convert_level_avx2 && __builtin_cpu_supports("avx2")) {
+        level = convert_level_avx2;
+    } else if (max_level >= convert_level_ssse3 && __builtin_cpu_supports("ssse3")) {
+        level = convert_level_ssse3;
+    }
+#endif
+
+    switch (level) {
+#ifdef CONVERT_X86
+    case convert_level_avx2:
+        rgb_to_screen = rgb_to_screen_avx2;
+        rgba_to_screen = rgba_to_screen_avx2;
+        screen_to_rgb888 = screen_to_rgb888_avx2;
+        break;
+    case convert_level_ssse3:
+        rgb_to_screen = rgb_to_screen_ssse3;
+        rgba_to_screen = rgba_to_screen_ssse3;
+        screen_to_rgb888 = screen_to_rgb888_ssse3;
+        break;
+#endif
+    default:
+        rgb_to_screen = rgb_to_screen_scalar;
+        rgba_to_screen = rgba_to_screen_scalar;
+        screen_to_rgb888 = screen_to_rgb888_scalar;
+        break;
+    }
+    return level;
+}
+
+/**
+ * convert a row of pixels from RGB (as in a GdkPixbuf without alpha) to screen pixels
+ *
+ * @param src  n pixels, 3 bytes each
+ * @param dst  n screen pixels, the top byte is set to 0
+ * @param n    number of pixels
+ */
+void convert_rgb_to_screen(const uint8_t *src, uint32_t *dst, int n) {
+    rgb_to_screen(src, dst, n);
+}
+
+/**
+ * convert a row of pixels from RGBA (as in a GdkPixbuf with alpha) to screen pixels
+ *
+ * @param src  n pixels, 4 bytes each
+ * @param dst  n screen pixels, alpha is kept in the top byte
+ * @param n    number of pixels
+ */
+void convert_rgba_to_screen(const uint8_t *src, uint32_t *dst, int n) {
+    rgba_to_screen(src, dst, n);
+}
+
+/**
+ * convert a row of screen pixels to the RGB888 wire format (blue, green, red)
+ *
+ * @param src  n screen pixels
+ * @param dst  buffer for n * 3 bytes
+ * @param n    number of pixels
+ */
+void convert_screen_to_rgb888(const uint32_t *src, uint8_t *dst, int n) {
+    screen_to_rgb888(src, dst, n);
+}
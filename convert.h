@@ -0,0 +1,29 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#ifndef SHAREIT_CONVERT_H
+#define SHAREIT_CONVERT_H
+#include <stdint.h>
+
+/*
+ * Conversion of rows of pixels between the layouts used by the grabbers,
+ * the screen buffers (0x00RRGGBB) and the wire.
+ * The kernels are picked at runtime from what the CPU supports.
+ */
+enum convert_level {
+    convert_level_scalar = 0,
+    convert_level_ssse3 = 1,
+    convert_level_avx2 = 2,
+};
+
+int convert_init(int max_level);
+void convert_rgb_to_screen(const uint8_t *src, uint32_t *dst, int n);
+void convert_rgba_to_screen(const uint8_t *src, uint32_t *dst, int n);
+void convert_screen_to_rgb888(const uint32_t *src, uint8_t *dst, int n);
+#endif
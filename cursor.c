@@ -0,0 +1,69 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#include <stdlib.h>
+#include <string.h>
+#include "cursor.h"
+
+/**
+ * look up a cursor shape by serial
+ *
+ * @param cache   cache to search
+ * @param serial  serial of cursor
+ * @return cached shape, or NULL if it's not in the cache
+ */
+cursor_shape_t *cursor_cache_find(cursor_cache_t *cache, uint32_t serial) {
+    for (int i = 0; i < cache->n_shapes; i ++) {
+        if (cache->shapes[i].serial == serial) {
+            return &cache->shapes[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * add a cursor shape to the cache, replacing the oldest one if the cache is full
+ * NOTE! The cache takes ownership of shape->pixels
+ *
+ * @param cache  cache to add shape to
+ * @param shape  shape to add
+ * @return the cached shape
+ */
+cursor_shape_t *cursor_cache_add(cursor_cache_t *cache, cursor_shape_t *shape) {
+    cursor_shape_t *slot;
+
+    slot = cursor_cache_find(cache, shape->serial);
+    if (slot == NULL) {
+        if (cache->n_shapes < CURSOR_CACHE_SIZE) {
+            slot = &cache->shapes[cache->n_shapes++];
+        } else {
+            slot = &cache->shapes[cache->next];
+            cache->next = (cache->next + 1) % CURSOR_CACHE_SIZE;
+        }
+    }
+
+    if (slot == cache->current) {
+        cache->current = NULL;
+    }
+    free(slot->pixels);
+    *slot = *shape;
+    return slot;
+}
+
+/**
+ * remove all shapes from the cache
+ *
+ * @param cache  cache to clear
+ */
+void cursor_cache_clear(cursor_cache_t *cache) {
+    for (int i = 0; i < cache->n_shapes; i ++) {
+        free(cache->shapes[i].pixels);
+    }
+    memset(cache, 0, sizeof(cursor_cache_t));
+}
@@ -0,0 +1,39 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#ifndef SHAREIT_CURSOR_H
+#define SHAREIT_CURSOR_H
+#include <stdint.h>
+
+// Number of cursor shapes remembered by each end
+#define CURSOR_CACHE_SIZE 16
+
+// Largest cursor shape we accept
+#define CURSOR_MAX_SIZE 256
+
+typedef struct {
+    uint32_t serial;   // serial of cursor, as reported by the grabber
+    uint16_t width;
+    uint16_t height;
+    uint16_t xhot;     // hotspot of cursor, relative to the top left corner of the image
+    uint16_t yhot;
+    uint32_t *pixels;  // premultiplied ARGB, width*height (NULL on the sharer side)
+} cursor_shape_t;
+
+typedef struct {
+    cursor_shape_t shapes[CURSOR_CACHE_SIZE];
+    int n_shapes;
+    int next;                 // slot to replace when the cache is full
+    cursor_shape_t *current;  // shape currently in use, or NULL if unknown
+} cursor_cache_t;
+
+cursor_shape_t *cursor_cache_find(cursor_cache_t *cache, uint32_t serial);
+cursor_shape_t *cursor_cache_add(cursor_cache_t *cache, cursor_shape_t *shape);
+void cursor_cache_clear(cursor_cache_t *cache);
+#endif
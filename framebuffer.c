@@ -7,17 +7,29 @@
 // Copyright © 2020 Elias Norberg
 // Licensed under the GPLv3 or later.
 // See COPYING at the root of the repository for details.
+#include <limits.h>
 #include <stdint.h>
 #include <string.h>
 #include "shareit.h"
 #include "framebuffer.h"
-
-#define BLOCK_WIDTH 64
-#define BLOCK_HEIGHT 64
+#include "jpeg.h"
+#include "hash.h"
+#include "palette.h"
+#include "convert.h"
 
 // Allocate in chunks of 20
 #define RECT_LIST_ALLOC_SZ 20
 
+// A block has to change in this many of the last 8 frames before lossy encoding is considered
+#define LOSSY_MIN_CHANGES 3
+
+// Blocks where more than this percentage of the pixels equals their left neighbour
+// are most likely text or UI, which looks bad with lossy encoding
+#define LOSSY_MAX_RUN_PERCENT 25
+
+// A lossy block is resent lossless when it hasn't changed for this many frames
+#define LOSSY_REFINE_FRAMES 3
+
 int min(int a, int b) {
     if (a < b) {
         return a;
@@ -25,11 +37,42 @@ int min(int a, int b) {
     return b;
 }
 
+/**
+ * get a printable name of an encoding type
+ *
+ * @param encoding_type  encoding type to get name of
+ * @return name of encoding, or NULL if it's not an encoding we know of
+ */
+const char *framebuffer_encoding_name(int encoding_type) {
+    switch (encoding_type) {
+    case framebuffer_encoding_type_raw:
+        return "raw";
+    case framebuffer_encoding_type_solid:
+        return "solid";
+    case framebuffer_encoding_type_trle:
+        return "trle";
+    case framebuffer_encoding_type_jpeg:
+        return "jpeg";
+    case framebuffer_encoding_type_cached:
+        return "cached";
+    default:
+        return NULL;
+    }
+}
+
 void free_framebuffer_rect(framebuffer_rect_t *rect) {
     switch (rect->encoding_type) {
     case framebuffer_encoding_type_raw:
         free(rect->enc.raw.data);
+        break;
+    case framebuffer_encoding_type_trle:
+        free(rect->enc.trle.data);
+        break;
+    case framebuffer_encoding_type_jpeg:
+        free(rect->enc.jpeg.data);
+        break;
     case framebuffer_encoding_type_solid:
+    case framebuffer_encoding_type_cached:
         /* noop */
         break;
     default:
@@ -53,7 +96,119 @@ void free_framebuffer_update(framebuffer_update_t *update) {
 }
 
 /**
- * copy a block from the current app screen into a raw data segment
+ * get the size of the blocks the screen is split into
+ *
+ * @param app the main application
+ * @return block size in pixels
+ */
+static int get_block_size(shareit_app_t *app) {
+    return app->block_size > 0 ? app->block_size : BLOCK_SIZE_DEFAULT;
+}
+
+/**
+ * get the size of the tiles in the screen buffers
+ *
+ * @param app the main application
+ * @return tile size in pixels, or 0 if the screen buffers are stored row by row
+ */
+int screen_tile_size(shareit_app_t *app) {
+    return app->tiled_screen ? get_block_size(app) : 0;
+}
+
+/**
+ * get the number of pixels to allocate for current_screen and prev_screen
+ *
+ * @param app the main application
+ * @return number of pixels, including the padding of the tiles at the right and bottom edges
+ */
+size_t screen_size(shareit_app_t *app) {
+    int tile_size = screen_tile_size(app);
+
+    if (tile_size == 0) {
+        return (size_t)app->width * app->height;
+    }
+    return (size_t)((app->width + tile_size - 1) / tile_size) * ((app->height + tile_size - 1) / tile_size) *
+           tile_size * tile_size;
+}
+
+/**
+ * get the number of pixels between two rows in a screen buffer
+ *
+ * @param app the main application
+ * @return row stride in pixels
+ */
+int screen_stride(shareit_app_t *app) {
+    return app->tiled_screen ? get_block_size(app) : app->width;
+}
+
+/**
+ * get a pointer to a pixel in one of the screen buffers
+ * NOTE! With the tiled layout, only the pixels in the same block as x,y can be
+ * reached from the pointer, stepping screen_stride() pixels between the rows.
+ *
+ * @param app     the main application
+ * @param screen  current_screen or prev_screen
+ * @param x       x position of pixel
+ * @param y       y position of pixel
+ * @return pointer to pixel
+ */
+uint32_t *screen_pixel(shareit_app_t *app, uint32_t *screen, int x, int y) {
+    int tile_size = screen_tile_size(app);
+    int tiles_x;
+
+    if (tile_size == 0) {
+        return screen + (size_t)y * app->width + x;
+    }
+    tiles_x = (app->width + tile_size - 1) / tile_size;
+    return screen + ((size_t)(y / tile_size) * tiles_x + x / tile_size) * tile_size * tile_size +
+           (y % tile_size) * tile_size + x % tile_size;
+}
+
+/**
+ * store a row by row screen as tiles, each tile_size x tile_size tile contiguous in memory
+ *
+ * @param src        screen stored row by row
+ * @param width      width of screen
+ * @param height     height of screen
+ * @param dst        buffer to write tiles to, see screen_size()
+ * @param tile_size  size of the tiles
+ */
+void screen_to_tiles(const uint32_t *src, int width, int height, uint32_t *dst, int tile_size) {
+    for (int y = 0; y < height; y ++) {
+        const uint32_t *row = src + (size_t)y * width;
+        uint32_t *tile = dst + (size_t)(y / tile_size) * ((width + tile_size - 1) / tile_size) * tile_size * tile_size +
+                         (y % tile_size) * tile_size;
+
+        for (int x = 0; x < width; x += tile_size, tile += tile_size * tile_size) {
+            memcpy(tile, row + x, min(tile_size, width - x) * sizeof(uint32_t));
+        }
+    }
+}
+
+/**
+ * copy a rect of the current screen into a buffer, row by row
+ * Unlike screen_pixel(), the rect may cover several blocks.
+ *
+ * @param[in]  app    the main application
+ * @param[out] dst    buffer to copy to (w*h pixels)
+ * @param[in]  x      x position of rect
+ * @param[in]  y      y position of rect
+ * @param[in]  w      width of rect, inside the screen
+ * @param[in]  h      height of rect, inside the screen
+ */
+static void copy_screen_rect(shareit_app_t *app, uint32_t *dst, int x, int y, int w, int h) {
+    int block_size = get_block_size(app);
+
+    for (int sy = y; sy < y + h; sy ++) {
+        for (int sx = x; sx < x + w; sx += block_size - sx % block_size) {
+            int n = min(block_size - sx % block_size, x + w - sx);
+            memcpy(dst + (sy - y) * w + sx - x, screen_pixel(app, app->current_screen, sx, sy), n * sizeof(uint32_t));
+        }
+    }
+}
+
+/**
+ * copy a block from the current app screen into a raw data segment, converting it to app->pixel_format
  *
  * @param[in]  app    the main application
  * @param[out] block  buffer to copy the contents to
@@ -66,23 +221,28 @@ void copy_screen_to_raw(shareit_app_t *app, uint8_t *block, int x, int y, int w,
     int row;
     int max_x = min(app->width, x+w);
     int max_y = min(app->height, y+h);
+    int format = app->pixel_format;
+    int bpp = pixfmt_bpp(format);
+    int stride = screen_stride(app);
+    const uint32_t *source = screen_pixel(app, app->current_screen, x, y);
 
-    for (row = 0; row < h; row ++, y++) {
-        uint8_t *output_row = block + w*row*3;
+    for (row = 0; row < h; row ++, y++, source += stride) {
+        uint8_t *output_row = block + w*row*bpp;
         if (y >= max_y || max_x < app->width) {
             // make sure we don't have any old data in the buffer
-            memset(output_row, 0x00, w*3);
+            memset(output_row, 0x00, w*bpp);
             if (y >= max_y) {
                 continue;
             }
         }
 
-        for (int col = 0; col < w && x+col < app->width; col ++) {
-            uint8_t *pixel = block + (row * w + col) * 3;
-            uint8_t *source = ((uint8_t *)(app->current_screen)) + (y*app->width + x + col)*sizeof(uint32_t);
-            pixel[0] = source[0];
-            pixel[1] = source[1];
-            pixel[2] = source[2];
+        if (format == pixel_format_rgb888) {
+            convert_screen_to_rgb888(source, output_row, max_x - x);
+        } else {
+            uint8_t *pixel = output_row;
+            for (int col = 0; col < w && x+col < app->width; col ++) {
+                pixel = pixfmt_put(format, pixel, pixfmt_reduce(format, source[col]));
+            }
         }
     }
 }
@@ -99,7 +259,8 @@ void copy_screen_to_raw(shareit_app_t *app, uint8_t *block, int x, int y, int w,
  */
 int compare_parts(shareit_app_t *app, int x, int y, int w, int h) {
     int max_x, max_y;
-    int sz;
+    int sz, stride;
+    const uint32_t *current, *prev;
 
     if (app->prev_screen == NULL) {
         return 1;
@@ -107,11 +268,18 @@ int compare_parts(shareit_app_t *app, int x, int y, int w, int h) {
 
     max_x = min(x+w, app->width);
     max_y = min(y+h, app->height);
+    stride = screen_stride(app);
+    current = screen_pixel(app, app->current_screen, x, y);
+    prev = screen_pixel(app, app->prev_screen, x, y);
 
     sz = (max_x - x) * (int)sizeof(uint32_t);
-    for (; y < max_y; y++) {
-        int startpos = x + y*app->width;
-        if (memcmp((uint8_t *)(app->current_screen+startpos), (uint8_t *)(app->prev_screen+startpos), sz) != 0) {
+    if (sz == stride * (int)sizeof(uint32_t)) {
+        // The rows are next to each other, e.g. a whole tile with the tiled layout
+        return memcmp(current, prev, sz * (max_y - y)) != 0;
+    }
+
+    for (; y < max_y; y++, current += stride, prev += stride) {
+        if (memcmp(current, prev, sz) != 0) {
             return 1;
         }
     }
@@ -120,51 +288,53 @@ int compare_parts(shareit_app_t *app, int x, int y, int w, int h) {
 }
 
 /**
- * Count the number of colours in a rect
- * @param app
- * @param x
- * @param y
- * @param w
- * @param h
- * @return returns TRUE if rect consists of only one colour, otherwise FALSE
+ * Collect the colours in a rect
+ *
+ * Runs of equal pixels are only looked up once, and the search stops as soon as
+ * there are more than RECT_PALETTE_MAX colours.
+ *
+ * @param[in]  app             the main application
+ * @param[in]  x               x position of rect
+ * @param[in]  y               y position of rect
+ * @param[in]  w               width of rect
+ * @param[in]  h               height of rect
+ * @param[out] output_palette  if not NULL, colours are written here (room for RECT_PALETTE_MAX colours)
+ * @param[out] index           if not NULL, the palette index of each pixel is written here (w*h bytes,
+ *                             pixels outside of the screen are left untouched)
+ * @return number of colours in rect, or 0 if there are more than RECT_PALETTE_MAX
  */
-int rect_palette(shareit_app_t *app, int x, int y, int w, int h, uint32_t **output_palette) {
-    uint32_t palette[32];
-    uint8_t n_colours = 0;
-    uint32_t pixel;
-    int i;
-    int has_colour;
+int rect_palette(shareit_app_t *app, int x, int y, int w, int h, uint32_t *output_palette, uint8_t *index) {
+    palette_t palette;
+    uint32_t pixel, last = 0;
+    int last_index = -1;
     int max_x = min(app->width, x+w);
     int max_y = min(app->height, y+h);
-
     int sx, sy;
+
+    palette_reset(&palette, RECT_PALETTE_MAX);
     for (sy = y; sy < max_y; sy ++) {
+        const uint32_t *row = screen_pixel(app, app->current_screen, x, sy) - x;
+        uint8_t *index_row = index != NULL ? index + (sy - y)*w - x : NULL;
+
         for (sx = x; sx < max_x; sx ++) {
-            pixel = app->current_screen[sx+sy*app->width] & 0xffffff;
-            has_colour = 0;
-            for (i = 0; i < n_colours; i++) {
-                if (palette[i] == pixel) {
-                    has_colour = 1;
-                    break;
+            pixel = row[sx] & 0xffffff;
+            if (pixel != last || last_index == -1) {
+                last_index = palette_index(&palette, pixel);
+                if (last_index == -1) {
+                    return 0;
                 }
+                last = pixel;
             }
-
-            if (has_colour) {
-                continue;
-            }
-
-            if (n_colours == 32) {
-                return 0;
+            if (index_row != NULL) {
+                index_row[sx] = last_index;
             }
-            palette[n_colours] = pixel;
-            n_colours ++;
         }
     }
 
     if (output_palette != NULL) {
-        *output_palette = palette;
+        memcpy(output_palette, palette.colours, palette.n_colours * sizeof(uint32_t));
     }
-    return n_colours;
+    return palette.n_colours;
 }
 
 /**
@@ -185,67 +355,948 @@ framebuffer_rect_t *create_rect(shareit_app_t *app, int x, int y, int w, int h)
     rect->ypos = y;
     rect->width = w;
     rect->height = h;
+    rect->hash = 0;
 
-    uint32_t *palette;
-    int colour_count = rect_palette(app, x, y, w, h, &palette);
+    uint32_t palette[RECT_PALETTE_MAX];
+    int colour_count = rect_palette(app, x, y, w, h, palette, NULL);
 
     if (colour_count == 1) {
         rect->encoding_type = framebuffer_encoding_type_solid;
-        uint32_t pixel = palette[0];
+        uint32_t pixel = pixfmt_quantize(app->pixel_format, palette[0]);
         rect->enc.solid.red = pixel & 0xff;
         rect->enc.solid.green = (pixel >> 8) & 0xff;
         rect->enc.solid.blue = (pixel >> 16) & 0xff;
         return rect;
     }
 
-    // No other types matched, go with raw ZRLE
+    // TRLE is smaller than raw for almost everything except photos and noise
+    int trle_w = min(w, app->width - x);
+    int trle_h = min(h, app->height - y);
+    uint8_t *data = malloc(TRLE_MAX_SIZE(trle_w, trle_h));
+    int length = trle_encode(screen_pixel(app, app->current_screen, x, y), screen_stride(app), trle_w, trle_h,
+                             app->pixel_format, data);
+    if (length < w * h * pixfmt_bpp(app->pixel_format)) {
+        rect->encoding_type = framebuffer_encoding_type_trle;
+        rect->width = trle_w;
+        rect->height = trle_h;
+        rect->enc.trle.length = length;
+        rect->enc.trle.data = realloc(data, length);
+        return rect;
+    }
+    free(data);
+
+    // No other types matched, go with raw
     rect->encoding_type = framebuffer_encoding_type_raw;
-    rect->enc.raw.data = malloc(w * h * 3);
+    rect->enc.raw.data = malloc(w * h * pixfmt_bpp(app->pixel_format));
     copy_screen_to_raw(app, rect->enc.raw.data, x, y, w, h);
     return rect;
 }
 
+/**
+ * Create a new JPEG encoded framebuffer rect from app->current_screen
+ * Parts of the rect that are outside of the screen are not included.
+ *
+ * @param app      The main application
+ * @param x        X-position of the rect
+ * @param y        Y-position of the rect
+ * @param w        Width
+ * @param h        Height
+ * @param quality  JPEG quality (1 - 100)
+ * @return     Returns a newly allocated framebuffer_rect_t, or NULL if the rect could not be encoded
+ */
+framebuffer_rect_t *create_jpeg_rect(shareit_app_t *app, int x, int y, int w, int h, int quality) {
+    framebuffer_rect_t *rect;
+
+    w = min(w, app->width - x);
+    h = min(h, app->height - y);
+
+    rect = malloc(sizeof(framebuffer_rect_t));
+    if (rect == NULL) {
+        return NULL;
+    }
+    rect->xpos = x;
+    rect->ypos = y;
+    rect->width = w;
+    rect->height = h;
+    rect->hash = 0;
+    rect->encoding_type = framebuffer_encoding_type_jpeg;
+
+    if (jpeg_block_encode((uint8_t *)screen_pixel(app, app->current_screen, x, y), screen_stride(app)*sizeof(uint32_t),
+                          w, h, quality, app->pixel_format == pixel_format_grey8,
+                          &rect->enc.jpeg.data, &rect->enc.jpeg.length) != 0) {
+        free(rect);
+        return NULL;
+    }
+    return rect;
+}
+
+/**
+ * check if a block looks like a photo or video, rather than text or UI elements
+ *
+ * @param app the main application
+ * @param x   x position of block
+ * @param y   y position of block
+ * @param w   width of block
+ * @param h   height of block
+ * @return TRUE if the block has many colours and few runs of equal pixels
+ */
+static int is_photographic(shareit_app_t *app, int x, int y, int w, int h) {
+    int max_x = min(app->width, x+w);
+    int max_y = min(app->height, y+h);
+    int sx, sy;
+    int equal = 0;
+
+    if (rect_palette(app, x, y, w, h, NULL, NULL) != 0) {
+        return FALSE;
+    }
+
+    for (sy = y; sy < max_y; sy ++) {
+        uint32_t *row = screen_pixel(app, app->current_screen, x, sy) - x;
+        for (sx = x + 1; sx < max_x; sx ++) {
+            equal += ((row[sx] ^ row[sx-1]) & 0xffffff) == 0;
+        }
+    }
+    return equal * 100 < (max_x - x) * (max_y - y) * LOSSY_MAX_RUN_PERCENT;
+}
+
+/**
+ * get the encoder state of all blocks, allocating it if needed
+ *
+ * @param app the main application
+ * @return list of block states, or NULL if it could not be allocated
+ */
+static tile_state_t *get_tile_state(shareit_app_t *app) {
+    int block_size = get_block_size(app);
+    int tiles_x = (app->width + block_size - 1) / block_size;
+    int tiles_y = (app->height + block_size - 1) / block_size;
+
+    if (app->tiles != NULL && app->tiles_x == tiles_x && app->tiles_y == tiles_y) {
+        if (app->prev_screen == NULL) {
+            // Everything will be sent again, so forget the old state
+            memset(app->tiles, 0, tiles_x * tiles_y * sizeof(tile_state_t));
+        }
+        return app->tiles;
+    }
+
+    free(app->tiles);
+    app->tiles = calloc(tiles_x * tiles_y, sizeof(tile_state_t));
+    app->tiles_x = tiles_x;
+    app->tiles_y = tiles_y;
+    return app->tiles;
+}
+
+void free_tile_state(shareit_app_t *app) {
+    free(app->tiles);
+    app->tiles = NULL;
+}
+
+/**
+ * create a rect referring to a tile in the tile cache
+ *
+ * @param x     x position of rect
+ * @param y     y position of rect
+ * @param w     width of rect
+ * @param h     height of rect
+ * @param slot  slot in tile cache
+ * @param hash  hash of the tile
+ * @return newly allocated framebuffer_rect_t
+ */
+static framebuffer_rect_t *create_cached_rect(int x, int y, int w, int h, int slot, uint64_t hash) {
+    framebuffer_rect_t *rect;
+
+    rect = malloc(sizeof(framebuffer_rect_t));
+    rect->xpos = x;
+    rect->ypos = y;
+    rect->width = w;
+    rect->height = h;
+    rect->hash = hash;
+    rect->encoding_type = framebuffer_encoding_type_cached;
+    rect->enc.cached.slot = slot;
+    return rect;
+}
+
+/**
+ * check if a rect should be put in the tile cache
+ * NOTE! Sharer and viewer must agree on this, since both ends add the same rects to their caches.
+ *
+ * @param rect    rect to check
+ * @param width   width of screen
+ * @param height  height of screen
+ * @return TRUE if rect is lossless, not trivial, not too large, and completely inside the screen
+ */
+int rect_is_cacheable(framebuffer_rect_t *rect, int width, int height) {
+    if (rect->encoding_type != framebuffer_encoding_type_raw &&
+        rect->encoding_type != framebuffer_encoding_type_trle) {
+        return FALSE;
+    }
+    if (rect->width * rect->height > TILE_CACHE_MAX_PIXELS) {
+        return FALSE;
+    }
+    return rect->xpos + rect->width <= width && rect->ypos + rect->height <= height;
+}
+
+/**
+ * calculate the hash of the pixels covered by a rect, as used by the tile cache
+ *
+ * @param app   the main application
+ * @param rect  rect to calculate hash for
+ * @return hash of pixels
+ */
+static uint64_t rect_hash(shareit_app_t *app, framebuffer_rect_t *rect) {
+    int w = min(rect->width, app->width - rect->xpos);
+    int h = min(rect->height, app->height - rect->ypos);
+    int tile_size = screen_tile_size(app);
+    uint32_t *pixels;
+    uint64_t hash;
+
+    if (tile_size == 0 || (rect->xpos % tile_size + w <= tile_size && rect->ypos % tile_size + h <= tile_size)) {
+        return hash_pixels(screen_pixel(app, app->current_screen, rect->xpos, rect->ypos), screen_stride(app), w, h);
+    }
+
+    // Merged rects cover several tiles, which aren't next to each other in the tiled layout
+    pixels = malloc(w * h * sizeof(uint32_t));
+    if (pixels == NULL) {
+        return 0;
+    }
+    copy_screen_rect(app, pixels, rect->xpos, rect->ypos, w, h);
+    hash = hash_pixels(pixels, w, w, h);
+    free(pixels);
+    return hash;
+}
+
+/**
+ * encode part of the screen, either as a reference to the tile cache, or using lossy encoding
+ * if it has been changing frequently and looks like a photo or video
+ * NOTE! Cached rects are only candidates, the tile cache isn't updated until update_tile_cache()
+ *
+ * @param app       the main application
+ * @param tile      encoder state of the block, or NULL if lossy encoding shouldn't be used
+ * @param x         x position of part
+ * @param y         y position of part
+ * @param w         width of part
+ * @param h         height of part
+ * @param lossless  TRUE if lossy encoding must not be used
+ * @return newly allocated framebuffer_rect_t
+ */
+static framebuffer_rect_t *encode_block(shareit_app_t *app, tile_state_t *tile, int x, int y, int w, int h,
+                                        int lossless) {
+    framebuffer_rect_t *rect = NULL;
+    uint64_t hash = 0;
+
+    if (app->tile_cache != NULL) {
+        int cw = min(w, app->width - x);
+        int ch = min(h, app->height - y);
+        hash = hash_pixels(screen_pixel(app, app->current_screen, x, y), screen_stride(app), cw, ch);
+        int slot = tile_cache_find(app->tile_cache, hash, cw, ch);
+        if (slot != -1) {
+            if (tile != NULL) {
+                tile->lossy = FALSE;
+            }
+            return create_cached_rect(x, y, cw, ch, slot, hash);
+        }
+    }
+
+    if (tile != NULL && !lossless && app->jpeg_quality > 0 &&
+        __builtin_popcount(tile->history) >= LOSSY_MIN_CHANGES &&
+        is_photographic(app, x, y, w, h)) {
+        rect = create_jpeg_rect(app, x, y, w, h, app->jpeg_quality);
+    }
+
+    if (tile != NULL) {
+        tile->lossy = rect != NULL;
+    }
+    if (rect == NULL) {
+        rect = create_rect(app, x, y, w, h);
+        if (rect_is_cacheable(rect, app->width, app->height)) {
+            rect->hash = hash;
+        }
+    }
+    return rect;
+}
+
+// Rects created for a frame
+typedef struct {
+    framebuffer_rect_t **rects;
+    int n_rects;
+    int allocated;
+    int pixel_format;    // pixel format of raw and TRLE rects
+    gint64 encode_time;  // time spent encoding, only measured when stats are enabled
+} rect_list_t;
+
+static void rect_list_add(rect_list_t *list, framebuffer_rect_t *rect) {
+    if (list->n_rects == list->allocated) {
+        list->allocated += RECT_LIST_ALLOC_SZ;
+        list->rects = realloc(list->rects, list->allocated*sizeof(framebuffer_rect_t *));
+    }
+    list->rects[list->n_rects] = rect;
+    list->n_rects ++;
+}
+
+/**
+ * encode the changed parts of a block that is known to have changed
+ *
+ * The block is split in four, and only the parts that have changed are encoded,
+ * splitting them further until app->min_block_size is reached (or not at all if
+ * it's 0). If all parts have changed, the whole block is encoded as one rect.
+ *
+ * @param app   the main application
+ * @param list  list to add rects to
+ * @param x     x position of block
+ * @param y     y position of block
+ * @param size  width and height of block
+ * @return TRUE if the whole block was encoded, FALSE if only some parts of it
+ */
+static int encode_changed_parts(shareit_app_t *app, rect_list_t *list, int x, int y, int size) {
+    int half = size / 2;
+    int changed[4];
+    int n_parts = 0, n_changed = 0;
+    int i;
+
+    if (app->min_block_size > 0 && half >= app->min_block_size) {
+        for (i = 0; i < 4; i ++) {
+            int px = x + (i & 1) * half;
+            int py = y + (i >> 1) * half;
+
+            changed[i] = 0;
+            if (px < app->width && py < app->height) {
+                n_parts ++;
+                changed[i] = compare_parts(app, px, py, half, half);
+                n_changed += changed[i];
+            }
+        }
+
+        if (n_changed < n_parts) {
+            for (i = 0; i < 4; i ++) {
+                if (changed[i]) {
+                    encode_changed_parts(app, list, x + (i & 1) * half, y + (i >> 1) * half, half);
+                }
+            }
+            return FALSE;
+        }
+    }
+
+    gint64 encode_start = stats_begin(app->stats);
+    rect_list_add(list, encode_block(app, NULL, x, y, size, size, TRUE));
+    if (app->stats != NULL) {
+        list->encode_time += g_get_monotonic_time() - encode_start;
+    }
+    return TRUE;
+}
+
+/**
+ * join two TRLE rects that are next to each other
+ *
+ * @param a           left or top rect, will be replaced with the joined rect
+ * @param b           right or bottom rect
+ * @param horizontal  TRUE if 'b' is to the right of 'a', FALSE if it's below
+ * @param format      pixel format of the rects
+ * @return 0 on success, -1 if the rects could not be joined
+ */
+static int join_trle_rects(framebuffer_rect_t *a, framebuffer_rect_t *b, int horizontal, int format) {
+    uint32_t length = a->enc.trle.length + b->enc.trle.length;
+    uint8_t *data;
+    int ret;
+
+    data = malloc(length);
+    if (data == NULL) {
+        return -1;
+    }
+
+    if (horizontal) {
+        ret = trle_join_horizontal(a->enc.trle.data, a->enc.trle.length, a->width,
+                                   b->enc.trle.data, b->enc.trle.length, b->width, a->height, format, data);
+    } else {
+        ret = trle_join_vertical(a->enc.trle.data, a->enc.trle.length, a->height,
+                                 b->enc.trle.data, b->enc.trle.length, data);
+    }
+    if (ret != 0) {
+        free(data);
+        return -1;
+    }
+
+    free(a->enc.trle.data);
+    a->enc.trle.data = data;
+    a->enc.trle.length = length;
+    if (horizontal) {
+        a->width += b->width;
+    } else {
+        a->height += b->height;
+    }
+    // The joined rect is a different tile, as far as the tile cache is concerned
+    a->hash = 0;
+    return 0;
+}
+
+/**
+ * join two raw rects that are next to each other
+ *
+ * @param a           left or top rect, will be replaced with the joined rect
+ * @param b           right or bottom rect
+ * @param horizontal  TRUE if 'b' is to the right of 'a', FALSE if it's below
+ * @param bpp         bytes per pixel in the rects
+ * @return 0 on success, -1 if the rects could not be joined
+ */
+static int join_raw_rects(framebuffer_rect_t *a, framebuffer_rect_t *b, int horizontal, int bpp) {
+    int a_size = a->width * a->height * bpp;
+    int b_size = b->width * b->height * bpp;
+    uint8_t *data;
+
+    data = malloc(a_size + b_size);
+    if (data == NULL) {
+        return -1;
+    }
+
+    if (horizontal) {
+        // Interleave the rows of both rects
+        for (int y = 0; y < a->height; y ++) {
+            memcpy(data + y * (a->width + b->width) * bpp, a->enc.raw.data + y * a->width * bpp, a->width * bpp);
+            memcpy(data + (y * (a->width + b->width) + a->width) * bpp, b->enc.raw.data + y * b->width * bpp,
+                   b->width * bpp);
+        }
+        a->width += b->width;
+    } else {
+        memcpy(data, a->enc.raw.data, a_size);
+        memcpy(data + a_size, b->enc.raw.data, b_size);
+        a->height += b->height;
+    }
+
+    free(a->enc.raw.data);
+    a->enc.raw.data = data;
+    a->hash = 0;
+    return 0;
+}
+
+/**
+ * try to join two rects that are next to each other into one
+ *
+ * @param a           left or top rect, will be replaced with the joined rect
+ * @param b           right or bottom rect
+ * @param horizontal  TRUE if 'b' is to the right of 'a', FALSE if it's below
+ * @param max_pixels  max size of the joined rect, if it's raw or TRLE
+ * @param format      pixel format of raw and TRLE rects
+ * @return 0 if the rects were joined (and 'b' can be freed), -1 otherwise
+ */
+static int join_rects(framebuffer_rect_t *a, framebuffer_rect_t *b, int horizontal, int max_pixels, int format) {
+    if (a->encoding_type != b->encoding_type) {
+        return -1;
+    }
+
+    if (horizontal) {
+        if (a->ypos != b->ypos || a->height != b->height || a->xpos + a->width != b->xpos ||
+            a->width + b->width > UINT16_MAX) {
+            return -1;
+        }
+    } else {
+        if (a->xpos != b->xpos || a->width != b->width || a->ypos + a->height != b->ypos ||
+            a->height + b->height > UINT16_MAX) {
+            return -1;
+        }
+    }
+
+    switch (a->encoding_type) {
+    case framebuffer_encoding_type_solid:
+        // Always smaller, and solid rects are never cached, so there's no size limit
+        if (a->enc.solid.red != b->enc.solid.red || a->enc.solid.green != b->enc.solid.green ||
+            a->enc.solid.blue != b->enc.solid.blue) {
+            return -1;
+        }
+        if (horizontal) {
+            a->width += b->width;
+        } else {
+            a->height += b->height;
+        }
+        return 0;
+    case framebuffer_encoding_type_raw:
+        if (a->width * a->height + b->width * b->height > max_pixels) {
+            return -1;
+        }
+        return join_raw_rects(a, b, horizontal, pixfmt_bpp(format));
+    case framebuffer_encoding_type_trle:
+        if (a->width * a->height + b->width * b->height > max_pixels) {
+            return -1;
+        }
+        return join_trle_rects(a, b, horizontal, format);
+    default:
+        return -1;
+    }
+}
+
+static int compare_rect_rows(const void *p1, const void *p2) {
+    const framebuffer_rect_t *a = *(framebuffer_rect_t **)p1, *b = *(framebuffer_rect_t **)p2;
+
+    if (a->ypos != b->ypos) {
+        return a->ypos - b->ypos;
+    }
+    if (a->height != b->height) {
+        return a->height - b->height;
+    }
+    return a->xpos - b->xpos;
+}
+
+static int compare_rect_columns(const void *p1, const void *p2) {
+    const framebuffer_rect_t *a = *(framebuffer_rect_t **)p1, *b = *(framebuffer_rect_t **)p2;
+
+    if (a->xpos != b->xpos) {
+        return a->xpos - b->xpos;
+    }
+    if (a->width != b->width) {
+        return a->width - b->width;
+    }
+    return a->ypos - b->ypos;
+}
+
+/**
+ * join rects that are next to each other, first horizontally and then vertically
+ *
+ * Solid rects of the same colour, raw rects and TRLE rects are joined with rects
+ * of the same type. Each join saves a rect header on the wire, and for solid rects
+ * also the colour.
+ *
+ * @param list        list of rects, joined rects are removed from it
+ * @param max_pixels  max size of joined raw and TRLE rects
+ */
+static void merge_rects(rect_list_t *list, int max_pixels) {
+    int pass, i, n;
+
+    if (list->n_rects < 2) {
+        return;
+    }
+
+    for (pass = 0; pass < 2; pass ++) {
+        int horizontal = pass == 0;
+
+        // Sort rects so that the ones that can be joined end up next to each other
+        qsort(list->rects, list->n_rects, sizeof(framebuffer_rect_t *),
+              horizontal ? compare_rect_rows : compare_rect_columns);
+
+        for (i = 1, n = 1; i < list->n_rects; i ++) {
+            if (join_rects(list->rects[n-1], list->rects[i], horizontal, max_pixels, list->pixel_format) == 0) {
+                free_framebuffer_rect(list->rects[i]);
+            } else {
+                list->rects[n++] = list->rects[i];
+            }
+        }
+        list->n_rects = n;
+    }
+}
+
+/**
+ * update the tile cache with the rects that will be sent, in the order the viewers will see them
+ *
+ * Rects that are already in the cache are replaced with references to it. References
+ * to tiles that have been replaced by earlier rects in the same frame are encoded again.
+ *
+ * @param app   the main application
+ * @param list  rects that will be sent
+ */
+static void update_tile_cache(shareit_app_t *app, rect_list_t *list) {
+    framebuffer_rect_t *rect;
+    int i, slot;
+
+    for (i = 0; i < list->n_rects; i ++) {
+        rect = list->rects[i];
+        if (rect->encoding_type != framebuffer_encoding_type_cached &&
+            !rect_is_cacheable(rect, app->width, app->height)) {
+            continue;
+        }
+
+        if (rect->hash == 0) {
+            rect->hash = rect_hash(app, rect);
+        }
+
+        slot = tile_cache_lookup(app->tile_cache, rect->hash, rect->width, rect->height);
+        if (slot != -1) {
+            if (rect->encoding_type != framebuffer_encoding_type_cached) {
+                list->rects[i] = create_cached_rect(rect->xpos, rect->ypos, rect->width, rect->height,
+                                                    slot, rect->hash);
+                free_framebuffer_rect(rect);
+            }
+            list->rects[i]->enc.cached.slot = slot;
+            continue;
+        }
+
+        if (rect->encoding_type == framebuffer_encoding_type_cached) {
+            list->rects[i] = create_rect(app, rect->xpos, rect->ypos, rect->width, rect->height);
+            list->rects[i]->hash = rect->hash;
+            free_framebuffer_rect(rect);
+            rect = list->rects[i];
+        }
+
+        if (rect_is_cacheable(rect, app->width, app->height)) {
+            tile_cache_insert(app->tile_cache, rect->hash, rect->width, rect->height);
+        }
+    }
+}
+
+/**
+ * add a pixel to a screen checksum (FNV-1a over the colour channels)
+ *
+ * @param sum    checksum so far
+ * @param pixel  pixel, 0x00RRGGBB
+ * @return updated checksum
+ */
+static inline uint32_t checksum_pixel(uint32_t sum, uint32_t pixel) {
+    return (sum ^ pixel) * 0x01000193;
+}
+
+/**
+ * finish a screen checksum, so that it's never SCREEN_CHECKSUM_NONE
+ *
+ * @param sum  checksum of all pixels
+ * @return checksum to send
+ */
+static inline uint32_t checksum_finish(uint32_t sum) {
+    return sum != SCREEN_CHECKSUM_NONE ? sum : 1;
+}
+
+/**
+ * calculate checksums of the screen as the viewers should have it, one for each row of blocks
+ *
+ * Pixels are checksummed with the precision of the pixel format each block was last
+ * sent in, since unchanged blocks aren't sent again when the format is switched. Rows
+ * with blocks that were last sent with lossy encoding, or partly in another format,
+ * can't be compared, and get SCREEN_CHECKSUM_NONE.
+ *
+ * @param[in]  app        the main application
+ * @param[out] checksums  one checksum for each row of blocks (room for app->tiles_y)
+ * @return number of checksums, 0 if they could not be calculated
+ */
+int screen_checksums(shareit_app_t *app, uint32_t *checksums) {
+    int block_size = get_block_size(app);
+    tile_state_t *tiles = app->tiles;
+
+    // The tile state is set up by compare_screens()
+    if (tiles == NULL || app->current_screen == NULL) {
+        return 0;
+    }
+
+    for (int ty = 0; ty < app->tiles_y; ty ++) {
+        uint32_t sum = 0x811c9dc5;
+        int y = ty * block_size;
+        int max_y = min(y + block_size, app->height);
+
+        int unchecked = FALSE;
+
+        for (int tx = 0; tx < app->tiles_x; tx ++) {
+            unchecked |= tiles[ty * app->tiles_x + tx].lossy ||
+                         tiles[ty * app->tiles_x + tx].pixel_format >= PIXEL_FORMAT_COUNT;
+        }
+        if (unchecked) {
+            checksums[ty] = SCREEN_CHECKSUM_NONE;
+            continue;
+        }
+
+        for (int sy = y; sy < max_y; sy ++) {
+            for (int x = 0; x < app->width; x += block_size) {
+                const uint32_t *row = screen_pixel(app, app->current_screen, x, sy);
+                int format = tiles[ty * app->tiles_x + x / block_size].pixel_format;
+                for (int sx = 0; sx < min(block_size, app->width - x); sx ++) {
+                    sum = checksum_pixel(sum, pixfmt_quantize(format, row[sx] & 0xffffff));
+                }
+            }
+        }
+        checksums[ty] = checksum_finish(sum);
+    }
+    return app->tiles_y;
+}
+
+/**
+ * calculate checksums of the screen shown by the viewer, see screen_checksums()
+ *
+ * @param[in]  view         view to calculate checksums for
+ * @param[in]  band_height  number of rows in each checksum
+ * @param[out] checksums    one checksum for each band (room for view->height / band_height, rounded up)
+ * @return number of checksums
+ */
+int view_checksums(viewinfo_t *view, int band_height, uint32_t *checksums) {
+    int n_bands = (view->height + band_height - 1) / band_height;
+
+    for (int band = 0; band < n_bands; band ++) {
+        uint32_t sum = 0x811c9dc5;
+        int max_y = min((band + 1) * band_height, view->height);
+
+        for (int y = band * band_height; y < max_y; y ++) {
+            const uint8_t *pixel = view->pixels + y * view->row_stride;
+            for (int x = 0; x < view->width; x ++, pixel += 4) {
+                sum = checksum_pixel(sum, pixel[0] | (pixel[1] << 8) | (pixel[2] << 16));
+            }
+        }
+        checksums[band] = checksum_finish(sum);
+    }
+    return n_bands;
+}
+
+/**
+ * send parts of the screen again with the next frame, even if they haven't changed
+ *
+ * @param app        the main application
+ * @param regions    parts of the screen to send
+ * @param n_regions  number of regions, or 0 for the whole screen
+ */
+void request_refresh(shareit_app_t *app, const refresh_region_t *regions, int n_regions) {
+    if (n_regions == 0 || app->n_refresh_regions + n_regions > REFRESH_MAX_REGIONS) {
+        // Everything is sent again, so the other regions don't matter
+        app->refresh_regions[0] = (refresh_region_t) { 0, 0, UINT16_MAX, UINT16_MAX };
+        app->n_refresh_regions = 1;
+        return;
+    }
+
+    memcpy(app->refresh_regions + app->n_refresh_regions, regions, n_regions * sizeof(refresh_region_t));
+    app->n_refresh_regions += n_regions;
+}
+
+/**
+ * send the blocks that changed while a viewer was away again with the next frame
+ *
+ * The blocks are remembered until no viewer is away anymore, see compare_screens().
+ *
+ * @param app  the main application
+ */
+void request_missed_refresh(shareit_app_t *app) {
+    refresh_region_t regions[REFRESH_MAX_REGIONS];
+    int block_size = get_block_size(app);
+    int n_regions = 0;
+
+    if (app->tiles == NULL) {
+        return;
+    }
+
+    for (int ty = 0; ty < app->tiles_y; ty++) {
+        refresh_region_t *run = NULL;
+        for (int tx = 0; tx < app->tiles_x; tx++) {
+            if (!app->tiles[ty * app->tiles_x + tx].missed) {
+                run = NULL;
+                continue;
+            }
+
+            // Blocks next to each other on a row are sent as one region
+            if (run != NULL) {
+                run->width += block_size;
+                continue;
+            }
+            if (n_regions == REFRESH_MAX_REGIONS) {
+                request_refresh(app, NULL, 0);
+                return;
+            }
+            run = &regions[n_regions++];
+            *run = (refresh_region_t) { tx * block_size, ty * block_size, block_size, block_size };
+        }
+    }
+
+    if (n_regions > 0) {
+        request_refresh(app, regions, n_regions);
+    }
+}
+
+/**
+ * check if a block overlaps one of the regions that should be sent again
+ *
+ * @param app the main application
+ * @param x   x position of block
+ * @param y   y position of block
+ * @param w   width of block
+ * @param h   height of block
+ * @return TRUE if the block should be sent again
+ */
+static int needs_refresh(shareit_app_t *app, int x, int y, int w, int h) {
+    for (int i = 0; i < app->n_refresh_regions; i ++) {
+        refresh_region_t *region = &app->refresh_regions[i];
+        if (x < region->x + region->width && region->x < x + w &&
+            y < region->y + region->height && region->y < y + h) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * allocate what compare_stream() needs, before the streams are grabbed
+ *
+ * @param app the main application
+ * @return 0 on success, -1 on error
+ */
+int compare_prepare(shareit_app_t *app) {
+    tile_state_t *tiles = get_tile_state(app);
+
+    if (tiles == NULL) {
+        return -1;
+    }
+    // Left over if the previous frame could not be grabbed
+    for (int i = 0; i < app->tiles_x * app->tiles_y; i ++) {
+        tiles[i].compared = FALSE;
+    }
+    return 0;
+}
+
+/**
+ * check if a block belongs to a stream
+ *
+ * Blocks that are partly outside of the stream, or that are also inside an earlier
+ * one, belong to no stream or the earlier one.
+ *
+ * @param app     the main application
+ * @param stream  index in app->streams
+ * @param x       x position of block
+ * @param y       y position of block
+ * @param size    width and height of block
+ * @return TRUE if the block belongs to the stream
+ */
+static int block_in_stream(shareit_app_t *app, int stream, int x, int y, int size) {
+    int w = min(size, app->width - x);
+    int h = min(size, app->height - y);
+
+    for (int i = 0; i <= stream; i ++) {
+        const grab_output_t *s = &app->streams[i];
+        if (x >= s->x && y >= s->y && x + w <= s->x + s->width && y + h <= s->y + s->height) {
+            return i == stream;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * compare the blocks of a stream with the previous frame, as soon as a part of it has been grabbed
+ *
+ * The blocks that end in rows y to y + height are compared, the rows above them must
+ * already have been grabbed. The result is kept for compare_screens(), which compares
+ * the blocks that don't belong to any stream. Each block belongs to one stream at most,
+ * so different streams can be compared in parallel. compare_prepare() must have been
+ * called for the frame.
+ *
+ * @param app     the main application
+ * @param stream  index in app->streams
+ * @param y       first row that has been grabbed
+ * @param height  number of rows that have been grabbed
+ */
+void compare_stream(shareit_app_t *app, int stream, int y, int height) {
+    const grab_output_t *s = &app->streams[stream];
+    int block_size = get_block_size(app);
+    int max_x = min(s->x + s->width, app->width);
+    int max_y = min(y + height, app->height);
+
+    // Blocks that started in earlier rows are compared if they end in these rows, and the
+    // ones that end below them are left for the next rows
+    for (y = y / block_size * block_size; y < max_y && min(y + block_size, app->height) <= max_y;
+         y += block_size) {
+        for (int x = s->x / block_size * block_size; x < max_x; x += block_size) {
+            if (block_in_stream(app, stream, x, y, block_size)) {
+                tile_state_t *tile = &app->tiles[(y / block_size) * app->tiles_x + x / block_size];
+                tile->changed = compare_parts(app, x, y, block_size, block_size);
+                tile->compared = TRUE;
+            }
+        }
+    }
+}
+
 /**
  * Check for changes between current screen and our previous buffer
  *
+ * Blocks that overlap the regions given to request_refresh() are sent even if they
+ * haven't changed, without affecting how the rest of the screen is compared. While
+ * a viewer is away, the blocks that change are remembered for request_missed_refresh().
  * @param[in]  app    the main application
  * @param[out] update if the screen has changed, this will create a framebuffer update that can be
  *                    sent to the server.
  * @return returns TRUE if screen has been changed, otherwise FALSE
  */
 int compare_screens(shareit_app_t *app, framebuffer_update_t **output) {
-    int n_rects = 0;
     framebuffer_update_t *update;
-    framebuffer_rect_t *rect;
-    framebuffer_rect_t **rect_list = NULL;
-    int rect_list_sz = 0;
+    rect_list_t list = { .pixel_format = app->pixel_format };
+    int block_size = get_block_size(app);
     int x, y;
     int ret;
+    gint64 start, encode_start;
+    tile_state_t *tiles, *tile = NULL;
+    gboolean away = app->away_clients != NULL && app->away_clients->len > 0;
 
-    // Split the image into 64x64 parts while checking if they've been updated
-    for (y = 0; y < app->height; y+=BLOCK_HEIGHT) {
-        for (x = 0; x < app->width; x+=BLOCK_WIDTH) {
-            ret = compare_parts(app, x, y, BLOCK_WIDTH, BLOCK_HEIGHT);
-            if (ret) {
-                rect = create_rect(app, x, y, BLOCK_WIDTH, BLOCK_HEIGHT);
-                if (n_rects == rect_list_sz) {
-                    rect_list_sz += RECT_LIST_ALLOC_SZ;
-                    rect_list = realloc(rect_list, rect_list_sz*sizeof(framebuffer_rect_t *));
+    start = stats_begin(app->stats);
+    tiles = get_tile_state(app);
+
+    // Split the image into blocks while checking if they've been updated
+    for (y = 0; y < app->height; y+=block_size) {
+        for (x = 0; x < app->width; x+=block_size) {
+            if (tiles != NULL) {
+                tile = &tiles[(y / block_size) * app->tiles_x + x / block_size];
+            }
+            if (tile != NULL && tile->compared) {
+                // Already compared while the frame was grabbed
+                ret = tile->changed;
+                tile->compared = FALSE;
+            } else {
+                ret = compare_parts(app, x, y, block_size, block_size);
+            }
+            if (tile != NULL) {
+                tile->history = (tile->history << 1) | (ret ? 1 : 0);
+                tile->missed = away && (tile->missed || ret);
+            }
+
+            encode_start = stats_begin(app->stats);
+            if (ret && tile != NULL && app->jpeg_quality > 0 &&
+                __builtin_popcount(tile->history) >= LOSSY_MIN_CHANGES) {
+                // Frequently changing blocks are encoded as a whole, so that they can use lossy encoding
+                rect_list_add(&list, encode_block(app, tile, x, y, block_size, block_size, FALSE));
+            } else if (ret) {
+                int whole = encode_changed_parts(app, &list, x, y, block_size);
+                if (tile != NULL && whole) {
+                    tile->lossy = FALSE;
+                    tile->pixel_format = app->pixel_format;
+                } else if (tile != NULL && tile->pixel_format != app->pixel_format) {
+                    // The rest of the block is still in the format it was sent in before
+                    tile->pixel_format = PIXEL_FORMAT_COUNT;
                 }
-                rect_list[n_rects] = rect;
-                n_rects ++;
+                continue;
+            } else if (tile != NULL && tile->lossy &&
+                       (tile->history & ((1 << LOSSY_REFINE_FRAMES) - 1)) == 0) {
+                // Block has stopped changing, replace the lossy version with a lossless one
+                rect_list_add(&list, encode_block(app, tile, x, y, block_size, block_size, TRUE));
+            } else if (app->n_refresh_regions > 0 && needs_refresh(app, x, y, block_size, block_size)) {
+                // A viewer has asked for it, send a lossless version so it doesn't have to be refined
+                rect_list_add(&list, encode_block(app, tile, x, y, block_size, block_size, TRUE));
+            } else {
+                continue;
             }
+
+            if (tile != NULL) {
+                tile->pixel_format = app->pixel_format;
+            }
+            if (app->stats != NULL) {
+                list.encode_time += g_get_monotonic_time() - encode_start;
+            }
+        }
+    }
+
+    app->n_refresh_regions = 0;
+
+    encode_start = stats_begin(app->stats);
+    // Don't let merged rects grow too large to be cached
+    merge_rects(&list, app->tile_cache != NULL ? TILE_CACHE_MAX_PIXELS : INT_MAX);
+    if (app->tile_cache != NULL) {
+        update_tile_cache(app, &list);
+    }
+
+    if (app->stats != NULL) {
+        list.encode_time += g_get_monotonic_time() - encode_start;
+
+        // Everything that wasn't spent encoding was spent diffing
+        stats_add_time(app->stats, stats_stage_diff, g_get_monotonic_time() - start - list.encode_time);
+        if (list.n_rects > 0) {
+            stats_add_time(app->stats, stats_stage_encode, list.encode_time);
+        }
+        for (int i = 0; i < list.n_rects; i ++) {
+            stats_add_rect(app->stats, list.rects[i]->encoding_type);
         }
     }
 
-    if (n_rects > 0) {
+    if (list.n_rects > 0) {
         update = malloc(sizeof(framebuffer_update_t));
-        update->n_rects = n_rects;
-        update->rects = rect_list;
+        update->n_rects = list.n_rects;
+        update->rects = list.rects;
+        update->pixel_format = list.pixel_format;
         *output = update;
         return TRUE;
     }
 
+    free(list.rects);
     return FALSE;
 }
 
@@ -280,27 +1331,76 @@ void view_blit_solid(viewinfo_t *view, int x, int y, int w, int h, uint8_t r, ui
 /**
  * blit/draw contents of 'raw' to position x,y
  *
- * @param app   main application - information will be written to app->view_pixels
- * @param x     x position of block
- * @param y     y position of block
- * @param w     width of block
- * @param h     height of block
- * @param raw   source data in RGB format (24bits per pixel)
+ * @param view    view to draw to
+ * @param x       x position of block
+ * @param y       y position of block
+ * @param w       width of block
+ * @param h       height of block
+ * @param raw     source data
+ * @param format  pixel format of 'raw'
  */
-void view_blit_raw(viewinfo_t *view, int x, int y, int w, int h, const uint8_t *raw) {
+void view_blit_raw(viewinfo_t *view, int x, int y, int w, int h, const uint8_t *raw, int format) {
     int sy, sx;
+    int bpp = pixfmt_bpp(format);
 
     for (sy = 0; sy < h && y+sy < view->height; sy ++) {
         for (sx = 0; sx < w  && x+sx < view->width; sx ++) {
-            const uint8_t *pixel = raw + (sx + sy*w) * 3;
-            view->pixels[(x+sx)*4 + (y+sy) * view->row_stride + 0] = pixel[0];
-            view->pixels[(x+sx)*4 + (y+sy) * view->row_stride + 1] = pixel[1];
-            view->pixels[(x+sx)*4 + (y+sy) * view->row_stride + 2] = pixel[2];
+            const uint8_t *pixel = raw + (sx + sy*w) * bpp;
+            pixfmt_expand(format, pixel, view->pixels + (x+sx)*4 + (y+sy) * view->row_stride);
             // view->pixels[(x+sx)*4 + (y+sy) * view->row_stride + 0 ] = 0; // alpha (unused)
         }
     }
 }
 
+/**
+ * blit/draw a tile from the tile cache to position x,y
+ *
+ * @param view  view to draw to
+ * @param rect  rect referring to the cached tile
+ * @return 0 on success, -1 if the tile isn't in the cache
+ */
+static int view_blit_cached(viewinfo_t *view, framebuffer_rect_t *rect) {
+    tile_cache_entry_t *entry;
+    int slot = rect->enc.cached.slot;
+
+    if (view->cache == NULL || tile_cache_touch(view->cache, slot) != 0) {
+        fprintf(stderr, "%s: tile %d is not in the cache\n", __FUNCTION__, slot);
+        return -1;
+    }
+
+    entry = &view->cache->entries[slot];
+    if (entry->width != rect->width || entry->height != rect->height ||
+        rect->xpos + rect->width > view->width || rect->ypos + rect->height > view->height) {
+        fprintf(stderr, "%s: tile %d doesn't match rect\n", __FUNCTION__, slot);
+        return -1;
+    }
+
+    for (int y = 0; y < rect->height; y ++) {
+        memcpy(view->pixels + rect->xpos*4 + (rect->ypos + y)*view->row_stride,
+               entry->pixels + y*rect->width*4, rect->width*4);
+    }
+    return 0;
+}
+
+/**
+ * copy a rect that has been drawn to the view into the tile cache
+ *
+ * @param view  view to copy from
+ * @param rect  rect to copy
+ */
+static void view_cache_rect(viewinfo_t *view, framebuffer_rect_t *rect) {
+    int slot = tile_cache_insert(view->cache, 0, rect->width, rect->height);
+    uint8_t *pixels = tile_cache_pixels(view->cache, slot);
+
+    if (pixels == NULL) {
+        return;
+    }
+    for (int y = 0; y < rect->height; y ++) {
+        memcpy(pixels + y*rect->width*4,
+               view->pixels + rect->xpos*4 + (rect->ypos + y)*view->row_stride, rect->width*4);
+    }
+}
+
 /**
  * draw framebuffer update to specified view
  *
@@ -309,22 +1409,62 @@ void view_blit_raw(viewinfo_t *view, int x, int y, int w, int h, const uint8_t *
  * @return 0 on success
  */
 int draw_update(viewinfo_t *view, framebuffer_update_t *update) {
+    int ret = 0;
+
+    // Keep going after errors, so that the tile cache stays in sync with the sharer
     for (int i = 0; i < update->n_rects; i++) {
         framebuffer_rect_t *rect = update->rects[i];
 
         switch (rect->encoding_type) {
         case framebuffer_encoding_type_raw:
-            view_blit_raw(view, rect->xpos, rect->ypos, rect->width, rect->height, rect->enc.raw.data);
+            view_blit_raw(view, rect->xpos, rect->ypos, rect->width, rect->height, rect->enc.raw.data,
+                          update->pixel_format);
             break;
         case framebuffer_encoding_type_solid:
             view_blit_solid(view, rect->xpos, rect->ypos, rect->width, rect->height,
                             rect->enc.solid.red, rect->enc.solid.green, rect->enc.solid.blue);
             break;
+        case framebuffer_encoding_type_trle:
+            // TRLE and JPEG rects never extend outside the screen, so they can be decoded directly into the view
+            if (rect->xpos + rect->width > view->width || rect->ypos + rect->height > view->height) {
+                fprintf(stderr, "%s: trle rect outside of view\n", __FUNCTION__);
+                ret = -1;
+                continue;
+            }
+            if (trle_decode(rect->enc.trle.data, rect->enc.trle.length,
+                            view->pixels + rect->xpos*4 + rect->ypos*view->row_stride, view->row_stride,
+                            rect->width, rect->height, update->pixel_format) != 0) {
+                fprintf(stderr, "%s: invalid trle data\n", __FUNCTION__);
+                ret = -1;
+            }
+            break;
+        case framebuffer_encoding_type_jpeg:
+            if (rect->xpos + rect->width > view->width || rect->ypos + rect->height > view->height) {
+                fprintf(stderr, "%s: jpeg rect outside of view\n", __FUNCTION__);
+                ret = -1;
+                continue;
+            }
+            if (jpeg_block_decode(rect->enc.jpeg.data, rect->enc.jpeg.length,
+                                  view->pixels + rect->xpos*4 + rect->ypos*view->row_stride, view->row_stride,
+                                  rect->width, rect->height) != 0) {
+                ret = -1;
+            }
+            break;
+        case framebuffer_encoding_type_cached:
+            if (view_blit_cached(view, rect) != 0) {
+                ret = -1;
+            }
+            break;
         default:
             fprintf(stderr, "%s: unhandled encoding type %d\n", __FUNCTION__, rect->encoding_type);
-            return -1;
+            ret = -1;
+            continue;
+        }
+
+        if (view->cache != NULL && rect_is_cacheable(rect, view->width, view->height)) {
+            view_cache_rect(view, rect);
         }
     }
 
-    return 0;
+    return ret;
 }
\ No newline at end of file
@@ -4,19 +4,40 @@
 #ifndef GRAB_FRAMEBUFFER_H
 #define GRAB_FRAMEBUFFER_H
 #include "shareit.h"
+#include "trle.h"
+#include "pixfmt.h"
+
+// Default size of the blocks the screen is split into when looking for changes
+#define BLOCK_SIZE_DEFAULT 64
+
+// Blocks are never split into smaller parts than this, and must be a multiple of it
+#define BLOCK_SIZE_MIN 16
+#define BLOCK_SIZE_MAX 256
+
+// How often (in ms) the sharer sends checksums of the screen, so that viewers can
+// find out if they've drifted from it
+#define SCREEN_CHECKSUM_INTERVAL_MS 2000
+
+// Screen checksum of a band that isn't checked, e.g. since it has lossy blocks
+#define SCREEN_CHECKSUM_NONE 0
+
+// Max number of colours rect_palette() collects
+#define RECT_PALETTE_MAX 32
 
 enum framebuffer_encoding_type {
     framebuffer_encoding_type_raw = 0,
     framebuffer_encoding_type_solid = 1,
     framebuffer_encoding_type_packed_palette = 2,
+    framebuffer_encoding_type_trle = 15,
     framebuffer_encoding_type_copyrect = 16,
     framebuffer_encoding_type_zrle = 16,
+    framebuffer_encoding_type_jpeg = 21,
+    framebuffer_encoding_type_cached = 22,
 
     /* Note, these are not implemented
     framebuffer_encoding_type_rre = 2,
     framebuffer_encoding_type_hextile = 5,
     framebuffer_encoding_type_zlib = 6,
-    framebuffer_encoding_type_trle = 15,
     framebuffer_encoding_type_zlib_hex = 8,
     framebuffer_encoding_type_cursor = -239,
     framebuffer_encoding_type_desktop_size = -223,
@@ -28,18 +49,24 @@ typedef struct {
     uint16_t source_y;
 } framebuffer_encoding_copyrect_t;
 
-enum rle_encoding_type {
-    rle_encoding_type_raw = 0,
-    rle_encoding_type_solid = 1,
-    rle_encoding_type_packed_palette = 2, // 2 - 16 are packed palette types,
-    rle_encoding_type_plain_rle = 128,
-    rle_encoding_type_palette_rle = 130, // 130 - 255 are palette rle's
-};
-
 typedef struct {
     uint8_t *data;
 } framebuffer_encoding_raw;
 
+typedef struct {
+    uint32_t length;
+    uint8_t *data;  // JPEG image, width x height
+} framebuffer_encoding_jpeg_t;
+
+typedef struct {
+    uint32_t length;
+    uint8_t *data;  // TRLE encoded sub-tiles
+} framebuffer_encoding_trle_t;
+
+typedef struct {
+    uint16_t slot;  // slot in tile cache
+} framebuffer_encoding_cached_t;
+
 typedef struct {
     uint8_t red;
     uint8_t green;
@@ -51,23 +78,46 @@ typedef struct {
     uint16_t ypos;
     uint16_t width;
     uint16_t height;
+    uint64_t hash;  // hash of the pixels, used by the tile cache (sharer only, 0 if not calculated)
     enum framebuffer_encoding_type encoding_type;
 
     union {
         framebuffer_encoding_raw raw;
         framebuffer_encoding_solid solid;
         framebuffer_encoding_copyrect_t copyrect;
+        framebuffer_encoding_jpeg_t jpeg;
+        framebuffer_encoding_trle_t trle;
+        framebuffer_encoding_cached_t cached;
     } enc;
 } framebuffer_rect_t;
 
 typedef struct {
-    uint8_t n_rects;
+    int n_rects;
     framebuffer_rect_t **rects;
+    uint8_t pixel_format;  // pixel format of raw and TRLE rects
 } framebuffer_update_t;
 
+const char *framebuffer_encoding_name(int encoding_type);
+void free_framebuffer_rect(framebuffer_rect_t *rect);
 void free_framebuffer_update(framebuffer_update_t *update);
+int screen_tile_size(shareit_app_t *app);
+size_t screen_size(shareit_app_t *app);
+int screen_stride(shareit_app_t *app);
+uint32_t *screen_pixel(shareit_app_t *app, uint32_t *screen, int x, int y);
+void screen_to_tiles(const uint32_t *src, int width, int height, uint32_t *dst, int tile_size);
 void copy_screen_to_raw(shareit_app_t *app, uint8_t *block, int x, int y, int w, int h);
 int compare_parts(shareit_app_t *app, int x, int y, int w, int h);
+int rect_palette(shareit_app_t *app, int x, int y, int w, int h, uint32_t *output_palette, uint8_t *index);
+framebuffer_rect_t *create_rect(shareit_app_t *app, int x, int y, int w, int h);
+framebuffer_rect_t *create_jpeg_rect(shareit_app_t *app, int x, int y, int w, int h, int quality);
+void free_tile_state(shareit_app_t *app);
+int rect_is_cacheable(framebuffer_rect_t *rect, int width, int height);
+int screen_checksums(shareit_app_t *app, uint32_t *checksums);
+int view_checksums(viewinfo_t *view, int band_height, uint32_t *checksums);
+void request_refresh(shareit_app_t *app, const refresh_region_t *regions, int n_regions);
+void request_missed_refresh(shareit_app_t *app);
+int compare_prepare(shareit_app_t *app);
+void compare_stream(shareit_app_t *app, int stream, int y, int height);
 int compare_screens(shareit_app_t *app, framebuffer_update_t **update);
 int draw_update(viewinfo_t *view, framebuffer_update_t *update);
 #endif
\ No newline at end of file
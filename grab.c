@@ -0,0 +1,295 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#include <stdlib.h>
+#include <string.h>
+#include "convert.h"
+#include "grab.h"
+
+typedef struct {
+    const grab_backend_t *backend;
+    void *data;
+} grabber_t;
+
+// Backends are only available if they're linked in, the others are NULL
+extern const grab_backend_t grab_backend_gdk __attribute__((weak));
+extern const grab_backend_t grab_backend_xcb __attribute__((weak));
+extern const grab_backend_t grab_backend_synthetic __attribute__((weak));
+extern const grab_backend_t grab_backend_file __attribute__((weak));
+
+// In order of preference, the first one available is the default
+static const grab_backend_t *const backends[] = {
+    &grab_backend_gdk,
+    &grab_backend_xcb,
+    &grab_backend_synthetic,
+    &grab_backend_file,
+};
+
+#define N_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+/**
+ * setup screen grabber
+ *
+ * @param spec    backend to use, optionally followed by ':' and options to the
+ *                backend, e.g. "synthetic:1920x1080". NULL for the default backend
+ * @param region  part of the screen to grab, or NULL for the whole screen
+ * @return grabber, or NULL on error
+ */
+void *grab_initialize(const char *spec, const grab_region_t *region) {
+    const grab_backend_t *backend = NULL;
+    const char *options = NULL;
+    grabber_t *grabber;
+    size_t i, len;
+
+    len = spec != NULL ? strcspn(spec, ":") : 0;
+    for (i = 0; i < N_BACKENDS && backend == NULL; i++) {
+        if (backends[i] != NULL && (spec == NULL || (strlen(backends[i]->name) == len &&
+                                                     strncmp(backends[i]->name, spec, len) == 0))) {
+            backend = backends[i];
+        }
+    }
+    if (backend == NULL) {
+        fprintf(stderr, "unknown screen grabber '%s'\n", spec != NULL ? spec : "");
+        return NULL;
+    }
+    if (spec != NULL && spec[len] == ':') {
+        options = spec + len + 1;
+    }
+
+    grabber = calloc(1, sizeof(grabber_t));
+    if (grabber == NULL) {
+        return NULL;
+    }
+    grabber->backend = backend;
+    grabber->data = backend->initialize(options, region);
+    if (grabber->data == NULL) {
+        free(grabber);
+        return NULL;
+    }
+    return grabber;
+}
+
+void grab_shutdown(void *g) {
+    grabber_t *grabber = g;
+
+    if (grabber == NULL) {
+        return;
+    }
+    grabber->backend->shutdown(grabber->data);
+    free(grabber);
+}
+
+int grab_window_size(void *g, int *width, int *height) {
+    grabber_t *grabber = g;
+    return grabber->backend->window_size(grabber->data, width, height);
+}
+
+/**
+ * grab a frame
+ *
+ * @param g      grabber
+ * @param frame  buffer to write the frame to, as large as grab_window_size() says
+ * @return 0 on success, -1 on error
+ */
+int grab_window(void *g, grab_frame_t *frame) {
+    grabber_t *grabber = g;
+    int ret;
+
+    ret = grabber->backend->window(grabber->data, frame);
+    if (ret == 0 && frame->ready != NULL && grabber->backend->streams == NULL) {
+        // Grabbed as a whole, which is stream 0
+        frame->ready(frame, 0, 0, frame->height);
+    }
+    return ret;
+}
+
+void grab_cursor_position(void *g, int *x, int *y) {
+    grabber_t *grabber = g;
+
+    if (grabber->backend->cursor_position == NULL) {
+        *x = *y = -1;
+        return;
+    }
+    grabber->backend->cursor_position(grabber->data, x, y);
+}
+
+int grab_cursor_serial(void *g, uint32_t *serial) {
+    grabber_t *grabber = g;
+
+    if (grabber->backend->cursor_serial == NULL) {
+        return -1;
+    }
+    return grabber->backend->cursor_serial(grabber->data, serial);
+}
+
+int grab_cursor_image(void *g, cursor_shape_t *shape) {
+    grabber_t *grabber = g;
+
+    if (grabber->backend->cursor_image == NULL) {
+        return -1;
+    }
+    return grabber->backend->cursor_image(grabber->data, shape);
+}
+
+int grab_list_outputs(void *g, grab_output_t *outputs, int max_outputs) {
+    grabber_t *grabber = g;
+
+    if (grabber->backend->list_outputs == NULL) {
+        return 0;
+    }
+    return grabber->backend->list_outputs(grabber->data, outputs, max_outputs);
+}
+
+/**
+ * list the parts of the grabbed screen that are grabbed as streams of their own,
+ * e.g. each monitor when the whole screen is shared
+ *
+ * @param g            grabber
+ * @param streams      list to fill in, positions are relative to the grabbed screen. May be NULL
+ *                     to just count them
+ * @param max_streams  max number of streams to list
+ * @return number of streams, 0 if the screen is grabbed as a whole
+ */
+int grab_streams(void *g, grab_output_t *streams, int max_streams) {
+    grabber_t *grabber = g;
+
+    if (grabber->backend->streams == NULL) {
+        return 0;
+    }
+    return grabber->backend->streams(grabber->data, streams, max_streams);
+}
+
+static int compare_ints(const void *p1, const void *p2) {
+    int a = *(const int *)p1, b = *(const int *)p2;
+    return a < b ? -1 : a > b;
+}
+
+/**
+ * calculate the area of the screen covered by monitors, counting overlapping parts once
+ *
+ * @param outputs    monitors
+ * @param n_outputs  number of monitors, up to GRAB_MAX_OUTPUTS
+ * @return covered area, in pixels
+ */
+int64_t grab_outputs_area(const grab_output_t *outputs, int n_outputs) {
+    int xs[2 * GRAB_MAX_OUTPUTS], ys[2 * GRAB_MAX_OUTPUTS];
+    int64_t area = 0;
+    int i, j, k;
+
+    // The edges of the monitors split the screen into cells that are either covered or not
+    for (i = 0; i < n_outputs; i++) {
+        xs[2 * i] = outputs[i].x;
+        xs[2 * i + 1] = outputs[i].x + outputs[i].width;
+        ys[2 * i] = outputs[i].y;
+        ys[2 * i + 1] = outputs[i].y + outputs[i].height;
+    }
+    qsort(xs, 2 * n_outputs, sizeof(int), compare_ints);
+    qsort(ys, 2 * n_outputs, sizeof(int), compare_ints);
+
+    for (i = 0; i + 1 < 2 * n_outputs; i++) {
+        for (j = 0; j + 1 < 2 * n_outputs; j++) {
+            for (k = 0; k < n_outputs; k++) {
+                const grab_output_t *o = &outputs[k];
+                if (xs[i] >= o->x && xs[i + 1] <= o->x + o->width &&
+                    ys[j] >= o->y && ys[j + 1] <= o->y + o->height) {
+                    area += (int64_t)(xs[i + 1] - xs[i]) * (ys[j + 1] - ys[j]);
+                    break;
+                }
+            }
+        }
+    }
+    return area;
+}
+
+/**
+ * print the available backends and their options
+ *
+ * @param f  file to print to
+ */
+void grab_print_backends(FILE *f) {
+    size_t i;
+
+    for (i = 0; i < N_BACKENDS; i++) {
+        if (backends[i] != NULL) {
+            fprintf(f, "      %-10s %s\n", backends[i]->name, backends[i]->usage);
+        }
+    }
+}
+
+/**
+ * convert a row of pixels to screen pixels
+ *
+ * @param src     pixels to convert
+ * @param dst     where to write the screen pixels
+ * @param n       number of pixels
+ * @param format  grab_format of src
+ */
+static void put_row(const uint8_t *src, uint32_t *dst, int n, int format) {
+    switch (format) {
+    case grab_format_rgb24:
+        convert_rgb_to_screen(src, dst, n);
+        break;
+    case grab_format_rgba:
+        convert_rgba_to_screen(src, dst, n);
+        break;
+    default:
+        memcpy(dst, src, n * sizeof(uint32_t));
+        break;
+    }
+}
+
+/**
+ * write part of a frame, in the layout of the frame
+ *
+ * @param frame       frame to write to
+ * @param x           x position of the part
+ * @param y           y position of the part
+ * @param width       width of the part
+ * @param height      height of the part
+ * @param src         top left pixel of the part
+ * @param src_stride  n. of bytes between each row in src
+ * @param format      grab_format of src
+ */
+void grab_frame_put(grab_frame_t *frame, int x, int y, int width, int height,
+                    const uint8_t *src, int src_stride, int format) {
+    int bpp = format == grab_format_rgb24 ? 3 : 4;
+    int ts = frame->tile_size;
+    int tiles_x = ts > 0 ? (frame->width + ts - 1) / ts : 0;
+
+    for (int row = y; row < y + height; row++, src += src_stride) {
+        if (ts == 0) {
+            put_row(src, frame->pixels + (size_t)row * frame->width + x, width, format);
+            continue;
+        }
+
+        // Each tile gets the part of the row that is inside of it
+        for (int px = x; px < x + width;) {
+            int n = ts - px % ts < x + width - px ? ts - px % ts : x + width - px;
+            uint32_t *dst = frame->pixels + ((size_t)(row / ts) * tiles_x + px / ts) * ts * ts +
+                            (row % ts) * ts + px % ts;
+            put_row(src + (px - x) * bpp, dst, n, format);
+            px += n;
+        }
+    }
+}
+
+/**
+ * clear all pixels of a frame, including the padding of the tiles
+ *
+ * @param frame  frame to clear
+ */
+void grab_frame_clear(grab_frame_t *frame) {
+    int ts = frame->tile_size;
+    size_t n = (size_t)frame->width * frame->height;
+
+    if (ts > 0) {
+        n = (size_t)((frame->width + ts - 1) / ts) * ((frame->height + ts - 1) / ts) * ts * ts;
+    }
+    memset(frame->pixels, 0, n * sizeof(uint32_t));
+}
@@ -9,10 +9,74 @@
 // See COPYING at the root of the repository for details.
 #ifndef SHAREIT_GRAB_H
 #define SHAREIT_GRAB_H
+#include <stdio.h>
+#include <stdint.h>
+#include "cursor.h"
+#include "region.h"
 
-void *grab_initialize();
+// Pixel layouts that grabbers can write to a frame with grab_frame_put()
+enum grab_format {
+    grab_format_bgrx = 0,   // 32 bits per pixel, the same as our 0x00RRGGBB screen pixels
+    grab_format_rgb24 = 1,  // 24 bits per pixel, red first
+    grab_format_rgba = 2,   // 32 bits per pixel, red first
+};
+
+/*
+ * Screen buffer a frame is grabbed to. With the tiled layout the frame is stored
+ * one tile at a time (see screen_to_tiles()), which grab_frame_put() takes care of.
+ */
+typedef struct grab_frame {
+    uint32_t *pixels;
+    int width;
+    int height;
+    int tile_size;  // size of the tiles, or 0 if the frame is stored row by row
+
+    // Called when rows y to y + height of a stream (see grab_streams()) have been written
+    // to the frame, after the rows above them, or NULL. Streams may be grabbed in parallel,
+    // so this can be called from other threads
+    void (*ready)(struct grab_frame *frame, int stream, int y, int height);
+    void *data;
+} grab_frame_t;
+
+/*
+ * Screen grabber backend. Every backend fills in one of these, and the
+ * grab_*() functions below call the backend picked by grab_initialize().
+ * Screen pixels are written as 0x00RRGGBB.
+ */
+typedef struct {
+    const char *name;
+    const char *usage;  // description of the options, shown in the help text
+
+    // options is the part of the backend spec after "name:", or NULL
+    void *(*initialize)(const char *options, const grab_region_t *region);
+    void (*shutdown)(void *data);
+    int (*window_size)(void *data, int *width, int *height);
+    int (*window)(void *data, grab_frame_t *frame);
+    void (*cursor_position)(void *data, int *x, int *y);
+    int (*cursor_serial)(void *data, uint32_t *serial);
+    int (*cursor_image)(void *data, cursor_shape_t *shape);
+    int (*list_outputs)(void *data, grab_output_t *outputs, int max_outputs);
+
+    // Parts of the grabbed screen that are grabbed by themselves, NULL if it's grabbed as a whole.
+    // Backends that have this call frame->ready() themselves
+    int (*streams)(void *data, grab_output_t *streams, int max_streams);
+} grab_backend_t;
+
+void *grab_initialize(const char *spec, const grab_region_t *region);
 void grab_shutdown(void *);
 int grab_window_size(void *, int *, int *);
-int grab_window(void *, unsigned char *);
+int grab_window(void *, grab_frame_t *frame);
 void grab_cursor_position(void *, int *x, int *y);
-#endif
\ No newline at end of file
+int grab_cursor_serial(void *, uint32_t *serial);
+int grab_cursor_image(void *, cursor_shape_t *shape);
+int grab_list_outputs(void *, grab_output_t *outputs, int max_outputs);
+int grab_streams(void *, grab_output_t *streams, int max_streams);
+int64_t grab_outputs_area(const grab_output_t *outputs, int n_outputs);
+void grab_print_backends(FILE *f);
+void grab_frame_put(grab_frame_t *frame, int x, int y, int width, int height,
+                    const uint8_t *src, int src_stride, int format);
+void grab_frame_clear(grab_frame_t *frame);
+
+// Content of the synthetic backend, also used by the benchmarks
+void grab_synthetic_render(uint32_t *screen, int width, int height, int frame);
+#endif
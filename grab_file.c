@@ -0,0 +1,155 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "grab.h"
+
+/*
+ * Replays raw frames from a file, e.g. a screen recording converted with
+ *   ffmpeg -i recording.mkv -pix_fmt bgr0 -f rawvideo recording.raw
+ * Frames are read back to back, starting over at the end of the file.
+ */
+
+// Pixel formats that can be replayed, named like ffmpeg's -pix_fmt
+typedef struct {
+    const char *name;
+    int format;  // grab_format of the pixels
+    int bytes_per_pixel;
+} grab_file_format_t;
+
+static const grab_file_format_t formats[] = {
+    { "bgr0", grab_format_bgrx, 4 },
+    { "rgb24", grab_format_rgb24, 3 },
+    { "rgba", grab_format_rgba, 4 },
+};
+
+#define N_FORMATS (sizeof(formats) / sizeof(formats[0]))
+
+typedef struct {
+    int width;
+    int height;
+    const grab_file_format_t *format;
+    uint8_t *frame;  // frame as read from the file, unless it can be read straight into the screen buffer
+    FILE *f;
+} grab_file_t;
+
+/**
+ * setup file grabber
+ *
+ * @param options  WIDTHxHEIGHT[:FORMAT]:path, where FORMAT is bgr0 (the default), rgb24 or rgba
+ * @param region   not used
+ * @return grabber, or NULL on error
+ */
+static void *grab_file_initialize(const char *options, const grab_region_t *region) {
+    grab_file_t *info;
+    const char *path;
+    long size;
+    size_t i;
+
+    info = calloc(1, sizeof(grab_file_t));
+    if (info == NULL) {
+        return NULL;
+    }
+
+    path = options != NULL ? strchr(options, ':') : NULL;
+    if (path == NULL || sscanf(options, "%dx%d", &info->width, &info->height) != 2 ||
+        info->width < 1 || info->height < 1 || info->width > 65535 || info->height > 65535) {
+        fprintf(stderr, "expected WIDTHxHEIGHT[:FORMAT]:path\n");
+        free(info);
+        return NULL;
+    }
+    path++;
+
+    info->format = &formats[0];
+    for (i = 0; i < N_FORMATS; i++) {
+        size_t len = strlen(formats[i].name);
+        if (strncmp(path, formats[i].name, len) == 0 && path[len] == ':') {
+            info->format = &formats[i];
+            path += len + 1;
+            break;
+        }
+    }
+
+    info->f = fopen(path, "rb");
+    if (info->f == NULL) {
+        fprintf(stderr, "could not open %s: %s\n", path, strerror(errno));
+        free(info);
+        return NULL;
+    }
+
+    if (fseek(info->f, 0, SEEK_END) != 0 || (size = ftell(info->f)) < 0 ||
+        fseek(info->f, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "could not read %s: %s\n", path, strerror(errno));
+        fclose(info->f);
+        free(info);
+        return NULL;
+    }
+    if (size < (long)info->width * info->height * info->format->bytes_per_pixel) {
+        fprintf(stderr, "%s does not contain a full %dx%d frame\n", path, info->width, info->height);
+        fclose(info->f);
+        free(info);
+        return NULL;
+    }
+    return info;
+}
+
+static void grab_file_shutdown(void *data) {
+    grab_file_t *info = data;
+
+    fclose(info->f);
+    free(info->frame);
+    free(info);
+}
+
+static int grab_file_window_size(void *data, int *width, int *height) {
+    grab_file_t *info = data;
+    *width = info->width;
+    *height = info->height;
+    return 0;
+}
+
+static int grab_file_window(void *data, grab_frame_t *output) {
+    grab_file_t *info = data;
+    size_t frame_size = (size_t)info->width * info->height * info->format->bytes_per_pixel;
+    int direct = info->format->format == grab_format_bgrx && output->tile_size == 0;
+    uint8_t *frame = (uint8_t *)output->pixels;
+
+    if (!direct) {
+        if (info->frame == NULL && (info->frame = malloc(frame_size)) == NULL) {
+            return -1;
+        }
+        frame = info->frame;
+    }
+
+    if (fread(frame, frame_size, 1, info->f) != 1) {
+        // Partial frames at the end are skipped, start over with the first one
+        rewind(info->f);
+        if (fread(frame, frame_size, 1, info->f) != 1) {
+            return -1;
+        }
+    }
+
+    if (!direct) {
+        grab_frame_put(output, 0, 0, info->width, info->height, frame,
+                       info->width * info->format->bytes_per_pixel, info->format->format);
+    }
+    return 0;
+}
+
+const grab_backend_t grab_backend_file = {
+    .name = "file",
+    .usage = "replay raw frames, WIDTHxHEIGHT[:FORMAT]:path where FORMAT is\n"
+             "                 bgr0 (the default), rgb24 or rgba",
+    .initialize = grab_file_initialize,
+    .shutdown = grab_file_shutdown,
+    .window_size = grab_file_window_size,
+    .window = grab_file_window,
+};
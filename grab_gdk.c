@@ -8,64 +8,350 @@
 // Licensed under the GPLv3 or later.
 // See COPYING at the root of the repository for details.
 #include <gtk/gtk.h>
+#include <gdk/gdkx.h>
 #include <string.h>
 #include <inttypes.h>
 #include <malloc.h>
+#include "cursor.h"
+#include "grab.h"
 
 typedef struct {
     GdkWindow *root;
+    int root_width;
+    int root_height;
+
+    // Part of the root window that is grabbed
+    int x;
+    int y;
     int width;
     int height;
+
+    // Window to follow when it's moved, or NULL
+    GdkWindow *window;
+
+    // When sharing the whole screen, each monitor is grabbed by itself, as a stream of its own
+    grab_output_t outputs[GRAB_MAX_OUTPUTS];
+    int n_outputs;
+    gboolean covered;  // the monitors cover all of the screen
+
+    // Cairo paints row by row, so with the tiled layout the screen is painted here and then split into tiles
+    uint32_t *screen;
 } grab_gdk_t;
 
-void *grab_initialize() {
+/**
+ * move the grabbed part of the screen, keeping it inside the root window
+ *
+ * @param info  grabber
+ * @param x     new x position
+ * @param y     new y position
+ */
+static void grab_move(grab_gdk_t *info, int x, int y) {
+    info->x = CLAMP(x, 0, info->root_width - info->width);
+    info->y = CLAMP(y, 0, info->root_height - info->height);
+}
+
+/**
+ * find the monitors of the default display
+ *
+ * Mirrored monitors show the same part of the screen, and are only listed once.
+ *
+ * @param outputs      list to fill in
+ * @param max_outputs  max number of monitors to list
+ * @return number of monitors found
+ */
+static int find_outputs(grab_output_t *outputs, int max_outputs) {
+    GdkDisplay *display = gdk_display_get_default();
+    int n_monitors = gdk_display_get_n_monitors(display);
+    int i, j, n = 0;
+
+    for (i = 0; i < n_monitors && n < max_outputs; i++) {
+        GdkMonitor *monitor = gdk_display_get_monitor(display, i);
+        const char *model = gdk_monitor_get_model(monitor);
+        GdkRectangle geom;
+
+        gdk_monitor_get_geometry(monitor, &geom);
+        for (j = 0; j < n; j++) {
+            if (outputs[j].x == geom.x && outputs[j].y == geom.y &&
+                outputs[j].width == geom.width && outputs[j].height == geom.height) {
+                break;
+            }
+        }
+        if (j < n) {
+            continue;
+        }
+
+        snprintf(outputs[n].name, sizeof(outputs[n].name), "%s", model != NULL ? model : "unknown");
+        outputs[n].x = geom.x;
+        outputs[n].y = geom.y;
+        outputs[n].width = geom.width;
+        outputs[n].height = geom.height;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * find monitor by name or number
+ *
+ * @param outputs    monitors to search
+ * @param n_outputs  number of monitors
+ * @param name       name, or number in the list, of monitor
+ * @return monitor, or NULL if it wasn't found
+ */
+static const grab_output_t *match_output(const grab_output_t *outputs, int n_outputs, const char *name) {
+    char *end;
+    long i = strtol(name, &end, 10);
+
+    if (*name != '\0' && *end == '\0') {
+        return i >= 0 && i < n_outputs ? &outputs[i] : NULL;
+    }
+    for (i = 0; i < n_outputs; i++) {
+        if (strcmp(outputs[i].name, name) == 0) {
+            return &outputs[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * setup grabber
+ *
+ * @param options  not used
+ * @param region  part of the screen to grab, or NULL for the whole screen
+ * @return grabber, or NULL on error
+ */
+static void *grab_gdk_initialize(const char *options, const grab_region_t *region) {
     gint x, y;
 
     grab_gdk_t *info;
-    info = malloc(sizeof(grab_gdk_t));
+    info = calloc(1, sizeof(grab_gdk_t));
+    if (info == NULL) {
+        return NULL;
+    }
 
     info->root = gdk_get_default_root_window();
-    gdk_window_get_geometry(info->root, &x, &y, &info->width, &info->height);
+    gdk_window_get_geometry(info->root, &x, &y, &info->root_width, &info->root_height);
+    info->width = info->root_width;
+    info->height = info->root_height;
+
+    if (region != NULL && region->output != NULL) {
+        grab_output_t outputs[GRAB_MAX_OUTPUTS];
+        const grab_output_t *output;
+
+        output = match_output(outputs, find_outputs(outputs, GRAB_MAX_OUTPUTS), region->output);
+        if (output == NULL) {
+            fprintf(stderr, "could not find monitor '%s'\n", region->output);
+            free(info);
+            return NULL;
+        }
+        info->width = MIN(output->width, info->root_width);
+        info->height = MIN(output->height, info->root_height);
+        grab_move(info, output->x, output->y);
+    } else if (region != NULL && region->window != 0) {
+        GdkDisplay *display = gdk_display_get_default();
+        if (!GDK_IS_X11_DISPLAY(display)) {
+            fprintf(stderr, "window sharing is only supported on X11\n");
+            free(info);
+            return NULL;
+        }
+
+        gdk_x11_display_error_trap_push(display);
+        info->window = gdk_x11_window_foreign_new_for_display(display, region->window);
+        if (info->window != NULL) {
+            gdk_window_get_origin(info->window, &x, &y);
+            info->width = MIN(gdk_window_get_width(info->window), info->root_width);
+            info->height = MIN(gdk_window_get_height(info->window), info->root_height);
+        }
+        if (gdk_x11_display_error_trap_pop(display) != 0 || info->window == NULL) {
+            fprintf(stderr, "could not find window 0x%lx\n", region->window);
+            if (info->window != NULL) {
+                g_object_unref(info->window);
+            }
+            free(info);
+            return NULL;
+        }
+        grab_move(info, x, y);
+    } else if (region != NULL && region->width > 0 && region->height > 0) {
+        info->width = MIN(region->width, info->root_width);
+        info->height = MIN(region->height, info->root_height);
+        grab_move(info, region->x, region->y);
+    } else {
+        // Parts of the screen that no monitor shows are never read
+        info->n_outputs = find_outputs(info->outputs, GRAB_MAX_OUTPUTS);
+        for (int i = 0; i < info->n_outputs; i++) {
+            grab_output_t *output = &info->outputs[i];
+            if (output->x < 0 || output->y < 0 ||
+                output->x + output->width > info->root_width ||
+                output->y + output->height > info->root_height) {
+                // Shouldn't happen, but grab everything rather than reading outside the screen
+                info->n_outputs = 0;
+                break;
+            }
+        }
+        info->covered = grab_outputs_area(info->outputs, info->n_outputs) == (int64_t)info->width * info->height;
+        if (info->n_outputs == 1 && info->covered) {
+            info->n_outputs = 0;
+        }
+    }
 
     return info;
 }
 
-int grab_window_size(grab_gdk_t *info, int *width, int *height) {
+/**
+ * list the monitors that can be shared
+ *
+ * @param data         grabber
+ * @param outputs      list to fill in
+ * @param max_outputs  max number of monitors to list
+ * @return number of monitors found
+ */
+static int grab_gdk_list_outputs(void *data, grab_output_t *outputs, int max_outputs) {
+    return find_outputs(outputs, max_outputs);
+}
+
+static int grab_gdk_window_size(void *data, int *width, int *height) {
+    grab_gdk_t *info = data;
     *width = info->width;
     *height = info->height;
     return 0;
 }
 
-int grab_window(grab_gdk_t *info, uint8_t *output) {
-    GdkPixbuf *px = gdk_pixbuf_get_from_window(info->root, 0, 0, info->width, info->height);
-    if (px == NULL) {
+// A monitor that has been grabbed, and is handed on in a thread of its own
+typedef struct {
+    grab_gdk_t *info;
+    grab_frame_t *frame;
+    int stream;
+} grab_gdk_stream_t;
+
+static gpointer stream_ready(gpointer data) {
+    grab_gdk_stream_t *stream = data;
+    const grab_output_t *o = &stream->info->outputs[stream->stream];
+    stream->frame->ready(stream->frame, stream->stream, o->y, o->height);
+    return NULL;
+}
+
+/**
+ * grab the shared part of the screen
+ *
+ * The root window is painted straight into the frame with cairo. Its RGB24
+ * format has the same layout as our screen pixels, so there's no intermediate
+ * pixbuf to allocate and convert.
+ *
+ * @param data    grabber
+ * @param output  frame of info->width * info->height screen pixels
+ * @return 0 on success, -1 on error
+ */
+static int grab_gdk_window(void *data, grab_frame_t *output) {
+    grab_gdk_t *info = data;
+    cairo_surface_t *surface;
+    cairo_status_t status;
+    uint8_t *screen = (uint8_t *)output->pixels;
+    cairo_t *cr;
+
+    if (info->window != NULL) {
+        // Follow the window if it has been moved. The size is kept, since the viewers
+        // have already been told how large the screen is
+        GdkDisplay *display = gdk_window_get_display(info->window);
+        gint x, y;
+
+        gdk_x11_display_error_trap_push(display);
+        gdk_window_get_origin(info->window, &x, &y);
+        if (gdk_x11_display_error_trap_pop(display) != 0) {
+            // The window is gone
+            return -1;
+        }
+        grab_move(info, x, y);
+    }
+
+    if (output->tile_size > 0) {
+        if (info->screen == NULL &&
+            (info->screen = malloc(sizeof(uint32_t) * info->width * info->height)) == NULL) {
+            return -1;
+        }
+        screen = (uint8_t *)info->screen;
+    }
+
+    surface = cairo_image_surface_create_for_data(screen, CAIRO_FORMAT_RGB24,
+                                                  info->width, info->height, info->width * 4);
+    cr = cairo_create(surface);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    gdk_cairo_set_source_window(cr, info->root, -info->x, -info->y);
+
+    if (info->n_outputs == 0) {
+        cairo_paint(cr);
+    } else {
+        if (!info->covered) {
+            // Keep the parts that aren't grabbed the same in every frame
+            memset(screen, 0, info->width * info->height * 4);
+        }
+
+        // Only the parts of the root window inside the rectangles are read
+        for (int i = 0; i < info->n_outputs; i++) {
+            grab_output_t *o = &info->outputs[i];
+            cairo_rectangle(cr, o->x, o->y, o->width, o->height);
+        }
+        cairo_fill(cr);
+    }
+
+    status = cairo_status(cr);
+    cairo_destroy(cr);
+    cairo_surface_flush(surface);
+    cairo_surface_destroy(surface);
+    if (status != CAIRO_STATUS_SUCCESS) {
         return -1;
     }
 
-    gboolean has_alpha = gdk_pixbuf_get_has_alpha(px);
-    uint8_t *pixels = gdk_pixbuf_get_pixels(px);
-    int stride = gdk_pixbuf_get_rowstride(px);
-    int n_channels = gdk_pixbuf_get_n_channels(px);
-
-    for (int y = 0; y < info->height; y ++) {
-        for (int x = 0; x < info->width; x ++) {
-            uint8_t *target = output + (y * info->width + x) * 4;
-            uint8_t *source = pixels + y * stride + x * n_channels;
-
-            target[2] = source[0];
-            target[1] = source[1];
-            target[0] = source[2];
-            if (has_alpha && n_channels == 4) {
-                target[3] = source[3];
+    if (output->tile_size > 0) {
+        grab_frame_put(output, 0, 0, info->width, info->height, screen, info->width * 4, grab_format_bgrx);
+    }
+
+    if (output->ready != NULL && info->n_outputs == 0) {
+        output->ready(output, 0, 0, info->height);
+    } else if (output->ready != NULL) {
+        // GDK can only be used from this thread, but what happens next to each monitor can run in parallel
+        GThread *threads[GRAB_MAX_OUTPUTS];
+        grab_gdk_stream_t streams[GRAB_MAX_OUTPUTS];
+
+        for (int i = 0; i < info->n_outputs; i++) {
+            streams[i] = (grab_gdk_stream_t) { info, output, i };
+            threads[i] = info->n_outputs > 1 ? g_thread_try_new("grab", stream_ready, &streams[i], NULL) : NULL;
+            if (threads[i] == NULL) {
+                stream_ready(&streams[i]);
+            }
+        }
+        for (int i = 0; i < info->n_outputs; i++) {
+            if (threads[i] != NULL) {
+                g_thread_join(threads[i]);
             }
         }
     }
-
-    g_object_unref(px);
     return 0;
 }
 
-void grab_shutdown(grab_gdk_t *info) {
+/**
+ * list the monitors that are grabbed as streams of their own
+ *
+ * @param data         grabber
+ * @param streams      list to fill in, or NULL
+ * @param max_streams  max number of streams to list
+ * @return number of streams, 0 if the screen is grabbed as a whole
+ */
+static int grab_gdk_streams(void *data, grab_output_t *streams, int max_streams) {
+    grab_gdk_t *info = data;
+
+    if (streams != NULL) {
+        memcpy(streams, info->outputs, MIN(info->n_outputs, max_streams) * sizeof(grab_output_t));
+    }
+    return info->n_outputs;
+}
+
+static void grab_gdk_shutdown(void *data) {
+    grab_gdk_t *info = data;
+
+    if (info->window != NULL) {
+        g_object_unref(info->window);
+    }
+    free(info->screen);
     free(info);
 }
 
@@ -74,7 +360,8 @@ void grab_shutdown(grab_gdk_t *info) {
  *
  * returns which cursor is used and where it's located
  */
-void grab_cursor_position(grab_gdk_t *info, int *x, int *y) {
+static void grab_gdk_cursor_position(void *data, int *x, int *y) {
+    grab_gdk_t *info = data;
     GdkDevice *device;
     gint cx, cy;
     *x = 0;
@@ -84,9 +371,28 @@ void grab_cursor_position(grab_gdk_t *info, int *x, int *y) {
     device = gdk_seat_get_pointer(seat);
     gdk_window_get_device_position (info->root, device, &cx, &cy, NULL);
 
+    // Position is relative to the part of the screen that is shared
+    cx -= info->x;
+    cy -= info->y;
     if (cx > 0 && cx < info->width  &&
         cy > 0 && cy <= info->height) {
         *x = cx;
         *y = cy;
     }
-}
\ No newline at end of file
+}
+
+const grab_backend_t grab_backend_gdk = {
+    .name = "gdk",
+    .usage = "grab the screen with GDK",
+    .initialize = grab_gdk_initialize,
+    .shutdown = grab_gdk_shutdown,
+    .window_size = grab_gdk_window_size,
+    .window = grab_gdk_window,
+    .cursor_position = grab_gdk_cursor_position,
+    // GDK has no way of getting the cursor image of other applications,
+    // so cursor shapes are not supported by this grabber
+    .cursor_serial = NULL,
+    .cursor_image = NULL,
+    .list_outputs = grab_gdk_list_outputs,
+    .streams = grab_gdk_streams,
+};
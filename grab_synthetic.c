@@ -0,0 +1,288 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#include <stdlib.h>
+#include <string.h>
+#include "grab.h"
+
+/*
+ * Synthetic screen content, so that the sharer and benchmarks can run
+ * reproducible workloads without a display. Every frame is a function of
+ * the frame number only.
+ */
+
+#define SYNTHETIC_DEFAULT_WIDTH 1920
+#define SYNTHETIC_DEFAULT_HEIGHT 1080
+#define SYNTHETIC_N_WINDOWS 3
+
+// Size of a character in the terminal
+#define CHAR_WIDTH 8
+#define CHAR_HEIGHT 16
+
+typedef struct {
+    int width;
+    int height;
+
+    // The content changes every n:th frame, 0 to leave it out
+    int text_rate;
+    int windows_rate;
+    int video_rate;
+
+    int frame;
+    uint32_t *screen;  // frame rendered row by row, when the tiled layout is grabbed to
+} grab_synthetic_t;
+
+static uint32_t hash32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+static void fill_rect(uint32_t *screen, int width, int height, int x, int y, int w, int h, uint32_t colour) {
+    int x1 = x + w < width ? x + w : width;
+    int y1 = y + h < height ? y + h : height;
+
+    for (int sy = y < 0 ? 0 : y; sy < y1; sy++) {
+        for (int sx = x < 0 ? 0 : x; sx < x1; sx++) {
+            screen[sx + sy * width] = colour;
+        }
+    }
+}
+
+/**
+ * draw a terminal with lines of text scrolling up
+ *
+ * @param scroll  number of lines that have scrolled by
+ */
+static void draw_terminal(uint32_t *screen, int width, int height, int x, int y, int w, int h, int scroll) {
+    int cols = w / CHAR_WIDTH - 1;
+    int rows = h / CHAR_HEIGHT;
+
+    fill_rect(screen, width, height, x, y, w, h, 0x000000);
+    for (int row = 0; row < rows; row++) {
+        uint32_t line = row + scroll;
+        int len = hash32(line) % cols;
+
+        for (int col = 0; col < len; col++) {
+            uint32_t glyph = hash32(line * 4099 + col);
+            if (glyph % 6 == 0) {
+                // space
+                continue;
+            }
+            for (int gy = 0; gy < 12; gy++) {
+                uint32_t *pixel = screen + (y + row * CHAR_HEIGHT + gy + 2) * width + x + (col + 1) * CHAR_WIDTH;
+                for (int gx = 0; gx < 6; gx++) {
+                    if (glyph & (1u << ((gx + gy * 6) % 32))) {
+                        pixel[gx] = 0xc0c0c0;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * draw a window bouncing around the screen
+ *
+ * @param i     number of the window
+ * @param step  number of times the window has moved
+ */
+static void draw_window(uint32_t *screen, int width, int height, int i, int step) {
+    int w = width / 4 + i * width / 16;
+    int h = height / 4 + i * height / 16;
+    int range_x = width - w, range_y = height - h;
+    int x = (hash32(i) % range_x + step * (4 + i)) % (2 * range_x);
+    int y = (hash32(i + 100) % range_y + step * (3 + i)) % (2 * range_y);
+
+    // Bounce off the edges
+    if (x > range_x) {
+        x = 2 * range_x - x;
+    }
+    if (y > range_y) {
+        y = 2 * range_y - y;
+    }
+
+    fill_rect(screen, width, height, x, y, w, h, 0xd4d0c8);
+    fill_rect(screen, width, height, x, y, w, 24, 0x0a246a);
+    fill_rect(screen, width, height, x + 8, y + 32, w - 16, h - 40, 0xffffff);
+}
+
+/**
+ * draw video, noise on top of a moving gradient
+ *
+ * @param step  number of video frames shown
+ */
+static void draw_video(uint32_t *screen, int width, int height, int x, int y, int w, int h, int step) {
+    uint32_t state = hash32(step) | 1;
+
+    for (int sy = 0; sy < h; sy++) {
+        uint32_t *row = screen + (y + sy) * width + x;
+        for (int sx = 0; sx < w; sx++) {
+            // xorshift32
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+
+            uint32_t r = sx * 255 / w;
+            uint32_t g = sy * 255 / h;
+            uint32_t b = (sx + sy + step * 8) & 0xff;
+            row[sx] = ((r << 16) | (g << 8) | b) ^ (state & 0x0f0f0f);
+        }
+    }
+}
+
+/**
+ * draw a frame of synthetic content
+ *
+ * @param screen  buffer of width * height pixels to draw to
+ * @param width   width of screen
+ * @param height  height of screen
+ * @param frame   frame number
+ * @param text_rate     scroll the terminal every n:th frame, 0 to not show it
+ * @param windows_rate  move the windows every n:th frame, 0 to not show them
+ * @param video_rate    show a new video frame every n:th frame, 0 to not show it
+ */
+static void render(uint32_t *screen, int width, int height, int frame,
+                   int text_rate, int windows_rate, int video_rate) {
+    fill_rect(screen, width, height, 0, 0, width, height, 0x3a6ea5);
+
+    if (text_rate > 0) {
+        draw_terminal(screen, width, height, width / 20, height / 10, width * 9 / 20, height * 8 / 10,
+                      frame / text_rate);
+    }
+    if (windows_rate > 0) {
+        for (int i = 0; i < SYNTHETIC_N_WINDOWS; i++) {
+            draw_window(screen, width, height, i, frame / windows_rate);
+        }
+    }
+    if (video_rate > 0) {
+        draw_video(screen, width, height, width * 6 / 10, height / 10, width * 3 / 10, height * 3 / 10,
+                   frame / video_rate);
+    }
+}
+
+void grab_synthetic_render(uint32_t *screen, int width, int height, int frame) {
+    render(screen, width, height, frame, 1, 2, 1);
+}
+
+/**
+ * setup synthetic grabber
+ *
+ * @param options  WIDTHxHEIGHT, optionally followed by ':' and a comma separated list
+ *                 of how often each kind of content changes, e.g. "1920x1080:text=1,windows=2,video=0"
+ * @param region   not used
+ * @return grabber, or NULL on error
+ */
+static void *grab_synthetic_initialize(const char *options, const grab_region_t *region) {
+    grab_synthetic_t *info;
+    const char *rates;
+
+    info = calloc(1, sizeof(grab_synthetic_t));
+    if (info == NULL) {
+        return NULL;
+    }
+    info->width = SYNTHETIC_DEFAULT_WIDTH;
+    info->height = SYNTHETIC_DEFAULT_HEIGHT;
+    info->text_rate = 1;
+    info->windows_rate = 2;
+    info->video_rate = 1;
+
+    if (options != NULL && *options != '\0' && *options != ':' &&
+        (sscanf(options, "%dx%d", &info->width, &info->height) != 2 ||
+         info->width < 64 || info->height < 64 || info->width > 65535 || info->height > 65535)) {
+        fprintf(stderr, "invalid synthetic screen size '%s'\n", options);
+        free(info);
+        return NULL;
+    }
+
+    rates = options != NULL ? strchr(options, ':') : NULL;
+    while (rates != NULL) {
+        char name[16];
+        int rate;
+
+        rates++;
+        if (sscanf(rates, "%15[a-z]=%d", name, &rate) != 2 || rate < 0) {
+            fprintf(stderr, "invalid synthetic content '%s'\n", rates);
+            free(info);
+            return NULL;
+        }
+        if (strcmp(name, "text") == 0) {
+            info->text_rate = rate;
+        } else if (strcmp(name, "windows") == 0) {
+            info->windows_rate = rate;
+        } else if (strcmp(name, "video") == 0) {
+            info->video_rate = rate;
+        } else {
+            fprintf(stderr, "unknown synthetic content '%s'\n", name);
+            free(info);
+            return NULL;
+        }
+        rates = strchr(rates, ',');
+    }
+    return info;
+}
+
+static void grab_synthetic_shutdown(void *data) {
+    grab_synthetic_t *info = data;
+
+    free(info->screen);
+    free(info);
+}
+
+static int grab_synthetic_window_size(void *data, int *width, int *height) {
+    grab_synthetic_t *info = data;
+    *width = info->width;
+    *height = info->height;
+    return 0;
+}
+
+static int grab_synthetic_window(void *data, grab_frame_t *output) {
+    grab_synthetic_t *info = data;
+    uint32_t *screen = output->pixels;
+
+    if (output->tile_size > 0) {
+        // Rendered row by row, and then split into tiles
+        if (info->screen == NULL &&
+            (info->screen = malloc(sizeof(uint32_t) * info->width * info->height)) == NULL) {
+            return -1;
+        }
+        screen = info->screen;
+    }
+
+    render(screen, info->width, info->height, info->frame++,
+           info->text_rate, info->windows_rate, info->video_rate);
+
+    if (output->tile_size > 0) {
+        grab_frame_put(output, 0, 0, info->width, info->height, (uint8_t *)screen,
+                       info->width * sizeof(uint32_t), grab_format_bgrx);
+    }
+    return 0;
+}
+
+static void grab_synthetic_cursor_position(void *data, int *x, int *y) {
+    grab_synthetic_t *info = data;
+
+    // Move the cursor along the top of the terminal
+    *x = info->width / 20 + (info->frame * 4) % (info->width * 9 / 20);
+    *y = info->height / 10;
+}
+
+const grab_backend_t grab_backend_synthetic = {
+    .name = "synthetic",
+    .usage = "generated content, WIDTHxHEIGHT[:text=n,windows=n,video=n] where\n"
+             "                 the content changes every n:th frame, 0 to leave it out",
+    .initialize = grab_synthetic_initialize,
+    .shutdown = grab_synthetic_shutdown,
+    .window_size = grab_synthetic_window_size,
+    .window = grab_synthetic_window,
+    .cursor_position = grab_synthetic_cursor_position,
+};
@@ -8,10 +8,51 @@
 // Licensed under the GPLv3 or later.
 // See COPYING at the root of the repository for details.
 #include <errno.h>
+#include <string.h>
 #include "shareit.h"
 #include "framebuffer.h"
 #include "handlers.h"
 #include "packet.h"
+#include "scale.h"
+
+/**
+ * make every viewer start over with empty caches, e.g. when one of them has missed
+ * cursor shapes or tiles that the others have
+ *
+ * @param app  the main application
+ * @return -1 on error
+ */
+static int reset_viewer_caches(shareit_app_t *app) {
+    cursor_cache_clear(&app->cursors);
+    app->has_cursor_serial = FALSE;
+
+    if (app->tile_cache != NULL) {
+        tile_cache_clear(app->tile_cache);
+        if (pkt_send_tile_cache_reset(app->conn->socket) != 0) {
+            show_error(app, "could not send tile cache reset to server");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * forget a client that was away, when it's back or has left for good
+ *
+ * @param app   the main application
+ * @param name  name of the client
+ */
+static void away_client_remove(shareit_app_t *app, const char *name) {
+    if (app->away_clients == NULL) {
+        return;
+    }
+    for (guint i = 0; i < app->away_clients->len; i++) {
+        if (strcmp(g_ptr_array_index(app->away_clients, i), name) == 0) {
+            g_ptr_array_remove_index_fast(app->away_clients, i);
+            return;
+        }
+    }
+}
 
 int app_handle_join_response(shareit_app_t *app) {
     pkt_session_join_response_t pkt;
@@ -26,13 +67,91 @@ int app_handle_join_response(shareit_app_t *app) {
     case SESSION_JOIN_CLIENT_JOINED:
         printf("client %s joined session\n", pkt.client_name);
         free(pkt.client_name);
+
+        // The new client hasn't seen any of the cursor shapes or tiles we've sent
+        if (reset_viewer_caches(app) != 0) {
+            return -1;
+        }
+
+        // ...or where the monitors are
+        if (app->share_screen && app_send_screen_layout(app) != 0) {
+            show_error(app, "could not send screen layout to server");
+            return -1;
+        }
+
+        // It doesn't know what size we want the screen in, should it start sharing
+        if (app->display_width != 0 &&
+            pkt_send_display_size_request(app->conn->socket, app->viewer_id,
+                                          app->display_width, app->display_height) != 0) {
+            show_error(app, "could not send display size request to server");
+            return -1;
+        }
         break;
     case SESSION_JOIN_CLIENT_LEFT:
         printf("client %s left session\n", pkt.client_name);
+        away_client_remove(app, pkt.client_name);
+        free(pkt.client_name);
+        break;
+    case SESSION_JOIN_CLIENT_AWAY:
+        printf("client %s lost its connection\n", pkt.client_name);
+
+        // Remember what changes until it's back, see compare_screens()
+        if (app->away_clients == NULL) {
+            app->away_clients = g_ptr_array_new_with_free_func(free);
+        }
+        g_ptr_array_add(app->away_clients, pkt.client_name);
+        break;
+    case SESSION_JOIN_CLIENT_RESUMED:
+        printf("client %s is back in the session\n", pkt.client_name);
+        away_client_remove(app, pkt.client_name);
         free(pkt.client_name);
+
+        // It has kept its screen, so only the blocks that changed while it was away are
+        // sent again. The tiles and cursor shapes it missed may be referred to later though
+        if (app->share_screen) {
+            request_missed_refresh(app);
+        }
+        if (reset_viewer_caches(app) != 0) {
+            return -1;
+        }
+
+        // Updates sent just before its connection dropped may be lost too. Checksums let
+        // it ask for the parts that differ, instead of everything being sent again
+        app->checksum_time = 0;
         break;
     case SESSION_JOIN_OK:
         printf("session joined!\n");
+        if (app->away_clients != NULL) {
+            g_ptr_array_set_size(app->away_clients, 0);
+        }
+
+        // Sizes asked for in a previous session don't apply here
+        app->n_display_requests = 0;
+        if (app->display_width != 0 &&
+            pkt_send_display_size_request(app->conn->socket, app->viewer_id,
+                                          app->display_width, app->display_height) != 0) {
+            show_error(app, "could not send display size request to server");
+            return -1;
+        }
+        break;
+    case SESSION_JOIN_RESUMED:
+        printf("session resumed\n");
+        app->reconnecting = FALSE;
+        app->reconnect_attempts = 0;
+
+        // Updates sent just before the connection dropped may be lost, and with them
+        // tiles and cursor shapes that we would refer to
+        if (app->share_screen && reset_viewer_caches(app) != 0) {
+            return -1;
+        }
+        app->checksum_time = 0;
+        break;
+    case SESSION_JOIN_NOT_FOUND:
+        if (app->reconnecting) {
+            end_session(app, "the session has expired");
+            break;
+        }
+        printf("session not found\n");
         break;
     default:
         printf("unknown status %d\n", pkt.status);
@@ -43,15 +162,62 @@ int app_handle_join_response(shareit_app_t *app) {
     return 0;
 }
 
+int app_handle_session_token(shareit_app_t *app) {
+    char *token;
+
+    if (pkt_recv_session_token(app->conn->socket, &token) != 0) {
+        show_error(app, "error while reading session token");
+        return -1;
+    }
+
+    // An empty token means that the server can't resume the session
+    free(app->resume_token);
+    app->resume_token = NULL;
+    if (token[0] != '\0') {
+        app->resume_token = token;
+    } else {
+        free(token);
+    }
+    return 0;
+}
+
 int app_handle_cursor_info(shareit_app_t *app) {
     uint16_t x, y;
     uint8_t cursor;
 
     if (pkt_recv_cursorinfo(app->conn->socket, &x, &y, &cursor)) {
-        show_error(app, "error while reading cursor info: %s");
+        show_error(app, "error while reading cursor info");
         return -1;
     }
-    printf("cursor: %d,%d\n", x, y);
+
+    app->mouse_pos_x = x;
+    app->mouse_pos_y = y;
+    app->has_mouse_pos = TRUE;
+    if (app->view != NULL) {
+        gtk_widget_queue_draw(app->screen_share_window);
+    }
+    return 0;
+}
+
+int app_handle_cursor_shape(shareit_app_t *app) {
+    cursor_shape_t shape;
+
+    if (pkt_recv_cursor_shape(app->conn->socket, &shape)) {
+        show_error(app, "error while reading cursor shape");
+        return -1;
+    }
+
+    if (shape.pixels == NULL) {
+        // Reference to a shape we've already received.
+        // If we don't have it, the viewer falls back to a default cursor
+        app->cursors.current = cursor_cache_find(&app->cursors, shape.serial);
+    } else {
+        app->cursors.current = cursor_cache_add(&app->cursors, &shape);
+    }
+
+    if (app->view != NULL) {
+        gtk_widget_queue_draw(app->screen_share_window);
+    }
     return 0;
 }
 
@@ -79,25 +245,412 @@ int app_handle_screenshare_start(shareit_app_t *app) {
     app->view->width = width;
     app->view->height = height;
 
+    if (app->view->cache == NULL) {
+        app->view->cache = tile_cache_new(FALSE);
+    } else {
+        tile_cache_clear(app->view->cache);
+    }
+
+    cursor_cache_clear(&app->cursors);
+    app->has_mouse_pos = FALSE;
+
+    if (app->pixel_format != pixel_format_rgb888 &&
+        pkt_send_pixel_format_request(app->conn->socket, app->pixel_format) != 0) {
+        fprintf(stderr, "could not send pixel format request\n");
+    }
+    // If we joined after the share started, only the parts that change would be sent to us
+    if (pkt_send_refresh_request(app->conn->socket, 0, NULL, 0) != 0) {
+        fprintf(stderr, "could not send refresh request\n");
+    }
+
     gtk_widget_show_all(app->screen_share_window);
     return 0;
 }
 
+/**
+ * ask the sharer to send the parts of the screen covered by an update again,
+ * used when the update could not be drawn
+ *
+ * @param app     the main application
+ * @param update  update that could not be drawn
+ */
+static void request_update_refresh(shareit_app_t *app, framebuffer_update_t *update) {
+    refresh_region_t regions[REFRESH_REQUEST_MAX_REGIONS];
+    int n_regions = 0;
+
+    for (int i = 0; i < update->n_rects && n_regions < REFRESH_REQUEST_MAX_REGIONS; i++) {
+        regions[n_regions++] = (refresh_region_t) {
+            update->rects[i]->xpos, update->rects[i]->ypos, update->rects[i]->width, update->rects[i]->height
+        };
+    }
+
+    // Most errors are references to tiles we don't have, so start over with empty caches
+    if (n_regions > 0 &&
+        pkt_send_refresh_request(app->conn->socket, REFRESH_FLAG_RESET_TILE_CACHE, regions, n_regions) != 0) {
+        fprintf(stderr, "could not send refresh request\n");
+    }
+}
+
 int app_handle_framebuffer_update(shareit_app_t *app) {
     framebuffer_update_t *update;
     int err;
 
+    gint64 start = stats_begin(app->stats);
     if ((err = pkt_recv_framebuffer_update(app->conn->socket, &update)) != 0) {
-        show_error(app, "error while reading screendata: %s", strerror(err));
-        return -1;
+        // We don't know where the next packet starts, so the connection can't be used anymore.
+        // When the session has been resumed, checksums tell us what has to be sent again
+        fprintf(stderr, "error while reading screendata: %s\n", strerror(err));
+        stats_add_dropped_frame(app->stats);
+        return -2;
+    }
+    if (app->stats != NULL) {
+        stats_end(app->stats, stats_stage_receive, start);
+        stats_add_bytes_received(app->stats, framebuffer_update_wire_size(update));
+        for (int i = 0; i < update->n_rects; i++) {
+            stats_add_rect(app->stats, update->rects[i]->encoding_type);
+        }
+    }
+
+    if (app->frame_stamped) {
+        app->frame_drawn = TRUE;
     }
 
     // FIXME - check that we're actually in a session as a viewer
     if (app->view != NULL) {
-        draw_update(app->view, update);
+        start = stats_begin(app->stats);
+        if (draw_update(app->view, update) != 0) {
+            stats_add_dropped_frame(app->stats);
+            request_update_refresh(app, update);
+        } else {
+            stats_end(app->stats, stats_stage_draw, start);
+            stats_add_frame(app->stats);
+        }
     }
 
     gtk_widget_queue_draw(app->screen_share_window);
     free_framebuffer_update(update);
     return 0;
 }
+
+int app_handle_tile_cache_reset(shareit_app_t *app) {
+    if (app->view != NULL && app->view->cache != NULL) {
+        tile_cache_clear(app->view->cache);
+    }
+    return 0;
+}
+
+int app_handle_pixel_format_request(shareit_app_t *app) {
+    uint8_t format;
+
+    if (pkt_recv_pixel_format_request(app->conn->socket, &format)) {
+        show_error(app, "error while reading pixel format request");
+        return -1;
+    }
+
+    // Requests from viewers are seen by the other viewers as well
+    if (!app->share_screen || format >= PIXEL_FORMAT_COUNT || format == app->pixel_format) {
+        return 0;
+    }
+
+    printf("switching to pixel format %s\n", pixfmt_name(format));
+    if (format < app->pixel_format) {
+        // The viewers only have a lower fidelity version of the screen, so send all of it again
+        free(app->prev_screen);
+        app->prev_screen = NULL;
+    }
+
+    // Blocks sent in the new format must not be references to tiles in the old one,
+    // or the checksums of the blocks won't match what the viewers have
+    if (app->tile_cache != NULL) {
+        tile_cache_clear(app->tile_cache);
+        if (pkt_send_tile_cache_reset(app->conn->socket) != 0) {
+            show_error(app, "could not send tile cache reset to server");
+            return -1;
+        }
+    }
+    app->pixel_format = format;
+    return 0;
+}
+
+int app_handle_refresh_request(shareit_app_t *app) {
+    refresh_region_t regions[REFRESH_REQUEST_MAX_REGIONS];
+    int n_regions;
+    uint8_t flags;
+
+    if (pkt_recv_refresh_request(app->conn->socket, &flags, regions, &n_regions)) {
+        show_error(app, "error while reading refresh request");
+        return -1;
+    }
+
+    if (!app->share_screen) {
+        return 0;
+    }
+
+    if ((flags & REFRESH_FLAG_RESET_TILE_CACHE) && app->tile_cache != NULL) {
+        tile_cache_clear(app->tile_cache);
+        if (pkt_send_tile_cache_reset(app->conn->socket) != 0) {
+            show_error(app, "could not send tile cache reset to server");
+            return -1;
+        }
+    }
+
+    // Sent with the next frame, from the latest captured screen. Unlike a pixel format change,
+    // prev_screen is kept, so the other viewers only get the refreshed parts
+    request_refresh(app, regions, n_regions);
+    return 0;
+}
+
+int app_handle_screen_checksums(shareit_app_t *app) {
+    refresh_region_t regions[REFRESH_REQUEST_MAX_REGIONS];
+    uint16_t width, height, band_height;
+    uint32_t *checksums, *view_sums;
+    int n_bands, n_regions = 0;
+
+    if (pkt_recv_screen_checksums(app->conn->socket, &width, &height, &band_height, &checksums, &n_bands)) {
+        show_error(app, "error while reading screen checksums");
+        return -1;
+    }
+
+    // The checksums may be for a screen size we haven't switched to yet
+    if (app->view == NULL || app->view->pixels == NULL || width != app->view->width ||
+        height != app->view->height || band_height == 0 || n_bands != (height + band_height - 1) / band_height) {
+        free(checksums);
+        return 0;
+    }
+
+    view_sums = malloc(n_bands * sizeof(uint32_t));
+    if (view_sums == NULL) {
+        free(checksums);
+        return 0;
+    }
+    view_checksums(app->view, band_height, view_sums);
+
+    for (int band = 0; band < n_bands && n_regions < REFRESH_REQUEST_MAX_REGIONS; band++) {
+        if (checksums[band] == SCREEN_CHECKSUM_NONE || checksums[band] == view_sums[band]) {
+            continue;
+        }
+
+        // Bands next to each other are asked for as one region
+        refresh_region_t *prev = n_regions > 0 ? &regions[n_regions - 1] : NULL;
+        int y = band * band_height;
+        int h = MIN(band_height, height - y);
+        if (prev != NULL && prev->y + prev->height == y) {
+            prev->height += h;
+        } else {
+            regions[n_regions++] = (refresh_region_t) { 0, y, width, h };
+        }
+    }
+    free(checksums);
+    free(view_sums);
+
+    if (n_regions > 0) {
+        printf("screen differs from the sharer, asking for %d region(s) again\n", n_regions);
+        // The drift may come from a broken tile in our cache, and the refreshed blocks
+        // would just be sent as references to it again
+        if (pkt_send_refresh_request(app->conn->socket, REFRESH_FLAG_RESET_TILE_CACHE, regions, n_regions) != 0) {
+            fprintf(stderr, "could not send refresh request\n");
+        }
+    }
+    return 0;
+}
+
+/**
+ * remember the display size a viewer has asked for
+ *
+ * @param app        the main application
+ * @param viewer_id  id of the viewer asking
+ * @param width      width of the viewer's display area, 0 for full resolution
+ * @param height     height of the viewer's display area, 0 for full resolution
+ */
+static void display_request_set(shareit_app_t *app, uint32_t viewer_id, uint16_t width, uint16_t height) {
+    display_request_t *req = NULL;
+
+    for (int i = 0; i < app->n_display_requests; i++) {
+        if (app->display_requests[i].viewer_id == viewer_id) {
+            req = &app->display_requests[i];
+            break;
+        }
+    }
+
+    if (req == NULL) {
+        // Viewers that have left are never removed, so make room by forgetting the oldest request
+        if (app->n_display_requests == DISPLAY_REQUESTS_MAX) {
+            memmove(&app->display_requests[0], &app->display_requests[1],
+                    (DISPLAY_REQUESTS_MAX - 1) * sizeof(display_request_t));
+            app->n_display_requests--;
+        }
+        req = &app->display_requests[app->n_display_requests++];
+        req->viewer_id = viewer_id;
+    }
+    req->width = width;
+    req->height = height;
+}
+
+/**
+ * choose the size the screen is sent in, large enough for every viewer that has asked for a size
+ *
+ * @param[in]  app     the main application
+ * @param[out] width   width to send the screen in
+ * @param[out] height  height to send the screen in
+ */
+void app_choose_display_size(shareit_app_t *app, int *width, int *height) {
+    int max_width = 0, max_height = 0;
+
+    for (int i = 0; i < app->n_display_requests; i++) {
+        display_request_t *req = &app->display_requests[i];
+        if (req->width == 0 || req->height == 0) {
+            // Someone wants the full resolution
+            max_width = 0;
+            max_height = 0;
+            break;
+        }
+        max_width = MAX(max_width, req->width);
+        max_height = MAX(max_height, req->height);
+    }
+
+    scale_fit(app->capture_width, app->capture_height, max_width, max_height, width, height);
+}
+
+/**
+ * tell the viewers where the monitors are on the screen, in the size it's sent in
+ *
+ * @param app  the main application
+ * @return -1 on error
+ */
+int app_send_screen_layout(shareit_app_t *app) {
+    refresh_region_t outputs[GRAB_MAX_OUTPUTS];
+
+    for (int i = 0; i < app->n_streams; i++) {
+        const grab_output_t *stream = &app->streams[i];
+        outputs[i].x = (int64_t)stream->x * app->width / app->capture_width;
+        outputs[i].y = (int64_t)stream->y * app->height / app->capture_height;
+        outputs[i].width = (int64_t)stream->width * app->width / app->capture_width;
+        outputs[i].height = (int64_t)stream->height * app->height / app->capture_height;
+    }
+    return pkt_send_screen_layout(app->conn->socket, outputs, app->n_streams);
+}
+
+int app_handle_screen_layout(shareit_app_t *app) {
+    refresh_region_t outputs[SCREEN_LAYOUT_MAX_OUTPUTS];
+    int n_outputs;
+
+    if (pkt_recv_screen_layout(app->conn->socket, outputs, &n_outputs)) {
+        show_error(app, "error while reading screen layout");
+        return -1;
+    }
+
+    if (n_outputs > 1) {
+        printf("the shared screen has %d monitors:\n", n_outputs);
+        for (int i = 0; i < n_outputs; i++) {
+            printf("  %dx%d+%d+%d\n", outputs[i].width, outputs[i].height, outputs[i].x, outputs[i].y);
+        }
+    }
+    return 0;
+}
+
+int app_handle_display_size_request(shareit_app_t *app) {
+    uint32_t viewer_id;
+    uint16_t display_width, display_height;
+    int width, height;
+
+    if (pkt_recv_display_size_request(app->conn->socket, &viewer_id, &display_width, &display_height)) {
+        show_error(app, "error while reading display size request");
+        return -1;
+    }
+
+    display_request_set(app, viewer_id, display_width, display_height);
+    if (!app->share_screen) {
+        return 0;
+    }
+
+    app_choose_display_size(app, &width, &height);
+    if (width == app->width && height == app->height) {
+        return 0;
+    }
+
+    printf("sending screen as %dx%d\n", width, height);
+    app->width = width;
+    app->height = height;
+
+    // Everything has to be sent again in the new size, and the viewers
+    // start over with empty caches when they get the new screen size
+    free(app->current_screen);
+    free(app->prev_screen);
+    app->current_screen = NULL;
+    app->prev_screen = NULL;
+    if (width == app->capture_width && height == app->capture_height) {
+        free(app->capture_screen);
+        app->capture_screen = NULL;
+    }
+    if (app->tile_cache != NULL) {
+        tile_cache_clear(app->tile_cache);
+    }
+    cursor_cache_clear(&app->cursors);
+    app->has_cursor_serial = FALSE;
+    app->mouse_pos_x = 0;
+    app->mouse_pos_y = 0;
+
+    if (pkt_send_session_screenshare_request(app->conn->socket, width, height) == -1 ||
+        app_send_screen_layout(app) != 0) {
+        show_error(app, "could not send screeninfo to server");
+        return -1;
+    }
+    return 0;
+}
+
+int app_handle_frame_timestamp(shareit_app_t *app) {
+    if (pkt_recv_frame_timestamp(app->conn->socket, &app->frame_id, &app->frame_capture_time)) {
+        show_error(app, "error while reading frame timestamp");
+        return -1;
+    }
+
+    // If the previous frame hasn't been presented yet it is superseded by this one
+    app->frame_stamped = TRUE;
+    app->frame_drawn = FALSE;
+    return 0;
+}
+
+int app_handle_frame_presented(shareit_app_t *app) {
+    uint32_t viewer_id, frame_id;
+    uint64_t capture_time, present_time;
+
+    if (pkt_recv_frame_presented(app->conn->socket, &viewer_id, &frame_id, &capture_time, &present_time)) {
+        show_error(app, "error while reading frame presented report");
+        return -1;
+    }
+
+    if (app->latency != NULL) {
+        latency_add_frame(app->latency, viewer_id, capture_time, present_time);
+    }
+    return 0;
+}
+
+int app_handle_clock_ping(shareit_app_t *app) {
+    uint64_t t0;
+
+    if (pkt_recv_clock_ping(app->conn->socket, &t0)) {
+        show_error(app, "error while reading clock ping");
+        return -1;
+    }
+
+    if (pkt_send_clock_pong(app->conn->socket, app->viewer_id, t0, g_get_monotonic_time())) {
+        fprintf(stderr, "could not send clock pong\n");
+        return -1;
+    }
+    return 0;
+}
+
+int app_handle_clock_pong(shareit_app_t *app) {
+    uint32_t viewer_id;
+    uint64_t t0, t1;
+
+    if (pkt_recv_clock_pong(app->conn->socket, &viewer_id, &t0, &t1)) {
+        show_error(app, "error while reading clock pong");
+        return -1;
+    }
+
+    if (app->latency != NULL) {
+        latency_add_clock_sample(app->latency, viewer_id, t0, t1, g_get_monotonic_time());
+    }
+    return 0;
+}
@@ -11,8 +11,22 @@
 #define SHAREIT_HANDLERS_H
 
 int app_handle_join_response(shareit_app_t *app);
+int app_handle_session_token(shareit_app_t *app);
 int app_handle_cursor_info(shareit_app_t *app);
+int app_handle_cursor_shape(shareit_app_t *app);
+int app_handle_tile_cache_reset(shareit_app_t *app);
+int app_handle_pixel_format_request(shareit_app_t *app);
+int app_handle_display_size_request(shareit_app_t *app);
+void app_choose_display_size(shareit_app_t *app, int *width, int *height);
+int app_send_screen_layout(shareit_app_t *app);
+int app_handle_screen_layout(shareit_app_t *app);
+int app_handle_refresh_request(shareit_app_t *app);
+int app_handle_screen_checksums(shareit_app_t *app);
 int app_handle_screenshare_start(shareit_app_t *app);
 int app_handle_framebuffer_update(shareit_app_t *app);
+int app_handle_frame_timestamp(shareit_app_t *app);
+int app_handle_frame_presented(shareit_app_t *app);
+int app_handle_clock_ping(shareit_app_t *app);
+int app_handle_clock_pong(shareit_app_t *app);
 
 #endif
@@ -0,0 +1,86 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#include <string.h>
+#include "hash.h"
+
+/*
+ * 64-bit hash based on xxHash64 (https://github.com/Cyan4973/xxHash), using the
+ * same rounds and avalanche, but fed with rows of pixels instead of a byte stream.
+ * The size of the block is part of the seed, so equal pixels in blocks of
+ * different size don't collide.
+ */
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t val) {
+    acc ^= round64(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/**
+ * calculate hash of a block of pixels
+ *
+ * @param pixels  first pixel of block
+ * @param stride  number of pixels between each row in 'pixels'
+ * @param w       width of block
+ * @param h       height of block
+ * @return 64-bit hash
+ */
+uint64_t hash_pixels(const uint32_t *pixels, int stride, int w, int h) {
+    uint64_t seed = ((uint64_t)w << 16) | h;
+    uint64_t v[4] = {
+        seed + PRIME64_1 + PRIME64_2,
+        seed + PRIME64_2,
+        seed,
+        seed - PRIME64_1,
+    };
+    uint64_t acc, lane;
+    int x, y, n = 0;
+
+    for (y = 0; y < h; y ++) {
+        const uint32_t *row = pixels + y * stride;
+        for (x = 0; x + 1 < w; x += 2, n ++) {
+            memcpy(&lane, row + x, sizeof(lane));
+            v[n & 3] = round64(v[n & 3], lane);
+        }
+        if (x < w) {
+            v[n & 3] = round64(v[n & 3], row[x]);
+            n ++;
+        }
+    }
+
+    acc = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+    acc = merge64(acc, v[0]);
+    acc = merge64(acc, v[1]);
+    acc = merge64(acc, v[2]);
+    acc = merge64(acc, v[3]);
+    acc += (uint64_t)w * h * sizeof(uint32_t);
+
+    acc ^= acc >> 33;
+    acc *= PRIME64_2;
+    acc ^= acc >> 29;
+    acc *= PRIME64_3;
+    acc ^= acc >> 32;
+    return acc;
+}
@@ -0,0 +1,15 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#ifndef SHAREIT_HASH_H
+#define SHAREIT_HASH_H
+#include <stdint.h>
+
+uint64_t hash_pixels(const uint32_t *pixels, int stride, int w, int h);
+#endif
@@ -0,0 +1,141 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include "jpeg.h"
+
+/*
+ * Pixels are stored as 32 bits per pixel, with blue in the first byte,
+ * the same way as the screen buffers and the cairo surface in the viewer.
+ * This requires the colour space extensions from libjpeg-turbo.
+ */
+#ifndef JCS_EXTENSIONS
+#error "libjpeg-turbo is required for JPEG encoding"
+#endif
+
+typedef struct {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jmp;
+} jpeg_error_t;
+
+/**
+ * error handler for libjpeg, the default one calls exit()
+ */
+static void jpeg_error_exit(j_common_ptr cinfo) {
+    jpeg_error_t *err = (jpeg_error_t *)cinfo->err;
+    char msg[JMSG_LENGTH_MAX];
+
+    cinfo->err->format_message(cinfo, msg);
+    fprintf(stderr, "jpeg: %s\n", msg);
+    longjmp(err->jmp, 1);
+}
+
+/**
+ * compress a block of pixels to JPEG
+ *
+ * @param[in]  pixels      first pixel of block
+ * @param[in]  row_stride  number of bytes between each row in 'pixels'
+ * @param[in]  w           width of block
+ * @param[in]  h           height of block
+ * @param[in]  quality     JPEG quality (1 - 100)
+ * @param[in]  greyscale   TRUE to only keep the luminance
+ * @param[out] output      will be set to a newly allocated buffer with the compressed data (must be free'd by caller)
+ * @param[out] length      will be set to the length of 'output'
+ * @return 0 on success, -1 on error
+ */
+int jpeg_block_encode(const uint8_t *pixels, int row_stride, int w, int h, int quality, int greyscale,
+                      uint8_t **output, uint32_t *length) {
+    struct jpeg_compress_struct cinfo;
+    jpeg_error_t err;
+    unsigned char *buffer = NULL;
+    unsigned long sz = 0;
+    JSAMPROW row;
+
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpeg_error_exit;
+    if (setjmp(err.jmp)) {
+        jpeg_destroy_compress(&cinfo);
+        free(buffer);
+        return -1;
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &buffer, &sz);
+
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = 4;
+    cinfo.in_color_space = JCS_EXT_BGRX;
+    jpeg_set_defaults(&cinfo);
+    if (greyscale) {
+        jpeg_set_colorspace(&cinfo, JCS_GRAYSCALE);
+    }
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.dct_method = JDCT_ISLOW;
+
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        row = (JSAMPROW)(pixels + cinfo.next_scanline * row_stride);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    *output = buffer;
+    *length = sz;
+    return 0;
+}
+
+/**
+ * decompress JPEG data to a block of pixels
+ *
+ * @param data        compressed data
+ * @param length      length of 'data'
+ * @param pixels      first pixel of block to write to
+ * @param row_stride  number of bytes between each row in 'pixels'
+ * @param w           expected width of image
+ * @param h           expected height of image
+ * @return 0 on success, -1 on error (e.g. if the image size doesn't match)
+ */
+int jpeg_block_decode(const uint8_t *data, uint32_t length, uint8_t *pixels, int row_stride, int w, int h) {
+    struct jpeg_decompress_struct cinfo;
+    jpeg_error_t err;
+    JSAMPROW row;
+
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpeg_error_exit;
+    if (setjmp(err.jmp)) {
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *)data, length);
+    jpeg_read_header(&cinfo, TRUE);
+
+    if (cinfo.image_width != (JDIMENSION)w || cinfo.image_height != (JDIMENSION)h) {
+        fprintf(stderr, "jpeg: expected %dx%d image, got %ux%u\n", w, h, cinfo.image_width, cinfo.image_height);
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+
+    cinfo.out_color_space = JCS_EXT_BGRX;
+    cinfo.dct_method = JDCT_ISLOW;
+    jpeg_start_decompress(&cinfo);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        row = (JSAMPROW)(pixels + cinfo.output_scanline * row_stride);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return 0;
+}
@@ -0,0 +1,19 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#ifndef SHAREIT_JPEG_H
+#define SHAREIT_JPEG_H
+#include <stdint.h>
+
+#define JPEG_DEFAULT_QUALITY 75
+
+int jpeg_block_encode(const uint8_t *pixels, int row_stride, int w, int h, int quality, int greyscale,
+                      uint8_t **output, uint32_t *length);
+int jpeg_block_decode(const uint8_t *data, uint32_t length, uint8_t *pixels, int row_stride, int w, int h);
+#endif
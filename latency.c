@@ -0,0 +1,248 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#include <stdlib.h>
+#include <string.h>
+#include "latency.h"
+
+// Upper bound (in ms) of each bucket in the histogram, the last one catches everything else
+static const int bucket_limits[LATENCY_N_BUCKETS] = {
+    5, 10, 15, 20, 30, 40, 50, 75, 100, 150, 200, 500, 1000, -1,
+};
+
+/**
+ * create a new latency measurement
+ *
+ * @param shared_clock  TRUE if sharer and viewer use the same clock
+ * @return newly allocated latency measurement, or NULL on error
+ */
+latency_t *latency_new(gboolean shared_clock) {
+    latency_t *latency;
+
+    latency = calloc(1, sizeof(latency_t));
+    if (latency == NULL) {
+        return NULL;
+    }
+
+    latency->shared_clock = shared_clock;
+    return latency;
+}
+
+void latency_free(latency_t *latency) {
+    if (latency == NULL) {
+        return;
+    }
+
+    if (latency->ping_timer != 0) {
+        g_source_remove(latency->ping_timer);
+    }
+    if (latency->report_timer != 0) {
+        g_source_remove(latency->report_timer);
+    }
+    free(latency);
+}
+
+/**
+ * find the clock offset estimation of a viewer, or start a new one
+ *
+ * @param latency    latency measurement
+ * @param viewer_id  id the viewer sends in pongs and frame presented reports
+ * @return the viewer's clock offset estimation
+ */
+static latency_viewer_t *latency_get_viewer(latency_t *latency, uint32_t viewer_id) {
+    latency_viewer_t *viewer = NULL;
+    int i;
+
+    for (i = 0; i < latency->n_viewers; i ++) {
+        if (latency->viewers[i].id == viewer_id) {
+            viewer = &latency->viewers[i];
+            break;
+        }
+    }
+
+    if (viewer == NULL) {
+        if (latency->n_viewers < LATENCY_MAX_VIEWERS) {
+            viewer = &latency->viewers[latency->n_viewers++];
+        } else {
+            // Replace the viewer we haven't heard from in the longest time
+            viewer = &latency->viewers[0];
+            for (i = 1; i < latency->n_viewers; i ++) {
+                if (latency->viewers[i].last_seen < viewer->last_seen) {
+                    viewer = &latency->viewers[i];
+                }
+            }
+        }
+        memset(viewer, 0, sizeof(latency_viewer_t));
+        viewer->id = viewer_id;
+    }
+
+    viewer->last_seen = g_get_monotonic_time();
+    return viewer;
+}
+
+/**
+ * update the clock offset estimation of a viewer from a ping/pong exchange
+ *
+ * The offset is taken from the sample with the lowest round trip time
+ * among the last LATENCY_CLOCK_SAMPLES, since that is the one where the
+ * viewer timestamp is least likely to be skewed by queueing.
+ *
+ * @param latency    latency measurement to update
+ * @param viewer_id  viewer that answered the ping
+ * @param t0         our clock when the ping was sent
+ * @param t1         viewer clock when the ping was received
+ * @param t2         our clock when the pong was received
+ */
+void latency_add_clock_sample(latency_t *latency, uint32_t viewer_id, gint64 t0, gint64 t1, gint64 t2) {
+    latency_viewer_t *viewer;
+    latency_clock_sample_t *sample;
+    int i, best;
+
+    if (latency->shared_clock || t2 < t0) {
+        return;
+    }
+
+    viewer = latency_get_viewer(latency, viewer_id);
+    sample = &viewer->clock_samples[viewer->next_clock_sample];
+    sample->rtt = t2 - t0;
+    sample->offset = t1 - (t0 + t2) / 2;
+    viewer->next_clock_sample = (viewer->next_clock_sample + 1) % LATENCY_CLOCK_SAMPLES;
+    if (viewer->n_clock_samples < LATENCY_CLOCK_SAMPLES) {
+        viewer->n_clock_samples ++;
+    }
+
+    best = 0;
+    for (i = 1; i < viewer->n_clock_samples; i ++) {
+        if (viewer->clock_samples[i].rtt < viewer->clock_samples[best].rtt) {
+            best = i;
+        }
+    }
+    viewer->clock_offset = viewer->clock_samples[best].offset;
+    viewer->has_clock_offset = TRUE;
+}
+
+/**
+ * add the latency of a presented frame to the histogram
+ *
+ * @param latency       latency measurement to update
+ * @param viewer_id     viewer that presented the frame
+ * @param capture_time  our clock when the frame was captured
+ * @param present_time  viewer clock when the frame was presented
+ * @return latency in us, or -1 if it could not be calculated
+ */
+int latency_add_frame(latency_t *latency, uint32_t viewer_id, gint64 capture_time, gint64 present_time) {
+    gint64 elapsed, clock_offset = 0;
+    int i;
+
+    if (!latency->shared_clock) {
+        latency_viewer_t *viewer = latency_get_viewer(latency, viewer_id);
+        if (!viewer->has_clock_offset) {
+            return -1;
+        }
+        clock_offset = viewer->clock_offset;
+    }
+
+    elapsed = present_time - clock_offset - capture_time;
+    if (elapsed < 0) {
+        // The offset estimation is off by more than the latency, clamp it
+        elapsed = 0;
+    }
+
+    for (i = 0; i < LATENCY_N_BUCKETS - 1; i ++) {
+        if (elapsed < bucket_limits[i] * 1000) {
+            break;
+        }
+    }
+    latency->buckets[i] ++;
+
+    if (latency->n_samples == 0 || elapsed < latency->min_us) {
+        latency->min_us = elapsed;
+    }
+    if (elapsed > latency->max_us) {
+        latency->max_us = elapsed;
+    }
+    latency->total_us += elapsed;
+    latency->n_samples ++;
+    return elapsed;
+}
+
+/**
+ * calculate an approximate percentile from the histogram
+ *
+ * @param latency  latency measurement
+ * @param pct      percentile (0 - 100)
+ * @return upper bound of the bucket the percentile falls in, in ms, or -1 if it's in the last bucket
+ */
+static int latency_percentile(latency_t *latency, int pct) {
+    uint32_t target = (latency->n_samples * pct + 99) / 100;
+    uint32_t seen = 0;
+    int i;
+
+    for (i = 0; i < LATENCY_N_BUCKETS; i ++) {
+        seen += latency->buckets[i];
+        if (seen >= target) {
+            return bucket_limits[i];
+        }
+    }
+    return -1;
+}
+
+/**
+ * print the latency histogram
+ *
+ * @param latency  latency measurement to print
+ * @param f        file to print to
+ */
+void latency_print_histogram(latency_t *latency, FILE *f) {
+    uint32_t largest = 0;
+    int i, lower = 0;
+    int p50, p95;
+
+    if (latency->n_samples == 0) {
+        fprintf(f, "latency: no frames measured\n");
+        return;
+    }
+
+    p50 = latency_percentile(latency, 50);
+    p95 = latency_percentile(latency, 95);
+    fprintf(f, "latency: %u frames, min %.1f ms, avg %.1f ms, max %.1f ms, p50 %s%d ms, p95 %s%d ms%s\n",
+            latency->n_samples,
+            (double)latency->min_us / 1000,
+            (double)latency->total_us / latency->n_samples / 1000,
+            (double)latency->max_us / 1000,
+            p50 > 0 ? "<" : ">", p50 > 0 ? p50 : bucket_limits[LATENCY_N_BUCKETS - 2],
+            p95 > 0 ? "<" : ">", p95 > 0 ? p95 : bucket_limits[LATENCY_N_BUCKETS - 2],
+            latency->shared_clock ? " (shared clock)" : "");
+    for (i = 0; i < latency->n_viewers; i ++) {
+        if (latency->viewers[i].has_clock_offset) {
+            fprintf(f, " viewer %08x: clock offset %.1f ms\n", latency->viewers[i].id,
+                    (double)latency->viewers[i].clock_offset / 1000);
+        }
+    }
+
+    for (i = 0; i < LATENCY_N_BUCKETS; i ++) {
+        if (latency->buckets[i] > largest) {
+            largest = latency->buckets[i];
+        }
+    }
+
+    for (i = 0; i < LATENCY_N_BUCKETS; i ++) {
+        char bar[51];
+        int len = latency->buckets[i] * 50 / largest;
+
+        memset(bar, '#', len);
+        bar[len] = '\0';
+        if (bucket_limits[i] > 0) {
+            fprintf(f, " %4d - %4d ms | %6u %s\n", lower, bucket_limits[i], latency->buckets[i], bar);
+            lower = bucket_limits[i];
+        } else {
+            fprintf(f, " %4d -      ms | %6u %s\n", lower, latency->buckets[i], bar);
+        }
+    }
+}
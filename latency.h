@@ -0,0 +1,74 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#ifndef SHAREIT_LATENCY_H
+#define SHAREIT_LATENCY_H
+#include <stdio.h>
+#include <stdint.h>
+#include <glib.h>
+
+// How often (in ms) we ping the viewer to estimate the clock offset
+#define LATENCY_PING_INTERVAL_MS 1000
+
+// How often (in ms) the histogram is printed while sharing
+#define LATENCY_REPORT_INTERVAL_MS 10000
+
+// Number of clock samples the offset estimation picks the best one from
+#define LATENCY_CLOCK_SAMPLES 8
+
+#define LATENCY_N_BUCKETS 14
+
+// Max number of viewers the clock offset is estimated for, the one heard from least recently is replaced
+#define LATENCY_MAX_VIEWERS 16
+
+typedef struct {
+    gint64 rtt;
+    gint64 offset;
+} latency_clock_sample_t;
+
+// Clock offset estimation for one viewer
+typedef struct {
+    uint32_t id;
+    gint64 last_seen;  // our clock when we last heard from the viewer
+
+    // Offset between viewer clock and our clock (viewer - sharer), in us
+    gint64 clock_offset;
+    gboolean has_clock_offset;
+    latency_clock_sample_t clock_samples[LATENCY_CLOCK_SAMPLES];
+    int n_clock_samples;
+    int next_clock_sample;
+} latency_viewer_t;
+
+typedef struct {
+    // If set, both ends use the same clock (e.g. over loopback) and no offset is estimated
+    gboolean shared_clock;
+
+    // Each viewer has its own clock, so the offset is kept per viewer
+    latency_viewer_t viewers[LATENCY_MAX_VIEWERS];
+    int n_viewers;
+
+    uint32_t next_frame_id;
+
+    // Latency histogram, capture -> present, for all viewers
+    uint32_t buckets[LATENCY_N_BUCKETS];
+    uint32_t n_samples;
+    gint64 total_us;
+    gint64 min_us;
+    gint64 max_us;
+
+    guint ping_timer;
+    guint report_timer;
+} latency_t;
+
+latency_t *latency_new(gboolean shared_clock);
+void latency_free(latency_t *latency);
+void latency_add_clock_sample(latency_t *latency, uint32_t viewer_id, gint64 t0, gint64 t1, gint64 t2);
+int latency_add_frame(latency_t *latency, uint32_t viewer_id, gint64 capture_time, gint64 present_time);
+void latency_print_histogram(latency_t *latency, FILE *f);
+#endif
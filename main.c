@@ -12,6 +12,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <signal.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include "shareit.h"
@@ -21,8 +22,13 @@
 #include "framebuffer.h"
 #include "packet.h"
 #include "password.h"
+#include "jpeg.h"
+#include "scale.h"
+#include "convert.h"
 
 static gboolean stop_screen_share(shareit_app_t *app);
+static void app_connection_lost(shareit_app_t *app);
+static gboolean screen_share_writable(GIOChannel *source, GIOCondition condition, shareit_app_t *app);
 
 static shareit_app_t *setup() {
     shareit_app_t *app;
@@ -32,6 +38,7 @@ static shareit_app_t *setup() {
     if (app == NULL) {
         return NULL;
     }
+    app->viewer_id = g_random_int();
 
     return app;
 }
@@ -69,47 +76,215 @@ void show_error(shareit_app_t *app, const char *fmt, ...) {
     }
 }
 
-static gboolean screen_share_timer(shareit_app_t *app) {
+/**
+ * send cursor shape to server, either as a reference to a shape already sent or as an image
+ *
+ * @param app     the main application
+ * @param serial  serial of the current cursor
+ * @return 0 on success, -1 on error
+ */
+static int screen_share_cursor_shape(shareit_app_t *app, uint32_t serial) {
+    cursor_shape_t shape;
     int ret;
-    uint32_t *tmp;
 
-    if (app->share_screen != TRUE) {
-        return FALSE;
+    if (cursor_cache_find(&app->cursors, serial) != NULL) {
+        memset(&shape, 0, sizeof(shape));
+        shape.serial = serial;
+        ret = pkt_send_cursor_shape(app->conn->socket, &shape);
+    } else {
+        if (grab_cursor_image(app->grabber, &shape) != 0) {
+            // Not fatal, we'll just have to do without a cursor image
+            return 0;
+        }
+        ret = pkt_send_cursor_shape(app->conn->socket, &shape);
+
+        // We only need to remember that the image has been sent
+        free(shape.pixels);
+        shape.pixels = NULL;
+        cursor_cache_add(&app->cursors, &shape);
     }
 
+    if (ret != 0) {
+        return -1;
+    }
+    app->cursor_serial = shape.serial;
+    app->has_cursor_serial = TRUE;
+    return 0;
+}
+
+/**
+ * send checksums of the screen as it has been sent, so that viewers can ask for the
+ * parts where they differ, e.g. if they've missed an update
+ *
+ * @param app  the main application
+ * @return 0 on success, -1 on error
+ */
+static int screen_share_checksums(shareit_app_t *app) {
+    uint32_t *checksums;
+    int n_bands, ret = 0;
+
+    checksums = malloc(app->tiles_y * sizeof(uint32_t));
+    if (checksums == NULL) {
+        return 0;
+    }
+
+    n_bands = screen_checksums(app, checksums);
+    if (n_bands > 0) {
+        ret = pkt_send_screen_checksums(app->conn->socket, app->width, app->height,
+                                        app->block_size > 0 ? app->block_size : BLOCK_SIZE_DEFAULT,
+                                        checksums, n_bands);
+    }
+    free(checksums);
+    return ret;
+}
+
+/**
+ * report that something could not be sent while sharing
+ *
+ * @param app   the main application
+ * @param what  what could not be sent
+ * @return -2 if the session can be resumed after reconnecting, -1 otherwise
+ */
+static int screen_share_send_error(shareit_app_t *app, const char *what) {
+    if (app->resume_token != NULL) {
+        fprintf(stderr, "could not send %s to server: %s\n", what, strerror(errno));
+        return -2;
+    }
+    show_error(app, "could not send %s to server", what);
+    return -1;
+}
+
+/**
+ * compare a part of the screen with the previous frame as soon as it has been grabbed,
+ * called by the grabber, possibly from another thread
+ *
+ * @param frame   the grabbed frame
+ * @param stream  index of the part in app->streams
+ * @param y       first row that has been grabbed
+ * @param height  number of rows that have been grabbed
+ */
+static void screen_share_stream_grabbed(grab_frame_t *frame, int stream, int y, int height) {
+    shareit_app_t *app = frame->data;
+
+    if (stream < app->n_streams) {
+        compare_stream(app, stream, y, height);
+    }
+}
+
+/**
+ * capture, encode and send one frame
+ *
+ * @param[in]  app       the main application
+ * @param[out] activity  set to TRUE if the screen changed or the cursor moved
+ * @return 0 on success, -1 if screen sharing has to be stopped, -2 if the connection was lost
+ */
+static int screen_share_frame(shareit_app_t *app, gboolean *activity) {
+    int ret;
+    uint32_t *tmp;
+    gboolean queued = FALSE;
+
     int mx, my;
     grab_cursor_position(app->grabber, &mx, &my);
-    if (mx != -1 && my != -1 && mx != app->mouse_pos_x && my != app->mouse_pos_y) {
+    if (mx != -1 && my != -1 && app->width != app->capture_width) {
+        mx = mx * app->width / app->capture_width;
+        my = my * app->height / app->capture_height;
+    }
+    if (mx != -1 && my != -1 && (mx != app->mouse_pos_x || my != app->mouse_pos_y)) {
         if (pkt_send_cursorinfo(app->conn->socket, mx, my, 0) != 0) {
-            show_error(app, "could not send cursor info to server");
-            gdk_threads_add_idle(G_SOURCE_FUNC(stop_screen_share), app);
-            return FALSE;
+            return screen_share_send_error(app, "cursor info");
         }
         app->mouse_pos_x = mx;
         app->mouse_pos_y = my;
+        *activity = TRUE;
+    }
+
+    // The cursor is drawn by the viewer, so it's only sent when its shape changes
+    uint32_t serial;
+    if (grab_cursor_serial(app->grabber, &serial) == 0 &&
+        (!app->has_cursor_serial || serial != app->cursor_serial)) {
+        if (screen_share_cursor_shape(app, serial) != 0) {
+            return screen_share_send_error(app, "cursor shape");
+        }
+        *activity = TRUE;
     }
 
     if (app->current_screen == NULL) {
-        app->current_screen = malloc(sizeof(uint32_t) * app->width * app->height);
+        app->current_screen = malloc(sizeof(uint32_t) * screen_size(app));
         if (app->current_screen == NULL) {
             fprintf(stderr, "could not allocate screen memory: %s\n", strerror(errno));
             return -1;
         }
     }
 
-    ret = grab_window(app->grabber, (uint8_t *)app->current_screen);
+    // When downscaling, the screen is grabbed to a separate buffer and scaled when it's
+    // copied to current_screen. Otherwise the grabber writes current_screen in its layout
+    gboolean scaled = app->width != app->capture_width || app->height != app->capture_height;
+    grab_frame_t frame = { app->current_screen, app->capture_width, app->capture_height, screen_tile_size(app) };
+    if (scaled && app->capture_screen == NULL) {
+        app->capture_screen = malloc(sizeof(uint32_t) * app->capture_width * app->capture_height);
+        if (app->capture_screen == NULL) {
+            fprintf(stderr, "could not allocate screen memory: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    gint64 capture_time = g_get_monotonic_time();
+    gint64 start = stats_begin(app->stats);
+    if (scaled) {
+        frame.pixels = app->capture_screen;
+        frame.tile_size = 0;
+    } else if (compare_prepare(app) == 0) {
+        // Each part of the screen is compared as soon as it's grabbed, in parallel with
+        // the rest of the screen being grabbed
+        frame.ready = screen_share_stream_grabbed;
+        frame.data = app;
+    }
+    ret = grab_window(app->grabber, &frame);
     if (ret != 0) {
         fprintf(stderr, "could not read window data\n");
-        return -1;
+        stats_add_dropped_frame(app->stats);
+        return 0;
+    }
+    if (scaled) {
+        scale_screen(app->capture_screen, app->capture_width, app->capture_height,
+                     app->current_screen, app->width, app->height, screen_tile_size(app));
     }
+    stats_end(app->stats, stats_stage_capture, start);
 
     framebuffer_update_t *update;
     if (compare_screens(app, &update)) {
-        if (pkt_send_framebuffer_update(app->conn->socket, update) == -1) {
-            show_error(app, "could not send block data to server");
-            gdk_threads_add_idle(G_SOURCE_FUNC(stop_screen_share), app);
-            return FALSE;
+        *activity = TRUE;
+        if (app->latency != NULL &&
+            pkt_send_frame_timestamp(app->conn->socket, app->latency->next_frame_id++, capture_time) != 0) {
+            ret = screen_share_send_error(app, "frame timestamp");
+            free_framebuffer_update(update);
+            return ret;
+        }
+
+        // What the socket can't take right away is sent by screen_share_timer() when it's
+        // writable, so that a slow link doesn't block the UI
+        start = stats_begin(app->stats);
+        ret = pkt_queue_framebuffer_update(app->conn->socket, update);
+        if (ret < 0) {
+            ret = screen_share_send_error(app, "block data");
+            free_framebuffer_update(update);
+            return ret;
         }
+        queued = ret == 1;
+        if (app->stats != NULL) {
+            stats_end(app->stats, stats_stage_send, start);
+            stats_add_bytes_sent(app->stats, framebuffer_update_wire_size(update));
+            stats_add_frame(app->stats);
+        }
+        free_framebuffer_update(update);
+    }
+
+    // Checksums would have to wait for the queued update, they're sent with a later frame instead
+    if (!queued && g_get_monotonic_time() - app->checksum_time >= SCREEN_CHECKSUM_INTERVAL_MS * 1000) {
+        if (screen_share_checksums(app) != 0) {
+            return screen_share_send_error(app, "screen checksums");
+        }
+        app->checksum_time = g_get_monotonic_time();
     }
 
     // Switch prev and current buffers, so that we don't have to allocate
@@ -117,34 +292,175 @@ static gboolean screen_share_timer(shareit_app_t *app) {
     tmp = app->prev_screen;
     app->prev_screen = app->current_screen;
     app->current_screen = tmp;
-    return TRUE;
+    return 0;
+}
+
+static gboolean screen_share_timer(shareit_app_t *app) {
+    gboolean activity = FALSE;
+    gint64 start = g_get_monotonic_time();
+    int interval, ret;
+
+    // We're a one-shot timer, the next one is scheduled below
+    app->scheduler.timer = 0;
+
+    if (app->share_screen != TRUE) {
+        return FALSE;
+    }
+
+    if (app->reconnecting) {
+        // Keep prev_screen as the viewers last saw it, so that only what has changed
+        // is sent when the session has been resumed
+        app->scheduler.timer = gdk_threads_add_timeout(1000 / app->scheduler.min_fps,
+                               G_SOURCE_FUNC(screen_share_timer), app);
+        return FALSE;
+    }
+
+    ret = pkt_send_queued(app->conn->socket);
+    if (ret < 0) {
+        ret = screen_share_send_error(app, "block data");
+    } else if (ret == 1 || (app->conn->latency_mode && !net_writable(app->conn))) {
+        // A frame captured now would have to wait behind the data that's queued, and be
+        // stale when it's sent. Capture the next one as soon as the queue has drained instead
+        stats_add_dropped_frame(app->stats);
+        app->scheduler.timer = g_io_add_watch(app->channel, G_IO_OUT | G_IO_HUP | G_IO_ERR,
+                                              (GIOFunc)screen_share_writable, app);
+        return FALSE;
+    } else {
+        ret = screen_share_frame(app, &activity);
+    }
+    if (ret != 0) {
+        if (ret == -2) {
+            app_connection_lost(app);
+            app->scheduler.timer = gdk_threads_add_timeout(1000 / app->scheduler.min_fps,
+                                   G_SOURCE_FUNC(screen_share_timer), app);
+        } else {
+            gdk_threads_add_idle(G_SOURCE_FUNC(stop_screen_share), app);
+        }
+        return FALSE;
+    }
+
+    if (app->conn->latency_mode &&
+        g_get_monotonic_time() - app->send_buffer_time >= NET_SEND_BUFFER_UPDATE_INTERVAL_MS * 1000) {
+        net_update_send_buffer(app->conn);
+        app->send_buffer_time = g_get_monotonic_time();
+    }
+
+    interval = scheduler_next_interval(&app->scheduler, activity, g_get_monotonic_time() - start,
+                                       net_unsent_bytes(app->conn));
+    app->scheduler.timer = gdk_threads_add_timeout(interval, G_SOURCE_FUNC(screen_share_timer), app);
+    return FALSE;
+}
+
+static gboolean screen_share_writable(GIOChannel *source, GIOCondition condition, shareit_app_t *app) {
+    // This watch is removed when we return, the timer schedules the next frame
+    app->scheduler.timer = 0;
+    return screen_share_timer(app);
+}
+
+static gboolean latency_ping_timer(shareit_app_t *app) {
+    if (app->reconnecting) {
+        return G_SOURCE_CONTINUE;
+    }
+    if (pkt_send_clock_ping(app->conn->socket, g_get_monotonic_time()) != 0) {
+        fprintf(stderr, "could not send clock ping\n");
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean latency_report_timer(shareit_app_t *app) {
+    latency_print_histogram(app->latency, stdout);
+    return G_SOURCE_CONTINUE;
+}
+
+static void latency_start(shareit_app_t *app) {
+    if (app->latency == NULL) {
+        return;
+    }
+
+    if (!app->latency->shared_clock) {
+        // Get a first clock sample right away instead of waiting for the timer
+        latency_ping_timer(app);
+        app->latency->ping_timer = g_timeout_add(LATENCY_PING_INTERVAL_MS,
+                                   G_SOURCE_FUNC(latency_ping_timer), app);
+    }
+    app->latency->report_timer = g_timeout_add(LATENCY_REPORT_INTERVAL_MS,
+                                 G_SOURCE_FUNC(latency_report_timer), app);
+}
+
+static void latency_stop(shareit_app_t *app) {
+    if (app->latency == NULL) {
+        return;
+    }
+
+    if (app->latency->ping_timer != 0) {
+        g_source_remove(app->latency->ping_timer);
+        app->latency->ping_timer = 0;
+    }
+    if (app->latency->report_timer != 0) {
+        g_source_remove(app->latency->report_timer);
+        app->latency->report_timer = 0;
+    }
+    latency_print_histogram(app->latency, stdout);
 }
 
 static gboolean stop_screen_share(shareit_app_t *app) {
     app->share_screen = FALSE;
     gtk_button_set_label(GTK_BUTTON(app->btn_sharescreen), "Share screen");
+    latency_stop(app);
+
+    if (app->scheduler.timer != 0) {
+        g_source_remove(app->scheduler.timer);
+        app->scheduler.timer = 0;
+    }
 
     grab_shutdown(app->grabber);
     app->grabber = NULL;
 
     free(app->current_screen);
     free(app->prev_screen);
+    free(app->capture_screen);
     app->current_screen = NULL;
     app->prev_screen = NULL;
+    app->capture_screen = NULL;
+    free_tile_state(app);
+    tile_cache_free(app->tile_cache);
+    app->tile_cache = NULL;
 
     app->mouse_pos_x = 0;
     app->mouse_pos_y = 0;
+    cursor_cache_clear(&app->cursors);
+    app->has_cursor_serial = FALSE;
     return FALSE;
 }
 
+/**
+ * switch the connection to latency mode if asked for on the command line, only done
+ * when sharing since the viewers hardly send anything
+ *
+ * @param app  the main application
+ */
+static void app_set_latency_mode(shareit_app_t *app) {
+    if (!app->latency_mode || app->conn->latency_mode) {
+        return;
+    }
+    if (net_set_latency_mode(app->conn) != 0) {
+        fprintf(stderr, "could not set latency mode: %s\n", strerror(errno));
+    }
+    app->send_buffer_time = g_get_monotonic_time();
+}
+
 static gboolean dlg_share_ok_clicked_cb(GtkWidget *widget, shareit_app_t *app) {
     gboolean visible, public;
     gtk_widget_hide(app->dlg_share_options);
+    if (app->conn == NULL) {
+        show_error(app, "not connected to a server");
+        return FALSE;
+    }
     visible = gtk_toggle_button_get_active(app->dlg_share_visible_checkbox);
     public = gtk_toggle_button_get_active(app->dlg_share_public_checkbox);
 
     void *grabber;
-    grabber = grab_initialize();
+    grabber = grab_initialize(app->grab_backend, &app->share_region);
     if (grabber == NULL) {
         gtk_message_dialog_new(GTK_WINDOW(app->window), GTK_DIALOG_MODAL,
                                GTK_MESSAGE_ERROR, GTK_BUTTONS_OK,
@@ -153,21 +469,37 @@ static gboolean dlg_share_ok_clicked_cb(GtkWidget *widget, shareit_app_t *app) {
     }
 
     app->grabber = grabber;
-    if (grab_window_size(app->grabber, &app->width, &app->height) != 0) {
+    if (grab_window_size(app->grabber, &app->capture_width, &app->capture_height) != 0) {
         show_error(app, "could not read window size");
         grab_shutdown(app->grabber);
         return FALSE;
     }
+    // Each monitor is grabbed and compared by itself, otherwise the screen is one stream
+    app->n_streams = grab_streams(app->grabber, app->streams, GRAB_MAX_OUTPUTS);
+    if (app->n_streams == 0) {
+        app->streams[0] = (grab_output_t) { .width = app->capture_width, .height = app->capture_height };
+        app->n_streams = 1;
+    }
+
+    // The viewers may already have told us what size they want
+    app_choose_display_size(app, &app->width, &app->height);
 
-    if (pkt_send_session_screenshare_request(app->conn->socket, app->width, app->height) == -1) {
+    if (pkt_send_session_screenshare_request(app->conn->socket, app->width, app->height) == -1 ||
+        app_send_screen_layout(app) != 0) {
         show_error(app, "could not send screeninfo to server");
         grab_shutdown(app->grabber);
         return FALSE;
     }
 
+    // Viewers start out with an empty tile cache when they get the screenshare request
+    app->tile_cache = tile_cache_new(TRUE);
+
     app->share_screen = TRUE;
     gtk_button_set_label(GTK_BUTTON(app->btn_sharescreen), "Stop sharing screen");
-    gdk_threads_add_timeout(100, G_SOURCE_FUNC(screen_share_timer), app);
+    app_set_latency_mode(app);
+    latency_start(app);
+    scheduler_reset(&app->scheduler);
+    app->scheduler.timer = gdk_threads_add_timeout(app->scheduler.interval_ms, G_SOURCE_FUNC(screen_share_timer), app);
     return FALSE;
 }
 
@@ -206,6 +538,10 @@ static gboolean btn_viewscreen_clicked_cb(GtkWidget *widget, shareit_app_t *app)
 
 static gboolean dlg_select_session_connect_clicked_cb(GtkWidget *widget, shareit_app_t *app) {
     int ret;
+    if (app->conn == NULL) {
+        show_error(app, "not connected to a server");
+        return FALSE;
+    }
     ret = pkt_send_session_join_request(app->conn->socket,
                                         gtk_entry_get_text(app->dlg_select_session_entry),
                                         "");
@@ -224,25 +560,205 @@ static gboolean dlg_select_session_cancel_clicked_cb(GtkWidget *widget, shareit_
 }
 
 static gboolean data_available(GIOChannel *source, GIOCondition condition, shareit_app_t *app);
-static gboolean app_setup_connection(shareit_app_t *app) {
-    // Setup connection
-    char *err;
-    app->conn = net_connect(app->host, &err);
-    if (app->conn == NULL) {
-        show_error(app, "cannot connect to %s: %s", app->host, err);
-        return FALSE;
+static void app_schedule_reconnect(shareit_app_t *app);
+
+static void app_connect_progress(const char *message, shareit_app_t *app) {
+    printf("%s\n", message);
+    if (!app->reconnecting) {
+        gtk_label_set_text(app->dlg_connect_status, message);
     }
+}
+
+/**
+ * keep the user from starting another connection while one is being set up
+ *
+ * @param app   the main application
+ * @param busy  TRUE while connecting
+ */
+static void dlg_connect_set_busy(shareit_app_t *app, gboolean busy) {
+    gtk_widget_set_sensitive(app->dlg_connect_connect, !busy);
+    gtk_widget_set_sensitive(GTK_WIDGET(app->dlg_connect_server_dropdown), !busy);
+    if (!busy) {
+        gtk_label_set_text(app->dlg_connect_status, "");
+    }
+}
+
+/**
+ * start reading packets from a new connection
+ *
+ * @param app   the main application
+ * @param conn  connection to use
+ */
+static void app_connection_setup(shareit_app_t *app, connection_t *conn) {
+    app->conn = conn;
 
+    if (app->channel_watch != 0) {
+        g_source_remove(app->channel_watch);
+        app->channel_watch = 0;
+    }
     if (app->channel != NULL) {
         g_io_channel_shutdown(app->channel, TRUE, NULL);
+        g_io_channel_unref(app->channel);
     }
 
     app->channel = g_io_channel_unix_new(app->conn->socket);
     g_io_channel_set_encoding(app->channel, NULL, NULL);
     g_io_channel_set_buffered(app->channel, FALSE);
-    g_io_add_watch(app->channel, G_IO_IN | G_IO_HUP | G_IO_ERR, (GIOFunc)data_available, app);
+    app->channel_watch = g_io_add_watch(app->channel, G_IO_IN | G_IO_HUP | G_IO_ERR, (GIOFunc)data_available, app);
 
-    return TRUE;
+    // Reconnected while sharing
+    if (app->share_screen) {
+        app_set_latency_mode(app);
+    }
+}
+
+/**
+ * leave the session for good, e.g. when it can't be resumed
+ *
+ * @param app     the main application
+ * @param reason  error to show to the user
+ */
+void end_session(shareit_app_t *app, const char *reason) {
+    free(app->resume_token);
+    app->resume_token = NULL;
+    app->reconnecting = FALSE;
+    app->reconnect_attempts = 0;
+
+    if (app->share_screen) {
+        stop_screen_share(app);
+    }
+    show_error(app, "%s", reason);
+    if (app->conn == NULL) {
+        gtk_widget_show_all(app->dlg_connect);
+    }
+}
+
+/**
+ * handle a dropped connection
+ *
+ * If the server has given us a resume token we reconnect in the background. The
+ * sharer keeps its screen buffers and holds back frames in the meantime, and the
+ * viewer keeps its framebuffer, so only what changed has to be sent once the
+ * session has been resumed.
+ *
+ * @param app  the main application
+ */
+static void app_connection_lost(shareit_app_t *app) {
+    if (app->conn == NULL) {
+        return;
+    }
+
+    if (app->channel_watch != 0) {
+        g_source_remove(app->channel_watch);
+        app->channel_watch = 0;
+    }
+    if (app->scheduler.timer != 0) {
+        // The sharer may be waiting for the socket to become writable
+        g_source_remove(app->scheduler.timer);
+        app->scheduler.timer = gdk_threads_add_timeout(app->scheduler.interval_ms,
+                               G_SOURCE_FUNC(screen_share_timer), app);
+    }
+    if (app->channel != NULL) {
+        g_io_channel_unref(app->channel);
+        app->channel = NULL;
+    }
+    pkt_queue_clear(app->conn->socket);
+    net_disconnect(app->conn);
+    free(app->conn);
+    app->conn = NULL;
+
+    if (app->resume_token == NULL) {
+        end_session(app, "connection to server lost");
+        return;
+    }
+
+    printf("connection to server lost, reconnecting\n");
+    if (!app->reconnecting) {
+        app->reconnecting = TRUE;
+        app->reconnect_attempts = 0;
+    }
+    app_schedule_reconnect(app);
+}
+
+static void app_reconnect_done(connection_t *conn, const char *error, shareit_app_t *app) {
+    app->connecting = NULL;
+    if (conn == NULL) {
+        printf("could not reconnect to %s: %s\n", app->host, error);
+        app_schedule_reconnect(app);
+        return;
+    }
+
+    app_connection_setup(app, conn);
+
+    // We're back once the server answers with SESSION_JOIN_RESUMED
+    if (pkt_send_session_resume_request(app->conn->socket, app->resume_token) != 0) {
+        app_connection_lost(app);
+    }
+}
+
+static gboolean app_reconnect_timer(shareit_app_t *app) {
+    app->reconnect_timer = 0;
+    app->connecting = net_connect_async(app->host, (net_progress_cb)app_connect_progress,
+                                        (net_connected_cb)app_reconnect_done, app);
+    if (app->connecting == NULL) {
+        app_schedule_reconnect(app);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void app_schedule_reconnect(shareit_app_t *app) {
+    int delay;
+
+    if (app->reconnect_attempts >= NET_RECONNECT_MAX_ATTEMPTS) {
+        end_session(app, "could not reconnect to server");
+        return;
+    }
+
+    delay = net_reconnect_delay(app->reconnect_attempts++);
+    app->reconnect_timer = g_timeout_add(delay, G_SOURCE_FUNC(app_reconnect_timer), app);
+}
+
+static void app_connect_done(connection_t *conn, const char *error, shareit_app_t *app) {
+    app->connecting = NULL;
+    dlg_connect_set_busy(app, FALSE);
+    if (conn == NULL) {
+        show_error(app, "cannot connect to %s: %s", app->host, error);
+        gtk_widget_show_all(app->dlg_connect);
+        return;
+    }
+
+    app_connection_setup(app, conn);
+    gtk_widget_hide(app->dlg_connect);
+}
+
+/**
+ * start connecting to app->host, app_connect_done() is called when done
+ *
+ * @param app  application to connect
+ */
+static void app_setup_connection(shareit_app_t *app) {
+    // Only the latest attempt counts
+    if (app->connecting != NULL) {
+        net_connect_async_cancel(app->connecting);
+    }
+    if (app->reconnect_timer != 0) {
+        g_source_remove(app->reconnect_timer);
+        app->reconnect_timer = 0;
+    }
+
+    // A new connection starts a new session
+    free(app->resume_token);
+    app->resume_token = NULL;
+    app->reconnecting = FALSE;
+
+    dlg_connect_set_busy(app, TRUE);
+    app->connecting = net_connect_async(app->host, (net_progress_cb)app_connect_progress,
+                                        (net_connected_cb)app_connect_done, app);
+    if (app->connecting == NULL) {
+        dlg_connect_set_busy(app, FALSE);
+        show_error(app, "cannot connect to %s: %s", app->host, strerror(errno));
+        gtk_widget_show_all(app->dlg_connect);
+    }
 }
 
 static gboolean dlg_connect_connect_clicked_cb(GtkWidget *widget, shareit_app_t *app) {
@@ -252,9 +768,7 @@ static gboolean dlg_connect_connect_clicked_cb(GtkWidget *widget, shareit_app_t
     name = gtk_combo_box_text_get_active_text(app->dlg_connect_server_dropdown);
     app->host = strdup(name);
 
-    if (app_setup_connection(app) == TRUE) {
-        gtk_widget_hide(app->dlg_connect);
-    }
+    app_setup_connection(app);
     return FALSE;
 }
 
@@ -263,39 +777,94 @@ static gboolean dlg_connect_cancel_clicked_cb(GtkWidget *widget, shareit_app_t *
     return FALSE;
 }
 
+/**
+ * give up on a connection that can't be read anymore, from data_available()
+ *
+ * @param app  the main application
+ * @return FALSE, to remove the watch
+ */
+static gboolean data_connection_lost(shareit_app_t *app) {
+    // The watch is removed when we return, so app_connection_lost() mustn't remove it as well
+    app->channel_watch = 0;
+    app_connection_lost(app);
+    return FALSE;
+}
+
 static gboolean data_available(GIOChannel *source, GIOCondition condition, shareit_app_t *app) {
     size_t nb;
     if (condition & G_IO_ERR) {
         printf("error!\n");
-        return FALSE;
+        return data_connection_lost(app);
     }
 
     uint8_t type;
+    int ret = 0;
     nb = recv(app->conn->socket, &type, sizeof(type), 0);
     if (nb != sizeof(type)) {
-        printf("could not read type: %s\n", strerror(errno));
-        return FALSE;
+        printf("could not read type: %s\n", nb == 0 ? "connection closed" : strerror(errno));
+        return data_connection_lost(app);
     }
 
     switch (type) {
     case packet_type_session_join_response:
         printf("join response!\n");
-        app_handle_join_response(app);
+        ret = app_handle_join_response(app);
+        break;
+    case packet_type_session_token:
+        ret = app_handle_session_token(app);
         break;
     case packet_type_cursor_info:
-        app_handle_cursor_info(app);
+        ret = app_handle_cursor_info(app);
         break;
     case packet_type_session_screenshare_start:
-        app_handle_screenshare_start(app);
+        ret = app_handle_screenshare_start(app);
         break;
     case packet_type_framebuffer_update:
-        app_handle_framebuffer_update(app);
+        ret = app_handle_framebuffer_update(app);
+        break;
+    case packet_type_frame_timestamp:
+        ret = app_handle_frame_timestamp(app);
+        break;
+    case packet_type_frame_presented:
+        ret = app_handle_frame_presented(app);
+        break;
+    case packet_type_clock_ping:
+        ret = app_handle_clock_ping(app);
+        break;
+    case packet_type_clock_pong:
+        ret = app_handle_clock_pong(app);
+        break;
+    case packet_type_cursor_shape:
+        ret = app_handle_cursor_shape(app);
+        break;
+    case packet_type_tile_cache_reset:
+        ret = app_handle_tile_cache_reset(app);
+        break;
+    case packet_type_pixel_format_request:
+        ret = app_handle_pixel_format_request(app);
+        break;
+    case packet_type_display_size_request:
+        ret = app_handle_display_size_request(app);
+        break;
+    case packet_type_refresh_request:
+        ret = app_handle_refresh_request(app);
+        break;
+    case packet_type_screen_checksums:
+        ret = app_handle_screen_checksums(app);
+        break;
+    case packet_type_screen_layout:
+        ret = app_handle_screen_layout(app);
         break;
     default:
+        // We don't know how long the packet is, so the rest of the stream can't be read
         printf("unknown packet type: %d!\n", type);
-        return FALSE;
+        return data_connection_lost(app);
     }
 
+    if (ret == -2) {
+        // The rest of the stream can't be read
+        return data_connection_lost(app);
+    }
     return TRUE;
 }
 
@@ -339,21 +908,53 @@ static void activate_builder (GtkApplication *gtk_application, shareit_app_t *ap
     BUILDER_GET(app->dlg_select_session_entry, GTK_ENTRY, "dlg_select_session_entry");
     BUILDER_GET(app->dlg_connect, GTK_WIDGET, "dlg_connect");
     BUILDER_GET(app->dlg_connect_server_dropdown, GTK_COMBO_BOX_TEXT, "dlg_connect_server_dropdown");
+    BUILDER_GET(app->dlg_connect_connect, GTK_WIDGET, "dlg_connect_connect");
+    BUILDER_GET(app->dlg_connect_status, GTK_LABEL, "dlg_connect_status");
 
     app->screen_share_window = viewer_initialize(app);
     if (app->screen_share_window == NULL) {
         fprintf(stderr, "Could not initialize viewer window");
     }
 
-    // Show the connect dialog at start unless we've already been called with a hostname
-    gboolean skip_connect_dialog = FALSE;
+    // Show the connect dialog at start unless we've already been called with a hostname,
+    // it's shown later if that connection fails
     if (app->host != NULL) {
-        skip_connect_dialog = app_setup_connection(app);
+        app_setup_connection(app);
+    } else {
+        gtk_widget_show_all(app->dlg_connect);
     }
+}
 
-    if (!skip_connect_dialog) {
-        gtk_widget_show_all(app->dlg_connect);
+/**
+ * print the monitors that can be shared
+ *
+ * @param grab_backend  screen grabber and its options, NULL for the default
+ * @param argc  pointer to argc, as given to gtk_init()
+ * @param argv  pointer to argv, as given to gtk_init()
+ * @return exit status
+ */
+static int list_outputs(const char *grab_backend, int *argc, char ***argv) {
+    grab_output_t outputs[GRAB_MAX_OUTPUTS];
+    void *grabber;
+    int i, n;
+
+    gtk_init(argc, argv);
+    grabber = grab_initialize(grab_backend, NULL);
+    if (grabber == NULL) {
+        fprintf(stderr, "could not initialize screen grabber\n");
+        return 1;
+    }
+
+    n = grab_list_outputs(grabber, outputs, GRAB_MAX_OUTPUTS);
+    for (i = 0; i < n; i++) {
+        printf("%d: %s %dx%d+%d+%d\n", i, outputs[i].name,
+               outputs[i].width, outputs[i].height, outputs[i].x, outputs[i].y);
+    }
+    if (n == 0) {
+        printf("no monitors found\n");
     }
+    grab_shutdown(grabber);
+    return 0;
 }
 
 int main(int argc, char **argv) {
@@ -361,25 +962,182 @@ int main(int argc, char **argv) {
     shareit_app_t *app;
     int status;
     int opt;
+    int err;
     char *hostname = NULL;
+    gboolean stats_log = FALSE;
+    char *stats_csv = NULL;
+    gboolean measure_latency = FALSE;
+    gboolean shared_clock = FALSE;
+    int min_fps = SCHEDULER_DEFAULT_MIN_FPS;
+    int max_fps = SCHEDULER_DEFAULT_MAX_FPS;
+    int cpu_budget = SCHEDULER_DEFAULT_CPU_BUDGET;
+    int jpeg_quality = JPEG_DEFAULT_QUALITY;
+    int block_size = BLOCK_SIZE_DEFAULT;
+    int min_block_size = BLOCK_SIZE_MIN;
+    int pixel_format = pixel_format_rgb888;
+    grab_region_t share_region = { 0 };
+    const char *grab_backend = NULL;
+    gboolean tiled_screen = FALSE;
+    gboolean latency_mode = FALSE;
+    char *end;
 
-    while ((opt = getopt(argc, argv, "h:")) != -1) {
+    while ((opt = getopt(argc, argv, "h:sS:lLNr:c:q:b:p:TR:W:O:G:")) != -1) {
         switch (opt) {
         case 'h':
             hostname = strdup(optarg);
             break;
+        case 's':
+            stats_log = TRUE;
+            break;
+        case 'S':
+            stats_csv = optarg;
+            break;
+        case 'l':
+            measure_latency = TRUE;
+            break;
+        case 'L':
+            measure_latency = TRUE;
+            shared_clock = TRUE;
+            break;
+        case 'N':
+            latency_mode = TRUE;
+            break;
+        case 'r':
+            if (sscanf(optarg, "%d:%d", &min_fps, &max_fps) != 2 || min_fps < 1 || max_fps < min_fps) {
+                fprintf(stderr, "invalid capture rate '%s', expected min:max\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            cpu_budget = atoi(optarg);
+            if (cpu_budget < 1 || cpu_budget > 100) {
+                fprintf(stderr, "invalid cpu budget '%s', expected 1-100\n", optarg);
+                return 1;
+            }
+            break;
+        case 'q':
+            jpeg_quality = atoi(optarg);
+            if (jpeg_quality < 0 || jpeg_quality > 100) {
+                fprintf(stderr, "invalid jpeg quality '%s', expected 0-100\n", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            if (sscanf(optarg, "%d:%d", &block_size, &min_block_size) < 1 ||
+                block_size < BLOCK_SIZE_MIN || block_size > BLOCK_SIZE_MAX || block_size % BLOCK_SIZE_MIN != 0 ||
+                min_block_size < 0 || min_block_size > block_size || min_block_size % BLOCK_SIZE_MIN != 0) {
+                fprintf(stderr, "invalid block size '%s', expected size[:min] in multiples of %d up to %d\n",
+                        optarg, BLOCK_SIZE_MIN, BLOCK_SIZE_MAX);
+                return 1;
+            }
+            break;
+        case 'p':
+            pixel_format = pixfmt_parse(optarg);
+            if (pixel_format == -1) {
+                fprintf(stderr, "invalid pixel format '%s', expected rgb888, rgb565, rgb332 or grey8\n", optarg);
+                return 1;
+            }
+            break;
+        case 'T':
+            tiled_screen = TRUE;
+            break;
+        case 'R':
+            if (sscanf(optarg, "%dx%d+%d+%d", &share_region.width, &share_region.height,
+                       &share_region.x, &share_region.y) != 4 ||
+                share_region.width < 1 || share_region.height < 1 || share_region.x < 0 || share_region.y < 0) {
+                fprintf(stderr, "invalid region '%s', expected WIDTHxHEIGHT+X+Y\n", optarg);
+                return 1;
+            }
+            break;
+        case 'O':
+            share_region.output = optarg;
+            break;
+        case 'W':
+            share_region.window = strtoul(optarg, &end, 0);
+            if (*optarg == '\0' || *end != '\0' || share_region.window == 0) {
+                fprintf(stderr, "invalid window id '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'G':
+            grab_backend = optarg;
+            break;
         default:
-            fprintf(stderr, "Usage: %s [-h hostname]\n", argv[0]);
+            fprintf(stderr, "Usage: %s [-h hostname] [-s] [-S stats.csv] [-l | -L] [-N] [-r min:max] [-c cpu%%] [-q quality] [-b size[:min]] [-p format] [-T]\n"
+                    "       [-R WIDTHxHEIGHT+X+Y | -W window | -O monitor] [-G grabber[:options]]\n", argv[0]);
+            fprintf(stderr, "  -s  log pipeline statistics every second\n");
+            fprintf(stderr, "  -S  write pipeline statistics to CSV file every second\n");
+            fprintf(stderr, "  -l  measure capture to present latency when sharing\n");
+            fprintf(stderr, "  -L  like -l, but viewers run on this host and share our clock\n");
+            fprintf(stderr, "  -N  keep the socket send queue short when sharing, so that frames are never stale when sent\n");
+            fprintf(stderr, "  -r  min and max capture rate in fps (default %d:%d)\n",
+                    SCHEDULER_DEFAULT_MIN_FPS, SCHEDULER_DEFAULT_MAX_FPS);
+            fprintf(stderr, "  -c  max percentage of CPU time to spend on capturing (default %d)\n",
+                    SCHEDULER_DEFAULT_CPU_BUDGET);
+            fprintf(stderr, "  -q  jpeg quality for video and photos, 0 to disable lossy encoding (default %d)\n",
+                    JPEG_DEFAULT_QUALITY);
+            fprintf(stderr, "  -b  size of the blocks the screen is compared in, and the smallest size changed\n"
+                            "      blocks are split into, 0 to not split them (default %d:%d)\n",
+                    BLOCK_SIZE_DEFAULT, BLOCK_SIZE_MIN);
+            fprintf(stderr, "  -p  pixel format to send when sharing, or to ask for when viewing:\n"
+                            "      rgb888 (default), rgb565, rgb332 or grey8\n");
+            fprintf(stderr, "  -T  store the screen one block at a time, instead of row by row\n");
+            fprintf(stderr, "  -R  share only this part of the screen\n");
+            fprintf(stderr, "  -W  share only this window, e.g. 0x3a00007 as shown by xwininfo\n");
+            fprintf(stderr, "  -O  share only this monitor, by name or number, 'list' to show the monitors\n");
+            fprintf(stderr, "  -G  screen grabber to share with, and its options:\n");
+            grab_print_backends(stderr);
             return 1;
         }
     }
 
+    convert_init(convert_level_avx2);
+
+    // A dropped connection should make send() fail so that we can reconnect, not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    if (share_region.output != NULL && strcmp(share_region.output, "list") == 0) {
+        return list_outputs(grab_backend, &argc, &argv);
+    }
+
     app = setup();
     if (app == NULL) {
         fprintf(stderr, "cannot setup application\n");
         return -1;
     }
 
+    scheduler_init(&app->scheduler, min_fps, max_fps, cpu_budget);
+    app->jpeg_quality = jpeg_quality;
+    app->block_size = block_size;
+    app->min_block_size = min_block_size;
+    app->pixel_format = pixel_format;
+    app->tiled_screen = tiled_screen;
+    app->latency_mode = latency_mode;
+    app->share_region = share_region;
+    app->grab_backend = grab_backend;
+
+    if (stats_log || stats_csv != NULL) {
+        app->stats = stats_new();
+        if (app->stats == NULL) {
+            fprintf(stderr, "cannot setup statistics\n");
+            return -1;
+        }
+        app->stats->log = stats_log;
+        if (stats_csv != NULL && (err = stats_open_csv(app->stats, stats_csv)) != 0) {
+            fprintf(stderr, "cannot open %s: %s\n", stats_csv, strerror(err));
+            return -1;
+        }
+        stats_start_timer(app->stats);
+    }
+
+    if (measure_latency) {
+        app->latency = latency_new(shared_clock);
+        if (app->latency == NULL) {
+            fprintf(stderr, "cannot setup latency measurement\n");
+            return -1;
+        }
+    }
+
     hostname = "localhost";
     if (hostname != NULL) {
         app->host = hostname;
@@ -398,5 +1156,10 @@ int main(int argc, char **argv) {
         net_disconnect(app->conn);
         app->conn = NULL;
     }
+
+    stats_free(app->stats);
+    app->stats = NULL;
+    latency_free(app->latency);
+    app->latency = NULL;
     return status;
 }
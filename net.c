@@ -8,91 +8,754 @@
 // Licensed under the GPLv3 or later.
 // See COPYING at the root of the repository for details.
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/tcp.h>
+#include <linux/sockios.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include <gio/gio.h>
 #include "net.h"
 
+// Resolved addresses of a host, in the order they should be tried, and the
+// connection attempts that are in progress
+struct net_connector {
+    char *hostname;
+    char *port;
+    struct addrinfo *addr;
+
+    struct addrinfo *candidates[NET_CONNECT_MAX_CANDIDATES];
+    int sockets[NET_CONNECT_MAX_CANDIDATES];  // -1 if not started yet or failed
+    int n_candidates;
+    int next_candidate;
+
+    int64_t start_ms;         // when the first attempt was started, 0 if not started
+    int64_t next_attempt_ms;  // when the next address should be tried
+    int last_error;           // errno of the last failed attempt
+
+    net_progress_cb progress;
+    void *progress_data;
+};
+
+struct net_connect_async {
+    char *url;
+    net_connector_t *connector;  // NULL while the hostname is being resolved
+    GCancellable *cancellable;
+
+    int fds[NET_CONNECT_MAX_CANDIDATES];
+    guint watches[NET_CONNECT_MAX_CANDIDATES];
+    int n_watches;
+    guint timer;
+
+    net_progress_cb progress;
+    net_connected_cb done;
+    void *data;
+};
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void address_to_string(struct addrinfo *ai, char *str, size_t len) {
+    if (getnameinfo(ai->ai_addr, ai->ai_addrlen, str, len, NULL, 0, NI_NUMERICHOST) != 0) {
+        snprintf(str, len, "?");
+    }
+}
+
+static void report_progress(net_connector_t *connector, const char *fmt, ...) {
+    char message[256];
+    va_list args;
+
+    if (connector->progress == NULL) {
+        return;
+    }
+
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+    connector->progress(message, connector->progress_data);
+}
+
 /**
- * setup connection to remote host
+ * get the path of the file where the last working address of each host is saved
+ *
+ * @param[in] create  TRUE if the directory should be created if it doesn't exist
+ * @return newly allocated path, or NULL if there's no cache directory
+ */
+static char *address_cache_path(int create) {
+    const char *base = getenv("XDG_CACHE_HOME");
+    char dir[4096];
+    char *path;
+
+    if (base != NULL && base[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s", base);
+    } else if ((base = getenv("HOME")) != NULL) {
+        snprintf(dir, sizeof(dir), "%s/.cache", base);
+    } else {
+        return NULL;
+    }
+
+    if (create) {
+        mkdir(dir, 0700);
+    }
+    strncat(dir, "/share-it", sizeof(dir) - strlen(dir) - 1);
+    if (create) {
+        mkdir(dir, 0700);
+    }
+
+    path = malloc(strlen(dir) + sizeof("/addresses"));
+    if (path != NULL) {
+        sprintf(path, "%s/addresses", dir);
+    }
+    return path;
+}
+
+/**
+ * look up the address that worked the last time we connected to a host
+ *
+ * The cache file has one line for each host, "hostname port address".
+ *
+ * @param[in] hostname  host to look up
+ * @param[in] port      port to look up
+ * @param[out] address  the cached address is saved here
+ * @param[in] len       size of address
+ * @return 0 if an address was found, -1 otherwise
+ */
+static int address_cache_get(const char *hostname, const char *port, char *address, size_t len) {
+    char line[512], host[256], service[64], cached[INET6_ADDRSTRLEN];
+    char *path;
+    FILE *f;
+    int ret = -1;
+
+    path = address_cache_path(0);
+    if (path == NULL) {
+        return -1;
+    }
+    f = fopen(path, "r");
+    free(path);
+    if (f == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%255s %63s %45s", host, service, cached) == 3 &&
+            strcmp(host, hostname) == 0 && strcmp(service, port) == 0) {
+            snprintf(address, len, "%s", cached);
+            ret = 0;
+            break;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+/**
+ * remember the address that worked for a host, so that it's tried first the next time
+ *
+ * @param[in] hostname  host that was connected to
+ * @param[in] port      port that was connected to
+ * @param[in] address   address that answered
+ */
+static void address_cache_put(const char *hostname, const char *port, const char *address) {
+    char line[512], host[256], service[64];
+    char *path, *tmp_path;
+    FILE *in, *out;
+
+    // Hostnames with whitespace would break the file format, they're not valid anyway
+    if (strpbrk(hostname, " \t\n") != NULL || strpbrk(port, " \t\n") != NULL) {
+        return;
+    }
+
+    path = address_cache_path(1);
+    if (path == NULL) {
+        return;
+    }
+    tmp_path = malloc(strlen(path) + sizeof(".tmp"));
+    if (tmp_path == NULL) {
+        free(path);
+        return;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+
+    out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        free(tmp_path);
+        free(path);
+        return;
+    }
+
+    fprintf(out, "%s %s %s\n", hostname, port, address);
+    in = fopen(path, "r");
+    if (in != NULL) {
+        while (fgets(line, sizeof(line), in) != NULL) {
+            if (sscanf(line, "%255s %63s", host, service) == 2 &&
+                strcmp(host, hostname) == 0 && strcmp(service, port) == 0) {
+                continue;
+            }
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+
+    if (fclose(out) == 0) {
+        rename(tmp_path, path);
+    } else {
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(path);
+}
+
+/**
+ * resolve a host and prepare to connect to it
+ *
+ * The addresses are ordered as described in RFC 8305 (happy eyeballs): the families
+ * alternate, starting with the family of the first address the resolver returned. If
+ * we've connected to the host before, the address that worked is tried first.
+ *
+ * Note that the lookup is blocking, use net_connect_async() to connect from the main loop.
  *
  * @param[in] url     url to connect to (hostname:port)
  * @param[out] error  on error, the error string will be saved in this variable
- * @return a new connection, or NULL on error
+ * @return a new connector, or NULL on error
  */
-connection_t *net_connect(const char *url, char **error) {
-    connection_t *conn;
+net_connector_t *net_connector_new(const char *url, char **error) {
+    net_connector_t *connector;
+    struct addrinfo hints;
+    struct addrinfo *p, *res;
+    struct addrinfo *first[NET_CONNECT_MAX_CANDIDATES], *second[NET_CONNECT_MAX_CANDIDATES];
+    int n_first = 0, n_second = 0;
+    char cached[INET6_ADDRSTRLEN], address[INET6_ADDRSTRLEN];
     char *ptr;
-    int ret;
+    int i, ret;
 
-    conn = calloc(1, sizeof(connection_t));
-    if (conn == NULL) {
+    connector = calloc(1, sizeof(net_connector_t));
+    if (connector == NULL) {
         if (error != NULL) {
             *error = strerror(errno);
         }
         return NULL;
     }
 
-    conn->hostname = strdup(url);
-    if ((ptr = strchr(conn->hostname, ':')) != NULL) {
+    connector->hostname = strdup(url);
+    if ((ptr = strrchr(connector->hostname, ':')) != NULL && strchr(connector->hostname, ':') == ptr) {
         *ptr = '\0';
-        conn->port = strdup(++ptr);
+        connector->port = strdup(++ptr);
+    } else if (connector->hostname[0] == '[' && (ptr = strstr(connector->hostname, "]:")) != NULL) {
+        // IPv6 literal with port, [::1]:8999
+        *ptr = '\0';
+        connector->port = strdup(ptr + 2);
+        memmove(connector->hostname, connector->hostname + 1, strlen(connector->hostname));
     } else {
-        conn->port = strdup("8999");
+        connector->port = strdup("8999");
     }
 
-    struct addrinfo hints;
-    struct addrinfo *p, *res;  // will point to the results
-
-    memset(&hints, 0, sizeof hints); // make sure the struct is empty
+    memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;     // don't care IPv4 or IPv6
     hints.ai_socktype = SOCK_STREAM; // TCP stream sockets
 
-    if ((ret = getaddrinfo(conn->hostname, conn->port, &hints, &res)) != 0) {
+    if ((ret = getaddrinfo(connector->hostname, connector->port, &hints, &res)) != 0) {
         if (error != NULL) {
             *error = (char *)gai_strerror(ret);
         }
-        free(conn->hostname);
-        free(conn->port);
-        free(conn);
+        net_connector_free(connector);
+        return NULL;
+    }
+    connector->addr = res;
+
+    // Split the addresses by family, keeping the order the resolver wants within each family
+    for (p = res; p != NULL; p = p->ai_next) {
+        if (p->ai_family == res->ai_family) {
+            if (n_first < NET_CONNECT_MAX_CANDIDATES) {
+                first[n_first++] = p;
+            }
+        } else if (n_second < NET_CONNECT_MAX_CANDIDATES) {
+            second[n_second++] = p;
+        }
+    }
+
+    for (i = 0; connector->n_candidates < NET_CONNECT_MAX_CANDIDATES && (i < n_first || i < n_second); i++) {
+        if (i < n_first) {
+            connector->candidates[connector->n_candidates++] = first[i];
+        }
+        if (i < n_second && connector->n_candidates < NET_CONNECT_MAX_CANDIDATES) {
+            connector->candidates[connector->n_candidates++] = second[i];
+        }
+    }
+
+    if (address_cache_get(connector->hostname, connector->port, cached, sizeof(cached)) == 0) {
+        for (i = 0; i < connector->n_candidates; i++) {
+            address_to_string(connector->candidates[i], address, sizeof(address));
+            if (strcmp(address, cached) == 0) {
+                p = connector->candidates[i];
+                memmove(&connector->candidates[1], &connector->candidates[0], i * sizeof(struct addrinfo *));
+                connector->candidates[0] = p;
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < NET_CONNECT_MAX_CANDIDATES; i++) {
+        connector->sockets[i] = -1;
+    }
+    connector->last_error = ECONNREFUSED;
+    return connector;
+}
+
+/**
+ * set a callback that is told about each address that is tried
+ *
+ * @param[in] connector  connector to update
+ * @param[in] progress   callback, or NULL
+ * @param[in] data       passed to the callback
+ */
+void net_connector_set_progress(net_connector_t *connector, net_progress_cb progress, void *data) {
+    connector->progress = progress;
+    connector->progress_data = data;
+}
+
+/**
+ * start a non-blocking connection attempt to the next address
+ *
+ * @param[in] connector  connector to update
+ * @return index of the attempt, or -1 if it failed right away
+ */
+static int start_attempt(net_connector_t *connector) {
+    struct addrinfo *ai = connector->candidates[connector->next_candidate];
+    int i = connector->next_candidate++;
+    char address[INET6_ADDRSTRLEN];
+    int fd;
+
+    address_to_string(ai, address, sizeof(address));
+    report_progress(connector, "connecting to %s port %s (%s)", connector->hostname, connector->port, address);
+
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd == -1) {
+        connector->last_error = errno;
+        report_progress(connector, "%s: %s", address, strerror(errno));
+        return -1;
+    }
+
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0 && errno != EINPROGRESS) {
+        connector->last_error = errno;
+        report_progress(connector, "%s: %s", address, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    connector->sockets[i] = fd;
+    return i;
+}
+
+/**
+ * turn a successful attempt into a connection, and give up on the others
+ *
+ * @param[in] connector  connector to take the socket and addresses from
+ * @param[in] winner     index of the attempt that succeeded
+ * @return a new connection, or NULL on error
+ */
+static connection_t *finish_attempt(net_connector_t *connector, int winner) {
+    char address[INET6_ADDRSTRLEN];
+    connection_t *conn;
+    int i, flags;
+
+    conn = calloc(1, sizeof(connection_t));
+    if (conn == NULL) {
+        connector->last_error = errno;
         return NULL;
     }
 
-    void *addr;
-    char ipstr[INET6_ADDRSTRLEN];
-    conn->addr = res;
-    p = res;
+    for (i = 0; i < connector->next_candidate; i++) {
+        if (i != winner && connector->sockets[i] != -1) {
+            close(connector->sockets[i]);
+            connector->sockets[i] = -1;
+        }
+    }
+
+    // The rest of the code expects blocking sends and receives
+    conn->socket = connector->sockets[winner];
+    connector->sockets[winner] = -1;
+    flags = fcntl(conn->socket, F_GETFL);
+    fcntl(conn->socket, F_SETFL, flags & ~O_NONBLOCK);
+
+    address_to_string(connector->candidates[winner], address, sizeof(address));
+    report_progress(connector, "connected to %s port %s (%s)", connector->hostname, connector->port, address);
+    address_cache_put(connector->hostname, connector->port, address);
 
-    // FIXME - loop through the returned addresses if necessary
-    if (p->ai_family == AF_INET) {
-        struct sockaddr_in *ipv4 = (struct sockaddr_in *)p->ai_addr;
-        addr = &(ipv4->sin_addr);
-    } else if (p->ai_family == AF_INET6) {
-        struct sockaddr_in6 *ipv6 = (struct sockaddr_in6 *)p->ai_addr;
-        addr = &(ipv6->sin6_addr);
+    conn->hostname = connector->hostname;
+    conn->port = connector->port;
+    conn->addr = connector->addr;
+    connector->hostname = NULL;
+    connector->port = NULL;
+    connector->addr = NULL;
+    return conn;
+}
+
+/**
+ * advance the connection attempts
+ *
+ * Checks if any of the attempts in progress has finished, and starts an attempt to the
+ * next address if the last one hasn't answered within NET_CONNECT_ATTEMPT_DELAY_MS or
+ * has failed. The caller should call this again when one of the sockets from
+ * net_connector_fds() is writable, or after net_connector_timeout() ms.
+ *
+ * @param[in] connector  connector to advance
+ * @param[in] now_ms     current monotonic time, in ms
+ * @param[out] conn      the connection is saved here when done
+ * @param[out] error     on error, the error string will be saved in this variable
+ * @return 1 if connected, 0 if still in progress, -1 if all addresses failed
+ */
+int net_connector_step(net_connector_t *connector, int64_t now_ms, connection_t **conn, char **error) {
+    struct pollfd pfds[NET_CONNECT_MAX_CANDIDATES];
+    int index[NET_CONNECT_MAX_CANDIDATES];
+    char address[INET6_ADDRSTRLEN];
+    int i, n = 0, pending = 0, err;
+    socklen_t len;
+
+    if (connector->start_ms == 0) {
+        connector->start_ms = now_ms;
+        connector->next_attempt_ms = now_ms;
     }
-    inet_ntop(p->ai_family, addr, ipstr, sizeof ipstr);
 
-    conn->socket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    for (i = 0; i < connector->next_candidate; i++) {
+        if (connector->sockets[i] != -1) {
+            pfds[n].fd = connector->sockets[i];
+            pfds[n].events = POLLOUT;
+            pfds[n].revents = 0;
+            index[n++] = i;
+        }
+    }
 
-    ret = connect(conn->socket, res->ai_addr, res->ai_addrlen);
-    if (ret != 0) {
+    if (n > 0 && poll(pfds, n, 0) > 0) {
+        for (i = 0; i < n; i++) {
+            if (pfds[i].revents == 0) {
+                continue;
+            }
+
+            len = sizeof(err);
+            if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) {
+                err = errno;
+            }
+            if (err == 0) {
+                *conn = finish_attempt(connector, index[i]);
+                if (*conn == NULL) {
+                    break;
+                }
+                return 1;
+            }
+
+            address_to_string(connector->candidates[index[i]], address, sizeof(address));
+            report_progress(connector, "%s: %s", address, strerror(err));
+            close(pfds[i].fd);
+            connector->sockets[index[i]] = -1;
+            connector->last_error = err;
+
+            // No need to wait for the delay, try the next address right away
+            connector->next_attempt_ms = now_ms;
+        }
+    }
+
+    while (connector->next_candidate < connector->n_candidates && now_ms >= connector->next_attempt_ms) {
+        if (start_attempt(connector) != -1) {
+            connector->next_attempt_ms = now_ms + NET_CONNECT_ATTEMPT_DELAY_MS;
+        }
+    }
+
+    for (i = 0; i < connector->next_candidate; i++) {
+        if (connector->sockets[i] != -1) {
+            pending++;
+        }
+    }
+
+    if (pending == 0 && connector->next_candidate == connector->n_candidates) {
         if (error != NULL) {
-            *error = strerror(errno);
+            *error = strerror(connector->last_error);
+        }
+        return -1;
+    }
+
+    if (now_ms - connector->start_ms >= NET_CONNECT_TIMEOUT_MS) {
+        if (error != NULL) {
+            *error = strerror(ETIMEDOUT);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * get the time until net_connector_step() should be called again if nothing happens on the sockets
+ *
+ * @param[in] connector  connector to check
+ * @param[in] now_ms     current monotonic time, in ms
+ * @return number of ms to wait
+ */
+int net_connector_timeout(net_connector_t *connector, int64_t now_ms) {
+    int64_t deadline = connector->start_ms + NET_CONNECT_TIMEOUT_MS;
+
+    if (connector->next_candidate < connector->n_candidates && connector->next_attempt_ms < deadline) {
+        deadline = connector->next_attempt_ms;
+    }
+    if (deadline <= now_ms) {
+        return 0;
+    }
+    return (int)(deadline - now_ms);
+}
+
+/**
+ * get the sockets of the connection attempts in progress
+ *
+ * @param[in] connector  connector to check
+ * @param[out] fds       the sockets are saved here
+ * @param[in] max_fds    max number of sockets to save
+ * @return number of sockets
+ */
+int net_connector_fds(net_connector_t *connector, int *fds, int max_fds) {
+    int i, n = 0;
+
+    for (i = 0; i < connector->next_candidate && n < max_fds; i++) {
+        if (connector->sockets[i] != -1) {
+            fds[n++] = connector->sockets[i];
+        }
+    }
+    return n;
+}
+
+void net_connector_free(net_connector_t *connector) {
+    int i;
+
+    if (connector == NULL) {
+        return;
+    }
+
+    for (i = 0; i < connector->next_candidate; i++) {
+        if (connector->sockets[i] != -1) {
+            close(connector->sockets[i]);
         }
-        free(conn->hostname);
-        free(conn->port);
-        free(conn);
+    }
+    if (connector->addr != NULL) {
+        freeaddrinfo(connector->addr);
+    }
+    free(connector->hostname);
+    free(connector->port);
+    free(connector);
+}
+
+/**
+ * setup connection to remote host
+ *
+ * Blocks until connected, see net_connect_async() for the non-blocking version.
+ *
+ * @param[in] url     url to connect to (hostname:port)
+ * @param[out] error  on error, the error string will be saved in this variable
+ * @return a new connection, or NULL on error
+ */
+connection_t *net_connect(const char *url, char **error) {
+    net_connector_t *connector;
+    connection_t *conn = NULL;
+    struct pollfd pfds[NET_CONNECT_MAX_CANDIDATES];
+    int fds[NET_CONNECT_MAX_CANDIDATES];
+    int i, n;
+    int64_t now;
+
+    connector = net_connector_new(url, error);
+    if (connector == NULL) {
         return NULL;
     }
 
+    now = now_ms();
+    while (net_connector_step(connector, now, &conn, error) == 0) {
+        n = net_connector_fds(connector, fds, NET_CONNECT_MAX_CANDIDATES);
+        for (i = 0; i < n; i++) {
+            pfds[i].fd = fds[i];
+            pfds[i].events = POLLOUT;
+        }
+        poll(pfds, n, net_connector_timeout(connector, now));
+        now = now_ms();
+    }
+
+    net_connector_free(connector);
     return conn;
 }
 
+static void net_connect_async_free(net_connect_async_t *attempt) {
+    int i;
+
+    for (i = 0; i < attempt->n_watches; i++) {
+        if (attempt->watches[i] != 0) {
+            g_source_remove(attempt->watches[i]);
+        }
+    }
+    if (attempt->timer != 0) {
+        g_source_remove(attempt->timer);
+    }
+    net_connector_free(attempt->connector);
+    g_object_unref(attempt->cancellable);
+    free(attempt->url);
+    free(attempt);
+}
+
+static gboolean net_connect_async_fd_ready(gint fd, GIOCondition condition, gpointer data);
+static gboolean net_connect_async_timeout(gpointer data);
+
+/**
+ * advance an asynchronous connection attempt, and wait for the sockets or the next timeout
+ *
+ * @param[in] attempt  attempt to advance, freed when done
+ */
+static void net_connect_async_step(net_connect_async_t *attempt) {
+    connection_t *conn = NULL;
+    char *error = NULL;
+    gint64 now = g_get_monotonic_time() / 1000;
+    int i, ret;
+
+    for (i = 0; i < attempt->n_watches; i++) {
+        if (attempt->watches[i] != 0) {
+            g_source_remove(attempt->watches[i]);
+        }
+    }
+    attempt->n_watches = 0;
+    if (attempt->timer != 0) {
+        g_source_remove(attempt->timer);
+        attempt->timer = 0;
+    }
+
+    ret = net_connector_step(attempt->connector, now, &conn, &error);
+    if (ret != 0) {
+        attempt->done(conn, error, attempt->data);
+        net_connect_async_free(attempt);
+        return;
+    }
+
+    attempt->n_watches = net_connector_fds(attempt->connector, attempt->fds, NET_CONNECT_MAX_CANDIDATES);
+    for (i = 0; i < attempt->n_watches; i++) {
+        attempt->watches[i] = g_unix_fd_add(attempt->fds[i], G_IO_OUT | G_IO_ERR | G_IO_HUP,
+                                            net_connect_async_fd_ready, attempt);
+    }
+    attempt->timer = g_timeout_add(net_connector_timeout(attempt->connector, now), net_connect_async_timeout, attempt);
+}
+
+static gboolean net_connect_async_fd_ready(gint fd, GIOCondition condition, gpointer data) {
+    net_connect_async_t *attempt = data;
+    int i;
+
+    // This source is removed when we return
+    for (i = 0; i < attempt->n_watches; i++) {
+        if (attempt->fds[i] == fd) {
+            attempt->watches[i] = 0;
+        }
+    }
+    net_connect_async_step(attempt);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean net_connect_async_timeout(gpointer data) {
+    net_connect_async_t *attempt = data;
+
+    attempt->timer = 0;
+    net_connect_async_step(attempt);
+    return G_SOURCE_REMOVE;
+}
+
+static void net_connect_async_resolve(GTask *task, gpointer source, gpointer data, GCancellable *cancellable) {
+    net_connector_t *connector;
+    char *error = NULL;
+
+    connector = net_connector_new(data, &error);
+    if (connector == NULL) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED, "%s", error);
+        return;
+    }
+    g_task_return_pointer(task, connector, (GDestroyNotify)net_connector_free);
+}
+
+static void net_connect_async_resolved(GObject *source, GAsyncResult *result, gpointer data) {
+    net_connect_async_t *attempt = data;
+    net_connector_t *connector;
+    GError *error = NULL;
+
+    connector = g_task_propagate_pointer(G_TASK(result), &error);
+    if (g_cancellable_is_cancelled(attempt->cancellable)) {
+        net_connector_free(connector);
+        g_clear_error(&error);
+        net_connect_async_free(attempt);
+        return;
+    }
+
+    if (connector == NULL) {
+        attempt->done(NULL, error->message, attempt->data);
+        g_error_free(error);
+        net_connect_async_free(attempt);
+        return;
+    }
+
+    attempt->connector = connector;
+    net_connector_set_progress(connector, attempt->progress, attempt->data);
+    net_connect_async_step(attempt);
+}
+
+/**
+ * setup connection to remote host without blocking the main loop
+ *
+ * The hostname is resolved in a separate thread, and then the addresses are raced as
+ * described in net_connector_step(). Exactly one call to done is made, unless the
+ * attempt is cancelled with net_connect_async_cancel().
+ *
+ * @param[in] url       url to connect to (hostname:port)
+ * @param[in] progress  called for each address that is tried, may be NULL
+ * @param[in] done      called with the new connection, or NULL and an error string
+ * @param[in] data      passed to the callbacks
+ * @return the connection attempt, or NULL on error
+ */
+net_connect_async_t *net_connect_async(const char *url, net_progress_cb progress, net_connected_cb done, void *data) {
+    net_connect_async_t *attempt;
+    GTask *task;
+
+    attempt = calloc(1, sizeof(net_connect_async_t));
+    if (attempt == NULL) {
+        return NULL;
+    }
+    attempt->url = strdup(url);
+    attempt->cancellable = g_cancellable_new();
+    attempt->progress = progress;
+    attempt->done = done;
+    attempt->data = data;
+
+    task = g_task_new(NULL, attempt->cancellable, net_connect_async_resolved, attempt);
+    g_task_set_task_data(task, attempt->url, NULL);
+    g_task_run_in_thread(task, net_connect_async_resolve);
+    g_object_unref(task);
+    return attempt;
+}
+
+/**
+ * give up on an asynchronous connection attempt, the done callback will not be called
+ *
+ * @param[in] attempt  attempt to cancel
+ */
+void net_connect_async_cancel(net_connect_async_t *attempt) {
+    if (attempt->connector == NULL) {
+        // Still resolving, the attempt is freed when the resolver thread is done
+        g_cancellable_cancel(attempt->cancellable);
+        return;
+    }
+    net_connect_async_free(attempt);
+}
+
 /**
  * disconnect from remote host
  *
@@ -106,4 +769,144 @@ int net_disconnect(connection_t *conn) {
     free(conn->port);
 
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * get the number of bytes in the socket send queue that haven't been sent yet
+ *
+ * @param[in] conn  connection to check
+ * @return number of bytes, or -1 if it could not be determined
+ */
+int net_unsent_bytes(connection_t *conn) {
+    int unsent;
+
+    if (ioctl(conn->socket, SIOCOUTQ, &unsent) != 0) {
+        return -1;
+    }
+    return unsent;
+}
+
+/**
+ * get the time to wait before reconnecting
+ *
+ * @param[in] attempt  number of reconnect attempts that have failed so far
+ * @return delay in ms
+ */
+int net_reconnect_delay(int attempt) {
+    int delay = NET_RECONNECT_MIN_DELAY_MS;
+
+    while (attempt-- > 0 && delay < NET_RECONNECT_MAX_DELAY_MS) {
+        delay *= 2;
+    }
+    if (delay > NET_RECONNECT_MAX_DELAY_MS) {
+        delay = NET_RECONNECT_MAX_DELAY_MS;
+    }
+    return delay;
+}
+
+/**
+ * make the connection send fresh data quickly, instead of queueing as much as possible
+ *
+ * Disables Nagle's algorithm, and limits the data waiting in the socket to
+ * NET_NOTSENT_LOWAT_BYTES, so that the socket only becomes writable when what's been
+ * written so far is about to go out. Anything that isn't written yet can then still
+ * be replaced by something newer. The send buffer is sized from the measured round
+ * trip time and bandwidth by net_update_send_buffer(), instead of the kernel's
+ * auto-tuning which tends to let seconds of data pile up on slow links.
+ *
+ * @param[in] conn  connection to update
+ * @return 0 on success, -1 on error
+ */
+int net_set_latency_mode(connection_t *conn) {
+    int nodelay = 1;
+    int lowat = NET_NOTSENT_LOWAT_BYTES;
+
+    if (setsockopt(conn->socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) != 0) {
+        return -1;
+    }
+    if (setsockopt(conn->socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) != 0) {
+        return -1;
+    }
+
+    conn->latency_mode = 1;
+    return net_update_send_buffer(conn) < 0 ? -1 : 0;
+}
+
+/**
+ * calculate the send buffer size needed to keep a link busy
+ *
+ * The buffer has to hold the data in flight (the bandwidth-delay product), with
+ * some margin since the estimation is noisy, plus what's waiting to be sent.
+ *
+ * @param[in] rtt_us         round trip time, in us
+ * @param[in] bytes_per_sec  bandwidth
+ * @return send buffer size, in bytes
+ */
+int net_send_buffer_size(uint32_t rtt_us, uint64_t bytes_per_sec) {
+    uint64_t size = bytes_per_sec * rtt_us / 1000000;
+
+    size = size * 2 + NET_NOTSENT_LOWAT_BYTES;
+    if (size < NET_SEND_BUFFER_MIN) {
+        size = NET_SEND_BUFFER_MIN;
+    }
+    if (size > NET_SEND_BUFFER_MAX) {
+        size = NET_SEND_BUFFER_MAX;
+    }
+    return (int)size;
+}
+
+/**
+ * resize the send buffer of a connection in latency mode from its current round trip time and bandwidth
+ *
+ * @param[in] conn  connection to update
+ * @return new send buffer size, 0 if not in latency mode, -1 on error
+ */
+int net_update_send_buffer(connection_t *conn) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    uint64_t bytes_per_sec;
+    int size;
+
+    if (!conn->latency_mode) {
+        return 0;
+    }
+
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(conn->socket, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+        return -1;
+    }
+
+    // Older kernels don't measure the delivery rate, the congestion window is the best guess then
+    bytes_per_sec = info.tcpi_delivery_rate;
+    if (bytes_per_sec == 0 && info.tcpi_rtt > 0) {
+        bytes_per_sec = (uint64_t)info.tcpi_snd_cwnd * info.tcpi_snd_mss * 1000000 / info.tcpi_rtt;
+    }
+
+    size = net_send_buffer_size(info.tcpi_rtt, bytes_per_sec);
+
+    // Don't bother the kernel with small changes
+    if (conn->send_buffer != 0 && abs(size - conn->send_buffer) < conn->send_buffer / 4) {
+        return conn->send_buffer;
+    }
+    if (setsockopt(conn->socket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) != 0) {
+        return -1;
+    }
+    conn->send_buffer = size;
+    return size;
+}
+
+/**
+ * check if more data can be written without waiting, in latency mode this means that
+ * less than NET_NOTSENT_LOWAT_BYTES are waiting to be sent
+ *
+ * @param[in] conn  connection to check
+ * @return 1 if writable, 0 otherwise
+ */
+int net_writable(connection_t *conn) {
+    struct pollfd pfd = { .fd = conn->socket, .events = POLLOUT };
+
+    if (poll(&pfd, 1, 0) != 1) {
+        return 0;
+    }
+    return (pfd.revents & POLLOUT) != 0;
+}
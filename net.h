@@ -9,6 +9,33 @@
 // See COPYING at the root of the repository for details.
 #ifndef SHAREIT_NET_H
 #define SHAREIT_NET_H
+#include <stdint.h>
+
+// Time (in ms) to wait for a connection attempt before racing it against the next address
+#define NET_CONNECT_ATTEMPT_DELAY_MS 250
+
+// Give up if no address has answered within this time (in ms)
+#define NET_CONNECT_TIMEOUT_MS 10000
+
+// Max number of resolved addresses that are tried
+#define NET_CONNECT_MAX_CANDIDATES 16
+
+// Delay (in ms) before reconnecting after the connection dropped, doubled after each failed attempt
+#define NET_RECONNECT_MIN_DELAY_MS 250
+#define NET_RECONNECT_MAX_DELAY_MS 8000
+
+// Give up reconnecting after this many failed attempts
+#define NET_RECONNECT_MAX_ATTEMPTS 10
+
+// Latency mode: the socket only reports writable when less than this many bytes are waiting to be sent
+#define NET_NOTSENT_LOWAT_BYTES (16 * 1024)
+
+// Latency mode: limits for the send buffer, which is sized from the bandwidth-delay product
+#define NET_SEND_BUFFER_MIN (64 * 1024)
+#define NET_SEND_BUFFER_MAX (8 * 1024 * 1024)
+
+// Latency mode: how often (in ms) the send buffer is resized
+#define NET_SEND_BUFFER_UPDATE_INTERVAL_MS 1000
 
 typedef struct {
     char *hostname;
@@ -16,8 +43,35 @@ typedef struct {
 
     struct addrinfo *addr;
     int socket;
+
+    int latency_mode;  // set by net_set_latency_mode()
+    int send_buffer;   // size of the send buffer set in latency mode, 0 if left to the kernel
 } connection_t;
 
+// Called with a human readable message for each address that is tried or fails
+typedef void (*net_progress_cb)(const char *message, void *data);
+
+// Called when an asynchronous connection attempt is done, conn is NULL on error
+typedef void (*net_connected_cb)(connection_t *conn, const char *error, void *data);
+
+typedef struct net_connector net_connector_t;
+typedef struct net_connect_async net_connect_async_t;
+
 connection_t *net_connect(const char *url, char **error);
+net_connect_async_t *net_connect_async(const char *url, net_progress_cb progress, net_connected_cb done, void *data);
+void net_connect_async_cancel(net_connect_async_t *attempt);
 int net_disconnect(connection_t *conn);
-#endif
\ No newline at end of file
+int net_unsent_bytes(connection_t *conn);
+int net_reconnect_delay(int attempt);
+int net_set_latency_mode(connection_t *conn);
+int net_update_send_buffer(connection_t *conn);
+int net_send_buffer_size(uint32_t rtt_us, uint64_t bytes_per_sec);
+int net_writable(connection_t *conn);
+
+net_connector_t *net_connector_new(const char *url, char **error);
+void net_connector_set_progress(net_connector_t *connector, net_progress_cb progress, void *data);
+int net_connector_step(net_connector_t *connector, int64_t now_ms, connection_t **conn, char **error);
+int net_connector_timeout(net_connector_t *connector, int64_t now_ms);
+int net_connector_fds(net_connector_t *connector, int *fds, int max_fds);
+void net_connector_free(net_connector_t *connector);
+#endif
@@ -8,6 +8,7 @@
 // Licensed under the GPLv3 or later.
 // See COPYING at the root of the repository for details.
 #include <arpa/inet.h>
+#include <endian.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -16,8 +17,17 @@
 #include "packet.h"
 #include "buf.h"
 
+// Data of a framebuffer update that the socket couldn't take without waiting,
+// see pkt_queue_framebuffer_update()
+static struct {
+    int socket;
+    buf_t *buf;
+    int sent;
+} send_queue = { -1, NULL, 0 };
+
 /**
  * write all data in 'ptr' to socket, in chunks if we have to
+ * NOTE! Data queued for the socket is sent first, so that packets aren't mixed up
  *
  * @param sockfd  socket to send data on
  * @param ptr     pointer to data
@@ -26,11 +36,28 @@
  */
 int send_all(int sockfd, void *ptr, size_t sz) {
     size_t sent = 0;
-    size_t ret;
+    ssize_t ret;
+
+    if (send_queue.buf != NULL && send_queue.socket == sockfd) {
+        buf_t *queued = send_queue.buf;
+        int offset = send_queue.sent;
+
+        send_queue.buf = NULL;
+        send_queue.sent = 0;
+        send_queue.socket = -1;
+        ret = send_all(sockfd, queued->buf + offset, queued->len - offset);
+        buf_free(queued);
+        if (ret < 0) {
+            return -1;
+        }
+    }
     while (sent < sz) {
         ret = send(sockfd, ptr+sent, sz-sent, 0);
         if (ret < 0) {
-            return ret;
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
         }
         sent += ret;
     }
@@ -38,83 +65,771 @@ int send_all(int sockfd, void *ptr, size_t sz) {
 }
 
 /**
- * read the expected number of bytes from socket, in chunks if we have to
+ * read the expected number of bytes from socket, in chunks if we have to
+ *
+ * @param sockfd  socket to read data from
+ * @param ptr     pointer to save data to
+ * @param sz      number of bytes to read
+ * @return  < 0 on error, otherwise the number of bytes read
+ */
+
+int recv_all(int sockfd, void *ptr, size_t sz) {
+    size_t read = 0;
+    ssize_t ret;
+    while (read < sz) {
+        ret = recv(sockfd, ptr+read, sz-read, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (ret == 0) {
+            // The other end has closed the connection
+            errno = ECONNRESET;
+            return -1;
+        }
+        read += ret;
+    }
+    return read;
+}
+
+/**
+ * read a length-encoded string from socket
+ * NOTE! expects the first u8 to be the length of the string
+ *
+ * @param sockfd  socket to read from
+ * @return newly allocated, null terminated string on success, or NULL on failure
+ */
+char *recv_str(int sockfd) {
+    uint8_t len;
+    char *str;
+
+    if (recv_all(sockfd, &len, sizeof(len)) < 0) {
+        perror("recv_all(len)");
+        return NULL;
+    }
+
+
+    str = malloc(len + 1);
+    if (str == NULL) {
+        perror("malloc()");
+        return NULL;
+    }
+
+    if (len > 0) {
+        if (recv_all(sockfd, str, len) < 0) {
+            perror("recv_all(session_name)");
+            free(str);
+            return NULL;
+        }
+    }
+
+    str[len] = '\0';
+    return str;
+}
+
+/**
+ * inform server that we want to share our screen in the current session
+ *
+ * @param s      socket to write to
+ * @param width  width of session screen
+ * @param height height of session screen
+ * @return -1 on error
+ */
+int pkt_send_session_screenshare_request(int s, uint16_t width, uint16_t height) {
+    buf_t *b;
+    int ret = 0;
+
+    b = buf_new();
+    buf_add_uint8(b, packet_type_session_screenshare_start);
+    buf_add_uint16(b, width);
+    buf_add_uint16(b, height);
+
+    if (send_all(s, b->buf, b->len) < 0) {
+        printf("%s: could not send, errno: %s\n", __FUNCTION__, strerror(errno));
+        ret = -1;
+    }
+    buf_free(b);
+    return ret;
+}
+
+/**
+ * read session screenshare start information from socket
+ * NOTE! This function expects that the 'type' has already been read from the socket.
+ *
+ * @param[in] s        socket to read from
+ * @param[out] width   width of screen to be displayed
+ * @param[out] height  height of screen to be displayed
+ * @return  -1 on error
+ */
+int pkt_recv_session_screenshare_start_request(int s, u_int16_t *width, u_int16_t *height) {
+    struct __attribute__ ((__packed__)) {
+        uint16_t width;
+        uint16_t height;
+    }
+    pkt;
+
+    if (recv_all(s, &pkt, sizeof(pkt)) <= 0) {
+        printf("%s: could not send, errno: %s\n", __FUNCTION__, strerror(errno));
+        return -1;
+    }
+    if (width != NULL) *width = ntohs(pkt.width);
+    if (height != NULL) *height = ntohs(pkt.height);
+    return 0;
+}
+
+
+/**
+ * calculate the number of bytes needed to send a framebuffer update
+ *
+ * @param update  update to calculate size of
+ * @return size of update on the wire, in bytes
+ */
+int framebuffer_update_wire_size(framebuffer_update_t *update) {
+    int sz = 0;
+    int i;
+
+    // type, n_rects and pixel format for each packet the update is split into
+    sz += ((update->n_rects + FRAMEBUFFER_UPDATE_MAX_RECTS - 1) / FRAMEBUFFER_UPDATE_MAX_RECTS) * 3;
+    for (i = 0; i < update->n_rects; i ++) {
+        framebuffer_rect_t *rect = update->rects[i];
+
+        // rect header
+        sz += 9;
+        switch (rect->encoding_type) {
+        case framebuffer_encoding_type_raw:
+            sz += rect->width * rect->height * pixfmt_bpp(update->pixel_format);
+            break;
+        case framebuffer_encoding_type_solid:
+            sz += 3;
+            break;
+        case framebuffer_encoding_type_trle:
+            sz += 4 + rect->enc.trle.length;
+            break;
+        case framebuffer_encoding_type_jpeg:
+            sz += 4 + rect->enc.jpeg.length;
+            break;
+        case framebuffer_encoding_type_cached:
+            sz += 2;
+            break;
+        default:
+            break;
+        }
+    }
+    return sz;
+}
+
+/**
+ * build the packet(s) for a framebuffer update
+ * NOTE! The packet header can only describe 255 rects, so larger updates
+ * are split up into several consecutive packets.
+ *
+ * @param update  update to build packets for
+ * @return newly allocated buffer, or NULL on error
+ */
+static buf_t *framebuffer_update_buf(framebuffer_update_t *update) {
+    buf_t *b;
+    framebuffer_rect_t *rect;
+    int i;
+    int n_rects;
+
+    b = buf_new();
+    for (i = 0; i < update->n_rects; i ++) {
+        if (i % FRAMEBUFFER_UPDATE_MAX_RECTS == 0) {
+            n_rects = update->n_rects - i;
+            if (n_rects > FRAMEBUFFER_UPDATE_MAX_RECTS) {
+                n_rects = FRAMEBUFFER_UPDATE_MAX_RECTS;
+            }
+            buf_add_uint8(b, packet_type_framebuffer_update);
+            buf_add_uint8(b, n_rects);
+            buf_add_uint8(b, update->pixel_format);
+        }
+
+        rect = update->rects[i];
+        buf_add_uint16(b, rect->xpos);
+        buf_add_uint16(b, rect->ypos);
+        buf_add_uint16(b, rect->width);
+        buf_add_uint16(b, rect->height);
+        buf_add_uint8(b, rect->encoding_type);
+
+        switch (rect->encoding_type) {
+        case framebuffer_encoding_type_raw:
+            buf_add_bytes(b, rect->width * rect->height * pixfmt_bpp(update->pixel_format),
+                          (uint8_t *)rect->enc.raw.data);
+            break;
+        case framebuffer_encoding_type_solid:
+            buf_add_uint8(b, rect->enc.solid.red);
+            buf_add_uint8(b, rect->enc.solid.green);
+            buf_add_uint8(b, rect->enc.solid.blue);
+            break;
+        case framebuffer_encoding_type_trle:
+            buf_add_uint32(b, rect->enc.trle.length);
+            buf_add_bytes(b, rect->enc.trle.length, rect->enc.trle.data);
+            break;
+        case framebuffer_encoding_type_jpeg:
+            buf_add_uint32(b, rect->enc.jpeg.length);
+            buf_add_bytes(b, rect->enc.jpeg.length, rect->enc.jpeg.data);
+            break;
+        case framebuffer_encoding_type_cached:
+            buf_add_uint16(b, rect->enc.cached.slot);
+            break;
+        default:
+            fprintf(stderr, "%s: encoding type %d not implemented!\n", __FUNCTION__, rect->encoding_type);
+            buf_free(b);
+            return NULL;
+        }
+    }
+    return b;
+}
+
+/**
+ * Send framebuffer update to server
+ *
+ * @param sockfd  socket to send update on
+ * @param update update to send to server
+ * @return -1 on error, otherwise 0
+ */
+int pkt_send_framebuffer_update(int sockfd, framebuffer_update_t *update) {
+    buf_t *b;
+    int ret = 0;
+
+    if ((b = framebuffer_update_buf(update)) == NULL) {
+        return -1;
+    }
+    if (send_all(sockfd, b->buf, b->len) < 0) {
+        ret = -1;
+    }
+    buf_free(b);
+    return ret;
+}
+
+/**
+ * Send framebuffer update to server without waiting for the socket
+ *
+ * What the socket can't take right away is queued, and has to be sent with
+ * pkt_send_queued() when the socket is writable again. Anything else written
+ * to the socket with send_all() waits for the queue to be sent first.
+ * NOTE! Only one socket can have data queued, queueing for another one drops the old queue
+ *
+ * @param sockfd  socket to send update on
+ * @param update  update to send to server
+ * @return -1 on error, 1 if part of the update is queued, otherwise 0
+ */
+int pkt_queue_framebuffer_update(int sockfd, framebuffer_update_t *update) {
+    buf_t *b;
+
+    if ((b = framebuffer_update_buf(update)) == NULL) {
+        return -1;
+    }
+
+    if (send_queue.buf != NULL && send_queue.socket == sockfd) {
+        buf_add_bytes(send_queue.buf, b->len, b->buf);
+        buf_free(b);
+    } else {
+        pkt_queue_clear(send_queue.socket);
+        send_queue.socket = sockfd;
+        send_queue.buf = b;
+        send_queue.sent = 0;
+    }
+    return pkt_send_queued(sockfd);
+}
+
+/**
+ * send as much of the queued data as the socket takes without waiting
+ *
+ * @param sockfd  socket to send queued data on
+ * @return -1 on error, 1 if data is still queued, 0 if the queue is empty
+ */
+int pkt_send_queued(int sockfd) {
+    ssize_t ret;
+
+    if (send_queue.buf == NULL || send_queue.socket != sockfd) {
+        return 0;
+    }
+
+    while (send_queue.sent < send_queue.buf->len) {
+        ret = send(sockfd, send_queue.buf->buf + send_queue.sent, send_queue.buf->len - send_queue.sent,
+                   MSG_DONTWAIT);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            return -1;
+        }
+        send_queue.sent += ret;
+    }
+
+    pkt_queue_clear(sockfd);
+    return 0;
+}
+
+/**
+ * drop the data queued for a socket, e.g. when the connection has been lost
+ *
+ * @param sockfd  socket to drop queued data for
+ */
+void pkt_queue_clear(int sockfd) {
+    if (send_queue.buf == NULL || send_queue.socket != sockfd) {
+        return;
+    }
+    buf_free(send_queue.buf);
+    send_queue.buf = NULL;
+    send_queue.sent = 0;
+    send_queue.socket = -1;
+}
+
+/**
+ * send the capture timestamp of the frame that the following framebuffer update belongs to
+ *
+ * @param s             socket to write to
+ * @param frame_id      id of frame
+ * @param capture_time  time the frame was captured (sharer clock, us)
+ * @return -1 on error
+ */
+int pkt_send_frame_timestamp(int s, uint32_t frame_id, uint64_t capture_time) {
+    buf_t *b;
+    int ret = 0;
+
+    b = buf_new();
+    buf_add_uint8(b, packet_type_frame_timestamp);
+    buf_add_uint32(b, frame_id);
+    buf_add_uint64(b, capture_time);
+
+    if (send_all(s, b->buf, b->len) < 0) {
+        ret = -1;
+    }
+    buf_free(b);
+    return ret;
+}
+
+/**
+ * read frame timestamp from socket
+ * NOTE! This function expects that the 'type' has already been read from the socket.
+ *
+ * @param[in]  s             socket to read from
+ * @param[out] frame_id      id of frame
+ * @param[out] capture_time  time the frame was captured (sharer clock, us)
+ * @return -1 on error
+ */
+int pkt_recv_frame_timestamp(int s, uint32_t *frame_id, uint64_t *capture_time) {
+    struct __attribute__ ((__packed__)) {
+        uint32_t frame_id;
+        uint64_t capture_time;
+    }
+    pkt;
+
+    if (recv_all(s, &pkt, sizeof(pkt)) <= 0) {
+        return -1;
+    }
+    if (frame_id != NULL) *frame_id = ntohl(pkt.frame_id);
+    if (capture_time != NULL) *capture_time = be64toh(pkt.capture_time);
+    return 0;
+}
+
+/**
+ * report that a frame has been presented on screen
+ *
+ * @param s             socket to write to
+ * @param viewer_id     id of the viewer, so that the sharer can tell the viewer clocks apart
+ * @param frame_id      id of frame
+ * @param capture_time  capture time, as received in the frame timestamp
+ * @param present_time  time the frame was presented (viewer clock, us)
+ * @return -1 on error
+ */
+int pkt_send_frame_presented(int s, uint32_t viewer_id, uint32_t frame_id, uint64_t capture_time,
+                             uint64_t present_time) {
+    buf_t *b;
+    int ret = 0;
+
+    b = buf_new();
+    buf_add_uint8(b, packet_type_frame_presented);
+    buf_add_uint32(b, viewer_id);
+    buf_add_uint32(b, frame_id);
+    buf_add_uint64(b, capture_time);
+    buf_add_uint64(b, present_time);
+
+    if (send_all(s, b->buf, b->len) < 0) {
+        ret = -1;
+    }
+    buf_free(b);
+    return ret;
+}
+
+/**
+ * read frame presented report from socket
+ * NOTE! This function expects that the 'type' has already been read from the socket.
+ *
+ * @param[in]  s             socket to read from
+ * @param[out] viewer_id     id of the viewer that presented the frame
+ * @param[out] frame_id      id of frame
+ * @param[out] capture_time  time the frame was captured (sharer clock, us)
+ * @param[out] present_time  time the frame was presented (viewer clock, us)
+ * @return -1 on error
+ */
+int pkt_recv_frame_presented(int s, uint32_t *viewer_id, uint32_t *frame_id, uint64_t *capture_time,
+                             uint64_t *present_time) {
+    struct __attribute__ ((__packed__)) {
+        uint32_t viewer_id;
+        uint32_t frame_id;
+        uint64_t capture_time;
+        uint64_t present_time;
+    }
+    pkt;
+
+    if (recv_all(s, &pkt, sizeof(pkt)) <= 0) {
+        return -1;
+    }
+    if (viewer_id != NULL) *viewer_id = ntohl(pkt.viewer_id);
+    if (frame_id != NULL) *frame_id = ntohl(pkt.frame_id);
+    if (capture_time != NULL) *capture_time = be64toh(pkt.capture_time);
+    if (present_time != NULL) *present_time = be64toh(pkt.present_time);
+    return 0;
+}
+
+/**
+ * tell viewers to forget all tiles in their tile cache
+ *
+ * @param s  socket to write to
+ * @return -1 on error
+ */
+int pkt_send_tile_cache_reset(int s) {
+    uint8_t type = packet_type_tile_cache_reset;
+
+    if (send_all(s, &type, sizeof(type)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * ask the sharer to use another pixel format
+ *
+ * @param s       socket to write to
+ * @param format  pixel format to use for the following framebuffer updates
+ * @return -1 on error
+ */
+int pkt_send_pixel_format_request(int s, uint8_t format) {
+    uint8_t pkt[2] = { packet_type_pixel_format_request, format };
+
+    if (send_all(s, pkt, sizeof(pkt)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * read pixel format request from socket
+ * NOTE! This function expects that the 'type' has already been read from the socket.
+ *
+ * @param[in]  s       socket to read from
+ * @param[out] format  requested pixel format
+ * @return -1 on error
+ */
+int pkt_recv_pixel_format_request(int s, uint8_t *format) {
+    if (recv_all(s, format, sizeof(*format)) <= 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * ask the sharer to downscale the screen to fit in the viewer's window
+ *
+ * @param s          socket to write to
+ * @param viewer_id  id of the viewer asking
+ * @param width      width of the area the screen is shown in, or 0 for full resolution
+ * @param height     height of the area the screen is shown in, or 0 for full resolution
+ * @return -1 on error
+ */
+int pkt_send_display_size_request(int s, uint32_t viewer_id, uint16_t width, uint16_t height) {
+    buf_t *b;
+    int ret = 0;
+
+    b = buf_new();
+    buf_add_uint8(b, packet_type_display_size_request);
+    buf_add_uint32(b, viewer_id);
+    buf_add_uint16(b, width);
+    buf_add_uint16(b, height);
+
+    if (send_all(s, b->buf, b->len) < 0) {
+        ret = -1;
+    }
+    buf_free(b);
+    return ret;
+}
+
+/**
+ * read display size request from socket
+ * NOTE! This function expects that the 'type' has already been read from the socket.
+ *
+ * @param[in]  s          socket to read from
+ * @param[out] viewer_id  id of the viewer asking
+ * @param[out] width      width of the viewer's display area, 0 for full resolution
+ * @param[out] height     height of the viewer's display area, 0 for full resolution
+ * @return -1 on error
+ */
+int pkt_recv_display_size_request(int s, uint32_t *viewer_id, uint16_t *width, uint16_t *height) {
+    struct __attribute__ ((__packed__)) {
+        uint32_t viewer_id;
+        uint16_t width;
+        uint16_t height;
+    }
+    pkt;
+
+    if (recv_all(s, &pkt, sizeof(pkt)) <= 0) {
+        return -1;
+    }
+    *viewer_id = ntohl(pkt.viewer_id);
+    *width = ntohs(pkt.width);
+    *height = ntohs(pkt.height);
+    return 0;
+}
+
+/**
+ * ask the sharer to send parts of the screen again, e.g. after an update could not be drawn
+ *
+ * @param s          socket to write to
+ * @param flags      REFRESH_FLAG_*
+ * @param regions    parts of the screen to send again
+ * @param n_regions  number of regions (up to REFRESH_REQUEST_MAX_REGIONS), or 0 for the whole screen
+ * @return -1 on error
+ */
+int pkt_send_refresh_request(int s, uint8_t flags, const refresh_region_t *regions, int n_regions) {
+    buf_t *b;
+    int ret = 0;
+
+    if (n_regions > REFRESH_REQUEST_MAX_REGIONS) {
+        // Too many to list, ask for everything instead
+        n_regions = 0;
+    }
+
+    b = buf_new();
+    buf_add_uint8(b, packet_type_refresh_request);
+    buf_add_uint8(b, flags);
+    buf_add_uint8(b, n_regions);
+    for (int i = 0; i < n_regions; i ++) {
+        buf_add_uint16(b, regions[i].x);
+        buf_add_uint16(b, regions[i].y);
+        buf_add_uint16(b, regions[i].width);
+        buf_add_uint16(b, regions[i].height);
+    }
+
+    if (send_all(s, b->buf, b->len) < 0) {
+        ret = -1;
+    }
+    buf_free(b);
+    return ret;
+}
+
+/**
+ * read refresh request from socket
+ * NOTE! This function expects that the 'type' has already been read from the socket.
+ *
+ * @param[in]  s          socket to read from
+ * @param[out] flags      REFRESH_FLAG_*
+ * @param[out] regions    parts of the screen to send again (room for REFRESH_REQUEST_MAX_REGIONS)
+ * @param[out] n_regions  number of regions, 0 for the whole screen
+ * @return -1 on error
+ */
+int pkt_recv_refresh_request(int s, uint8_t *flags, refresh_region_t *regions, int *n_regions) {
+    struct __attribute__ ((__packed__)) {
+        uint8_t flags;
+        uint8_t n_regions;
+    }
+    hdr;
+    struct __attribute__ ((__packed__)) {
+        uint16_t x;
+        uint16_t y;
+        uint16_t width;
+        uint16_t height;
+    }
+    pkt;
+
+    if (recv_all(s, &hdr, sizeof(hdr)) <= 0) {
+        return -1;
+    }
+    for (int i = 0; i < hdr.n_regions; i ++) {
+        if (recv_all(s, &pkt, sizeof(pkt)) <= 0) {
+            return -1;
+        }
+        regions[i].x = ntohs(pkt.x);
+        regions[i].y = ntohs(pkt.y);
+        regions[i].width = ntohs(pkt.width);
+        regions[i].height = ntohs(pkt.height);
+    }
+    *flags = hdr.flags;
+    *n_regions = hdr.n_regions;
+    return 0;
+}
+
+/**
+ * tell the viewers where the monitors are on the shared screen, each of them is grabbed as a stream of its own
+ *
+ * @param s          socket to write to
+ * @param outputs    the monitors, in the coordinates of the screen sent to the viewers
+ * @param n_outputs  number of monitors (up to SCREEN_LAYOUT_MAX_OUTPUTS)
+ * @return -1 on error
+ */
+int pkt_send_screen_layout(int s, const refresh_region_t *outputs, int n_outputs) {
+    buf_t *b;
+    int ret = 0;
+
+    if (n_outputs > SCREEN_LAYOUT_MAX_OUTPUTS) {
+        n_outputs = SCREEN_LAYOUT_MAX_OUTPUTS;
+    }
+
+    b = buf_new();
+    buf_add_uint8(b, packet_type_screen_layout);
+    buf_add_uint8(b, n_outputs);
+    for (int i = 0; i < n_outputs; i ++) {
+        buf_add_uint16(b, outputs[i].x);
+        buf_add_uint16(b, outputs[i].y);
+        buf_add_uint16(b, outputs[i].width);
+        buf_add_uint16(b, outputs[i].height);
+    }
+
+    if (send_all(s, b->buf, b->len) < 0) {
+        ret = -1;
+    }
+    buf_free(b);
+    return ret;
+}
+
+/**
+ * read screen layout from socket
+ * NOTE! This function expects that the 'type' has already been read from the socket.
+ *
+ * @param[in]  s          socket to read from
+ * @param[out] outputs    the monitors (room for SCREEN_LAYOUT_MAX_OUTPUTS)
+ * @param[out] n_outputs  number of monitors
+ * @return -1 on error
+ */
+int pkt_recv_screen_layout(int s, refresh_region_t *outputs, int *n_outputs) {
+    uint8_t n;
+    struct __attribute__ ((__packed__)) {
+        uint16_t x;
+        uint16_t y;
+        uint16_t width;
+        uint16_t height;
+    }
+    pkt;
+
+    if (recv_all(s, &n, sizeof(n)) <= 0) {
+        return -1;
+    }
+    for (int i = 0; i < n; i ++) {
+        if (recv_all(s, &pkt, sizeof(pkt)) <= 0) {
+            return -1;
+        }
+        outputs[i].x = ntohs(pkt.x);
+        outputs[i].y = ntohs(pkt.y);
+        outputs[i].width = ntohs(pkt.width);
+        outputs[i].height = ntohs(pkt.height);
+    }
+    *n_outputs = n;
+    return 0;
+}
+
+/**
+ * send checksums of the screen, so that the viewers can check that they have the same screen
  *
- * @param sockfd  socket to read data from
- * @param ptr     pointer to save data to
- * @param sz      number of bytes to read
- * @return  < 0 on error, otherwise the number of bytes read
+ * @param s            socket to write to
+ * @param width        width of screen
+ * @param height       height of screen
+ * @param band_height  number of rows covered by each checksum
+ * @param checksums    one checksum for each band, from the top, SCREEN_CHECKSUM_NONE for bands that can't be checked
+ * @param n_bands      number of checksums
+ * @return -1 on error
  */
+int pkt_send_screen_checksums(int s, uint16_t width, uint16_t height, uint16_t band_height,
+                              const uint32_t *checksums, int n_bands) {
+    buf_t *b;
+    int ret = 0;
 
-int recv_all(int sockfd, void *ptr, size_t sz) {
-    size_t read = 0;
-    size_t ret;
-    while (read < sz) {
-        ret = recv(sockfd, ptr+read, sz-read, 0);
-        if (ret < 0) {
-            return ret;
-        }
-        read += ret;
+    b = buf_new();
+    buf_add_uint8(b, packet_type_screen_checksums);
+    buf_add_uint16(b, width);
+    buf_add_uint16(b, height);
+    buf_add_uint16(b, band_height);
+    buf_add_uint16(b, n_bands);
+    for (int i = 0; i < n_bands; i ++) {
+        buf_add_uint32(b, checksums[i]);
     }
-    return read;
+
+    if (send_all(s, b->buf, b->len) < 0) {
+        ret = -1;
+    }
+    buf_free(b);
+    return ret;
 }
 
 /**
- * read a length-encoded string from socket
- * NOTE! expects the first u8 to be the length of the string
+ * read screen checksums from socket
+ * NOTE! This function expects that the 'type' has already been read from the socket.
  *
- * @param sockfd  socket to read from
- * @return newly allocated, null terminated string on success, or NULL on failure
+ * @param[in]  s            socket to read from
+ * @param[out] width        width of screen
+ * @param[out] height       height of screen
+ * @param[out] band_height  number of rows covered by each checksum
+ * @param[out] checksums    newly allocated list of checksums, to be freed by the caller
+ * @param[out] n_bands      number of checksums
+ * @return -1 on error
  */
-char *recv_str(int sockfd) {
-    uint8_t len;
-    char *str;
-
-    if (recv_all(sockfd, &len, sizeof(len)) < 0) {
-        perror("recv_all(len)");
-        return NULL;
+int pkt_recv_screen_checksums(int s, uint16_t *width, uint16_t *height, uint16_t *band_height,
+                              uint32_t **checksums, int *n_bands) {
+    struct __attribute__ ((__packed__)) {
+        uint16_t width;
+        uint16_t height;
+        uint16_t band_height;
+        uint16_t n_bands;
     }
+    hdr;
+    uint32_t *list;
 
-
-    str = malloc(len + 1);
-    if (str == NULL) {
-        perror("malloc()");
-        return NULL;
+    if (recv_all(s, &hdr, sizeof(hdr)) <= 0) {
+        return -1;
     }
 
-    if (len > 0) {
-        if (recv_all(sockfd, str, len) < 0) {
-            perror("recv_all(session_name)");
-            free(str);
-            return NULL;
-        }
+    list = malloc((ntohs(hdr.n_bands) + 1) * sizeof(uint32_t));
+    if (list == NULL) {
+        return -1;
+    }
+    if (hdr.n_bands != 0 && recv_all(s, list, ntohs(hdr.n_bands) * sizeof(uint32_t)) <= 0) {
+        free(list);
+        return -1;
+    }
+    for (int i = 0; i < ntohs(hdr.n_bands); i ++) {
+        list[i] = ntohl(list[i]);
     }
 
-    str[len] = '\0';
-    return str;
+    *width = ntohs(hdr.width);
+    *height = ntohs(hdr.height);
+    *band_height = ntohs(hdr.band_height);
+    *n_bands = ntohs(hdr.n_bands);
+    *checksums = list;
+    return 0;
 }
 
 /**
- * inform server that we want to share our screen in the current session
+ * send a clock ping, used to estimate the clock offset to the other end
  *
- * @param s      socket to write to
- * @param width  width of session screen
- * @param height height of session screen
+ * @param s   socket to write to
+ * @param t0  our current time (us)
  * @return -1 on error
  */
-int pkt_send_session_screenshare_request(int s, uint16_t width, uint16_t height) {
-    size_t sz;
+int pkt_send_clock_ping(int s, uint64_t t0) {
     buf_t *b;
     int ret = 0;
 
     b = buf_new();
-    buf_add_uint8(b, packet_type_session_screenshare_start);
-    buf_add_uint16(b, width);
-    buf_add_uint16(b, height);
+    buf_add_uint8(b, packet_type_clock_ping);
+    buf_add_uint64(b, t0);
 
-    sz = send(s, b->buf, b->len, 0);
-    if (sz != b->len) {
-        printf("%s: could not send, errno: %s\n", __FUNCTION__, strerror(errno));
+    if (send_all(s, b->buf, b->len) < 0) {
         ret = -1;
     }
     buf_free(b);
@@ -122,84 +837,76 @@ int pkt_send_session_screenshare_request(int s, uint16_t width, uint16_t height)
 }
 
 /**
- * read session screenshare start information from socket
+ * read clock ping from socket
  * NOTE! This function expects that the 'type' has already been read from the socket.
  *
- * @param[in] s        socket to read from
- * @param[out] width   width of screen to be displayed
- * @param[out] height  height of screen to be displayed
- * @return  -1 on error
+ * @param[in]  s   socket to read from
+ * @param[out] t0  time the ping was sent (remote clock, us)
+ * @return -1 on error
  */
-int pkt_recv_session_screenshare_start_request(int s, u_int16_t *width, u_int16_t *height) {
-    struct __attribute__ ((__packed__)) {
-        uint16_t width;
-        uint16_t height;
-    }
-    pkt;
+int pkt_recv_clock_ping(int s, uint64_t *t0) {
+    uint64_t pkt;
 
     if (recv_all(s, &pkt, sizeof(pkt)) <= 0) {
-        printf("%s: could not send, errno: %s\n", __FUNCTION__, strerror(errno));
         return -1;
     }
-    if (width != NULL) *width = ntohs(pkt.width);
-    if (height != NULL) *height = ntohs(pkt.height);
+    if (t0 != NULL) *t0 = be64toh(pkt);
     return 0;
 }
 
-
 /**
- * Send framebuffer update to server
+ * answer a clock ping
  *
- * @param sockfd  socket to send update on
- * @param update update to send to server
- * @return -1 on error, otherwise 0
+ * @param s          socket to write to
+ * @param viewer_id  id of the viewer, so that the sharer can tell the viewer clocks apart
+ * @param t0         timestamp received in the ping
+ * @param t1         our time when the ping was received (us)
+ * @return -1 on error
  */
-int pkt_send_framebuffer_update(int sockfd, framebuffer_update_t *update) {
+int pkt_send_clock_pong(int s, uint32_t viewer_id, uint64_t t0, uint64_t t1) {
     buf_t *b;
-    framebuffer_rect_t *rect;
     int ret = 0;
-    uint8_t *compressed_data = NULL;
-    int i;
 
     b = buf_new();
-    buf_add_uint8(b, packet_type_framebuffer_update);
-    buf_add_uint8(b, update->n_rects);
-
-    for (i = 0; i < update->n_rects; i ++) {
-        rect = update->rects[i];
-        buf_add_uint16(b, rect->xpos);
-        buf_add_uint16(b, rect->ypos);
-        buf_add_uint16(b, rect->width);
-        buf_add_uint16(b, rect->height);
-        buf_add_uint8(b, rect->encoding_type);
-
-        switch (rect->encoding_type) {
-        case framebuffer_encoding_type_raw:
-            // 3 bytes per pixel (RGB)
-            buf_add_bytes(b,  rect->width * rect->height * 3, (uint8_t *)rect->enc.raw.data);
-            break;
-        case framebuffer_encoding_type_solid:
-            buf_add_uint8(b, rect->enc.solid.red);
-            buf_add_uint8(b, rect->enc.solid.green);
-            buf_add_uint8(b, rect->enc.solid.blue);
-            break;
-        default:
-            fprintf(stderr, "%s: encoding type %d not implemented!\n", __FUNCTION__, rect->encoding_type);
-            buf_free(b);
-            return -1;
-        }
-    }
+    buf_add_uint8(b, packet_type_clock_pong);
+    buf_add_uint32(b, viewer_id);
+    buf_add_uint64(b, t0);
+    buf_add_uint64(b, t1);
 
-    if (send_all(sockfd, b->buf, b->len) < 0) {
+    if (send_all(s, b->buf, b->len) < 0) {
         ret = -1;
     }
     buf_free(b);
-    if (compressed_data) {
-        free(compressed_data);
-    }
     return ret;
 }
 
+/**
+ * read clock pong from socket
+ * NOTE! This function expects that the 'type' has already been read from the socket.
+ *
+ * @param[in]  s          socket to read from
+ * @param[out] viewer_id  id of the viewer that answered
+ * @param[out] t0         time the ping was sent (our clock, us)
+ * @param[out] t1         time the ping was received (remote clock, us)
+ * @return -1 on error
+ */
+int pkt_recv_clock_pong(int s, uint32_t *viewer_id, uint64_t *t0, uint64_t *t1) {
+    struct __attribute__ ((__packed__)) {
+        uint32_t viewer_id;
+        uint64_t t0;
+        uint64_t t1;
+    }
+    pkt;
+
+    if (recv_all(s, &pkt, sizeof(pkt)) <= 0) {
+        return -1;
+    }
+    if (viewer_id != NULL) *viewer_id = ntohl(pkt.viewer_id);
+    if (t0 != NULL) *t0 = be64toh(pkt.t0);
+    if (t1 != NULL) *t1 = be64toh(pkt.t1);
+    return 0;
+}
+
 /**
  * send the current cursor position and type
  *
@@ -210,7 +917,6 @@ int pkt_send_framebuffer_update(int sockfd, framebuffer_update_t *update) {
  * @return -1 on error
  */
 int pkt_send_cursorinfo(int s, uint16_t x, uint16_t y, uint8_t cursor) {
-    size_t sz;
     buf_t *b;
     int ret = 0;
 
@@ -220,9 +926,7 @@ int pkt_send_cursorinfo(int s, uint16_t x, uint16_t y, uint8_t cursor) {
     buf_add_uint16(b, y);
     buf_add_uint8(b, cursor);
 
-    printf("sending cursor info (%d x %d, %d)\n", x, y, cursor);
-    sz = send(s, b->buf, b->len, 0);
-    if (sz != b->len) {
+    if (send_all(s, b->buf, b->len) < 0) {
         printf("could not send, errno: %s\n", strerror(errno));
         ret = -1;
     }
@@ -259,6 +963,94 @@ int pkt_recv_cursorinfo(int s, uint16_t *x, uint16_t *y, uint8_t *cursor) {
     return 0;
 }
 
+/**
+ * send the shape of the cursor
+ * If shape->width and shape->height are 0, no image is sent, and the receiver
+ * should use the image it has cached for shape->serial.
+ *
+ * @param s      socket to write to
+ * @param shape  cursor shape to send
+ * @return -1 on error
+ */
+int pkt_send_cursor_shape(int s, cursor_shape_t *shape) {
+    buf_t *b;
+    int ret = 0;
+    int i;
+
+    b = buf_new();
+    buf_add_uint8(b, packet_type_cursor_shape);
+    buf_add_uint32(b, shape->serial);
+    buf_add_uint16(b, shape->width);
+    buf_add_uint16(b, shape->height);
+    buf_add_uint16(b, shape->xhot);
+    buf_add_uint16(b, shape->yhot);
+    for (i = 0; i < shape->width * shape->height; i ++) {
+        buf_add_uint32(b, shape->pixels[i]);
+    }
+
+    if (send_all(s, b->buf, b->len) < 0) {
+        ret = -1;
+    }
+    buf_free(b);
+    return ret;
+}
+
+/**
+ * read cursor shape from socket
+ * NOTE! This function expects that the 'type' has already been read from the socket.
+ *
+ * @param[in]  s      socket to read from
+ * @param[out] shape  cursor shape (shape->pixels is allocated and must be free'd by caller,
+ *                    or is NULL if no image was sent)
+ * @return -1 on error
+ */
+int pkt_recv_cursor_shape(int s, cursor_shape_t *shape) {
+    struct __attribute__ ((__packed__)) {
+        uint32_t serial;
+        uint16_t width;
+        uint16_t height;
+        uint16_t xhot;
+        uint16_t yhot;
+    }
+    pkt;
+    int i;
+
+    if (recv_all(s, &pkt, sizeof(pkt)) <= 0) {
+        return -1;
+    }
+
+    shape->serial = ntohl(pkt.serial);
+    shape->width = ntohs(pkt.width);
+    shape->height = ntohs(pkt.height);
+    shape->xhot = ntohs(pkt.xhot);
+    shape->yhot = ntohs(pkt.yhot);
+    shape->pixels = NULL;
+
+    if (shape->width > CURSOR_MAX_SIZE || shape->height > CURSOR_MAX_SIZE) {
+        fprintf(stderr, "%s: cursor too large (%dx%d)\n", __FUNCTION__, shape->width, shape->height);
+        return -1;
+    }
+
+    if (shape->width * shape->height == 0) {
+        return 0;
+    }
+
+    shape->pixels = malloc(shape->width * shape->height * sizeof(uint32_t));
+    if (shape->pixels == NULL) {
+        return -1;
+    }
+
+    if (recv_all(s, shape->pixels, shape->width * shape->height * sizeof(uint32_t)) <= 0) {
+        free(shape->pixels);
+        shape->pixels = NULL;
+        return -1;
+    }
+    for (i = 0; i < shape->width * shape->height; i ++) {
+        shape->pixels[i] = ntohl(shape->pixels[i]);
+    }
+    return 0;
+}
+
 /**
  * request to join an existing session
  *
@@ -324,7 +1116,8 @@ int pkt_send_session_join_response(int s, pkt_session_join_response_t *pkt) {
     buf_add_uint8(b, packet_type_session_join_response);
     buf_add_uint8(b, pkt->status);
 
-    if (pkt->status == SESSION_JOIN_CLIENT_JOINED || pkt->status == SESSION_JOIN_CLIENT_LEFT) {
+    if (pkt->status == SESSION_JOIN_CLIENT_JOINED || pkt->status == SESSION_JOIN_CLIENT_LEFT ||
+        pkt->status == SESSION_JOIN_CLIENT_RESUMED || pkt->status == SESSION_JOIN_CLIENT_AWAY) {
         uint8_t len = strlen(pkt->client_name);
         buf_add_uint8(b, len);
         buf_add_string(b, pkt->client_name);
@@ -354,7 +1147,8 @@ int pkt_recv_session_join_response(int s, pkt_session_join_response_t *pkt) {
     }
     pkt->status = status;
 
-    if (status == SESSION_JOIN_CLIENT_JOINED || status == SESSION_JOIN_CLIENT_LEFT) {
+    if (status == SESSION_JOIN_CLIENT_JOINED || status == SESSION_JOIN_CLIENT_LEFT ||
+        status == SESSION_JOIN_CLIENT_RESUMED || status == SESSION_JOIN_CLIENT_AWAY) {
         char *name = recv_str(s);
         if (name == NULL) {
             return -1;
@@ -365,6 +1159,90 @@ int pkt_recv_session_join_response(int s, pkt_session_join_response_t *pkt) {
     return 0;
 }
 
+/**
+ * send a string packet, as used for session tokens
+ *
+ * @param s     socket to write to
+ * @param type  type of packet
+ * @param str   string to send, max 255 bytes
+ * @return -1 on error
+ */
+static int send_str_packet(int s, uint8_t type, const char *str) {
+    buf_t *b;
+    int ret = 0;
+
+    if (strlen(str) > SESSION_TOKEN_MAX_LEN) {
+        return -1;
+    }
+
+    b = buf_new();
+    buf_add_uint8(b, type);
+    buf_add_uint8(b, strlen(str));
+    buf_add_string(b, str);
+
+    if (send_all(s, b->buf, b->len) <= 0) {
+        ret = -1;
+    }
+    buf_free(b);
+    return ret;
+}
+
+/**
+ * send the token a client can use to get back into its session (server)
+ *
+ * @param s      socket to write to
+ * @param token  token to send
+ * @return -1 on error
+ */
+int pkt_send_session_token(int s, const char *token) {
+    return send_str_packet(s, packet_type_session_token, token);
+}
+
+/**
+ * read session token from socket
+ * NOTE! This function expects that the 'type' has already been read from the socket.
+ *
+ * @param[in] s       socket to read from
+ * @param[out] token  token to resume the session with (must be freed by caller)
+ * @return -1 on error
+ */
+int pkt_recv_session_token(int s, char **token) {
+    *token = recv_str(s);
+    if (*token == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * ask the server to put us back into the session we were in before the connection dropped
+ *
+ * The server answers with a session join response, SESSION_JOIN_RESUMED on success.
+ *
+ * @param s      socket to write to
+ * @param token  token received in the session token packet
+ * @return -1 on error
+ */
+int pkt_send_session_resume_request(int s, const char *token) {
+    return send_str_packet(s, packet_type_session_resume_request, token);
+}
+
+/**
+ * read session resume request from socket
+ * NOTE! This function expects that the 'type' has already been read from the socket.
+ *
+ * @param[in] s       socket to read from
+ * @param[out] token  token of the session to resume (must be freed by caller)
+ * @return -1 on error
+ */
+int pkt_recv_session_resume_request(int s, char **token) {
+    *token = recv_str(s);
+    if (*token == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * read framebuffer update from socket
  * NOTE! This function expects that the 'type' has already been read from the socket.
@@ -377,6 +1255,7 @@ int pkt_recv_session_join_response(int s, pkt_session_join_response_t *pkt) {
 int pkt_recv_framebuffer_update(int sockfd, framebuffer_update_t **output) {
     struct __attribute__ ((__packed__)) {
         uint8_t n_rects;
+        uint8_t pixel_format;
     }
     hdr;
 
@@ -392,6 +1271,10 @@ int pkt_recv_framebuffer_update(int sockfd, framebuffer_update_t **output) {
     if (recv_all(sockfd, &hdr, sizeof(hdr)) < 0) {
         return -1;
     }
+    if (hdr.pixel_format >= PIXEL_FORMAT_COUNT) {
+        fprintf(stderr, "%s: unknown pixel format %d\n", __FUNCTION__, hdr.pixel_format);
+        return -1;
+    }
 
     framebuffer_update_t *update = malloc(sizeof(framebuffer_update_t));
     if (update == NULL) {
@@ -399,6 +1282,7 @@ int pkt_recv_framebuffer_update(int sockfd, framebuffer_update_t **output) {
     }
 
     update->n_rects = hdr.n_rects;
+    update->pixel_format = hdr.pixel_format;
     update->rects = malloc(sizeof(framebuffer_rect_t *) * update->n_rects);
 
     int i;
@@ -416,10 +1300,11 @@ int pkt_recv_framebuffer_update(int sockfd, framebuffer_update_t **output) {
         rect->ypos = ntohs(rect_info.ypos);
         rect->width = ntohs(rect_info.width);
         rect->height = ntohs(rect_info.height);
+        rect->hash = 0;
         rect->encoding_type = rect_info.encoding_type;
 
         if (rect->encoding_type == framebuffer_encoding_type_raw) {
-            size_t sz = rect->width * rect->height * 3;
+            size_t sz = rect->width * rect->height * pixfmt_bpp(update->pixel_format);
             uint8_t *data = malloc(sz);
             if (data == NULL) {
                 return errno;
@@ -436,6 +1321,51 @@ int pkt_recv_framebuffer_update(int sockfd, framebuffer_update_t **output) {
             rect->enc.solid.red = pixel[0];
             rect->enc.solid.green = pixel[1];
             rect->enc.solid.blue = pixel[2];
+        } else if (rect->encoding_type == framebuffer_encoding_type_trle) {
+            uint32_t length;
+            if (recv_all(sockfd, &length, sizeof(length)) < 0) {
+                return errno;
+            }
+            length = ntohl(length);
+            if (length > TRLE_MAX_SIZE(rect->width, rect->height)) {
+                fprintf(stderr, "%s: trle rect too large (%u bytes)\n", __FUNCTION__, length);
+                return -1;
+            }
+            uint8_t *data = malloc(length);
+            if (data == NULL) {
+                return errno;
+            }
+            if (recv_all(sockfd, data, length) < 0) {
+                return errno;
+            }
+            rect->enc.trle.length = length;
+            rect->enc.trle.data = data;
+        } else if (rect->encoding_type == framebuffer_encoding_type_jpeg) {
+            uint32_t length;
+            if (recv_all(sockfd, &length, sizeof(length)) < 0) {
+                return errno;
+            }
+            length = ntohl(length);
+            // A JPEG image should never be larger than the uncompressed pixels, plus headers
+            if (length > (uint32_t)rect->width * rect->height * 4 + 1024) {
+                fprintf(stderr, "%s: jpeg rect too large (%u bytes)\n", __FUNCTION__, length);
+                return -1;
+            }
+            uint8_t *data = malloc(length);
+            if (data == NULL) {
+                return errno;
+            }
+            if (recv_all(sockfd, data, length) < 0) {
+                return errno;
+            }
+            rect->enc.jpeg.length = length;
+            rect->enc.jpeg.data = data;
+        } else if (rect->encoding_type == framebuffer_encoding_type_cached) {
+            uint16_t slot;
+            if (recv_all(sockfd, &slot, sizeof(slot)) < 0) {
+                return errno;
+            }
+            rect->enc.cached.slot = ntohs(slot);
         } else {
             fprintf(stderr, "%s: unknown encoding %d\n", __FUNCTION__, rect->encoding_type);
             return -1;
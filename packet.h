@@ -11,6 +11,22 @@
 #define SHAREIT_PACKET_H
 #include <stdint.h>
 #include "framebuffer.h"
+#include "cursor.h"
+
+// Max number of rects in a single framebuffer update packet
+#define FRAMEBUFFER_UPDATE_MAX_RECTS 255
+
+// Max number of regions in a single refresh request
+#define REFRESH_REQUEST_MAX_REGIONS 255
+
+// Max number of monitors in a screen layout
+#define SCREEN_LAYOUT_MAX_OUTPUTS 255
+
+// Max length of a session token
+#define SESSION_TOKEN_MAX_LEN 255
+
+// The viewer's tile cache can't be trusted, and should be reset before the refresh
+#define REFRESH_FLAG_RESET_TILE_CACHE 0x01
 
 // Types of data packets
 enum packet_type {
@@ -21,34 +37,100 @@ enum packet_type {
     packet_type_session_join_request = 3,
     packet_type_session_join_response = 4,
     packet_type_session_screenshare_start = 5,
+    packet_type_session_token = 16,
+    packet_type_session_resume_request = 17,
+
+    // Latency measurement
+    packet_type_frame_timestamp = 6,
+    packet_type_frame_presented = 7,
+    packet_type_clock_ping = 8,
+    packet_type_clock_pong = 9,
+
+    packet_type_cursor_shape = 10,
+    packet_type_tile_cache_reset = 11,
+    packet_type_pixel_format_request = 12,
+    packet_type_display_size_request = 13,
+    packet_type_refresh_request = 14,
+    packet_type_screen_checksums = 15,
+    packet_type_screen_layout = 18,
 };
 
-enum {
+enum session_join_status {
     SESSION_JOIN_OK = 1,
     SESSION_JOIN_NOT_FOUND = 2,
     SESSION_JOIN_INVALID_PASSWORD = 3,
     SESSION_JOIN_CLIENT_JOINED = 4, // A new client has joined the session
     SESSION_JOIN_CLIENT_LEFT = 5, // A client has left the session
-} session_join_status;
+    SESSION_JOIN_RESUMED = 6, // We're back in the session we were in before the connection dropped
+    SESSION_JOIN_CLIENT_RESUMED = 7, // A client has reconnected to the session
+    SESSION_JOIN_CLIENT_AWAY = 8, // A client's connection has dropped, it may resume the session
+};
 
 typedef struct {
     uint8_t status;
-    char *client_name;  // Only set if 'status' is SESSION_JOIN_CLIENT_ADDED or SESSION_JOIN_CLIENT_LEFT
+    char *client_name;  // Only set if 'status' is SESSION_JOIN_CLIENT_ADDED, SESSION_JOIN_CLIENT_LEFT,
+                        // SESSION_JOIN_CLIENT_RESUMED or SESSION_JOIN_CLIENT_AWAY
 }
 pkt_session_join_response_t;
 
 int pkt_send_session_screenshare_request (int s, uint16_t width, uint16_t height);
 int pkt_recv_session_screenshare_start_request(int s, u_int16_t *width, u_int16_t *height);
 
+int framebuffer_update_wire_size(framebuffer_update_t *update);
 int pkt_send_framebuffer_update(int sockfd, framebuffer_update_t *update);
+int pkt_queue_framebuffer_update(int sockfd, framebuffer_update_t *update);
+int pkt_send_queued(int sockfd);
+void pkt_queue_clear(int sockfd);
 int pkt_recv_framebuffer_update(int sockfd, framebuffer_update_t **output);
 
+int pkt_send_frame_timestamp(int s, uint32_t frame_id, uint64_t capture_time);
+int pkt_recv_frame_timestamp(int s, uint32_t *frame_id, uint64_t *capture_time);
+
+int pkt_send_frame_presented(int s, uint32_t viewer_id, uint32_t frame_id, uint64_t capture_time,
+                             uint64_t present_time);
+int pkt_recv_frame_presented(int s, uint32_t *viewer_id, uint32_t *frame_id, uint64_t *capture_time,
+                             uint64_t *present_time);
+
+int pkt_send_clock_ping(int s, uint64_t t0);
+int pkt_recv_clock_ping(int s, uint64_t *t0);
+
+int pkt_send_clock_pong(int s, uint32_t viewer_id, uint64_t t0, uint64_t t1);
+int pkt_recv_clock_pong(int s, uint32_t *viewer_id, uint64_t *t0, uint64_t *t1);
+
 int pkt_send_cursorinfo(int s, uint16_t x, uint16_t y, uint8_t cursor);
 int pkt_recv_cursorinfo(int s, uint16_t *x, uint16_t *y, uint8_t *cursor);
 
+int pkt_send_tile_cache_reset(int s);
+
+int pkt_send_pixel_format_request(int s, uint8_t format);
+int pkt_recv_pixel_format_request(int s, uint8_t *format);
+
+int pkt_send_refresh_request(int s, uint8_t flags, const refresh_region_t *regions, int n_regions);
+int pkt_recv_refresh_request(int s, uint8_t *flags, refresh_region_t *regions, int *n_regions);
+
+int pkt_send_screen_checksums(int s, uint16_t width, uint16_t height, uint16_t band_height,
+                              const uint32_t *checksums, int n_bands);
+int pkt_recv_screen_checksums(int s, uint16_t *width, uint16_t *height, uint16_t *band_height,
+                              uint32_t **checksums, int *n_bands);
+
+int pkt_send_screen_layout(int s, const refresh_region_t *outputs, int n_outputs);
+int pkt_recv_screen_layout(int s, refresh_region_t *outputs, int *n_outputs);
+
+int pkt_send_display_size_request(int s, uint32_t viewer_id, uint16_t width, uint16_t height);
+int pkt_recv_display_size_request(int s, uint32_t *viewer_id, uint16_t *width, uint16_t *height);
+
+int pkt_send_cursor_shape(int s, cursor_shape_t *shape);
+int pkt_recv_cursor_shape(int s, cursor_shape_t *shape);
+
 int pkt_send_session_join_request(int s, const char *session_name, const char *password);
 int pkt_recv_session_join_request(int s, char **session_name, char **password);
 
 int pkt_send_session_join_response(int s, pkt_session_join_response_t *pkt);
 int pkt_recv_session_join_response(int s, pkt_session_join_response_t *pkt);
+
+int pkt_send_session_token(int s, const char *token);
+int pkt_recv_session_token(int s, char **token);
+
+int pkt_send_session_resume_request(int s, const char *token);
+int pkt_recv_session_resume_request(int s, char **token);
 #endif
@@ -0,0 +1,66 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#ifndef SHAREIT_PALETTE_H
+#define SHAREIT_PALETTE_H
+#include <stdint.h>
+#include <string.h>
+
+// Largest palette that can be collected, and size of the hash table used to find colours in it.
+// The table is kept at most half full, so that probe sequences stay short.
+#define PALETTE_MAX_COLOURS 127
+#define PALETTE_HASH_SIZE 256
+
+typedef struct {
+    uint32_t colours[PALETTE_MAX_COLOURS];
+    int n_colours;
+    int max_colours;                  // palette_index() fails when more colours than this are added
+    int16_t table[PALETTE_HASH_SIZE]; // index in 'colours', or -1 if unused
+} palette_t;
+
+/**
+ * empty a palette
+ *
+ * @param palette      palette to reset
+ * @param max_colours  max number of colours to collect (at most PALETTE_MAX_COLOURS)
+ */
+static inline void palette_reset(palette_t *palette, int max_colours) {
+    palette->n_colours = 0;
+    palette->max_colours = max_colours;
+    memset(palette->table, 0xff, sizeof(palette->table));
+}
+
+/**
+ * find the index of a colour, adding it to the palette if needed
+ *
+ * @param palette  palette to search
+ * @param colour   colour to find (24 bits)
+ * @return index of colour, or -1 if the palette is full
+ */
+static inline int palette_index(palette_t *palette, uint32_t colour) {
+    uint32_t pos = (colour * 0x9E3779B1u) >> 24;
+
+    for (;; pos = (pos + 1) & (PALETTE_HASH_SIZE - 1)) {
+        int i = palette->table[pos];
+        if (i == -1) {
+            break;
+        }
+        if (palette->colours[i] == colour) {
+            return i;
+        }
+    }
+
+    if (palette->n_colours == palette->max_colours) {
+        return -1;
+    }
+    palette->colours[palette->n_colours] = colour;
+    palette->table[pos] = palette->n_colours;
+    return palette->n_colours++;
+}
+#endif
@@ -0,0 +1,40 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#include <string.h>
+#include "pixfmt.h"
+
+static const char *names[PIXEL_FORMAT_COUNT] = {
+    [pixel_format_rgb888] = "rgb888",
+    [pixel_format_rgb565] = "rgb565",
+    [pixel_format_rgb332] = "rgb332",
+    [pixel_format_grey8] = "grey8",
+};
+
+const char *pixfmt_name(int format) {
+    if (format < 0 || format >= PIXEL_FORMAT_COUNT) {
+        return "unknown";
+    }
+    return names[format];
+}
+
+/**
+ * find a pixel format by name
+ *
+ * @param name  name of format, as returned by pixfmt_name()
+ * @return pixel format, or -1 if there's no format with that name
+ */
+int pixfmt_parse(const char *name) {
+    for (int i = 0; i < PIXEL_FORMAT_COUNT; i ++) {
+        if (strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
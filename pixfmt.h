@@ -0,0 +1,147 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#ifndef SHAREIT_PIXFMT_H
+#define SHAREIT_PIXFMT_H
+#include <stdint.h>
+
+/*
+ * Pixel formats used for the pixels in raw and TRLE rects.
+ * Screen pixels are 0x00RRGGBB, and RGB888 sends the three lower bytes as they are.
+ * Formats are ordered by decreasing fidelity.
+ */
+enum pixel_format {
+    pixel_format_rgb888 = 0,  // 3 bytes: blue, green, red
+    pixel_format_rgb565 = 1,  // 2 bytes: rrrrrggg gggbbbbb (network byte order)
+    pixel_format_rgb332 = 2,  // 1 byte:  rrrgggbb
+    pixel_format_grey8 = 3,   // 1 byte:  luminance
+    PIXEL_FORMAT_COUNT,
+};
+
+const char *pixfmt_name(int format);
+int pixfmt_parse(const char *name);
+
+/*
+ * The functions below are called for every pixel, and are inlined
+ * so that the format checks can be hoisted out of the loops.
+ */
+
+/**
+ * number of bytes used for each pixel on the wire
+ */
+static inline int pixfmt_bpp(int format) {
+    switch (format) {
+    case pixel_format_rgb565:
+        return 2;
+    case pixel_format_rgb332:
+    case pixel_format_grey8:
+        return 1;
+    default:
+        return 3;
+    }
+}
+
+/**
+ * convert a screen pixel to its value in a pixel format
+ *
+ * @param format  pixel format to convert to
+ * @param pixel   screen pixel, 0x00RRGGBB (the upper byte is ignored)
+ * @return pixel value, pixels that look the same in 'format' get the same value
+ */
+static inline uint32_t pixfmt_reduce(int format, uint32_t pixel) {
+    switch (format) {
+    case pixel_format_rgb565:
+        return ((pixel >> 8) & 0xf800) | ((pixel >> 5) & 0x07e0) | ((pixel >> 3) & 0x001f);
+    case pixel_format_rgb332:
+        return ((pixel >> 16) & 0xe0) | ((pixel >> 11) & 0x1c) | ((pixel >> 6) & 0x03);
+    case pixel_format_grey8:
+        return (((pixel >> 16) & 0xff) * 77 + ((pixel >> 8) & 0xff) * 150 + (pixel & 0xff) * 29) >> 8;
+    default:
+        return pixel & 0xffffff;
+    }
+}
+
+/**
+ * write a pixel value returned by pixfmt_reduce()
+ *
+ * @param format  pixel format of value
+ * @param out     buffer to write pixfmt_bpp() bytes to
+ * @param value   pixel value
+ * @return pointer to the byte after the pixel
+ */
+static inline uint8_t *pixfmt_put(int format, uint8_t *out, uint32_t value) {
+    switch (format) {
+    case pixel_format_rgb565:
+        out[0] = value >> 8;
+        out[1] = value & 0xff;
+        return out + 2;
+    case pixel_format_rgb332:
+    case pixel_format_grey8:
+        out[0] = value;
+        return out + 1;
+    default:
+        out[0] = value & 0xff;
+        out[1] = (value >> 8) & 0xff;
+        out[2] = (value >> 16) & 0xff;
+        return out + 3;
+    }
+}
+
+/**
+ * expand a pixel from the wire to the 3 bytes used by the view (blue, green, red)
+ *
+ * @param format  pixel format of 'in'
+ * @param in      pixel as sent on the wire
+ * @param out     view pixel to write to
+ */
+static inline void pixfmt_expand(int format, const uint8_t *in, uint8_t *out) {
+    uint32_t v;
+
+    switch (format) {
+    case pixel_format_rgb565:
+        v = (in[0] << 8) | in[1];
+        out[0] = ((v & 0x1f) << 3) | ((v & 0x1f) >> 2);
+        out[1] = (((v >> 5) & 0x3f) << 2) | (((v >> 5) & 0x3f) >> 4);
+        out[2] = ((v >> 11) << 3) | ((v >> 11) >> 2);
+        break;
+    case pixel_format_rgb332:
+        v = in[0];
+        out[0] = (v & 0x03) * 0x55;
+        out[1] = ((v >> 2) & 0x07) * 0x49 >> 1;
+        out[2] = (v >> 5) * 0x49 >> 1;
+        break;
+    case pixel_format_grey8:
+        out[0] = out[1] = out[2] = in[0];
+        break;
+    default:
+        out[0] = in[0];
+        out[1] = in[1];
+        out[2] = in[2];
+        break;
+    }
+}
+
+/**
+ * get the colour a screen pixel is shown as when it's sent in a pixel format
+ *
+ * @param format  pixel format
+ * @param pixel   screen pixel, 0x00RRGGBB
+ * @return screen pixel with the precision of 'format'
+ */
+static inline uint32_t pixfmt_quantize(int format, uint32_t pixel) {
+    uint8_t wire[3], out[3];
+
+    if (format == pixel_format_rgb888) {
+        return pixel;
+    }
+    pixfmt_put(format, wire, pixfmt_reduce(format, pixel));
+    pixfmt_expand(format, wire, out);
+    return out[0] | (out[1] << 8) | (out[2] << 16);
+}
+#endif
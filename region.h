@@ -0,0 +1,33 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#ifndef SHAREIT_REGION_H
+#define SHAREIT_REGION_H
+
+// Part of the screen to share
+typedef struct {
+    int x;
+    int y;
+    int width;             // 0 to share the whole screen
+    int height;
+    unsigned long window;  // X11 window to follow, or 0 to use x and y
+    const char *output;    // name or number of the monitor to share, or NULL
+} grab_region_t;
+
+#define GRAB_MAX_OUTPUTS 16
+
+// A monitor, as a part of the root window
+typedef struct {
+    char name[32];
+    int x;
+    int y;
+    int width;
+    int height;
+} grab_output_t;
+#endif
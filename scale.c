@@ -0,0 +1,109 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#include "scale.h"
+
+/**
+ * calculate the size of a downscaled screen
+ *
+ * The aspect ratio is kept, and the screen is never scaled up.
+ *
+ * @param[in]  src_width   width of the captured screen
+ * @param[in]  src_height  height of the captured screen
+ * @param[in]  max_width   width of the area the screen should fit in, or 0 for full resolution
+ * @param[in]  max_height  height of the area the screen should fit in, or 0 for full resolution
+ * @param[out] width       width of the downscaled screen
+ * @param[out] height      height of the downscaled screen
+ */
+void scale_fit(int src_width, int src_height, int max_width, int max_height, int *width, int *height) {
+    *width = src_width;
+    *height = src_height;
+
+    if (max_width <= 0 || max_height <= 0 ||
+        (src_width <= max_width && src_height <= max_height)) {
+        return;
+    }
+
+    if (max_width < SCALE_MIN_SIZE) {
+        max_width = SCALE_MIN_SIZE;
+    }
+    if (max_height < SCALE_MIN_SIZE) {
+        max_height = SCALE_MIN_SIZE;
+    }
+
+    if ((int64_t)max_width * src_height <= (int64_t)max_height * src_width) {
+        // Width is the limiting factor
+        if (max_width < src_width) {
+            *width = max_width;
+            *height = (int)((int64_t)src_height * max_width / src_width);
+        }
+    } else if (max_height < src_height) {
+        *height = max_height;
+        *width = (int)((int64_t)src_width * max_height / src_height);
+    }
+
+    if (*width < 1) {
+        *width = 1;
+    }
+    if (*height < 1) {
+        *height = 1;
+    }
+}
+
+/**
+ * downscale screen with a box filter
+ *
+ * Each destination pixel is the average of the source pixels it covers, which
+ * keeps text and thin lines readable compared to just picking every n:th pixel.
+ *
+ * @param src         pixels of the captured screen
+ * @param src_width   width of the captured screen
+ * @param src_height  height of the captured screen
+ * @param dst         buffer to write the downscaled screen to
+ * @param dst_width   width of the downscaled screen, not larger than src_width
+ * @param dst_height  height of the downscaled screen, not larger than src_height
+ * @param dst_tile_size  size of the tiles to store dst as (see screen_to_tiles()), or 0 to store it row by row
+ */
+void scale_screen(const uint32_t *src, int src_width, int src_height,
+                  uint32_t *dst, int dst_width, int dst_height, int dst_tile_size) {
+    int dx, dy, sx, sy;
+    // Row by row is the same as a single column of tiles as wide as the screen
+    int tile_size = dst_tile_size > 0 ? dst_tile_size : dst_width;
+    int tiles_x = (dst_width + tile_size - 1) / tile_size;
+
+    for (dy = 0; dy < dst_height; dy++) {
+        uint32_t *dst_row = dst + (int64_t)(dy / tile_size) * tiles_x * tile_size * tile_size +
+                            (dy % tile_size) * tile_size;
+
+        int y0 = (int)((int64_t)dy * src_height / dst_height);
+        int y1 = (int)((int64_t)(dy + 1) * src_height / dst_height);
+
+        for (dx = 0; dx < dst_width; dx++) {
+            int x0 = (int)((int64_t)dx * src_width / dst_width);
+            int x1 = (int)((int64_t)(dx + 1) * src_width / dst_width);
+            uint32_t r = 0, g = 0, b = 0;
+            uint32_t n = (uint32_t)(x1 - x0) * (y1 - y0);
+
+            for (sy = y0; sy < y1; sy++) {
+                const uint32_t *row = src + sy * src_width;
+                for (sx = x0; sx < x1; sx++) {
+                    r += (row[sx] >> 16) & 0xff;
+                    g += (row[sx] >> 8) & 0xff;
+                    b += row[sx] & 0xff;
+                }
+            }
+
+            // Round to nearest
+            r = (r + n / 2) / n;
+            g = (g + n / 2) / n;
+            b = (b + n / 2) / n;
+            dst_row[(dx / tile_size) * tile_size * tile_size + dx % tile_size] = (r << 16) | (g << 8) | b;
+        }
+    }
+}
@@ -0,0 +1,20 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#ifndef SHAREIT_SCALE_H
+#define SHAREIT_SCALE_H
+#include <stdint.h>
+
+// Viewers can't ask for a screen smaller than this
+#define SCALE_MIN_SIZE 64
+
+void scale_fit(int src_width, int src_height, int max_width, int max_height, int *width, int *height);
+void scale_screen(const uint32_t *src, int src_width, int src_height,
+                  uint32_t *dst, int dst_width, int dst_height, int dst_tile_size);
+#endif
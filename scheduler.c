@@ -0,0 +1,100 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#include "scheduler.h"
+
+/**
+ * setup frame scheduler
+ *
+ * @param scheduler   scheduler to setup
+ * @param min_fps     capture rate to fall back to when nothing is happening
+ * @param max_fps     capture rate to use when the screen is changing
+ * @param cpu_budget  max percentage of time to spend capturing and encoding
+ */
+void scheduler_init(scheduler_t *scheduler, int min_fps, int max_fps, int cpu_budget) {
+    if (min_fps < 1) {
+        min_fps = 1;
+    }
+    if (max_fps < min_fps) {
+        max_fps = min_fps;
+    }
+    if (cpu_budget < 1 || cpu_budget > 100) {
+        cpu_budget = SCHEDULER_DEFAULT_CPU_BUDGET;
+    }
+
+    scheduler->min_fps = min_fps;
+    scheduler->max_fps = max_fps;
+    scheduler->cpu_budget = cpu_budget;
+    scheduler->timer = 0;
+    scheduler_reset(scheduler);
+}
+
+/**
+ * start over at max rate, e.g. when screen sharing starts
+ *
+ * @param scheduler  scheduler to reset
+ */
+void scheduler_reset(scheduler_t *scheduler) {
+    scheduler->interval_ms = 1000 / scheduler->max_fps;
+    scheduler->last_activity = g_get_monotonic_time();
+}
+
+/**
+ * calculate when the next frame should be captured
+ *
+ * The rate jumps to max_fps as soon as there's activity (screen changes or cursor motion),
+ * and stays there for SCHEDULER_IDLE_TIMEOUT_MS. After that it is halved for each idle
+ * frame until it reaches min_fps. The interval is never shorter than what fits in the
+ * CPU budget, and is doubled while the socket has too much unsent data.
+ *
+ * @param scheduler     scheduler to update
+ * @param activity      TRUE if the last frame had changes or the cursor moved
+ * @param work_us       time spent on capturing, encoding and sending the last frame
+ * @param unsent_bytes  number of bytes waiting in the socket send queue (or -1 if unknown)
+ * @return number of ms to wait until the next frame should be captured
+ */
+int scheduler_next_interval(scheduler_t *scheduler, gboolean activity, gint64 work_us, int unsent_bytes) {
+    int min_interval = 1000 / scheduler->max_fps;
+    int max_interval = 1000 / scheduler->min_fps;
+    int sleep_ms, budget_ms;
+    gint64 now = g_get_monotonic_time();
+
+    if (activity) {
+        scheduler->last_activity = now;
+        scheduler->interval_ms = min_interval;
+    } else if (now - scheduler->last_activity > SCHEDULER_IDLE_TIMEOUT_MS * 1000) {
+        scheduler->interval_ms *= 2;
+    }
+
+    if (unsent_bytes > SCHEDULER_BACKPRESSURE_BYTES) {
+        // The network can't keep up, there's no point in producing frames faster than they're sent
+        scheduler->interval_ms *= 2;
+    }
+
+    if (scheduler->interval_ms < min_interval) {
+        scheduler->interval_ms = min_interval;
+    }
+    if (scheduler->interval_ms > max_interval) {
+        scheduler->interval_ms = max_interval;
+    }
+
+    // interval_ms is the time between two captures, and we've already spent some of it working
+    sleep_ms = scheduler->interval_ms - (int)(work_us / 1000);
+
+    // Wait long enough to keep the time spent working within the budget
+    budget_ms = (int)(work_us * 100 / scheduler->cpu_budget / 1000) - (int)(work_us / 1000);
+    if (sleep_ms < budget_ms) {
+        sleep_ms = budget_ms;
+    }
+
+    if (sleep_ms < 1) {
+        sleep_ms = 1;
+    }
+    return sleep_ms;
+}
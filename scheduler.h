@@ -0,0 +1,37 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#ifndef SHAREIT_SCHEDULER_H
+#define SHAREIT_SCHEDULER_H
+#include <glib.h>
+
+#define SCHEDULER_DEFAULT_MIN_FPS 2
+#define SCHEDULER_DEFAULT_MAX_FPS 30
+#define SCHEDULER_DEFAULT_CPU_BUDGET 50  // percent of wall clock time
+
+// Keep capturing at max rate for this long (in ms) after the last change
+#define SCHEDULER_IDLE_TIMEOUT_MS 1000
+
+// Back off if there's more than this many bytes waiting in the socket send queue
+#define SCHEDULER_BACKPRESSURE_BYTES (256 * 1024)
+
+typedef struct {
+    int min_fps;
+    int max_fps;
+    int cpu_budget;      // max percentage of time we may spend capturing and encoding
+
+    int interval_ms;     // current interval between captures
+    gint64 last_activity;
+    guint timer;
+} scheduler_t;
+
+void scheduler_init(scheduler_t *scheduler, int min_fps, int max_fps, int cpu_budget);
+void scheduler_reset(scheduler_t *scheduler);
+int scheduler_next_interval(scheduler_t *scheduler, gboolean activity, gint64 work_us, int unsent_bytes);
+#endif
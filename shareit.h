@@ -2,6 +2,12 @@
 #define SHAREIT_APP_H
 #include <gtk/gtk.h>
 #include "net.h"
+#include "stats.h"
+#include "latency.h"
+#include "scheduler.h"
+#include "cursor.h"
+#include "cache.h"
+#include "region.h"
 
 // Macro to simplify getting widgets from builder
 #define BUILDER_GET(out, type, name) out = type(gtk_builder_get_object(builder, name)); \
@@ -15,28 +21,129 @@ typedef struct {
     int row_stride;  // n. of bytes for each row
     int width;       // width of view
     int height;      // height of view
+    tile_cache_t *cache;  // tiles that the sharer may refer to
 } viewinfo_t;
 
+// Encoder state for each block of the screen (sharer)
+typedef struct {
+    uint8_t history;  // one bit for each of the last 8 frames, set if the block changed (bit 0 is the latest)
+    gboolean lossy;   // block was last sent with lossy encoding, and should be refined when it stops changing
+    uint8_t compared;  // compared by compare_stream() while the frame was grabbed, see 'changed'
+    uint8_t changed;   // result of that comparison
+    uint8_t missed;    // changed while a viewer was away, sent again when it's back
+    uint8_t pixel_format;  // format the viewers have the block in, PIXEL_FORMAT_COUNT if its parts differ
+} tile_state_t;
+
+// Max number of regions the sharer keeps track of until they're refreshed,
+// if the viewers ask for more the whole screen is sent again
+#define REFRESH_MAX_REGIONS 32
+
+// Part of the screen a viewer has asked to get again
+typedef struct {
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+} refresh_region_t;
+
+// Max number of viewers whose display size is remembered, the oldest request is forgotten first
+#define DISPLAY_REQUESTS_MAX 16
+
+// Display size a viewer has asked for
+typedef struct {
+    uint32_t viewer_id;
+    uint16_t width;   // 0 for full resolution
+    uint16_t height;
+} display_request_t;
+
 typedef struct {
     gboolean share_screen;
 
     // Variables used in presentation mode
     void *grabber;
-    int width;
+    const char *grab_backend;    // screen grabber and its options, NULL for the default
+    grab_region_t share_region;  // part of the screen to share
+    int width;           // size of the screen sent to the viewers
     int height;
+    int capture_width;   // size of the grabbed screen, larger than width/height when downscaling
+    int capture_height;
+
+    // Parts of the grabbed screen that are grabbed, and compared, in parallel (e.g. one for each monitor)
+    grab_output_t streams[GRAB_MAX_OUTPUTS];
+    int n_streams;
+
+    // Display size requested from the sharer (viewer), 0 for full resolution
+    int display_width;
+    int display_height;
+
+    // Display sizes the viewers have asked for. Every client keeps track of them,
+    // so they are already known if it starts sharing
+    display_request_t display_requests[DISPLAY_REQUESTS_MAX];
+    int n_display_requests;
 
     uint32_t *current_screen;
     uint32_t *prev_screen;
+    uint32_t *capture_screen;  // grabbed screen, only used when downscaling
+    gboolean tiled_screen;     // current/prev_screen are stored one block at a time, see screen_pixel()
+
+    int block_size;      // size of the blocks the screen is compared in, or 0 for the default
+    int min_block_size;  // changed blocks are split down to this size, or 0 to never split them
+    tile_state_t *tiles;
+    int tiles_x;
+    int tiles_y;
+    int jpeg_quality;  // quality used for lossy blocks, or 0 to always use lossless encoding
+    refresh_region_t refresh_regions[REFRESH_MAX_REGIONS];  // sent again with the next frame
+    int n_refresh_regions;
+    gint64 checksum_time;  // when the viewers were last sent checksums of the screen
+    int pixel_format;  // pixel format used when sharing, or requested from the sharer when viewing
+
+    // Tiles that the viewers have a copy of
+    tile_cache_t *tile_cache;
 
     uint16_t mouse_pos_x;
     uint16_t mouse_pos_y;
+    gboolean has_mouse_pos;
+
+    // Cursor shapes sent to (sharer) or received from (viewer) the other end
+    cursor_cache_t cursors;
+    uint32_t cursor_serial;  // serial of the last cursor shape sent
+    gboolean has_cursor_serial;
+
+    // Decides when the next frame should be captured
+    scheduler_t scheduler;
 
     viewinfo_t *view;
 
+    // Pipeline statistics, NULL unless enabled
+    stats_t *stats;
+
+    // Glass-to-glass latency measurement (sharer), NULL unless enabled
+    latency_t *latency;
+
+    // Random id that tells our clock apart from other viewers' in pongs and frame presented reports (viewer)
+    uint32_t viewer_id;
+
+    // Last frame timestamp received (viewer), reported back when the frame has been presented
+    uint32_t frame_id;
+    uint64_t frame_capture_time;
+    gboolean frame_stamped;  // timestamp received, waiting for framebuffer update
+    gboolean frame_drawn;    // framebuffer update drawn, waiting to be presented
+
     // Network settings
     connection_t *conn;
+    net_connect_async_t *connecting;  // connection attempt in progress, or NULL
     char *host;
     GIOChannel  *channel;
+    guint channel_watch;
+    gboolean latency_mode;     // keep the socket send queue short while sharing, see net_set_latency_mode()
+    gint64 send_buffer_time;   // when the send buffer was last resized
+
+    // Token from the server that gets us back into the session if the connection drops, or NULL
+    char *resume_token;
+    gboolean reconnecting;  // connection lost, nothing is sent until the session has been resumed
+    int reconnect_attempts;
+    guint reconnect_timer;
+    GPtrArray *away_clients;  // names of the other clients whose connection has dropped, or NULL
 
     // Widgets
     GtkWidget *window;
@@ -50,9 +157,12 @@ typedef struct {
     GtkEntry *dlg_select_session_entry;
     GtkWidget *dlg_connect;
     GtkComboBoxText *dlg_connect_server_dropdown;
+    GtkWidget *dlg_connect_connect;
+    GtkLabel *dlg_connect_status;
 
     GtkWidget *screen_share_window;
 } shareit_app_t;
 
 void show_error(shareit_app_t *app, const char *fmt, ...);
+void end_session(shareit_app_t *app, const char *reason);
 #endif
\ No newline at end of file
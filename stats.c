@@ -0,0 +1,198 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "shareit.h"
+#include "framebuffer.h"
+#include "stats.h"
+
+static const char *stage_names[STATS_N_STAGES] = {
+    [stats_stage_capture] = "capture",
+    [stats_stage_diff] = "diff",
+    [stats_stage_encode] = "encode",
+    [stats_stage_send] = "send",
+    [stats_stage_receive] = "receive",
+    [stats_stage_draw] = "draw",
+    [stats_stage_present] = "present",
+};
+
+const char *stats_stage_name(enum stats_stage stage) {
+    if (stage < 0 || stage >= STATS_N_STAGES) {
+        return "unknown";
+    }
+    return stage_names[stage];
+}
+
+/**
+ * create a new, empty, stats collector
+ *
+ * @return newly allocated stats (must be free'd with stats_free()), or NULL on error
+ */
+stats_t *stats_new() {
+    stats_t *stats;
+
+    stats = calloc(1, sizeof(stats_t));
+    if (stats == NULL) {
+        return NULL;
+    }
+    stats->period_start = g_get_monotonic_time();
+    return stats;
+}
+
+void stats_free(stats_t *stats) {
+    if (stats == NULL) {
+        return;
+    }
+
+    if (stats->timer != 0) {
+        g_source_remove(stats->timer);
+    }
+    if (stats->csv != NULL) {
+        fclose(stats->csv);
+    }
+    free(stats);
+}
+
+/**
+ * open a file that a CSV line will be written to after each period
+ *
+ * @param stats     stats to dump
+ * @param filename  name of file to write to
+ * @return 0 on success, otherwise errno
+ */
+int stats_open_csv(stats_t *stats, const char *filename) {
+    int type;
+    int stage;
+
+    stats->csv = fopen(filename, "w");
+    if (stats->csv == NULL) {
+        return errno;
+    }
+
+    fprintf(stats->csv, "time_us,period_us,frames,dropped_frames,bytes_sent,bytes_received");
+    for (stage = 0; stage < STATS_N_STAGES; stage ++) {
+        fprintf(stats->csv, ",%s_count,%s_avg_us,%s_max_us",
+                stage_names[stage], stage_names[stage], stage_names[stage]);
+    }
+    for (type = 0; type < STATS_N_ENCODINGS; type ++) {
+        const char *name = framebuffer_encoding_name(type);
+        if (name != NULL) {
+            fprintf(stats->csv, ",rects_%s", name);
+        }
+    }
+    fprintf(stats->csv, "\n");
+    return 0;
+}
+
+static void stats_write_csv(stats_t *stats) {
+    stats_period_t *p = &stats->last;
+    int type;
+    int stage;
+
+    fprintf(stats->csv, "%" G_GINT64_FORMAT ",%" G_GINT64_FORMAT ",%u,%u,%" G_GUINT64_FORMAT ",%" G_GUINT64_FORMAT,
+            stats->period_start, stats->period_length, p->frames, p->dropped_frames, p->bytes_sent, p->bytes_received);
+    for (stage = 0; stage < STATS_N_STAGES; stage ++) {
+        fprintf(stats->csv, ",%u,%" G_GINT64_FORMAT ",%" G_GINT64_FORMAT, p->count[stage],
+                p->count[stage] > 0 ? p->total_us[stage] / p->count[stage] : 0, p->max_us[stage]);
+    }
+    for (type = 0; type < STATS_N_ENCODINGS; type ++) {
+        if (framebuffer_encoding_name(type) != NULL) {
+            fprintf(stats->csv, ",%u", p->rects[type]);
+        }
+    }
+    fprintf(stats->csv, "\n");
+    fflush(stats->csv);
+}
+
+/**
+ * summarize the last complete period as human readable text
+ *
+ * @param stats   stats to summarize
+ * @param output  buffer to write summary to
+ * @param sz      size of output buffer
+ * @return number of characters written
+ */
+int stats_format_summary(stats_t *stats, char *output, size_t sz) {
+    stats_period_t *p = &stats->last;
+    double seconds = stats->period_length > 0 ? (double)stats->period_length / G_USEC_PER_SEC : 1;
+    int n = 0;
+    int stage;
+    int type;
+
+#define APPEND(...) if ((size_t)n < sz) { n += snprintf(output + n, sz - n, __VA_ARGS__); }
+    APPEND("%.1f fps, %u dropped, sent %.1f KB/s, received %.1f KB/s\n",
+           p->frames / seconds, p->dropped_frames,
+           p->bytes_sent / seconds / 1024, p->bytes_received / seconds / 1024);
+
+    for (stage = 0; stage < STATS_N_STAGES; stage ++) {
+        if (p->count[stage] == 0) {
+            continue;
+        }
+        APPEND("%-8s avg %6.2f ms  max %6.2f ms\n", stage_names[stage],
+               (double)p->total_us[stage] / p->count[stage] / 1000, (double)p->max_us[stage] / 1000);
+    }
+
+    APPEND("rects:");
+    for (type = 0; type < STATS_N_ENCODINGS; type ++) {
+        const char *name = framebuffer_encoding_name(type);
+        if (name != NULL && p->rects[type] > 0) {
+            APPEND(" %s %u", name, p->rects[type]);
+        }
+    }
+    APPEND("\n");
+#undef APPEND
+
+    if ((size_t)n >= sz) {
+        n = sz - 1;
+    }
+    return n;
+}
+
+/**
+ * end the current period, and log / dump it if that has been requested
+ *
+ * @param stats  stats to update
+ */
+void stats_end_period(stats_t *stats) {
+    gint64 now = g_get_monotonic_time();
+
+    stats->last = stats->current;
+    stats->period_length = now - stats->period_start;
+    memset(&stats->current, 0, sizeof(stats->current));
+
+    if (stats->log) {
+        char summary[1024];
+        stats_format_summary(stats, summary, sizeof(summary));
+        printf("%s", summary);
+    }
+
+    if (stats->csv != NULL) {
+        stats_write_csv(stats);
+    }
+    stats->period_start = now;
+}
+
+static gboolean stats_timer_cb(stats_t *stats) {
+    stats_end_period(stats);
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * start summarizing the stats every STATS_PERIOD_MS
+ *
+ * @param stats  stats to summarize
+ */
+void stats_start_timer(stats_t *stats) {
+    if (stats->timer != 0) {
+        return;
+    }
+    stats->timer = g_timeout_add(STATS_PERIOD_MS, G_SOURCE_FUNC(stats_timer_cb), stats);
+}
@@ -0,0 +1,149 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#ifndef SHAREIT_STATS_H
+#define SHAREIT_STATS_H
+#include <stdio.h>
+#include <stdint.h>
+#include <glib.h>
+
+// How often (in ms) stats are summarized, logged and written to the CSV file
+#define STATS_PERIOD_MS 1000
+
+// Number of rect encoding types we keep counters for (encoding type is a uint8 on the wire)
+#define STATS_N_ENCODINGS 256
+
+// Stages of the pipeline that we measure
+enum stats_stage {
+    stats_stage_capture = 0,  // grab_window()
+    stats_stage_diff,         // compare_parts() on all blocks
+    stats_stage_encode,       // create_rect() on changed blocks
+    stats_stage_send,         // pkt_send_framebuffer_update()
+    stats_stage_receive,      // pkt_recv_framebuffer_update()
+    stats_stage_draw,         // draw_update()
+    stats_stage_present,      // painting the view in the viewer window
+    STATS_N_STAGES,
+};
+
+typedef struct {
+    gint64 total_us[STATS_N_STAGES];
+    gint64 max_us[STATS_N_STAGES];
+    uint32_t count[STATS_N_STAGES];
+
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint32_t rects[STATS_N_ENCODINGS];
+    uint32_t frames;
+    uint32_t dropped_frames;
+} stats_period_t;
+
+typedef struct {
+    stats_period_t current;  // counters for the period we're currently in
+    stats_period_t last;     // counters for the last complete period
+    gint64 period_start;
+    gint64 period_length;    // length of 'last', in us
+
+    gboolean log;            // print a summary to stdout after each period
+    FILE *csv;               // if set, a line is written to this file after each period
+    guint timer;
+} stats_t;
+
+stats_t *stats_new();
+void stats_free(stats_t *stats);
+int stats_open_csv(stats_t *stats, const char *filename);
+void stats_start_timer(stats_t *stats);
+void stats_end_period(stats_t *stats);
+const char *stats_stage_name(enum stats_stage stage);
+int stats_format_summary(stats_t *stats, char *output, size_t sz);
+
+/*
+ * The functions below are called from the hot paths, and are
+ * inlined so that they cost no more than a NULL check when stats are disabled.
+ */
+
+/**
+ * mark the beginning of a stage
+ *
+ * @param stats  stats to update, or NULL if stats are disabled
+ * @return timestamp to pass to stats_end()
+ */
+static inline gint64 stats_begin(stats_t *stats) {
+    if (stats == NULL) {
+        return 0;
+    }
+    return g_get_monotonic_time();
+}
+
+/**
+ * add time spent in a stage
+ *
+ * @param stats    stats to update, or NULL if stats are disabled
+ * @param stage    stage that the time was spent in
+ * @param elapsed  time spent, in us
+ */
+static inline void stats_add_time(stats_t *stats, enum stats_stage stage, gint64 elapsed) {
+    if (stats == NULL) {
+        return;
+    }
+    stats->current.total_us[stage] += elapsed;
+    stats->current.count[stage] ++;
+    if (elapsed > stats->current.max_us[stage]) {
+        stats->current.max_us[stage] = elapsed;
+    }
+}
+
+/**
+ * mark the end of a stage
+ *
+ * @param stats  stats to update, or NULL if stats are disabled
+ * @param stage  stage that has been completed
+ * @param start  timestamp returned by stats_begin()
+ */
+static inline void stats_end(stats_t *stats, enum stats_stage stage, gint64 start) {
+    if (stats == NULL) {
+        return;
+    }
+    stats_add_time(stats, stage, g_get_monotonic_time() - start);
+}
+
+static inline void stats_add_rect(stats_t *stats, int encoding_type) {
+    if (stats == NULL) {
+        return;
+    }
+    stats->current.rects[encoding_type & (STATS_N_ENCODINGS - 1)] ++;
+}
+
+static inline void stats_add_bytes_sent(stats_t *stats, int bytes) {
+    if (stats == NULL) {
+        return;
+    }
+    stats->current.bytes_sent += bytes;
+}
+
+static inline void stats_add_bytes_received(stats_t *stats, int bytes) {
+    if (stats == NULL) {
+        return;
+    }
+    stats->current.bytes_received += bytes;
+}
+
+static inline void stats_add_frame(stats_t *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    stats->current.frames ++;
+}
+
+static inline void stats_add_dropped_frame(stats_t *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    stats->current.dropped_frames ++;
+}
+#endif
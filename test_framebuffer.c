@@ -1,9 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
 #include "shareit.h"
 #include "framebuffer.h"
 #include "net.h"
 #include "packet.h"
+#include "jpeg.h"
+#include "scale.h"
+#include "convert.h"
+#include "grab.h"
+#include "latency.h"
 
 #define ASSERT(x, ...) if (!(x)) { fprintf(stderr, "error: "); fprintf(stderr, __VA_ARGS__); putc('\n', stderr); return 1;}
 
@@ -63,6 +73,84 @@ int check_update(framebuffer_update_t *update, int expected_pixelcount) {
     return 0;
 }
 
+int check_view(shareit_app_t *app) {
+    for (int y = 0; y < app->height; y++) {
+        for (int x = 0; x < app->width; x++) {
+            uint8_t *pixel = app->view->pixels + x * 4 + y * app->view->row_stride;
+            uint32_t expected = pixfmt_quantize(app->pixel_format, *screen_pixel(app, app->current_screen, x, y));
+            ASSERT(pixel[0] == (expected & 0xff) &&
+                   pixel[1] == ((expected >> 8) & 0xff) &&
+                   pixel[2] == ((expected >> 16) & 0xff),
+                   "view differs from screen at %d,%d", x, y);
+        }
+    }
+    return 0;
+}
+
+/**
+ * compare the conversion kernels of a level with the scalar ones
+ *
+ * @param level  convert_level to test
+ * @return 0 if they give the same result
+ */
+int check_convert(int level) {
+    uint32_t pixels[100], screen[100], expected_screen[100];
+    uint8_t *src = (uint8_t *)pixels;
+    uint8_t rgb[3 * 100], expected_rgb[3 * 100];
+
+    for (int i = 0; i < (int)sizeof(pixels); i++) {
+        src[i] = rand();
+    }
+
+    // Every length up to a few vectors, to get all kinds of leftover pixels
+    for (int n = 0; n < 100; n++) {
+        convert_init(convert_level_scalar);
+        convert_rgb_to_screen(src, expected_screen, n);
+        convert_init(level);
+        convert_rgb_to_screen(src, screen, n);
+        ASSERT(memcmp(screen, expected_screen, n * 4) == 0, "rgb to screen differs for %d pixels", n);
+
+        convert_init(convert_level_scalar);
+        convert_rgba_to_screen(src, expected_screen, n);
+        convert_init(level);
+        convert_rgba_to_screen(src, screen, n);
+        ASSERT(memcmp(screen, expected_screen, n * 4) == 0, "rgba to screen differs for %d pixels", n);
+
+        memset(rgb, 0, sizeof(rgb));
+        memset(expected_rgb, 0, sizeof(expected_rgb));
+        convert_init(convert_level_scalar);
+        convert_screen_to_rgb888(pixels, expected_rgb, n);
+        convert_init(level);
+        convert_screen_to_rgb888(pixels, rgb, n);
+        ASSERT(memcmp(rgb, expected_rgb, sizeof(rgb)) == 0, "screen to rgb888 differs for %d pixels", n);
+    }
+
+    ASSERT(expected_screen[0] == (((uint32_t)src[3] << 24) | (src[0] << 16) | (src[1] << 8) | src[2]),
+           "rgba to screen gives wrong pixel");
+    return 0;
+}
+
+int check_latency(void) {
+    latency_t *latency = latency_new(FALSE);
+    ASSERT(latency != NULL, "could not create latency measurement");
+
+    // GIVEN two viewers, one with its clock 1 s ahead of ours and one 1 s behind
+    latency_add_clock_sample(latency, 1, 1000000, 2010000, 1020000);
+    latency_add_clock_sample(latency, 2, 1000000, 10000, 1020000);
+
+    // WHEN both present a frame 5 ms after it was captured
+    int ahead = latency_add_frame(latency, 1, 2000000, 3005000);
+    int behind = latency_add_frame(latency, 2, 2000000, 1005000);
+
+    // THEN the latency is calculated with each viewer's own clock offset
+    ASSERT(ahead == 5000 && behind == 5000, "expected 5 ms latency for both viewers, got %d and %d us", ahead, behind);
+
+    // AND viewers that haven't answered a ping can't be measured
+    ASSERT(latency_add_frame(latency, 3, 2000000, 2005000) == -1, "expected no latency without a clock offset");
+    latency_free(latency);
+    return 0;
+}
+
 int main (int argc, char *argv[]) {
     shareit_app_t app;
     framebuffer_update_t *update;
@@ -77,6 +165,18 @@ int main (int argc, char *argv[]) {
         gtk_init(&argc, &argv);
     }
 
+    // WHEN pixels are converted with the SIMD kernels
+    // THEN they are the same as with the scalar ones
+    for (int level = convert_level_ssse3; level <= convert_level_avx2; level++) {
+        if (convert_init(level) == level) {
+            ASSERT(!check_convert(level), "conversion kernels differ at level %d", level);
+        }
+    }
+    convert_init(convert_level_avx2);
+
+    ASSERT(!check_latency(), "latency measurement failed");
+
+    memset(&app, 0, sizeof(app));
     app.width = 640;
     app.height = 480;
     app.current_screen = calloc(640*480, sizeof(uint32_t));
@@ -85,7 +185,7 @@ int main (int argc, char *argv[]) {
     memset(app.current_screen, 0xff, sizeof(uint32_t)*640*480);
 
     // Create output pixbuf
-    app.view = malloc(sizeof(viewinfo_t));
+    app.view = calloc(1, sizeof(viewinfo_t));
     app.view->pixels = calloc(app.width*app.height, sizeof(uint32_t));
     app.view->row_stride = app.width*sizeof(uint32_t);
     app.view->width = app.width;
@@ -93,9 +193,11 @@ int main (int argc, char *argv[]) {
 
     // WHEN whole framebuffer has changed
     // THEN compare screens returns TRUE, and all pixels are marked as changed
+    // AND the solid blocks are merged into one rect
     is_updated = compare_screens(&app, &update);
     ASSERT(is_updated == TRUE, "compare_screens did not return change for differing buffers");
     ASSERT(!check_update(update, 640*480), "expected whole screen to be updated");
+    ASSERT(update->n_rects == 1, "expected solid blocks to be merged, got %d rects", update->n_rects);
 
     ret = draw_update(app.view, update);
     ASSERT(ret == 0, "draw update failed");
@@ -151,12 +253,668 @@ int main (int argc, char *argv[]) {
 
     ret = draw_update(app.view, update);
     ASSERT(ret == 0, "draw update failed");
+    ASSERT(!check_view(&app), "lossless update was not drawn correctly");
 
     if (show) {
         show_image(app.view);
     }
 
     free_framebuffer_update(update);
+
+    // WHEN the screen switches back to content that has been sent before
+    // THEN the tiles are sent as references to the tile cache
+    app.tile_cache = tile_cache_new(TRUE);
+    app.view->cache = tile_cache_new(FALSE);
+    const char *images[] = {
+        "test/02-50-black-50-white.png", "test/04-pine-hello.png",
+        "test/02-50-black-50-white.png", "test/04-pine-hello.png",
+    };
+    int n_cached = 0;
+    for (int i = 0; i < 4; i++) {
+        memcpy(app.prev_screen, app.current_screen, 640*480*sizeof(uint32_t));
+        png2screenbuf((char *)images[i], app.current_screen, app.width, app.height);
+        is_updated = compare_screens(&app, &update);
+        ASSERT(is_updated == TRUE, "compare_screens did not return change for %s", images[i]);
+        ret = draw_update(app.view, update);
+        ASSERT(ret == 0, "draw update failed");
+        ASSERT(!check_view(&app), "view differs after drawing %s", images[i]);
+        n_cached = 0;
+        for (int j = 0; j < update->n_rects; j++) {
+            n_cached += update->rects[j]->encoding_type == framebuffer_encoding_type_cached;
+        }
+        free_framebuffer_update(update);
+    }
+    ASSERT(n_cached > 0, "expected tiles to be sent from cache");
+    tile_cache_free(app.tile_cache);
+    tile_cache_free(app.view->cache);
+    app.tile_cache = NULL;
+    app.view->cache = NULL;
+
+    // WHEN a small part of a block has changed
+    // THEN only the smallest sub-block covering the change is sent
+    app.min_block_size = BLOCK_SIZE_MIN;
+    memcpy(app.prev_screen, app.current_screen, 640*480*sizeof(uint32_t));
+    for (int y = 100; y < 110; y++) {
+        for (int x = 100; x < 110; x++) {
+            app.current_screen[x + y * app.width] = 0xff123456;
+        }
+    }
+    is_updated = compare_screens(&app, &update);
+    ASSERT(is_updated == TRUE, "compare_screens did not return change for small change");
+    ASSERT(update->n_rects == 1, "expected one rect, got %d", update->n_rects);
+    ASSERT(!check_update(update, BLOCK_SIZE_MIN*BLOCK_SIZE_MIN), "expected one sub-block to be updated");
+    ret = draw_update(app.view, update);
+    ASSERT(ret == 0, "draw update failed");
+    ASSERT(!check_view(&app), "sub-block was not drawn correctly");
+    free_framebuffer_update(update);
+    app.min_block_size = 0;
+
+    // WHEN a lower colour depth is used
+    // THEN the view gets the screen in that depth
+    for (int format = pixel_format_rgb565; format < PIXEL_FORMAT_COUNT; format++) {
+        app.pixel_format = format;
+        memcpy(app.prev_screen, app.current_screen, 640*480*sizeof(uint32_t));
+        png2screenbuf(format % 2 ? "test/03-red-green-blue.png" : "test/04-pine-hello.png",
+                      app.current_screen, app.width, app.height);
+        is_updated = compare_screens(&app, &update);
+        ASSERT(is_updated == TRUE, "compare_screens did not return change for %s", pixfmt_name(format));
+        ASSERT(update->pixel_format == format, "update has pixel format %d, expected %d", update->pixel_format, format);
+        ret = draw_update(app.view, update);
+        ASSERT(ret == 0, "draw update failed");
+        ASSERT(!check_view(&app), "view differs with pixel format %s", pixfmt_name(format));
+        free_framebuffer_update(update);
+    }
+    app.pixel_format = pixel_format_rgb888;
+
+    // WHEN a noisy image changes in several consecutive frames
+    // THEN it is sent with lossy encoding, and refined when it stops changing
+    app.jpeg_quality = JPEG_DEFAULT_QUALITY;
+    int n_jpeg = 0, n_rects = 0;
+    for (int frame = 0; frame < 4; frame++) {
+        memcpy(app.prev_screen, app.current_screen, 640*480*sizeof(uint32_t));
+        for (int i = 0; i < 640*480; i++) {
+            app.current_screen[i] = rand() | 0xff000000;
+        }
+        is_updated = compare_screens(&app, &update);
+        ASSERT(is_updated == TRUE, "compare_screens did not return change for noise");
+        ASSERT(!check_update(update, 640*480), "expected whole screen to be updated");
+        ret = draw_update(app.view, update);
+        ASSERT(ret == 0, "draw update failed");
+        n_jpeg = 0;
+        n_rects = update->n_rects;
+        for (int i = 0; i < update->n_rects; i++) {
+            n_jpeg += update->rects[i]->encoding_type == framebuffer_encoding_type_jpeg;
+        }
+        free_framebuffer_update(update);
+    }
+    ASSERT(n_jpeg == n_rects, "expected all %d rects to be jpeg, got %d", n_rects, n_jpeg);
+
+    memcpy(app.prev_screen, app.current_screen, 640*480*sizeof(uint32_t));
+    is_updated = compare_screens(&app, &update);
+    ASSERT(is_updated == FALSE, "lossy blocks were refined too early");
+    is_updated = compare_screens(&app, &update);
+    ASSERT(is_updated == FALSE, "lossy blocks were refined too early");
+    is_updated = compare_screens(&app, &update);
+    ASSERT(is_updated == TRUE, "lossy blocks were not refined");
+    ASSERT(!check_update(update, 640*480), "expected whole screen to be refined");
+    for (int i = 0; i < update->n_rects; i++) {
+        ASSERT(update->rects[i]->encoding_type != framebuffer_encoding_type_jpeg, "refined rect %d is lossy", i);
+    }
+    free_framebuffer_update(update);
+    app.jpeg_quality = 0;
+
+    // WHEN the viewer asks for a smaller screen
+    // THEN the screen is downscaled to fit, and the changes are found in the downscaled screen
+    int width, height;
+    scale_fit(640, 480, 400, 400, &width, &height);
+    ASSERT(width == 400 && height == 300, "expected 640x480 to fit in 400x300, got %dx%d", width, height);
+    scale_fit(640, 480, 1024, 768, &width, &height);
+    ASSERT(width == 640 && height == 480, "screen was scaled up to %dx%d", width, height);
+    scale_fit(640, 480, 320, 240, &width, &height);
+
+    uint32_t *capture = calloc(640*480, sizeof(uint32_t));
+    png2screenbuf("test/04-pine-hello.png", capture, 640, 480);
+    capture[0] = 0x000000;
+    capture[1] = 0xffffff;
+    capture[640] = 0x0000ff;
+    capture[641] = 0x00ff00;
+    app.width = width;
+    app.height = height;
+    free(app.prev_screen);
+    app.prev_screen = NULL;
+    scale_screen(capture, 640, 480, app.current_screen, width, height, 0);
+    ASSERT(app.current_screen[0] == 0x408080, "expected pixels to be averaged, got %06x", app.current_screen[0]);
+
+    app.view->width = width;
+    app.view->height = height;
+    app.view->row_stride = width * sizeof(uint32_t);
+    is_updated = compare_screens(&app, &update);
+    ASSERT(is_updated == TRUE, "compare_screens did not return change for downscaled screen");
+    ret = draw_update(app.view, update);
+    ASSERT(ret == 0, "draw update failed");
+    ASSERT(!check_view(&app), "downscaled screen was not drawn correctly");
+    free_framebuffer_update(update);
+
+    app.prev_screen = malloc(width*height*sizeof(uint32_t));
+    memcpy(app.prev_screen, app.current_screen, width*height*sizeof(uint32_t));
+    for (int y = 200; y < 220; y++) {
+        for (int x = 200; x < 220; x++) {
+            capture[x + y * 640] = 0x123456;
+        }
+    }
+    scale_screen(capture, 640, 480, app.current_screen, width, height, 0);
+    is_updated = compare_screens(&app, &update);
+    ASSERT(is_updated == TRUE, "compare_screens did not return change for downscaled screen");
+    ASSERT(update->n_rects == 1, "expected one rect, got %d", update->n_rects);
+    ret = draw_update(app.view, update);
+    ASSERT(ret == 0, "draw update failed");
+    ASSERT(!check_view(&app), "downscaled change was not drawn correctly");
+    free_framebuffer_update(update);
+    free(capture);
+
+    // WHEN the screen is grabbed from the synthetic grabber
+    // THEN every frame is drawn correctly, and the content keeps changing
+    void *grabber = grab_initialize("synthetic:640x480:text=1,windows=2,video=0", NULL);
+    ASSERT(grabber != NULL, "could not setup synthetic grabber");
+    ASSERT(grab_initialize("synthetic:640", NULL) == NULL, "synthetic grabber accepted invalid size");
+    ASSERT(grab_initialize("nosuchgrabber", NULL) == NULL, "unknown grabber was accepted");
+    ret = grab_window_size(grabber, &width, &height);
+    ASSERT(ret == 0 && width == 640 && height == 480, "expected 640x480 synthetic screen, got %dx%d", width, height);
+    app.width = width;
+    app.height = height;
+    app.view->width = width;
+    app.view->height = height;
+    app.view->row_stride = width * sizeof(uint32_t);
+    app.prev_screen = realloc(app.prev_screen, width*height*sizeof(uint32_t));
+    app.current_screen = realloc(app.current_screen, width*height*sizeof(uint32_t));
+    memset(app.current_screen, 0, width*height*sizeof(uint32_t));
+    memset(app.view->pixels, 0, width*height*sizeof(uint32_t));
+    for (int frame = 0; frame < 4; frame++) {
+        memcpy(app.prev_screen, app.current_screen, width*height*sizeof(uint32_t));
+        grab_frame_t grab_frame = { app.current_screen, width, height, 0 };
+        ret = grab_window(grabber, &grab_frame);
+        ASSERT(ret == 0, "could not grab synthetic frame %d", frame);
+        is_updated = compare_screens(&app, &update);
+        ASSERT(is_updated == TRUE, "synthetic frame %d did not change", frame);
+        ret = draw_update(app.view, update);
+        ASSERT(ret == 0, "draw update failed");
+        ASSERT(!check_view(&app), "synthetic frame %d was not drawn correctly", frame);
+        free_framebuffer_update(update);
+    }
+    grab_shutdown(grabber);
+
+    // WHEN frames are replayed from a file
+    // THEN they are grabbed in order, starting over at the end of the file
+    char path[] = "/tmp/share-it-test-XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT(fd != -1, "could not create %s", path);
+    FILE *f = fdopen(fd, "wb");
+    uint32_t *frames = malloc(2*width*height*sizeof(uint32_t));
+    grab_synthetic_render(frames, width, height, 0);
+    grab_synthetic_render(frames + width*height, width, height, 1);
+    fwrite(frames, sizeof(uint32_t), 2*width*height, f);
+    // and half a frame, which is skipped
+    fwrite(frames, sizeof(uint32_t), width*height/2, f);
+    fclose(f);
+
+    char spec[64];
+    snprintf(spec, sizeof(spec), "file:%dx%d:%s", width, height, path);
+    grabber = grab_initialize(spec, NULL);
+    ASSERT(grabber != NULL, "could not setup file grabber");
+    for (int frame = 0; frame < 3; frame++) {
+        grab_frame_t grab_frame = { app.current_screen, width, height, 0 };
+        ret = grab_window(grabber, &grab_frame);
+        ASSERT(ret == 0, "could not grab frame %d from file", frame);
+        ASSERT(memcmp(app.current_screen, frames + (frame % 2)*width*height, width*height*sizeof(uint32_t)) == 0,
+               "frame %d from file differs", frame);
+    }
+    grab_shutdown(grabber);
+    snprintf(spec, sizeof(spec), "file:%dx%d:%s", width * 2, height * 2, path);
+    ASSERT(grab_initialize(spec, NULL) == NULL, "file grabber accepted file without a full frame");
+
+    // WHEN the frames in the file are RGB
+    // THEN they are converted to screen pixels
+    f = fopen(path, "wb");
+    ASSERT(f != NULL, "could not open %s", path);
+    for (int i = 0; i < 2*width*height; i++) {
+        uint8_t rgb[3] = { frames[i] >> 16, frames[i] >> 8, frames[i] };
+        fwrite(rgb, 1, sizeof(rgb), f);
+    }
+    fclose(f);
+    snprintf(spec, sizeof(spec), "file:%dx%d:rgb24:%s", width, height, path);
+    grabber = grab_initialize(spec, NULL);
+    ASSERT(grabber != NULL, "could not setup file grabber for RGB frames");
+    for (int frame = 0; frame < 2; frame++) {
+        grab_frame_t grab_frame = { app.current_screen, width, height, 0 };
+        ret = grab_window(grabber, &grab_frame);
+        ASSERT(ret == 0, "could not grab RGB frame %d from file", frame);
+        ASSERT(memcmp(app.current_screen, frames + frame*width*height, width*height*sizeof(uint32_t)) == 0,
+               "RGB frame %d from file differs", frame);
+    }
+    grab_shutdown(grabber);
+    unlink(path);
+    free(frames);
+
+    // WHEN the screens are stored one tile at a time
+    // THEN the same rects are sent as when they're stored row by row
+    width = 600;
+    height = 450;
+    uint32_t *capture_frames[2] = { malloc(width*height*sizeof(uint32_t)), malloc(width*height*sizeof(uint32_t)) };
+    uint32_t *tiles = NULL;
+    int n_rects_by_layout[2], wire_size_by_layout[2];
+    for (int tiled = 0; tiled < 2; tiled++) {
+        app.width = width;
+        app.height = height;
+        app.block_size = BLOCK_SIZE_DEFAULT;
+        app.tiled_screen = tiled;
+        app.view->width = width;
+        app.view->height = height;
+        app.view->row_stride = width * sizeof(uint32_t);
+        app.prev_screen = realloc(app.prev_screen, screen_size(&app)*sizeof(uint32_t));
+        app.current_screen = realloc(app.current_screen, screen_size(&app)*sizeof(uint32_t));
+        // Merged rects are looked up in the cache, and span several tiles
+        app.tile_cache = tile_cache_new(TRUE);
+        app.view->cache = tile_cache_new(FALSE);
+        for (int frame = 0; frame < 2; frame++) {
+            grab_synthetic_render(capture_frames[frame], width, height, frame);
+            if (tiled) {
+                // Grabbers write the tiles directly, in parts that don't line up with them
+                grab_frame_t grab_frame = { app.current_screen, width, height, BLOCK_SIZE_DEFAULT };
+                uint8_t *src = (uint8_t *)capture_frames[frame];
+                grab_frame_clear(&grab_frame);
+                grab_frame_put(&grab_frame, 0, 0, 250, 100, src, width*4, grab_format_bgrx);
+                grab_frame_put(&grab_frame, 250, 0, width - 250, 100, src + 250*4, width*4, grab_format_bgrx);
+                grab_frame_put(&grab_frame, 0, 100, width, height - 100, src + 100*width*4, width*4,
+                               grab_format_bgrx);
+
+                tiles = realloc(tiles, screen_size(&app)*sizeof(uint32_t));
+                memset(tiles, 0, screen_size(&app)*sizeof(uint32_t));
+                screen_to_tiles(capture_frames[frame], width, height, tiles, BLOCK_SIZE_DEFAULT);
+                ASSERT(memcmp(tiles, app.current_screen, screen_size(&app)*sizeof(uint32_t)) == 0,
+                       "grabbed tiles of frame %d differ", frame);
+            } else {
+                memcpy(app.current_screen, capture_frames[frame], width*height*sizeof(uint32_t));
+            }
+            ASSERT(*screen_pixel(&app, app.current_screen, 599, 449) == capture_frames[frame][width*height - 1],
+                   "last pixel differs with tiled=%d", tiled);
+
+            if (frame == 0) {
+                free(app.prev_screen);
+                app.prev_screen = NULL;
+            }
+            is_updated = compare_screens(&app, &update);
+            ASSERT(is_updated == TRUE, "synthetic frame %d did not change with tiled=%d", frame, tiled);
+            ret = draw_update(app.view, update);
+            ASSERT(ret == 0, "draw update failed");
+            ASSERT(!check_view(&app), "frame %d was not drawn correctly with tiled=%d", frame, tiled);
+            n_rects_by_layout[tiled] = update->n_rects;
+            wire_size_by_layout[tiled] = framebuffer_update_wire_size(update);
+            free_framebuffer_update(update);
+
+            if (frame == 0) {
+                app.prev_screen = malloc(screen_size(&app)*sizeof(uint32_t));
+            }
+            memcpy(app.prev_screen, app.current_screen, screen_size(&app)*sizeof(uint32_t));
+        }
+        tile_cache_free(app.tile_cache);
+        tile_cache_free(app.view->cache);
+        app.tile_cache = NULL;
+        app.view->cache = NULL;
+    }
+    ASSERT(n_rects_by_layout[0] == n_rects_by_layout[1] && wire_size_by_layout[0] == wire_size_by_layout[1],
+           "tiled layout gave %d rects, %d bytes, expected %d rects, %d bytes", n_rects_by_layout[1],
+           wire_size_by_layout[1], n_rects_by_layout[0], wire_size_by_layout[0]);
+
+    // WHEN the screen is grabbed as two monitors, that are compared as soon as each band has been grabbed
+    // THEN the same rects are sent as when the whole screen is compared at once
+    grab_output_t outputs[3] = { { "left", 0, 0, 300, 450 }, { "right", 300, 0, 300, 450 }, { "mirror", 0, 0, 300, 450 } };
+    ASSERT(grab_outputs_area(outputs, 3) == width*height, "expected monitors to cover %d pixels, got %ld",
+           width*height, (long)grab_outputs_area(outputs, 3));
+    app.tiled_screen = FALSE;
+    app.prev_screen = realloc(app.prev_screen, width*height*sizeof(uint32_t));
+    app.current_screen = realloc(app.current_screen, width*height*sizeof(uint32_t));
+    for (int streams = 0; streams < 2; streams++) {
+        memcpy(app.prev_screen, capture_frames[0], width*height*sizeof(uint32_t));
+        memcpy(app.current_screen, capture_frames[1], width*height*sizeof(uint32_t));
+        if (streams) {
+            memcpy(app.streams, outputs, 2 * sizeof(grab_output_t));
+            app.n_streams = 2;
+            ASSERT(compare_prepare(&app) == 0, "could not prepare to compare streams");
+            // In bands that don't line up with the blocks
+            for (int y = 0; y < height; y += 50) {
+                compare_stream(&app, 1, y, min(50, height - y));
+            }
+            compare_stream(&app, 0, 0, height);
+        }
+        is_updated = compare_screens(&app, &update);
+        ASSERT(is_updated == TRUE, "screen did not change with streams=%d", streams);
+        n_rects_by_layout[streams] = update->n_rects;
+        wire_size_by_layout[streams] = framebuffer_update_wire_size(update);
+        free_framebuffer_update(update);
+    }
+    ASSERT(n_rects_by_layout[0] == n_rects_by_layout[1] && wire_size_by_layout[0] == wire_size_by_layout[1],
+           "streams gave %d rects, %d bytes, expected %d rects, %d bytes", n_rects_by_layout[1],
+           wire_size_by_layout[1], n_rects_by_layout[0], wire_size_by_layout[0]);
+    memcpy(app.prev_screen, app.current_screen, width*height*sizeof(uint32_t));
+
+    // GIVEN monitors that overlap
+    // THEN the part they share is only counted once
+    outputs[1].x = 200;
+    ASSERT(grab_outputs_area(outputs, 3) == 500*height, "expected monitors to cover %d pixels, got %ld",
+           500*height, (long)grab_outputs_area(outputs, 3));
+
+    // WHEN a viewer asks for part of an unchanged screen
+    // THEN only the blocks overlapping it are sent, and nothing after that
+    uint8_t flags;
+    int n_regions, sv[2];
+    refresh_region_t regions[REFRESH_REQUEST_MAX_REGIONS] = { { 100, 100, 10, 10 }, { 590, 440, 100, 100 } };
+    ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "could not create socket pair");
+    ret = pkt_send_refresh_request(sv[0], REFRESH_FLAG_RESET_TILE_CACHE, regions, 2);
+    ASSERT(ret == 0, "could not send refresh request");
+    uint8_t type = 0;
+    ASSERT(recv(sv[1], &type, 1, 0) == 1 && type == packet_type_refresh_request, "expected refresh request");
+    memset(regions, 0, sizeof(regions));
+    ret = pkt_recv_refresh_request(sv[1], &flags, regions, &n_regions);
+    ASSERT(ret == 0 && flags == REFRESH_FLAG_RESET_TILE_CACHE && n_regions == 2, "could not read refresh request");
+    ASSERT(regions[1].x == 590 && regions[1].y == 440 && regions[1].width == 100 && regions[1].height == 100,
+           "refresh region differs after sending");
+    close(sv[0]);
+    close(sv[1]);
+
+    memset(app.view->pixels, 0, width*height*sizeof(uint32_t));
+    request_refresh(&app, regions, n_regions);
+    is_updated = compare_screens(&app, &update);
+    ASSERT(is_updated == TRUE, "refresh did not send anything");
+    int refreshed_pixels = 0;
+    for (int i = 0; i < update->n_rects; i++) {
+        framebuffer_rect_t *rect = update->rects[i];
+        ASSERT((rect->xpos == 64 && rect->ypos == 64) || (rect->xpos == 576 && rect->ypos == 384),
+               "rect %d at %d,%d was not asked for", i, rect->xpos, rect->ypos);
+        refreshed_pixels += min(rect->width, width - rect->xpos) * min(rect->height, height - rect->ypos);
+    }
+    ASSERT(refreshed_pixels == 64*64 + 24*66, "expected two blocks to be refreshed, got %d pixels", refreshed_pixels);
+    ret = draw_update(app.view, update);
+    ASSERT(ret == 0, "draw update failed");
+    free_framebuffer_update(update);
+    uint8_t *refreshed = app.view->pixels + 100*4 + 100*app.view->row_stride;
+    uint32_t expected = *screen_pixel(&app, app.current_screen, 100, 100);
+    ASSERT(refreshed[0] == (expected & 0xff) && refreshed[1] == ((expected >> 8) & 0xff) &&
+           refreshed[2] == ((expected >> 16) & 0xff), "refreshed pixel was not drawn");
+    is_updated = compare_screens(&app, &update);
+    ASSERT(is_updated == FALSE, "refresh was sent more than once");
+
+
+    // WHEN the viewer compares checksums of its screen with the sharer's
+    // THEN they only differ for the rows of blocks where the screens differ
+    uint32_t checksums[8], view_sums[8];
+    ASSERT(screen_checksums(&app, checksums) == 8, "expected a checksum for each of the 8 rows of blocks");
+    ASSERT(view_checksums(app.view, BLOCK_SIZE_DEFAULT, view_sums) == 8, "expected 8 view checksums");
+    ASSERT(memcmp(checksums, view_sums, sizeof(checksums)) != 0, "only part of the screen is drawn, but checksums match");
+    memcpy(app.prev_screen, app.current_screen, screen_size(&app)*sizeof(uint32_t));
+    app.prev_screen[0] = ~app.current_screen[0];
+    is_updated = compare_screens(&app, &update);
+    ASSERT(is_updated == TRUE, "first block did not change");
+    free_framebuffer_update(update);
+    request_refresh(&app, NULL, 0);
+    is_updated = compare_screens(&app, &update);
+    ASSERT(is_updated == TRUE, "refresh of whole screen did not send anything");
+    ret = draw_update(app.view, update);
+    ASSERT(ret == 0, "draw update failed");
+    free_framebuffer_update(update);
+    ASSERT(!check_view(&app), "screen was not refreshed");
+    view_checksums(app.view, BLOCK_SIZE_DEFAULT, view_sums);
+    ASSERT(memcmp(checksums, view_sums, sizeof(checksums)) == 0, "checksums differ for equal screens");
+
+    app.view->pixels[300*4 + 200*app.view->row_stride] ^= 1;
+    view_checksums(app.view, BLOCK_SIZE_DEFAULT, view_sums);
+    for (int band = 0; band < 8; band++) {
+        ASSERT((checksums[band] != view_sums[band]) == (band == 200 / BLOCK_SIZE_DEFAULT),
+               "expected only checksum of row 3 to differ, row %d %s", band,
+               checksums[band] != view_sums[band] ? "differs" : "is equal");
+    }
+    app.view->pixels[300*4 + 200*app.view->row_stride] ^= 1;
+
+    uint16_t checksum_width, checksum_height, band_height;
+    uint32_t *received;
+    int n_bands;
+    ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "could not create socket pair");
+    ret = pkt_send_screen_checksums(sv[0], width, height, BLOCK_SIZE_DEFAULT, checksums, 8);
+    ASSERT(ret == 0, "could not send screen checksums");
+    ASSERT(recv(sv[1], &type, 1, 0) == 1 && type == packet_type_screen_checksums, "expected screen checksums");
+    ret = pkt_recv_screen_checksums(sv[1], &checksum_width, &checksum_height, &band_height, &received, &n_bands);
+    ASSERT(ret == 0 && checksum_width == width && checksum_height == height && band_height == BLOCK_SIZE_DEFAULT &&
+           n_bands == 8 && memcmp(received, checksums, sizeof(checksums)) == 0, "screen checksums differ after sending");
+    free(received);
+    close(sv[0]);
+    close(sv[1]);
+
+    // AND rows with lossy blocks are not checked
+    app.tiles[app.tiles_x * 2].lossy = TRUE;
+    screen_checksums(&app, checksums);
+    ASSERT(checksums[2] == SCREEN_CHECKSUM_NONE && checksums[1] != SCREEN_CHECKSUM_NONE,
+           "expected only row 2 to be unchecked");
+    app.tiles[app.tiles_x * 2].lossy = FALSE;
+
+    // GIVEN a switch to a pixel format with less precision
+    // THEN unchanged blocks are checksummed in the format the viewer has them in
+    app.pixel_format = pixel_format_rgb332;
+    screen_checksums(&app, checksums);
+    view_checksums(app.view, BLOCK_SIZE_DEFAULT, view_sums);
+    ASSERT(memcmp(checksums, view_sums, sizeof(checksums)) == 0, "checksums differ after switching pixel format");
+
+    // AND rows with blocks that are partly in the new format are not checked
+    app.min_block_size = BLOCK_SIZE_MIN;
+    memcpy(app.prev_screen, app.current_screen, screen_size(&app)*sizeof(uint32_t));
+    *screen_pixel(&app, app.prev_screen, 0, 0) = ~*screen_pixel(&app, app.current_screen, 0, 0);
+    refresh_region_t block = { 64, 64, 1, 1 };
+    request_refresh(&app, &block, 1);
+    is_updated = compare_screens(&app, &update);
+    ASSERT(is_updated == TRUE, "first block did not change");
+    ret = draw_update(app.view, update);
+    ASSERT(ret == 0, "draw update failed");
+    free_framebuffer_update(update);
+    screen_checksums(&app, checksums);
+    view_checksums(app.view, BLOCK_SIZE_DEFAULT, view_sums);
+    ASSERT(checksums[0] == SCREEN_CHECKSUM_NONE, "expected row 0 to be unchecked");
+    ASSERT(memcmp(checksums + 1, view_sums + 1, 7 * sizeof(uint32_t)) == 0,
+           "checksums differ for blocks sent in the new pixel format");
+
+    app.min_block_size = 0;
+    app.pixel_format = pixel_format_rgb888;
+    request_refresh(&app, NULL, 0);
+    is_updated = compare_screens(&app, &update);
+    ret = draw_update(app.view, update);
+    ASSERT(is_updated == TRUE && ret == 0, "could not refresh screen");
+    free_framebuffer_update(update);
+
+    // GIVEN a viewer whose connection has dropped
+    // WHEN two blocks change while it's away
+    // THEN only those blocks are sent again when it's back, and nothing after that
+    app.away_clients = g_ptr_array_new_with_free_func(free);
+    g_ptr_array_add(app.away_clients, strdup("viewer"));
+    memcpy(app.prev_screen, app.current_screen, screen_size(&app)*sizeof(uint32_t));
+    *screen_pixel(&app, app.prev_screen, 0, 0) = ~*screen_pixel(&app, app.current_screen, 0, 0);
+    *screen_pixel(&app, app.prev_screen, 130, 70) = ~*screen_pixel(&app, app.current_screen, 130, 70);
+    is_updated = compare_screens(&app, &update);
+    ASSERT(is_updated == TRUE, "blocks did not change");
+    free_framebuffer_update(update);
+    memcpy(app.prev_screen, app.current_screen, screen_size(&app)*sizeof(uint32_t));
+
+    g_ptr_array_set_size(app.away_clients, 0);
+    request_missed_refresh(&app);
+    is_updated = compare_screens(&app, &update);
+    ASSERT(is_updated == TRUE, "missed blocks were not sent again");
+    for (int i = 0; i < update->n_rects; i++) {
+        framebuffer_rect_t *rect = update->rects[i];
+        ASSERT((rect->xpos < 64 && rect->ypos < 64) ||
+               (rect->xpos >= 128 && rect->xpos < 192 && rect->ypos >= 64 && rect->ypos < 128),
+               "rect %d at %d,%d was not missed", i, rect->xpos, rect->ypos);
+    }
+    free_framebuffer_update(update);
+    request_missed_refresh(&app);
+    is_updated = compare_screens(&app, &update);
+    ASSERT(is_updated == FALSE, "missed blocks were sent more than once");
+    g_ptr_array_free(app.away_clients, TRUE);
+    app.away_clients = NULL;
+
+    // GIVEN a socket that can't take a whole update without waiting
+    // WHEN the update is queued
+    // THEN the rest is sent when the socket is writable again
+    int small_buffer = 4096, large_buffer = 0, n_received = 0;
+    ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "could not create socket pair");
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &small_buffer, sizeof(small_buffer));
+    request_refresh(&app, NULL, 0);
+    is_updated = compare_screens(&app, &update);
+    ASSERT(is_updated == TRUE, "refresh of whole screen did not send anything");
+    int wire_size = framebuffer_update_wire_size(update);
+    ret = pkt_queue_framebuffer_update(sv[0], update);
+    ASSERT(ret == 1, "expected part of the %d byte update to be queued", wire_size);
+    uint8_t *received_bytes = malloc(wire_size + 13);
+    while ((ret = pkt_send_queued(sv[0])) == 1 || n_received < wire_size) {
+        ASSERT(ret >= 0, "could not send queued update");
+        ssize_t nb = recv(sv[1], received_bytes + n_received, wire_size - n_received, 0);
+        ASSERT(nb > 0, "could not read queued update");
+        n_received += nb;
+    }
+    ASSERT(received_bytes[0] == packet_type_framebuffer_update, "expected a framebuffer update");
+
+    // AND packets sent while the update is queued come after it
+    struct { uint8_t type; int size; } after[] = {
+        { packet_type_frame_timestamp, 13 },
+        { packet_type_session_screenshare_start, 5 },
+        { packet_type_cursor_info, 6 },
+    };
+    large_buffer = wire_size * 2;
+    for (int i = 0; i < 3; i++) {
+        setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &small_buffer, sizeof(small_buffer));
+        ret = pkt_queue_framebuffer_update(sv[0], update);
+        ASSERT(ret == 1, "expected part of the update to be queued");
+        setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &large_buffer, sizeof(large_buffer));
+        switch (after[i].type) {
+        case packet_type_frame_timestamp:
+            ret = pkt_send_frame_timestamp(sv[0], 1, 2);
+            break;
+        case packet_type_session_screenshare_start:
+            ret = pkt_send_session_screenshare_request(sv[0], width, height);
+            break;
+        default:
+            ret = pkt_send_cursorinfo(sv[0], 1, 2, 0);
+            break;
+        }
+        ASSERT(ret == 0 && pkt_send_queued(sv[0]) == 0, "could not send packet of type %d", after[i].type);
+        for (n_received = 0; n_received < wire_size + after[i].size; ) {
+            ssize_t nb = recv(sv[1], received_bytes + n_received, wire_size + after[i].size - n_received, 0);
+            ASSERT(nb > 0, "could not read packet of type %d", after[i].type);
+            n_received += nb;
+        }
+        ASSERT(received_bytes[0] == packet_type_framebuffer_update && received_bytes[wire_size] == after[i].type,
+               "expected the whole update before packet of type %d", after[i].type);
+    }
+    free_framebuffer_update(update);
+    free(received_bytes);
+    close(sv[0]);
+    close(sv[1]);
+
+    app.tiled_screen = FALSE;
+    free(capture_frames[0]);
+    free(capture_frames[1]);
+    free(tiles);
+
+    // GIVEN a server that only listens on IPv4
+    char cache_dir[] = "/tmp/test_framebuffer.XXXXXX";
+    ASSERT(mkdtemp(cache_dir) != NULL, "could not create cache directory");
+    setenv("XDG_CACHE_HOME", cache_dir, 1);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in listen_addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t addr_len = sizeof(listen_addr);
+    ASSERT(listener != -1 && bind(listener, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) == 0 &&
+           listen(listener, 4) == 0 && getsockname(listener, (struct sockaddr *)&listen_addr, &addr_len) == 0,
+           "could not setup listening socket");
+
+    // WHEN connecting to a name that may also resolve to an IPv6 address
+    char url[64];
+    char *error = NULL;
+    snprintf(url, sizeof(url), "localhost:%d", ntohs(listen_addr.sin_port));
+    connection_t *conn = net_connect(url, &error);
+
+    // THEN the IPv4 address is used, and saved for the next time
+    ASSERT(conn != NULL, "could not connect to %s: %s", url, error);
+
+    // AND the connection can be switched to latency mode
+    int nodelay = 0, lowat = 0, send_buffer = 0;
+    socklen_t opt_len = sizeof(int);
+    ASSERT(net_set_latency_mode(conn) == 0, "could not set latency mode");
+    getsockopt(conn->socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, &opt_len);
+    getsockopt(conn->socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, &opt_len);
+    getsockopt(conn->socket, SOL_SOCKET, SO_SNDBUF, &send_buffer, &opt_len);
+    ASSERT(nodelay == 1 && lowat == NET_NOTSENT_LOWAT_BYTES, "expected TCP_NODELAY and TCP_NOTSENT_LOWAT to be set");
+    ASSERT(conn->send_buffer >= NET_SEND_BUFFER_MIN && send_buffer >= conn->send_buffer,
+           "expected send buffer to be set, got %d", send_buffer);
+    ASSERT(net_writable(conn), "expected an idle connection to be writable");
+    net_disconnect(conn);
+    free(conn);
+    char cache_path[128], cache_line[128], expected_line[128];
+    snprintf(cache_path, sizeof(cache_path), "%s/share-it/addresses", cache_dir);
+    snprintf(expected_line, sizeof(expected_line), "localhost %d 127.0.0.1\n", ntohs(listen_addr.sin_port));
+    FILE *cache_file = fopen(cache_path, "r");
+    ASSERT(cache_file != NULL && fgets(cache_line, sizeof(cache_line), cache_file) != NULL &&
+           strcmp(cache_line, expected_line) == 0, "expected the address to be cached");
+    fclose(cache_file);
+
+    // AND connecting fails quickly when nothing is listening
+    close(listener);
+    conn = net_connect(url, &error);
+    ASSERT(conn == NULL && error != NULL, "expected connection to fail");
+    unlink(cache_path);
+    snprintf(cache_path, sizeof(cache_path), "%s/share-it", cache_dir);
+    rmdir(cache_path);
+    rmdir(cache_dir);
+
+    // GIVEN a session token from the server
+    char *token = NULL;
+    ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "could not create socket pair");
+    ret = pkt_send_session_token(sv[0], "0123456789abcdef");
+    ASSERT(ret == 0, "could not send session token");
+    ASSERT(recv(sv[1], &type, 1, 0) == 1 && type == packet_type_session_token, "expected session token");
+    ret = pkt_recv_session_token(sv[1], &token);
+    ASSERT(ret == 0 && strcmp(token, "0123456789abcdef") == 0, "session token differs after sending");
+
+    // WHEN the client reconnects and asks to resume the session
+    char *resume_token = NULL;
+    ret = pkt_send_session_resume_request(sv[1], token);
+    ASSERT(ret == 0, "could not send session resume request");
+    ASSERT(recv(sv[0], &type, 1, 0) == 1 && type == packet_type_session_resume_request, "expected resume request");
+    ret = pkt_recv_session_resume_request(sv[0], &resume_token);
+    ASSERT(ret == 0 && strcmp(resume_token, token) == 0, "resume token differs after sending");
+    free(token);
+    free(resume_token);
+
+    // THEN the other clients are told who is back
+    pkt_session_join_response_t join = { SESSION_JOIN_CLIENT_RESUMED, "viewer" };
+    ret = pkt_send_session_join_response(sv[0], &join);
+    ASSERT(ret == 0, "could not send session join response");
+    memset(&join, 0, sizeof(join));
+    ASSERT(recv(sv[1], &type, 1, 0) == 1 && type == packet_type_session_join_response, "expected join response");
+    ret = pkt_recv_session_join_response(sv[1], &join);
+    ASSERT(ret == 0 && join.status == SESSION_JOIN_CLIENT_RESUMED && strcmp(join.client_name, "viewer") == 0,
+           "join response differs after sending");
+    free(join.client_name);
+    close(sv[0]);
+    close(sv[1]);
+
+    // AND the send buffer follows the bandwidth-delay product, within limits
+    ASSERT(net_send_buffer_size(100, 1000) == NET_SEND_BUFFER_MIN, "expected the minimum send buffer on a fast link");
+    ASSERT(net_send_buffer_size(50000, 10000000) == 2 * 500000 + NET_NOTSENT_LOWAT_BYTES,
+           "expected the send buffer to be twice the bandwidth-delay product");
+    ASSERT(net_send_buffer_size(1000000, 1000000000) == NET_SEND_BUFFER_MAX, "expected the send buffer to be capped");
+
+    // AND reconnects back off exponentially, up to a limit
+    ASSERT(net_reconnect_delay(0) == NET_RECONNECT_MIN_DELAY_MS && net_reconnect_delay(1) == 2 * NET_RECONNECT_MIN_DELAY_MS,
+           "expected reconnect delay to double");
+    ASSERT(net_reconnect_delay(NET_RECONNECT_MAX_ATTEMPTS) == NET_RECONNECT_MAX_DELAY_MS,
+           "expected reconnect delay to be capped");
+
+    free_tile_state(&app);
     return 0;
 }
 
@@ -0,0 +1,462 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#include <string.h>
+#include "trle.h"
+#include "palette.h"
+#include "pixfmt.h"
+
+/*
+ * TRLE as described in the RFB protocol, except that there's no support for reusing
+ * the palette from the previous sub-tile (127 and 129), since each rect should be
+ * possible to decode on its own.
+ *
+ * Pixels (CPIXEL) are sent in the pixel format of the update, in the same way as in raw rects.
+ */
+
+typedef struct {
+    palette_t palette;
+    int n_colours;          // number of colours, or 0 if there are too many for a palette
+    uint8_t index[TRLE_TILE_SIZE * TRLE_TILE_SIZE];
+    int runs;               // number of runs of equal pixels
+    int plain_rle_sz;       // size of run lengths for plain RLE
+    int palette_rle_sz;     // size of run lengths for palette RLE
+} subtile_info_t;
+
+/**
+ * number of bits used for each pixel in a packed palette
+ */
+static int packed_bits(int n_colours) {
+    if (n_colours <= 2) {
+        return 1;
+    } else if (n_colours <= 4) {
+        return 2;
+    }
+    return 4;
+}
+
+/**
+ * number of extra bytes needed to encode a run length
+ */
+static inline int run_length_sz(int len) {
+    return (len - 1) / 255 + 1;
+}
+
+static inline uint8_t *put_run_length(uint8_t *out, int len) {
+    len --;
+    while (len >= 255) {
+        *out++ = 255;
+        len -= 255;
+    }
+    *out++ = len;
+    return out;
+}
+
+/**
+ * collect palette and run information for a sub-tile
+ *
+ * @param px    pixels of the sub-tile, w*h
+ * @param n     number of pixels
+ * @param bpp   bytes per pixel
+ * @param info  will be filled in with information about the sub-tile
+ */
+static void subtile_analyze(const uint32_t *px, int n, int bpp, subtile_info_t *info) {
+    int i, c, len;
+    int has_palette = 1;
+
+    palette_reset(&info->palette, TRLE_MAX_PALETTE);
+    info->runs = 0;
+    info->plain_rle_sz = 0;
+    info->palette_rle_sz = 0;
+
+    for (i = 0; i < n; i += len) {
+        // Find the length of this run
+        for (len = 1; i + len < n && px[i + len] == px[i]; len ++);
+
+        info->runs ++;
+        info->plain_rle_sz += run_length_sz(len);
+        info->palette_rle_sz += len == 1 ? 0 : run_length_sz(len);
+
+        if (has_palette) {
+            c = palette_index(&info->palette, px[i]);
+            if (c == -1 || info->palette.n_colours * bpp + info->runs >= n * bpp) {
+                // Too many colours for a palette to be smaller than raw
+                has_palette = 0;
+                continue;
+            }
+            memset(&info->index[i], c, len);
+        }
+    }
+    info->n_colours = has_palette ? info->palette.n_colours : 0;
+}
+
+/**
+ * encode one sub-tile using whichever sub-encoding is the smallest
+ *
+ * @param px      pixel values of the sub-tile, as returned by pixfmt_reduce()
+ * @param w       width of sub-tile
+ * @param h       height of sub-tile
+ * @param format  pixel format
+ * @param out     buffer to write to
+ * @return pointer to the byte after the encoded sub-tile
+ */
+static uint8_t *subtile_encode(const uint32_t *px, int w, int h, int format, uint8_t *out) {
+    subtile_info_t info;
+    int n = w * h;
+    int bpp = pixfmt_bpp(format);
+    int raw_sz, packed_sz, plain_rle_sz, palette_rle_sz;
+    int i, c, len, bits = 0;
+
+    subtile_analyze(px, n, bpp, &info);
+
+    if (info.n_colours == 1) {
+        *out++ = rle_encoding_type_solid;
+        return pixfmt_put(format, out, px[0]);
+    }
+
+    raw_sz = n * bpp;
+    plain_rle_sz = info.runs * bpp + info.plain_rle_sz;
+    packed_sz = raw_sz + 1;
+    palette_rle_sz = raw_sz + 1;
+    if (info.n_colours > 1) {
+        palette_rle_sz = info.n_colours * bpp + info.runs + info.palette_rle_sz;
+        if (info.n_colours <= 16) {
+            bits = packed_bits(info.n_colours);
+            packed_sz = info.n_colours * bpp + (w * bits + 7) / 8 * h;
+        }
+    }
+
+    if (packed_sz <= raw_sz && packed_sz <= plain_rle_sz && packed_sz <= palette_rle_sz) {
+        *out++ = rle_encoding_type_packed_palette + info.n_colours - 2;
+        for (c = 0; c < info.n_colours; c ++) {
+            out = pixfmt_put(format, out, info.palette.colours[c]);
+        }
+        for (int y = 0; y < h; y ++) {
+            int shift = 8;
+            uint8_t byte = 0;
+            for (int x = 0; x < w; x ++) {
+                shift -= bits;
+                byte |= info.index[y * w + x] << shift;
+                if (shift == 0) {
+                    *out++ = byte;
+                    byte = 0;
+                    shift = 8;
+                }
+            }
+            if (shift != 8) {
+                *out++ = byte;
+            }
+        }
+    } else if (palette_rle_sz <= raw_sz && palette_rle_sz <= plain_rle_sz) {
+        *out++ = rle_encoding_type_palette_rle + info.n_colours - 2;
+        for (c = 0; c < info.n_colours; c ++) {
+            out = pixfmt_put(format, out, info.palette.colours[c]);
+        }
+        for (i = 0; i < n; i += len) {
+            for (len = 1; i + len < n && px[i + len] == px[i]; len ++);
+            if (len == 1) {
+                *out++ = info.index[i];
+            } else {
+                *out++ = info.index[i] | 0x80;
+                out = put_run_length(out, len);
+            }
+        }
+    } else if (plain_rle_sz < raw_sz) {
+        *out++ = rle_encoding_type_plain_rle;
+        for (i = 0; i < n; i += len) {
+            for (len = 1; i + len < n && px[i + len] == px[i]; len ++);
+            out = pixfmt_put(format, out, px[i]);
+            out = put_run_length(out, len);
+        }
+    } else {
+        *out++ = rle_encoding_type_raw;
+        for (i = 0; i < n; i ++) {
+            out = pixfmt_put(format, out, px[i]);
+        }
+    }
+    return out;
+}
+
+/**
+ * encode a rect with TRLE
+ *
+ * @param pixels  first pixel of the rect
+ * @param stride  number of pixels between each row in 'pixels'
+ * @param w       width of rect
+ * @param h       height of rect
+ * @param format  pixel format to use for the encoded pixels
+ * @param output  buffer to write the encoded rect to, must be at least TRLE_MAX_SIZE(w, h) bytes
+ * @return number of bytes written to output
+ */
+int trle_encode(const uint32_t *pixels, int stride, int w, int h, int format, uint8_t *output) {
+    uint32_t px[TRLE_TILE_SIZE * TRLE_TILE_SIZE];
+    uint8_t *out = output;
+    int tx, ty, tw, th;
+
+    for (ty = 0; ty < h; ty += TRLE_TILE_SIZE) {
+        th = h - ty < TRLE_TILE_SIZE ? h - ty : TRLE_TILE_SIZE;
+        for (tx = 0; tx < w; tx += TRLE_TILE_SIZE) {
+            tw = w - tx < TRLE_TILE_SIZE ? w - tx : TRLE_TILE_SIZE;
+
+            // Compare the pixels as they will be sent, so that the unused byte, and colours
+            // that are lost in the conversion, don't affect the comparisons
+            for (int y = 0; y < th; y ++) {
+                const uint32_t *row = pixels + (ty + y) * stride + tx;
+                for (int x = 0; x < tw; x ++) {
+                    px[y * tw + x] = pixfmt_reduce(format, row[x]);
+                }
+            }
+            out = subtile_encode(px, tw, th, format, out);
+        }
+    }
+    return out - output;
+}
+
+/**
+ * decode a TRLE encoded rect
+ *
+ * @param data        encoded rect
+ * @param length      length of 'data'
+ * @param pixels      first pixel of block to write to (4 bytes per pixel)
+ * @param row_stride  number of bytes between each row in 'pixels'
+ * @param w           width of rect
+ * @param h           height of rect
+ * @param format      pixel format of the encoded pixels
+ * @return 0 on success, -1 if the data is invalid
+ */
+int trle_decode(const uint8_t *data, uint32_t length, uint8_t *pixels, int row_stride, int w, int h, int format) {
+    const uint8_t *end = data + length;
+    uint8_t palette[TRLE_MAX_PALETTE][3];
+    uint8_t pixel[3];
+    int bpp = pixfmt_bpp(format);
+    int tx, ty, tw, th;
+    int n_colours, n, i, c, len;
+    uint8_t type;
+
+// Position of pixel i in the current sub-tile
+#define PIXEL(i) (pixels + (ty + (i) / tw) * row_stride + (tx + (i) % tw) * 4)
+#define NEED(n) if (end - data < (n)) { return -1; }
+
+    for (ty = 0; ty < h; ty += TRLE_TILE_SIZE) {
+        th = h - ty < TRLE_TILE_SIZE ? h - ty : TRLE_TILE_SIZE;
+        for (tx = 0; tx < w; tx += TRLE_TILE_SIZE) {
+            tw = w - tx < TRLE_TILE_SIZE ? w - tx : TRLE_TILE_SIZE;
+            n = tw * th;
+
+            NEED(1);
+            type = *data++;
+
+            if (type == rle_encoding_type_raw) {
+                NEED(n * bpp);
+                for (i = 0; i < n; i ++, data += bpp) {
+                    pixfmt_expand(format, data, PIXEL(i));
+                }
+            } else if (type == rle_encoding_type_solid) {
+                NEED(bpp);
+                pixfmt_expand(format, data, pixel);
+                for (i = 0; i < n; i ++) {
+                    memcpy(PIXEL(i), pixel, 3);
+                }
+                data += bpp;
+            } else if (type >= rle_encoding_type_packed_palette && type <= 16) {
+                n_colours = type;
+                int bits = packed_bits(n_colours);
+                int row_sz = (tw * bits + 7) / 8;
+
+                NEED(n_colours * bpp + row_sz * th);
+                for (c = 0; c < n_colours; c ++, data += bpp) {
+                    pixfmt_expand(format, data, palette[c]);
+                }
+                for (int y = 0; y < th; y ++, data += row_sz) {
+                    for (int x = 0; x < tw; x ++) {
+                        int bit = x * bits;
+                        c = (data[bit / 8] >> (8 - bits - bit % 8)) & ((1 << bits) - 1);
+                        if (c >= n_colours) {
+                            return -1;
+                        }
+                        memcpy(PIXEL(y * tw + x), palette[c], 3);
+                    }
+                }
+            } else if (type == rle_encoding_type_plain_rle) {
+                for (i = 0; i < n; i += len) {
+                    NEED(bpp + 1);
+                    pixfmt_expand(format, data, pixel);
+                    data += bpp;
+                    for (len = 1; *data == 255; data ++) {
+                        len += 255;
+                        NEED(2);
+                    }
+                    len += *data++;
+                    if (i + len > n) {
+                        return -1;
+                    }
+                    for (int j = i; j < i + len; j ++) {
+                        memcpy(PIXEL(j), pixel, 3);
+                    }
+                }
+            } else if (type >= rle_encoding_type_palette_rle) {
+                n_colours = type - 128;
+                NEED(n_colours * bpp);
+                for (c = 0; c < n_colours; c ++, data += bpp) {
+                    pixfmt_expand(format, data, palette[c]);
+                }
+                for (i = 0; i < n; i += len) {
+                    NEED(1);
+                    c = *data++;
+                    len = 1;
+                    if (c & 0x80) {
+                        c &= 0x7f;
+                        NEED(1);
+                        for (; *data == 255; data ++) {
+                            len += 255;
+                            NEED(2);
+                        }
+                        len += *data++;
+                    }
+                    if (c >= n_colours || i + len > n) {
+                        return -1;
+                    }
+                    for (int j = i; j < i + len; j ++) {
+                        memcpy(PIXEL(j), palette[c], 3);
+                    }
+                }
+            } else {
+                // 127 and 129 (reuse palette) are not supported
+                return -1;
+            }
+        }
+    }
+
+#undef PIXEL
+#undef NEED
+    return data == end ? 0 : -1;
+}
+
+/**
+ * find the number of bytes used by an encoded sub-tile
+ *
+ * @param data  start of sub-tile
+ * @param end   end of encoded data
+ * @param tw    width of sub-tile
+ * @param th    height of sub-tile
+ * @param bpp   bytes per pixel
+ * @return size of sub-tile, or -1 if the data is invalid
+ */
+static int subtile_size(const uint8_t *data, const uint8_t *end, int tw, int th, int bpp) {
+    const uint8_t *p = data + 1;
+    int n = tw * th;
+    int i, len, n_colours;
+
+    if (data >= end) {
+        return -1;
+    }
+
+    if (data[0] == rle_encoding_type_raw) {
+        p += n * bpp;
+    } else if (data[0] == rle_encoding_type_solid) {
+        p += bpp;
+    } else if (data[0] <= 16) {
+        p += data[0] * bpp + (tw * packed_bits(data[0]) + 7) / 8 * th;
+    } else if (data[0] == rle_encoding_type_plain_rle || data[0] >= rle_encoding_type_palette_rle) {
+        n_colours = data[0] == rle_encoding_type_plain_rle ? 0 : data[0] - 128;
+        p += n_colours * bpp;
+        for (i = 0; i < n; i += len) {
+            if (n_colours == 0) {
+                p += bpp;
+            } else if (p < end && (*p++ & 0x80) == 0) {
+                len = 1;
+                continue;
+            }
+            for (len = 1; p < end && *p == 255; p ++) {
+                len += 255;
+            }
+            if (p >= end) {
+                return -1;
+            }
+            len += *p++;
+        }
+    } else {
+        return -1;
+    }
+
+    if (p > end) {
+        return -1;
+    }
+    return p - data;
+}
+
+/**
+ * join two TRLE encoded rects that are next to each other into one, without re-encoding them
+ *
+ * @param a       encoded left rect
+ * @param a_len   length of 'a'
+ * @param a_w     width of left rect, must be a multiple of TRLE_TILE_SIZE
+ * @param b       encoded right rect
+ * @param b_len   length of 'b'
+ * @param b_w     width of right rect
+ * @param h       height of both rects
+ * @param format  pixel format of both rects
+ * @param output  buffer to write the joined rect to, must be at least a_len + b_len bytes
+ * @return 0 on success, -1 if the rects can't be joined
+ */
+int trle_join_horizontal(const uint8_t *a, uint32_t a_len, int a_w, const uint8_t *b, uint32_t b_len, int b_w,
+                         int h, int format, uint8_t *output) {
+    const uint8_t *a_end = a + a_len, *b_end = b + b_len;
+    int bpp = pixfmt_bpp(format);
+    int tx, ty, th, sz;
+
+    if (a_w % TRLE_TILE_SIZE != 0) {
+        return -1;
+    }
+
+    // Sub-tiles are stored row by row, so the rows of sub-tiles have to be interleaved
+    for (ty = 0; ty < h; ty += TRLE_TILE_SIZE) {
+        th = h - ty < TRLE_TILE_SIZE ? h - ty : TRLE_TILE_SIZE;
+        for (tx = 0; tx < a_w; tx += TRLE_TILE_SIZE) {
+            if ((sz = subtile_size(a, a_end, TRLE_TILE_SIZE, th, bpp)) < 0) {
+                return -1;
+            }
+            memcpy(output, a, sz);
+            output += sz;
+            a += sz;
+        }
+        for (tx = 0; tx < b_w; tx += TRLE_TILE_SIZE) {
+            int tw = b_w - tx < TRLE_TILE_SIZE ? b_w - tx : TRLE_TILE_SIZE;
+            if ((sz = subtile_size(b, b_end, tw, th, bpp)) < 0) {
+                return -1;
+            }
+            memcpy(output, b, sz);
+            output += sz;
+            b += sz;
+        }
+    }
+    return a == a_end && b == b_end ? 0 : -1;
+}
+
+/**
+ * join two TRLE encoded rects where 'b' is right below 'a' into one
+ *
+ * @param a       encoded top rect
+ * @param a_len   length of 'a'
+ * @param a_h     height of top rect, must be a multiple of TRLE_TILE_SIZE
+ * @param b       encoded bottom rect, with the same width as 'a'
+ * @param b_len   length of 'b'
+ * @param output  buffer to write the joined rect to, must be at least a_len + b_len bytes
+ * @return 0 on success, -1 if the rects can't be joined
+ */
+int trle_join_vertical(const uint8_t *a, uint32_t a_len, int a_h, const uint8_t *b, uint32_t b_len, uint8_t *output) {
+    if (a_h % TRLE_TILE_SIZE != 0) {
+        return -1;
+    }
+
+    // The rows of sub-tiles in 'b' simply follow the ones in 'a'
+    memcpy(output, a, a_len);
+    memcpy(output + a_len, b, b_len);
+    return 0;
+}
@@ -0,0 +1,39 @@
+//      _                       _ _
+//     | |                     (_) |
+//  ___| |__   __ _ _ __ ___    _| |_
+// / __| '_ \ / _` | '__/ _ \__| | __|
+// \__ \ | | | (_| | | |  __/--| | |_
+// |___/_| |_|\__,_|_|  \___|  |_|\__|
+// Copyright © 2020 Elias Norberg
+// Licensed under the GPLv3 or later.
+// See COPYING at the root of the repository for details.
+#ifndef SHAREIT_TRLE_H
+#define SHAREIT_TRLE_H
+#include <stdint.h>
+
+// Rects are split into sub-tiles of this size, which are encoded separately
+#define TRLE_TILE_SIZE 16
+
+// Largest palette that can be used for palette RLE
+#define TRLE_MAX_PALETTE 127
+
+// Max number of bytes needed to encode a w x h rect: each sub-tile is never larger than raw
+// (at most 3 bytes per pixel), plus one byte for the sub-encoding type
+#define TRLE_MAX_SIZE(w, h) ((w) * (h) * 3 + \
+                             (((w) + TRLE_TILE_SIZE - 1) / TRLE_TILE_SIZE) * \
+                             (((h) + TRLE_TILE_SIZE - 1) / TRLE_TILE_SIZE))
+
+enum rle_encoding_type {
+    rle_encoding_type_raw = 0,
+    rle_encoding_type_solid = 1,
+    rle_encoding_type_packed_palette = 2, // 2 - 16 are packed palette types,
+    rle_encoding_type_plain_rle = 128,
+    rle_encoding_type_palette_rle = 130, // 130 - 255 are palette rle's
+};
+
+int trle_encode(const uint32_t *pixels, int stride, int w, int h, int format, uint8_t *output);
+int trle_decode(const uint8_t *data, uint32_t length, uint8_t *pixels, int row_stride, int w, int h, int format);
+int trle_join_horizontal(const uint8_t *a, uint32_t a_len, int a_w, const uint8_t *b, uint32_t b_len, int b_w,
+                         int h, int format, uint8_t *output);
+int trle_join_vertical(const uint8_t *a, uint32_t a_len, int a_h, const uint8_t *b, uint32_t b_len, uint8_t *output);
+#endif
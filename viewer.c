@@ -8,7 +8,12 @@
 // Licensed under the GPLv3 or later.
 // See COPYING at the root of the repository for details.
 #include <gtk/gtk.h>
+#include <string.h>
 #include "shareit.h"
+#include "packet.h"
+
+// Wait this long (in ms) after the window has been resized before asking the sharer for a new size
+#define DISPLAY_SIZE_DELAY_MS 500
 
 typedef struct {
     shareit_app_t *app;
@@ -20,6 +25,8 @@ typedef struct {
     GtkWidget *btn_toggle_zoom_fit;
     GtkWidget *btn_zoom_original;
     GtkWidget *btn_leave;
+    GtkWidget *btn_toggle_stats;
+    GtkWidget *combo_pixel_format;
     GtkAdjustment *drawing_adjust_horizontal;
     GtkAdjustment *drawing_adjust_vertical;
 
@@ -31,14 +38,110 @@ typedef struct {
     double scale_x;
     double scale_y;
     gboolean fit_to_window;
+    guint display_size_timer;
+
+    // Show pipeline statistics on top of the image
+    gboolean show_stats;
+    guint stats_redraw_timer;
 }viewer_win_t;
 
+/**
+ * draw the statistics overlay in the top left corner of the visible area
+ *
+ * @param cr   cairo context to draw to, in widget coordinates
+ * @param win  viewer window
+ */
+static void draw_stats_overlay(cairo_t *cr, viewer_win_t *win) {
+    char summary[1024];
+    char *line, *saveptr;
+    double x = gtk_adjustment_get_value(win->drawing_adjust_horizontal) + 8;
+    double y = gtk_adjustment_get_value(win->drawing_adjust_vertical) + 8;
+    int n_lines = 1;
+
+    stats_format_summary(win->app->stats, summary, sizeof(summary));
+    for (char *p = summary; *p; p++) {
+        if (*p == '\n') {
+            n_lines++;
+        }
+    }
+
+    cairo_select_font_face(cr, "monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size(cr, 12);
+    cairo_set_source_rgba(cr, 0, 0, 0, 0.6);
+    cairo_rectangle(cr, x, y, 420, n_lines * 14 + 8);
+    cairo_fill(cr);
+
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    y += 16;
+    for (line = strtok_r(summary, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr)) {
+        cairo_move_to(cr, x + 4, y);
+        cairo_show_text(cr, line);
+        y += 14;
+    }
+}
+
 static gboolean window_draw(GtkWidget *widget, cairo_t *cr, viewer_win_t *win) {
     gtk_widget_queue_draw(win->drawing);
     return FALSE;
 }
 
+/**
+ * draw the remote cursor on top of the image
+ *
+ * @param cr  cairo context to draw to, scaled to image coordinates
+ * @param x   x position of the image
+ * @param y   y position of the image
+ * @param app the main application
+ */
+static void draw_cursor(cairo_t *cr, double x, double y, shareit_app_t *app) {
+    cursor_shape_t *shape = app->cursors.current;
+    double cx = x + app->mouse_pos_x;
+    double cy = y + app->mouse_pos_y;
+
+    if (shape != NULL && shape->pixels != NULL) {
+        cairo_surface_t *surface = cairo_image_surface_create_for_data((uint8_t *)shape->pixels,
+                                   CAIRO_FORMAT_ARGB32,
+                                   shape->width,
+                                   shape->height,
+                                   shape->width * sizeof(uint32_t));
+        cairo_set_source_surface(cr, surface, cx - shape->xhot, cy - shape->yhot);
+        cairo_paint(cr);
+        cairo_surface_destroy(surface);
+        return;
+    }
+
+    // No shape received (or the grabber can't provide one), draw a plain arrow
+    cairo_move_to(cr, cx, cy);
+    cairo_line_to(cr, cx, cy + 16);
+    cairo_line_to(cr, cx + 4, cy + 12);
+    cairo_line_to(cr, cx + 11, cy + 12);
+    cairo_close_path(cr);
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    cairo_fill_preserve(cr);
+    cairo_set_source_rgb(cr, 0, 0, 0);
+    cairo_set_line_width(cr, 1);
+    cairo_stroke(cr);
+}
+
+static gboolean drawing_configure(GtkWidget *widget, GdkEventConfigure *event_p, viewer_win_t *win) {
+    if (win->fit_to_window) {
+        win->scale_x = (double)win->window_width / win->app->view->width;
+        win->scale_y = (double)win->window_height / win->app->view->height;
+    } else {
+        // Synchronize scales
+        win->scale_x = win->scale_y;
+    }
+    return FALSE;
+}
+
 static gboolean drawing_draw(GtkWidget *widget, cairo_t *cr, viewer_win_t *win) {
+    gint64 start = stats_begin(win->app->stats);
+
+    // The sharer may have changed the size of the screen
+    if (win->fit_to_window) {
+        drawing_configure(widget, NULL, win);
+    }
+
     // Position image in center if it's smaller than the window
     viewinfo_t *view = win->app->view;
     double w = (double)view->width * win->scale_x;
@@ -60,23 +163,71 @@ static gboolean drawing_draw(GtkWidget *widget, cairo_t *cr, viewer_win_t *win)
                                                                     view->height,
                                                                     view->row_stride);
     gtk_widget_set_size_request(widget, (int)w, (int) h);
+    cairo_save(cr);
     cairo_scale(cr, win->scale_x, win->scale_y);
     cairo_set_source_surface(cr, surface, x, y);
     cairo_paint(cr);
+    if (win->app->has_mouse_pos) {
+        draw_cursor(cr, x, y, win->app);
+    }
+    cairo_restore(cr);
+    cairo_surface_destroy(surface);
+    stats_end(win->app->stats, stats_stage_present, start);
+
+    // Report back to the sharer if it's measuring latency
+    if (win->app->frame_drawn && win->app->conn != NULL) {
+        shareit_app_t *app = win->app;
+        if (pkt_send_frame_presented(app->conn->socket, app->viewer_id, app->frame_id,
+                                     app->frame_capture_time, g_get_monotonic_time()) != 0) {
+            fprintf(stderr, "could not send frame presented report\n");
+        }
+        app->frame_stamped = FALSE;
+        app->frame_drawn = FALSE;
+    }
+
+    if (win->show_stats && win->app->stats != NULL) {
+        draw_stats_overlay(cr, win);
+    }
     return FALSE;
 }
 
-static gboolean drawing_configure(GtkWidget *widget, GdkEventConfigure *event_p, viewer_win_t *win) {
+static gboolean send_display_size(viewer_win_t *win) {
+    shareit_app_t *app = win->app;
+    int width = 0, height = 0;
+
+    win->display_size_timer = 0;
+
+    // When fitting the screen to the window there's no point in getting more pixels than
+    // the window has, otherwise we want the full resolution
     if (win->fit_to_window) {
-        win->scale_x = (double)win->window_width / win->app->view->width;
-        win->scale_y = (double)win->window_height / win->app->view->height;
-    } else {
-        // Synchronize scales
-        win->scale_x = win->scale_y;
+        width = win->window_width;
+        height = win->window_height;
+    }
+    if (width == app->display_width && height == app->display_height) {
+        return FALSE;
+    }
+
+    app->display_width = width;
+    app->display_height = height;
+    if (app->conn != NULL && pkt_send_display_size_request(app->conn->socket, app->viewer_id, width, height) != 0) {
+        fprintf(stderr, "could not send display size request\n");
     }
     return FALSE;
 }
 
+/**
+ * tell the sharer how large our screen is, once the window has stopped changing size
+ *
+ * @param win  viewer window
+ */
+static void request_display_size(viewer_win_t *win) {
+    // Every new size makes the sharer send the whole screen again
+    if (win->display_size_timer != 0) {
+        g_source_remove(win->display_size_timer);
+    }
+    win->display_size_timer = g_timeout_add(DISPLAY_SIZE_DELAY_MS, G_SOURCE_FUNC(send_display_size), win);
+}
+
 static gboolean scroll_win_size_event(GtkWidget *widget, GdkEvent *ev, viewer_win_t *win) {
     GtkAllocation sz;
     gtk_widget_get_allocation(widget, &sz);
@@ -86,6 +237,7 @@ static gboolean scroll_win_size_event(GtkWidget *widget, GdkEvent *ev, viewer_wi
     if (win->fit_to_window) {
         drawing_configure(win->drawing, NULL, win);
         gtk_widget_queue_draw(win->drawing);
+        request_display_size(win);
     }
     return FALSE;
 }
@@ -119,6 +271,7 @@ static gboolean drawing_scroll(GtkWidget *drawing, GdkEventScroll *ev, viewer_wi
         if (win->fit_to_window) {
             win->fit_to_window = FALSE;
             gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(win->btn_toggle_zoom_fit), FALSE);
+            request_display_size(win);
         }
 
         gtk_adjustment_set_value(win->drawing_adjust_horizontal, new_x + gtk_adjustment_get_value(win->drawing_adjust_horizontal) - ev->x);
@@ -137,16 +290,63 @@ static gboolean zoom_original(GtkWidget *btn, viewer_win_t *win) {
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(win->btn_toggle_zoom_fit), FALSE);
     drawing_configure(win->drawing, NULL, win);
     gtk_widget_queue_draw(win->drawing);
+    request_display_size(win);
     return FALSE;
 }
 
 static gboolean zoom_fit(GtkWidget *btn, viewer_win_t *win) {
     win->fit_to_window = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(btn));
+    request_display_size(win);
     drawing_configure(win->drawing, NULL, win);
     gtk_widget_queue_draw(win->drawing);
     return FALSE;
 }
 
+static gboolean stats_redraw(viewer_win_t *win) {
+    gtk_widget_queue_draw(win->drawing);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean toggle_stats(GtkWidget *btn, viewer_win_t *win) {
+    win->show_stats = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(btn));
+
+    if (win->show_stats) {
+        // Start collecting stats if we weren't asked to do so at startup
+        if (win->app->stats == NULL) {
+            win->app->stats = stats_new();
+            if (win->app->stats == NULL) {
+                return FALSE;
+            }
+            stats_start_timer(win->app->stats);
+        }
+
+        // Keep the overlay up to date even if the screen isn't changing
+        win->stats_redraw_timer = g_timeout_add(STATS_PERIOD_MS, G_SOURCE_FUNC(stats_redraw), win);
+    } else if (win->stats_redraw_timer != 0) {
+        g_source_remove(win->stats_redraw_timer);
+        win->stats_redraw_timer = 0;
+    }
+
+    gtk_widget_queue_draw(win->drawing);
+    return FALSE;
+}
+
+static gboolean pixel_format_changed(GtkWidget *combo, viewer_win_t *win) {
+    const char *id = gtk_combo_box_get_active_id(GTK_COMBO_BOX(combo));
+    int format = id != NULL ? pixfmt_parse(id) : -1;
+
+    if (format == -1 || format == win->app->pixel_format) {
+        return FALSE;
+    }
+
+    // Takes effect with the next framebuffer update, which says what format it uses
+    win->app->pixel_format = format;
+    if (win->app->conn != NULL && pkt_send_pixel_format_request(win->app->conn->socket, format) != 0) {
+        fprintf(stderr, "could not send pixel format request\n");
+    }
+    return FALSE;
+}
+
 static gboolean leave_session(GtkWidget *btn, viewer_win_t *win) {
     gtk_widget_hide(win->window);
     return FALSE;
@@ -174,6 +374,8 @@ GtkWidget *viewer_initialize(shareit_app_t *app) {
     BUILDER_GET(win->btn_toggle_zoom_fit, GTK_WIDGET, "btn_toggle_zoom_fit");
     BUILDER_GET(win->btn_zoom_original, GTK_WIDGET, "btn_zoom_original");
     BUILDER_GET(win->btn_leave, GTK_WIDGET, "btn_leave");
+    BUILDER_GET(win->btn_toggle_stats, GTK_WIDGET, "btn_toggle_stats");
+    BUILDER_GET(win->combo_pixel_format, GTK_WIDGET, "combo_pixel_format");
 
     gtk_scrolled_window_set_policy(win->scrolled_window, GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
     win->drawing_adjust_horizontal = gtk_scrolled_window_get_hadjustment(win->scrolled_window);
@@ -185,6 +387,7 @@ GtkWidget *viewer_initialize(shareit_app_t *app) {
     gtk_widget_set_events(win->drawing, gtk_widget_get_events(win->drawing) | GDK_SCROLL_MASK);
 
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(win->btn_toggle_zoom_fit), win->fit_to_window);
+    gtk_combo_box_set_active_id(GTK_COMBO_BOX(win->combo_pixel_format), pixfmt_name(app->pixel_format));
 
     // Register all signal handlers
     g_signal_connect(G_OBJECT(win->drawing), "configure-event", G_CALLBACK(drawing_configure), win);
@@ -195,6 +398,8 @@ GtkWidget *viewer_initialize(shareit_app_t *app) {
     g_signal_connect(G_OBJECT(win->btn_zoom_original), "clicked", G_CALLBACK(zoom_original), win);
     g_signal_connect(G_OBJECT(win->btn_toggle_zoom_fit), "toggled", G_CALLBACK(zoom_fit), win);
     g_signal_connect(G_OBJECT(win->btn_leave), "clicked", G_CALLBACK(leave_session), win);
+    g_signal_connect(G_OBJECT(win->btn_toggle_stats), "toggled", G_CALLBACK(toggle_stats), win);
+    g_signal_connect(G_OBJECT(win->combo_pixel_format), "changed", G_CALLBACK(pixel_format_changed), win);
     g_signal_connect(G_OBJECT(win->window), "delete-event", G_CALLBACK(gtk_widget_hide_on_delete), win);
 
     return win->window;
@@ -9,15 +9,32 @@
 // See COPYING at the root of the repository for details.
 #include <xcb/xcb.h>
 #include <xcb/xfixes.h>
+#include <xcb/randr.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #include <ctype.h>
 #include <malloc.h>
+#include <pthread.h>
 #include <zlib.h>
+#include "cursor.h"
+#include "grab.h"
 
 #define CHUNK 16384
 
+// The screen is fetched in bands of this many rows, so that we can start
+// comparing the first bands while the server is still sending the rest
+#define GRAB_BAND_HEIGHT 64
+
+// Part of the screen that is fetched with one request, relative to the grabbed region
+typedef struct {
+    int x;
+    int y;
+    int width;
+    int height;
+} grab_band_t;
+
 static int check_xfixes(xcb_connection_t *conn) {
     xcb_xfixes_query_version_cookie_t cookie;
     xcb_xfixes_query_version_reply_t *reply;
@@ -37,13 +54,201 @@ typedef struct grab_xcb_t {
     xcb_connection_t *conn;
     xcb_drawable_t win;
     int can_grab_cursor;
+    int root_width;
+    int root_height;
+
+    // Part of the root window that is grabbed
+    int x;
+    int y;
     int width;
     int height;
+
+    // Window to follow when it's moved, or 0
+    xcb_window_t follow;
+
+    // When sharing the whole screen, each monitor is grabbed by itself, as a stream of its own
+    grab_output_t outputs[GRAB_MAX_OUTPUTS];
+    int n_outputs;
+    int covered;  // the monitors cover all of the screen
+    int first_band[GRAB_MAX_OUTPUTS + 1];  // bands of output i are first_band[i] up to first_band[i + 1]
+
+    grab_band_t *bands;
+    xcb_get_image_cookie_t *cookies;
+    int n_bands;
+
+    // Cursor changes are reported to us as XFixes cursor notify events
+    uint8_t xfixes_first_event;
+    uint32_t cursor_serial;
+    int has_cursor_serial;
 } grab_xcb_t;
 
-void *grab_initialize() {
+/**
+ * move the grabbed part of the screen, keeping it inside the root window
+ *
+ * @param info  grabber
+ * @param x     new x position
+ * @param y     new y position
+ */
+static void grab_move(grab_xcb_t *info, int x, int y) {
+    if (x > info->root_width - info->width) {
+        x = info->root_width - info->width;
+    }
+    if (y > info->root_height - info->height) {
+        y = info->root_height - info->height;
+    }
+    info->x = x < 0 ? 0 : x;
+    info->y = y < 0 ? 0 : y;
+}
+
+/**
+ * find where a window is on the screen
+ *
+ * @param[in]  info  grabber
+ * @param[out] x     x position of window, relative to the root window
+ * @param[out] y     y position of window, relative to the root window
+ * @return 0 on success, -1 if the window is gone
+ */
+static int window_position(grab_xcb_t *info, int *x, int *y) {
+    xcb_translate_coordinates_reply_t *pos;
+
+    pos = xcb_translate_coordinates_reply(info->conn,
+                                          xcb_translate_coordinates(info->conn, info->follow, info->win, 0, 0), NULL);
+    if (pos == NULL) {
+        return -1;
+    }
+    *x = pos->dst_x;
+    *y = pos->dst_y;
+    free(pos);
+    return 0;
+}
+
+/**
+ * find the monitors of the screen with RandR
+ *
+ * Mirrored monitors show the same part of the screen, and are only listed once.
+ *
+ * @param info         grabber
+ * @param outputs      list to fill in
+ * @param max_outputs  max number of monitors to list
+ * @return number of monitors found, 0 if RandR 1.5 isn't available
+ */
+static int find_outputs(grab_xcb_t *info, grab_output_t *outputs, int max_outputs) {
+    xcb_randr_query_version_reply_t *version;
+    xcb_randr_get_monitors_reply_t *monitors;
+    xcb_randr_monitor_info_iterator_t iter;
+    int i, n = 0;
+
+    // Monitors were added in RandR 1.5
+    version = xcb_randr_query_version_reply(info->conn, xcb_randr_query_version(info->conn, 1, 5), NULL);
+    if (version == NULL) {
+        return 0;
+    }
+    if (version->major_version < 1 || (version->major_version == 1 && version->minor_version < 5)) {
+        free(version);
+        return 0;
+    }
+    free(version);
+
+    monitors = xcb_randr_get_monitors_reply(info->conn, xcb_randr_get_monitors(info->conn, info->win, 1), NULL);
+    if (monitors == NULL) {
+        return 0;
+    }
+
+    for (iter = xcb_randr_get_monitors_monitors_iterator(monitors); iter.rem && n < max_outputs;
+         xcb_randr_monitor_info_next(&iter)) {
+        xcb_randr_monitor_info_t *monitor = iter.data;
+        xcb_get_atom_name_reply_t *name;
+
+        for (i = 0; i < n; i++) {
+            if (outputs[i].x == monitor->x && outputs[i].y == monitor->y &&
+                outputs[i].width == monitor->width && outputs[i].height == monitor->height) {
+                break;
+            }
+        }
+        if (i < n) {
+            continue;
+        }
+
+        outputs[n].name[0] = '\0';
+        name = xcb_get_atom_name_reply(info->conn, xcb_get_atom_name(info->conn, monitor->name), NULL);
+        if (name != NULL) {
+            snprintf(outputs[n].name, sizeof(outputs[n].name), "%.*s",
+                     xcb_get_atom_name_name_length(name), xcb_get_atom_name_name(name));
+            free(name);
+        }
+        outputs[n].x = monitor->x;
+        outputs[n].y = monitor->y;
+        outputs[n].width = monitor->width;
+        outputs[n].height = monitor->height;
+        n++;
+    }
+    free(monitors);
+    return n;
+}
+
+/**
+ * find monitor by name or number
+ *
+ * @param outputs    monitors to search
+ * @param n_outputs  number of monitors
+ * @param name       name, or number in the list, of monitor
+ * @return monitor, or NULL if it wasn't found
+ */
+static const grab_output_t *match_output(const grab_output_t *outputs, int n_outputs, const char *name) {
+    char *end;
+    long i = strtol(name, &end, 10);
+
+    if (*name != '\0' && *end == '\0') {
+        return i >= 0 && i < n_outputs ? &outputs[i] : NULL;
+    }
+    for (i = 0; i < n_outputs; i++) {
+        if (strcmp(outputs[i].name, name) == 0) {
+            return &outputs[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * split part of the grabbed region into bands
+ *
+ * @param info    grabber
+ * @param x       x position, relative to the grabbed region
+ * @param y       y position, relative to the grabbed region
+ * @param width   width of the part
+ * @param height  height of the part
+ * @return 0 on success, -1 on error
+ */
+static int add_bands(grab_xcb_t *info, int x, int y, int width, int height) {
+    int n = (height + GRAB_BAND_HEIGHT - 1) / GRAB_BAND_HEIGHT;
+    grab_band_t *bands;
+    xcb_get_image_cookie_t *cookies;
+    int i;
+
+    bands = realloc(info->bands, (info->n_bands + n) * sizeof(grab_band_t));
+    if (bands == NULL) {
+        return -1;
+    }
+    info->bands = bands;
+    cookies = realloc(info->cookies, (info->n_bands + n) * sizeof(xcb_get_image_cookie_t));
+    if (cookies == NULL) {
+        return -1;
+    }
+    info->cookies = cookies;
+
+    for (i = 0; i < n; i++) {
+        grab_band_t *band = &info->bands[info->n_bands++];
+        band->x = x;
+        band->y = y + i * GRAB_BAND_HEIGHT;
+        band->width = width;
+        band->height = i < n - 1 ? GRAB_BAND_HEIGHT : height - i * GRAB_BAND_HEIGHT;
+    }
+    return 0;
+}
+
+static void *grab_xcb_initialize(const char *options, const grab_region_t *region) {
     grab_xcb_t *info;
-    info = malloc(sizeof(grab_xcb_t));
+    info = calloc(1, sizeof(grab_xcb_t));
 
     info->conn = xcb_connect(NULL, NULL);
     if (info->conn == NULL) {
@@ -65,6 +270,13 @@ void *grab_initialize() {
     xcb_screen_t *screen = iter.data;
     info->win = screen->root;
 
+    info->has_cursor_serial = 0;
+    if (info->can_grab_cursor) {
+        info->xfixes_first_event = xcb_get_extension_data(info->conn, &xcb_xfixes_id)->first_event;
+        xcb_xfixes_select_cursor_input(info->conn, info->win, XCB_XFIXES_CURSOR_NOTIFY_MASK_DISPLAY_CURSOR);
+        xcb_flush(info->conn);
+    }
+
     xcb_get_geometry_reply_t *geom;
     geom = xcb_get_geometry_reply (info->conn, xcb_get_geometry (info->conn, info->win), NULL);
     if (geom == NULL) {
@@ -72,61 +284,249 @@ void *grab_initialize() {
         return NULL;
     }
 
-    info->width = geom->width;
-    info->height = geom->height;
+    info->root_width = info->width = geom->width;
+    info->root_height = info->height = geom->height;
+    free(geom);
+
+    if (region != NULL && region->output != NULL) {
+        grab_output_t outputs[GRAB_MAX_OUTPUTS];
+        const grab_output_t *output;
+
+        output = match_output(outputs, find_outputs(info, outputs, GRAB_MAX_OUTPUTS), region->output);
+        if (output == NULL) {
+            printf("could not find monitor '%s'\n", region->output);
+            return NULL;
+        }
+        info->width = output->width < info->root_width ? output->width : info->root_width;
+        info->height = output->height < info->root_height ? output->height : info->root_height;
+        grab_move(info, output->x, output->y);
+    } else if (region != NULL && region->window != 0) {
+        int x, y;
+
+        info->follow = region->window;
+        geom = xcb_get_geometry_reply(info->conn, xcb_get_geometry(info->conn, info->follow), NULL);
+        if (geom == NULL || window_position(info, &x, &y) != 0) {
+            printf("could not find window 0x%lx\n", region->window);
+            free(geom);
+            return NULL;
+        }
+        info->width = geom->width < info->root_width ? geom->width : info->root_width;
+        info->height = geom->height < info->root_height ? geom->height : info->root_height;
+        free(geom);
+        grab_move(info, x, y);
+    } else if (region != NULL && region->width > 0 && region->height > 0) {
+        info->width = region->width < info->root_width ? region->width : info->root_width;
+        info->height = region->height < info->root_height ? region->height : info->root_height;
+        grab_move(info, region->x, region->y);
+    } else {
+        // Parts of the screen that no monitor shows are never read
+        int i;
+
+        info->n_outputs = find_outputs(info, info->outputs, GRAB_MAX_OUTPUTS);
+        for (i = 0; i < info->n_outputs; i++) {
+            grab_output_t *output = &info->outputs[i];
+            if (output->x < 0 || output->y < 0 ||
+                output->x + output->width > info->root_width ||
+                output->y + output->height > info->root_height) {
+                // Shouldn't happen, but grab everything rather than reading outside the screen
+                info->n_outputs = 0;
+                break;
+            }
+        }
+        info->covered = grab_outputs_area(info->outputs, info->n_outputs) == (int64_t)info->width * info->height;
+        if (info->n_outputs == 1 && info->covered) {
+            info->n_outputs = 0;
+        }
+    }
+
+    if (info->n_outputs == 0) {
+        info->covered = 1;
+        if (add_bands(info, 0, 0, info->width, info->height) != 0) {
+            return NULL;
+        }
+    }
+    for (int i = 0; i < info->n_outputs; i++) {
+        grab_output_t *o = &info->outputs[i];
+        info->first_band[i] = info->n_bands;
+        if (add_bands(info, o->x, o->y, o->width, o->height) != 0) {
+            return NULL;
+        }
+    }
+    info->first_band[info->n_outputs] = info->n_bands;
     return info;
 }
 
 
-int grab_window_size(grab_xcb_t *info, int *width, int *height) {
+static int grab_xcb_window_size(void *data, int *width, int *height) {
+    grab_xcb_t *info = data;
     *width = info->width;
     *height = info->height;
     return 0;
 }
 
-int grab_window(grab_xcb_t *info, uint8_t *output) {
-    xcb_get_image_cookie_t cookie;
+/**
+ * copy a grabbed band to the frame
+ *
+ * @param reply  grabbed image
+ * @param band   part of the frame the image is of
+ * @param frame  frame to write to
+ */
+static void copy_image(xcb_get_image_reply_t *reply, const grab_band_t *band, grab_frame_t *frame) {
+    if (xcb_get_image_data_length(reply) < band->width * band->height * 4) {
+        return;
+    }
+
+    // 32 bit ZPixmap images are BGRX in memory, which is the same as our 0x00RRGGBB screen pixels
+    grab_frame_put(frame, band->x, band->y, band->width, band->height, xcb_get_image_data(reply),
+                   band->width * 4, grab_format_bgrx);
+}
+
+// A monitor that is grabbed in a thread of its own
+typedef struct {
+    grab_xcb_t *info;
+    grab_frame_t *frame;
+    int stream;
+    int ret;
+} grab_xcb_stream_t;
+
+/**
+ * read the bands of a stream as the replies arrive, each band is handed on as soon as it's been read
+ *
+ * @param arg  grab_xcb_stream_t of the stream
+ * @return NULL
+ */
+static void *grab_stream(void *arg) {
+    grab_xcb_stream_t *stream = arg;
+    grab_xcb_t *info = stream->info;
+    int first = stream->stream < info->n_outputs ? info->first_band[stream->stream] : 0;
+    int last = stream->stream < info->n_outputs ? info->first_band[stream->stream + 1] : info->n_bands;
     xcb_get_image_reply_t *reply;
+
+    stream->ret = 0;
+    for (int i = first; i < last; i++) {
+        // Every reply has to be read, even if an earlier one failed
+        reply = xcb_get_image_reply(info->conn, info->cookies[i], NULL);
+        if (reply == NULL) {
+            stream->ret = -1;
+            continue;
+        }
+        copy_image(reply, &info->bands[i], stream->frame);
+        free(reply);
+
+        if (stream->ret == 0 && stream->frame->ready != NULL) {
+            stream->frame->ready(stream->frame, stream->stream, info->bands[i].y, info->bands[i].height);
+        }
+    }
+    return NULL;
+}
+
+static int grab_xcb_window(void *data, grab_frame_t *output) {
+    grab_xcb_t *info = data;
+    grab_xcb_stream_t streams[GRAB_MAX_OUTPUTS];
+    pthread_t threads[GRAB_MAX_OUTPUTS];
+    int started[GRAB_MAX_OUTPUTS];
     uint8_t format = XCB_IMAGE_FORMAT_Z_PIXMAP;
     uint32_t plane_mask = ~0;
+    int i, n_streams, ret = 0;
 
     if (output == NULL) {
         return 0;
     }
 
-    cookie = xcb_get_image(info->conn, format, info->win, 0, 0, info->width, info->height, plane_mask);
-    reply = xcb_get_image_reply(info->conn, cookie, NULL);
-    if (reply == NULL) {
+    if (info->follow != 0) {
+        int x, y;
+        if (window_position(info, &x, &y) != 0) {
+            printf("window is gone\n");
+            return -1;
+        }
+        grab_move(info, x, y);
+    }
+
+    // Ask for all bands before waiting for the first one, so that the server can
+    // work on the next ones while we're converting the previous
+    for (i = 0; i < info->n_bands; i++) {
+        grab_band_t *b = &info->bands[i];
+        info->cookies[i] = xcb_get_image(info->conn, format, info->win, info->x + b->x, info->y + b->y,
+                                         b->width, b->height, plane_mask);
+    }
+    xcb_flush(info->conn);
+
+    if (!info->covered) {
+        // Keep the parts that aren't grabbed the same in every frame
+        grab_frame_clear(output);
+    }
+
+    // Each monitor is read and handed on by a thread of its own. The replies still
+    // arrive in the order they were asked for, but the bands that have arrived can
+    // be compared while the next ones are being read
+    n_streams = info->n_outputs > 0 ? info->n_outputs : 1;
+    for (i = 0; i < n_streams; i++) {
+        streams[i] = (grab_xcb_stream_t) { .info = info, .frame = output, .stream = i };
+        started[i] = n_streams > 1 && pthread_create(&threads[i], NULL, grab_stream, &streams[i]) == 0;
+        if (!started[i]) {
+            grab_stream(&streams[i]);
+        }
+    }
+    for (i = 0; i < n_streams; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+        if (streams[i].ret != 0) {
+            ret = -1;
+        }
+    }
+    if (ret != 0) {
         printf("could not grab image\n");
-        return -1;
     }
+    return ret;
+}
 
-    uint8_t *img = xcb_get_image_data(reply);
-    int len = xcb_get_image_data_length(reply);
+/**
+ * list the monitors that are grabbed as streams of their own
+ *
+ * @param data         grabber
+ * @param streams      list to fill in, or NULL
+ * @param max_streams  max number of streams to list
+ * @return number of streams, 0 if the screen is grabbed as a whole
+ */
+static int grab_xcb_streams(void *data, grab_output_t *streams, int max_streams) {
+    grab_xcb_t *info = data;
+    int n = info->n_outputs < max_streams ? info->n_outputs : max_streams;
 
-    // ZPixmap images are in BGRA format, but we want RGBA for our output buffer
-    for ( ; len>0 ; len-=4) {
-        output[0] = img[2];
-        output[1] = img[1];
-        output[2] = img[0];
-        output[3] = img[3];
-        output += 4;
-        img += 4;
+    if (streams != NULL) {
+        memcpy(streams, info->outputs, n * sizeof(grab_output_t));
     }
-    free(reply);
-    return 0;
+    return info->n_outputs;
+}
+
+/**
+ * list the monitors that can be shared
+ *
+ * @param data         grabber
+ * @param outputs      list to fill in
+ * @param max_outputs  max number of monitors to list
+ * @return number of monitors found
+ */
+static int grab_xcb_list_outputs(void *data, grab_output_t *outputs, int max_outputs) {
+    grab_xcb_t *info = data;
+    return find_outputs(info, outputs, max_outputs);
 }
 
-void grab_shutdown(grab_xcb_t *info) {
+static void grab_xcb_shutdown(void *data) {
+    grab_xcb_t *info = data;
+
     xcb_disconnect(info->conn);
+    free(info->bands);
+    free(info->cookies);
 }
 
 /*
- * grab_cursor_position()
+ * grab_xcb_cursor_position()
  *
  * returns which cursor is used and where it's located
  */
-void grab_cursor_position(grab_xcb_t *info, int *x, int *y) {
+static void grab_xcb_cursor_position(void *data, int *x, int *y) {
+    grab_xcb_t *info = data;
     xcb_query_pointer_reply_t *cur;
 
     *x = 0;
@@ -135,69 +535,111 @@ void grab_cursor_position(grab_xcb_t *info, int *x, int *y) {
     if (cur == NULL) {
         return;
     }
-    *x = cur->root_x;
-    *y = cur->root_y;
+    // Position is relative to the part of the screen that is shared
+    if (cur->root_x >= info->x && cur->root_x < info->x + info->width &&
+        cur->root_y >= info->y && cur->root_y < info->y + info->height) {
+        *x = cur->root_x - info->x;
+        *y = cur->root_y - info->y;
+    }
     free(cur);
 }
 
-void grab_cursor(xcb_connection_t *conn, uint32_t *image, int img_x, int img_y, int img_w, int img_h) {
+/*
+ * grab_xcb_cursor_image()
+ *
+ * returns the image of the cursor currently displayed
+ * (shape->pixels is allocated and must be free'd by caller)
+ */
+static int grab_xcb_cursor_image(void *data, cursor_shape_t *shape) {
+    grab_xcb_t *info = data;
     xcb_xfixes_get_cursor_image_cookie_t cur_cookie;
     xcb_xfixes_get_cursor_image_reply_t *cur;
     uint32_t *cursor;
 
-    cur_cookie = xcb_xfixes_get_cursor_image(conn);
-    cur = xcb_xfixes_get_cursor_image_reply(conn, cur_cookie, NULL);
+    if (!info->can_grab_cursor) {
+        return -1;
+    }
+
+    cur_cookie = xcb_xfixes_get_cursor_image(info->conn);
+    cur = xcb_xfixes_get_cursor_image_reply(info->conn, cur_cookie, NULL);
     if (cur == NULL) {
-        return;
+        return -1;
     }
 
     cursor = xcb_xfixes_get_cursor_image_cursor_image(cur);
-    if (cursor == NULL) {
-        return;
+    if (cursor == NULL || cur->width > CURSOR_MAX_SIZE || cur->height > CURSOR_MAX_SIZE) {
+        free(cur);
+        return -1;
     }
 
-    uint8_t alpha, r, g, b, ir, ig, ib, ia;
-    int x, y, end_x, end_y;
-
-    // FIXME - calculate start if cursor is located just before the window
-    end_x = cur->width;
-    if ((cur->x + cur->width) > (img_x + img_w)) {
-        end_x = (img_w - img_x) - cur->x;
-    }
-
-    end_y = cur->height;
-    if ((cur->y + cur->height) > img_h) {
-        end_y = (img_h - img_y) - cur->y;
-    }
-
-    for (y = 0; y < end_y; y++) {
-        for (x = 0; x < end_x; x++) {
-            alpha = (cursor[y * cur->width + x] >> 24) & 0xff;
-            switch (alpha) {
-            case 0:
-                continue;
-            case 255:
-                image[(cur->y + y) * img_w + (cur->x + x)] = cursor[y*cur->width+x];
-            default:
-                r = (cursor[y * cur->width + x]) & 0xff;
-                g = (cursor[y * cur->width + x] >> 8) & 0xff;
-                b = (cursor[y * cur->width + x] >> 16) & 0xff;
-                ir = (image[(cur->y + y) * img_w + (cur->x + x)]) & 0xff;
-                ig = (image[(cur->y + y) * img_w + (cur->x + x)] >> 8) & 0xff;
-                ib = (image[(cur->y + y) * img_w + (cur->x + x)] >> 16) & 0xff;
-                ia = (image[(cur->y + y) * img_w + (cur->x + x)] >> 24) & 0xff;
-
-                image[(cur->y + y) * img_w + (cur->x + x)] = (ir + (r*(255-alpha)+127)/255) |
-                        (ig + (g*(255-alpha)+127)/255) >> 8 |
-                        (ib + (b*(255-alpha)+127)/255) >> 16 |
-                        ia >> 24;
-            }
-        }
+    shape->serial = cur->cursor_serial;
+    shape->width = cur->width;
+    shape->height = cur->height;
+    shape->xhot = cur->xhot;
+    shape->yhot = cur->yhot;
+    shape->pixels = malloc(cur->width * cur->height * sizeof(uint32_t));
+    if (shape->pixels == NULL) {
+        free(cur);
+        return -1;
     }
+    memcpy(shape->pixels, cursor, cur->width * cur->height * sizeof(uint32_t));
+
+    info->cursor_serial = cur->cursor_serial;
+    info->has_cursor_serial = 1;
     free(cur);
-    return;
+    return 0;
 }
 
+/*
+ * grab_xcb_cursor_serial()
+ *
+ * returns the serial of the cursor currently displayed, which changes
+ * every time the cursor shape changes
+ */
+static int grab_xcb_cursor_serial(void *data, uint32_t *serial) {
+    grab_xcb_t *info = data;
+    xcb_generic_event_t *ev;
+
+    if (!info->can_grab_cursor) {
+        return -1;
+    }
+
+    while ((ev = xcb_poll_for_event(info->conn)) != NULL) {
+        if ((ev->response_type & 0x7f) == info->xfixes_first_event + XCB_XFIXES_CURSOR_NOTIFY) {
+            xcb_xfixes_cursor_notify_event_t *notify = (xcb_xfixes_cursor_notify_event_t *)ev;
+            info->cursor_serial = notify->cursor_serial;
+            info->has_cursor_serial = 1;
+        }
+        free(ev);
+    }
+
+    if (!info->has_cursor_serial) {
+        // No change since we started, ask for the current cursor
+        cursor_shape_t shape;
+        if (grab_xcb_cursor_image(info, &shape) != 0) {
+            return -1;
+        }
+        free(shape.pixels);
+    }
+
+    *serial = info->cursor_serial;
+    return 0;
+}
+
+const grab_backend_t grab_backend_xcb = {
+    .name = "xcb",
+    .usage = "grab the screen with xcb, with cursor shapes from XFixes",
+    .initialize = grab_xcb_initialize,
+    .shutdown = grab_xcb_shutdown,
+    .window_size = grab_xcb_window_size,
+    .window = grab_xcb_window,
+    .cursor_position = grab_xcb_cursor_position,
+    .cursor_serial = grab_xcb_cursor_serial,
+    .cursor_image = grab_xcb_cursor_image,
+    .list_outputs = grab_xcb_list_outputs,
+    .streams = grab_xcb_streams,
+};
+
 int print_window_info(xcb_connection_t *conn, xcb_drawable_t win) {
     //xcb_get_window_attributes_reply_t *attr;
     xcb_get_geometry_reply_t *geom;